@@ -21,7 +21,9 @@ namespace rdmaio {
         WRONG_ARG = 2,
         ERR = 3,
         NOT_READY = 4,
-        UNKNOWN = 5
+        UNKNOWN = 5,
+        // the peer has no QP for the request, e.g., it tore down an idle one
+        NO_QP = 6
     };
 
 /**
@@ -45,7 +47,7 @@ namespace rdmaio {
     struct QPConnArg {
         uint16_t from_node;
         uint8_t from_worker;
-        uint8_t from_index;
+        uint16_t from_index; // wide enough for UD_ID_BASE
         uint8_t qp_type; // RC QP or UD QP
     };
 
@@ -56,22 +58,52 @@ namespace rdmaio {
         uint64_t mr_id;
     };
 
+/**
+ * The MR and all QPs a node needs from a peer, requested in one exchange.
+ * The ConnArg is followed by nqps QPConnArgs. The ConnReply carries the MR
+ * and is followed by nqps QPAttrs, in the same order. A QPAttr with qpn 0
+ * means the peer has not created that QP yet.
+ */
+    struct BatchConnArg {
+        uint64_t mr_id;
+        uint16_t nqps;
+    };
+
+/**
+ * Connects a QP on demand. It carries the requester's QP and MR, so the peer
+ * can create its QP and bring it to RTS before it replies with its own.
+ */
+    struct QPConnectArg {
+        QPConnArg qp;
+        QPAttr attr;
+        MemoryAttr mr;
+    };
+
     struct ConnArg {
         enum {
-            MR, QP, TERMINATE
+            MR, QP, TERMINATE, BATCH, QP_RESET, QP_CONNECT, QP_DISCONNECT,
+            QP_RESET_DONE
         } type;
         union {
             QPConnArg qp;
             MRConnArg mr;
             uint64_t node_id;
+            BatchConnArg batch;
+            QPConnectArg conn;
         } payload;
     };
 
+    struct QPConnectReply {
+        QPAttr qp;
+        MemoryAttr mr;
+    };
+
     struct ConnReply {
         ConnStatus ack;
         union {
             QPAttr qp;
             MemoryAttr mr;
+            QPConnectReply conn;
         } payload;
     };
 
@@ -39,6 +39,11 @@ DEFINE_uint64(rdma_max_num_sends, 0,
 DEFINE_uint64(rdma_doorbell_batch_size, 0, "The doorbell batch size.");
 DEFINE_uint32(nrdma_workers, 0,
               "Number of rdma threads.");
+DEFINE_uint32(mem_init_threads, 0,
+              "Number of threads used to prefault the memory pool before it is registered. 0 uses all cores.");
+DEFINE_uint32(mem_partitions, 1, "Number of partitions of the memory pool.");
+DEFINE_string(mem_partition_policy, "key",
+              "How allocations map to partitions: key, key_hash, thread, or numa.");
 
 class ExampleRDMAThread {
 public:
@@ -98,9 +103,6 @@ int main(int argc, char *argv[]) {
     }
 
 
-    char *rdma_backing_mem = (char *) malloc(
-            FLAGS_mem_pool_size_gb * 1024 * 1024 * 1024);
-    memset(rdma_backing_mem, 0, FLAGS_mem_pool_size_gb * 1024 * 1024 * 1024);
     std::vector<Host> hosts = convert_hosts(FLAGS_servers);
 
     NovaConfig::config = new NovaConfig;
@@ -112,6 +114,23 @@ int main(int argc, char *argv[]) {
     NovaConfig::config->max_msg_size = FLAGS_rdma_max_msg_size;
     NovaConfig::config->rdma_max_num_sends = FLAGS_rdma_max_num_sends;
 
+    NovaMemPartitionPolicy policy = ParseMemPartitionPolicy(
+            FLAGS_mem_partition_policy);
+    uint64_t backing_mem_size = FLAGS_mem_pool_size_gb * 1024 * 1024 * 1024;
+    char *rdma_backing_mem = AllocRDMABackingMem(backing_mem_size);
+    char *user_memory = rdma_backing_mem + nrdma_buf_total();
+    RDMA_ASSERT(nrdma_buf_total() < backing_mem_size)
+        << fmt::format("{} bytes of broker buffers, {} bytes of memory",
+                       nrdma_buf_total(), backing_mem_size);
+    // The pool gets what the broker buffers leave.
+    uint64_t pool_size = backing_mem_size - nrdma_buf_total();
+    if (policy == PARTITION_BY_NUMA_NODE) {
+        // Before the prefault, so that pages are faulted in on their node.
+        NovaMemManager::PlaceNUMAPartitions(
+                user_memory, FLAGS_mem_partitions, pool_size);
+    }
+    PrefaultMem(rdma_backing_mem, backing_mem_size, FLAGS_mem_init_threads);
+
     RdmaCtrl *ctrl = new RdmaCtrl(FLAGS_server_id, FLAGS_rdma_port);
     std::vector<QPEndPoint> endpoints;
     for (int i = 0; i < hosts.size(); i++) {
@@ -132,12 +151,11 @@ int main(int argc, char *argv[]) {
     // We register all memory to the RNIC.
     // RDMA verbs can only work on the memory registered in RNIC.
     // You may use nova mem manager to manage this memory.
-    char *user_memory = rdma_backing_mem + nrdma_buf_total();
-    uint32_t partitions = 1;
     uint32_t slab_mb = 1;
-    NovaMemManager *mem_manager = new NovaMemManager(user_memory, partitions,
-                                                     FLAGS_mem_pool_size_gb,
-                                                     slab_mb);
+    NovaMemManager *mem_manager = new NovaMemManager(user_memory,
+                                                     FLAGS_mem_partitions,
+                                                     pool_size,
+                                                     slab_mb, policy);
     uint32_t scid = mem_manager->slabclassid(0, 40);
     char *buf = mem_manager->ItemAlloc(0, scid);
     // Do sth with the buf.
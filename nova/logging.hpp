@@ -7,6 +7,7 @@
 #include <iostream>
 #include <sstream>
 #include <algorithm>
+#include <atomic>
 #include <string>
 
 namespace rdmaio {
@@ -46,20 +47,50 @@ namespace rdmaio {
 #define RDMA_LOG_LEVEL ::rdmaio::INFO
 #endif
 
+    // Lines below RDMA_LOG_LEVEL are compiled out; lines below this level are
+    // skipped at runtime.
+    inline std::atomic<int> &log_level() {
+        static std::atomic<int> level(RDMA_LOG_LEVEL);
+        return level;
+    }
+
+    // Receives the lines of RDMA_LOG instead of std::cout if set, e.g., to
+    // write them asynchronously. FATAL lines always go to std::cout.
+    typedef void (*log_sink_t)(int level, const char *file, int line,
+                               const std::string &msg);
+
+    inline log_sink_t &log_sink() {
+        static log_sink_t sink = nullptr;
+        return sink;
+    }
+
+    // Called before a FATAL line aborts, so that a sink that writes
+    // asynchronously gets its pending lines out first.
+    typedef void (*log_flush_t)();
+
+    inline log_flush_t &log_flush() {
+        static log_flush_t flush = nullptr;
+        return flush;
+    }
+
 // logging macro definiations
 // default log
 #define RDMA_LOG(n)                                                      \
-  if (n >= RDMA_LOG_LEVEL)                                          \
+  if (n >= RDMA_LOG_LEVEL &&                                        \
+      n >= ::rdmaio::log_level().load(std::memory_order_relaxed))   \
     ::rdmaio::MessageLogger((char*)__FILE__, __LINE__, n).stream()
 
 // log with tag
 #define RDMA_TLOG(n, t)                                                   \
-  if(n >= RDMA_LOG_LEVEL)                                               \
+  if(n >= RDMA_LOG_LEVEL &&                                             \
+     n >= ::rdmaio::log_level().load(std::memory_order_relaxed))        \
     ::rdmaio::MessageLogger((char*)__FILE__, __LINE__, n).stream()    \
           << "[" << (t) << "]"
 
 #define RDMA_LOG_IF(n, condition)                                         \
-  if(n >= RDMA_LOG_LEVEL && (condition))                            \
+  if(n >= RDMA_LOG_LEVEL &&                                             \
+     n >= ::rdmaio::log_level().load(std::memory_order_relaxed) &&      \
+     (condition))                                                       \
     ::rdmaio::MessageLogger((char*)__FILE__, __LINE__, n).stream()
 
 #define RDMA_ASSERT(condition)                                               \
@@ -70,9 +101,14 @@ namespace rdmaio {
 
     class MessageLogger {
     public:
-        MessageLogger(const char *file, int line, int level) : level_(level) {
+        MessageLogger(const char *file, int line, int level)
+                : file_(file), line_(line), level_(level) {
             if (level_ < RDMA_LOG_LEVEL)
                 return;
+            if (level_ < ::rdmaio::FATAL)
+                sink_ = log_sink();
+            if (sink_ != nullptr)
+                return;
             // current date/time based on current system
             time_t now = time(0);
 
@@ -85,13 +121,21 @@ namespace rdmaio {
         }
 
         ~MessageLogger() {
+            if (sink_ != nullptr) {
+                sink_(level_, file_, line_, stream_.str());
+                return;
+            }
             if (level_ >= RDMA_LOG_LEVEL) {
+                if (level_ >= ::rdmaio::FATAL && log_flush() != nullptr)
+                    log_flush()();
                 stream_ << "\n";
                 std::cout << "\033["
                           << RDMA_DEBUG_LEVEL_COLOR[std::min(level_, 6)] << "m"
                           << stream_.str() << EndcolorFlag();
-                if (level_ >= ::rdmaio::FATAL)
+                if (level_ >= ::rdmaio::FATAL) {
+                    std::cout.flush();
                     abort();
+                }
             }
         }
 
@@ -100,7 +144,10 @@ namespace rdmaio {
 
     private:
         std::stringstream stream_;
+        const char *file_;
+        int line_;
         int level_;
+        log_sink_t sink_ = nullptr;
 
         // control flags for color
 #define R_BLACK 39
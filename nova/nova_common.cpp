@@ -5,6 +5,15 @@
 //
 
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <unistd.h>
+#include <thread>
+#include <algorithm>
+#include <chrono>
+#include <fmt/core.h>
+
 #include "nova_common.h"
 
 namespace nova {
@@ -76,4 +85,104 @@ namespace nova {
         }
         return hosts;
     }
-}
\ No newline at end of file
+
+    uint64_t NowMicros() {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    uint64_t NowNanos() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    char *AllocRDMABackingMem(uint64_t size) {
+        void *buf = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        RDMA_ASSERT(buf != MAP_FAILED)
+            << "mmap " << size << " bytes failed: " << strerror(errno);
+        // Best effort. Transparent huge pages cut the number of faults and
+        // the number of pages ibv_reg_mr pins by 512x.
+        madvise(buf, size, MADV_HUGEPAGE);
+        return (char *) buf;
+    }
+
+    void PrefaultMem(char *buf, uint64_t size, uint32_t nthreads) {
+        if (nthreads == 0) {
+            nthreads = std::thread::hardware_concurrency();
+        }
+        if (nthreads == 0) {
+            nthreads = 1;
+        }
+        uint64_t page_size = sysconf(_SC_PAGESIZE);
+        uint64_t npages = (size + page_size - 1) / page_size;
+        uint64_t pages_per_thread = (npages + nthreads - 1) / nthreads;
+        std::vector<std::thread> threads;
+        for (uint32_t i = 0; i < nthreads; i++) {
+            uint64_t start = i * pages_per_thread * page_size;
+            if (start >= size) {
+                break;
+            }
+            uint64_t end = std::min(start + pages_per_thread * page_size, size);
+            threads.emplace_back([buf, start, end, page_size]() {
+                // A write fault is needed; a read fault maps the shared zero
+                // page and ibv_reg_mr would still have to break COW later.
+                for (uint64_t off = start; off < end; off += page_size) {
+                    *(volatile char *) (buf + off) = 0;
+                }
+            });
+        }
+        for (auto &t : threads) {
+            t.join();
+        }
+        RDMA_LOG(INFO) << fmt::format("prefaulted {} bytes with {} threads",
+                                      size, threads.size());
+    }
+
+    uint32_t NumNUMANodes() {
+        uint32_t nnodes = 0;
+        while (true) {
+            std::string path = fmt::format(
+                    "/sys/devices/system/node/node{}", nnodes);
+            struct stat st;
+            if (stat(path.c_str(), &st) != 0) {
+                break;
+            }
+            nnodes++;
+        }
+        return nnodes == 0 ? 1 : nnodes;
+    }
+
+    uint32_t CurrentNUMANode() {
+        unsigned cpu = 0;
+        unsigned node = 0;
+        if (syscall(SYS_getcpu, &cpu, &node, nullptr) != 0) {
+            return 0;
+        }
+        return node;
+    }
+
+    bool BindMemToNUMANode(char *buf, uint64_t size, uint32_t node) {
+        uint64_t page_size = sysconf(_SC_PAGESIZE);
+        // mbind requires a page-aligned start. Round it up: a page that
+        // straddles the start belongs to the range before it, which mbind
+        // extends to the end of its last page.
+        uint64_t start = ((uint64_t) buf + page_size - 1) & ~(page_size - 1);
+        if (start - (uint64_t) buf >= size) {
+            return true;
+        }
+        size -= start - (uint64_t) buf;
+        unsigned long nodemask[4] = {};
+        if (node >= sizeof(nodemask) * 8) {
+            return false;
+        }
+        nodemask[node / (sizeof(unsigned long) * 8)] =
+                1UL << (node % (sizeof(unsigned long) * 8));
+        long ret = syscall(SYS_mbind, start, size, MPOL_PREFERRED, nodemask,
+                           sizeof(nodemask) * 8, MPOL_MF_MOVE);
+        RDMA_LOG_IF(WARNING, ret != 0)
+            << fmt::format("mbind {} bytes to node {} failed: {}", size, node,
+                           strerror(errno));
+        return ret == 0;
+    }
+}
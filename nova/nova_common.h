@@ -30,6 +30,10 @@ namespace nova {
     using namespace std;
     using namespace rdmaio;
 #define CONN_SLEEP 50000
+// Backoff between connection attempts to a peer, in microseconds. It doubles
+// after every failed attempt.
+#define CONN_BACKOFF_MIN 1000
+#define CONN_BACKOFF_MAX 1000000
 
 /* Initial power multiplier for the hash table */
     std::string ibv_wr_opcode_str(ibv_wr_opcode code);
@@ -49,5 +53,59 @@ namespace nova {
     };
 
     vector<Host> convert_hosts(string hosts_str);
+
+    // Microseconds on the monotonic clock.
+    uint64_t NowMicros();
+
+    // Nanoseconds on the monotonic clock.
+    uint64_t NowNanos();
+
+    // Test-and-test-and-set lock for critical sections of a few hundred
+    // nanoseconds, e.g., posting to a QP shared by threads.
+    class NovaSpinLock {
+    public:
+        void lock() {
+            while (locked_.exchange(true, std::memory_order_acquire)) {
+                while (locked_.load(std::memory_order_relaxed)) {
+                }
+            }
+        }
+
+        bool try_lock() {
+            return !locked_.load(std::memory_order_relaxed) &&
+                   !locked_.exchange(true, std::memory_order_acquire);
+        }
+
+        void unlock() {
+            locked_.store(false, std::memory_order_release);
+        }
+
+    private:
+        std::atomic<bool> locked_{false};
+    };
+
+    // Allocates size bytes of page-aligned anonymous memory for the RDMA
+    // backing pool. Fresh anonymous pages are zero-filled by the kernel, so
+    // the pool as a whole need not be memset; its users still clear the
+    // slices they rely on being zero.
+    char *AllocRDMABackingMem(uint64_t size);
+
+    // Prefaults [buf, buf + size) with nthreads threads, each touching one
+    // contiguous chunk. Registering the pool afterwards only pins pages that
+    // are already resident instead of faulting them in one by one.
+    void PrefaultMem(char *buf, uint64_t size, uint32_t nthreads);
+
+    // Number of NUMA nodes with memory. 1 if NUMA is not available.
+    uint32_t NumNUMANodes();
+
+    // The NUMA node the calling thread currently runs on.
+    uint32_t CurrentNUMANode();
+
+    // Places the pages of [buf, buf + size) on the given NUMA node, moving
+    // pages that were already faulted in. A page that buf does not start is
+    // left to the range before it, so that adjacent ranges do not rebind
+    // each other's pages. Returns false if the kernel refused, e.g., when
+    // NUMA is not available.
+    bool BindMemToNUMANode(char *buf, uint64_t size, uint32_t node);
 }
 #endif //RLIB_NOVA_COMMON_H
@@ -0,0 +1,65 @@
+//
+// Copyright (c) 2020 University of Southern California. All rights reserved.
+//
+
+#include <cmath>
+#include <fmt/core.h>
+
+#include "nova_histogram.h"
+
+namespace nova {
+
+    void NovaHistogram::Merge(const NovaHistogram &other) {
+        for (uint32_t i = 0; i < HIST_NUM_BUCKETS; i++) {
+            counts_[i] += other.counts_[i];
+        }
+        count_ += other.count_;
+        sum_ += other.sum_;
+        if (other.min_ < min_) {
+            min_ = other.min_;
+        }
+        if (other.max_ > max_) {
+            max_ = other.max_;
+        }
+    }
+
+    uint64_t NovaHistogram::BucketUpperBound(uint32_t bucket) {
+        if (bucket < (1 << HIST_SUB_BITS)) {
+            return bucket;
+        }
+        if (bucket == HIST_NUM_BUCKETS - 1) {
+            return UINT64_MAX;
+        }
+        uint32_t exp = (bucket >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+        uint64_t sub = bucket & ((1 << HIST_SUB_BITS) - 1);
+        uint64_t width = 1ull << (exp - HIST_SUB_BITS);
+        return (((1ull << HIST_SUB_BITS) + sub) << (exp - HIST_SUB_BITS)) +
+               width - 1;
+    }
+
+    uint64_t NovaHistogram::Percentile(double p) const {
+        if (count_ == 0) {
+            return 0;
+        }
+        uint64_t rank = (uint64_t) std::ceil(p / 100.0 * count_);
+        if (rank == 0) {
+            rank = 1;
+        }
+        uint64_t seen = 0;
+        for (uint32_t i = 0; i < HIST_NUM_BUCKETS; i++) {
+            seen += counts_[i];
+            if (seen >= rank) {
+                uint64_t bound = BucketUpperBound(i);
+                return bound < max_ ? bound : max_;
+            }
+        }
+        return max_;
+    }
+
+    std::string NovaHistogram::ToString() const {
+        return fmt::format(
+                "count:{} mean:{:.1f} p50:{} p99:{} p99.9:{} max:{}",
+                count_, Mean(), Percentile(50), Percentile(99),
+                Percentile(99.9), max());
+    }
+}
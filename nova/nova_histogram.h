@@ -0,0 +1,93 @@
+//
+// Copyright (c) 2020 University of Southern California. All rights reserved.
+//
+
+#ifndef RLIB_NOVA_HISTOGRAM_H
+#define RLIB_NOVA_HISTOGRAM_H
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+
+// Every power of two is split into 2^HIST_SUB_BITS linear buckets, so a
+// percentile is off by at most 1/16 of its value.
+#define HIST_SUB_BITS 4
+// Values of 2^(HIST_MAX_EXP + 1) and above fall into the last bucket.
+#define HIST_MAX_EXP 47
+#define HIST_NUM_BUCKETS (((HIST_MAX_EXP - HIST_SUB_BITS + 2) << HIST_SUB_BITS))
+
+namespace nova {
+
+    // Log-linear histogram of non-negative values, e.g., latencies in
+    // nanoseconds. Add costs a few instructions. Not thread safe.
+    class NovaHistogram {
+    public:
+        NovaHistogram() {
+            Reset();
+        }
+
+        void Add(uint64_t value) {
+            counts_[BucketOf(value)]++;
+            count_++;
+            sum_ += value;
+            if (value < min_) {
+                min_ = value;
+            }
+            if (value > max_) {
+                max_ = value;
+            }
+        }
+
+        void Merge(const NovaHistogram &other);
+
+        void Reset() {
+            memset(counts_, 0, sizeof(counts_));
+            count_ = 0;
+            sum_ = 0;
+            min_ = UINT64_MAX;
+            max_ = 0;
+        }
+
+        // p in [0, 100]. Returns the upper bound of the bucket holding the
+        // p-th percentile, 0 if empty.
+        uint64_t Percentile(double p) const;
+
+        double Mean() const {
+            return count_ == 0 ? 0 : (double) sum_ / count_;
+        }
+
+        uint64_t count() const { return count_; }
+
+        uint64_t min() const { return count_ == 0 ? 0 : min_; }
+
+        uint64_t max() const { return max_; }
+
+        // count, mean, p50, p99, p99.9 and max.
+        std::string ToString() const;
+
+        static uint32_t BucketOf(uint64_t value) {
+            if (value < (1 << HIST_SUB_BITS)) {
+                return value;
+            }
+            uint32_t exp = 63 - __builtin_clzll(value);
+            if (exp > HIST_MAX_EXP) {
+                return HIST_NUM_BUCKETS - 1;
+            }
+            uint32_t sub = (value >> (exp - HIST_SUB_BITS)) &
+                           ((1 << HIST_SUB_BITS) - 1);
+            return ((exp - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + sub;
+        }
+
+        // Largest value of bucket.
+        static uint64_t BucketUpperBound(uint32_t bucket);
+
+    private:
+        uint64_t counts_[HIST_NUM_BUCKETS];
+        uint64_t count_;
+        uint64_t sum_;
+        uint64_t min_;
+        uint64_t max_;
+    };
+}
+
+#endif //RLIB_NOVA_HISTOGRAM_H
@@ -0,0 +1,502 @@
+//
+// Copyright (c) 2020 University of Southern California. All rights reserved.
+//
+
+#include <algorithm>
+#include <cstring>
+#include <fmt/core.h>
+
+#include "nova_kv.h"
+#include "nova_common.h"
+
+namespace nova {
+
+    namespace {
+        // The finalizer of MurmurHash3.
+        inline uint64_t Mix64(uint64_t x) {
+            x ^= x >> 33;
+            x *= 0xff51afd7ed558ccdULL;
+            x ^= x >> 33;
+            x *= 0xc4ceb9fe1a85ec53ULL;
+            x ^= x >> 33;
+            return x;
+        }
+
+        // Clients and servers must agree on it.
+        inline uint64_t HomeBucket(uint64_t key, uint64_t nbuckets) {
+            return Mix64(key) % nbuckets;
+        }
+
+        inline uint64_t PackItem(uint64_t offset, uint64_t size) {
+            return (offset << KV_ITEM_SIZE_BITS) | size;
+        }
+
+        inline uint64_t ItemOffset(uint64_t item) {
+            return item >> KV_ITEM_SIZE_BITS;
+        }
+
+        inline uint32_t ItemSize(uint64_t item) {
+            return item & ((1ULL << KV_ITEM_SIZE_BITS) - 1);
+        }
+    }
+
+    uint32_t KVChecksum(uint64_t key, const char *value, uint32_t size) {
+        uint64_t h = Mix64(key ^ size);
+        uint32_t i = 0;
+        for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+            uint64_t word;
+            memcpy(&word, value + i, sizeof(word));
+            h = (h ^ word) * 0x9e3779b97f4a7c15ULL;
+            h ^= h >> 32;
+        }
+        uint64_t tail = 0;
+        memcpy(&tail, value + i, size - i);
+        h = Mix64(h ^ tail);
+        return (uint32_t) (h ^ (h >> 32));
+    }
+
+    NovaKVIndex::NovaKVIndex(NovaMemManager *mem_manager, char *index_buf,
+                             uint64_t nbuckets) :
+            mem_manager_(mem_manager),
+            buckets_((NovaKVBucket *) index_buf),
+            nbuckets_(nbuckets) {
+        RDMA_ASSERT(nbuckets > 0);
+        memset(index_buf, 0, IndexSize(nbuckets));
+        index_offset_ = mem_manager_->OffsetOf(index_buf);
+        rkey_ = mem_manager_->rkey();
+    }
+
+    uint64_t NovaKVIndex::IndexSize(uint64_t nbuckets) {
+        // The probes of the last home bucket run past it instead of wrapping
+        // around, so that a GET reads them with one READ.
+        return (nbuckets + KV_MAX_PROBES - 1) * sizeof(NovaKVBucket);
+    }
+
+    NovaKVSlot *NovaKVIndex::Find(uint64_t key) {
+        NovaKVBucket *bucket = &buckets_[HomeBucket(key, nbuckets_)];
+        for (uint32_t p = 0; p < KV_MAX_PROBES; p++) {
+            for (uint32_t i = 0; i < KV_SLOTS_PER_BUCKET; i++) {
+                NovaKVSlot *slot = &bucket[p].slots[i];
+                if (slot->item != 0 && slot->key == key) {
+                    return slot;
+                }
+            }
+        }
+        return nullptr;
+    }
+
+    NovaKVStatus
+    NovaKVIndex::Put(uint64_t key, const char *value, uint32_t size) {
+        uint64_t item_size = sizeof(NovaKVItemHeader) + size;
+        if (item_size >= (1ULL << KV_ITEM_SIZE_BITS) ||
+            item_size > mem_manager_->max_item_size()) {
+            return NOVA_KV_TOO_LARGE;
+        }
+        std::lock_guard<std::mutex> guard(mutex_);
+        FreeRetired();
+        NovaKVSlot *slot = Find(key);
+        if (slot == nullptr) {
+            NovaKVBucket *bucket = &buckets_[HomeBucket(key, nbuckets_)];
+            for (uint32_t p = 0; p < KV_MAX_PROBES && !slot; p++) {
+                for (uint32_t i = 0; i < KV_SLOTS_PER_BUCKET; i++) {
+                    if (bucket[p].slots[i].item == 0) {
+                        slot = &bucket[p].slots[i];
+                        break;
+                    }
+                }
+            }
+            if (slot == nullptr) {
+                return NOVA_KV_INDEX_FULL;
+            }
+        }
+
+        uint32_t scid = mem_manager_->slabclassid(key, item_size);
+        char *buf = mem_manager_->ItemAlloc(key, scid, item_size);
+        if (buf == nullptr) {
+            return NOVA_KV_NO_MEMORY;
+        }
+        NovaKVItemHeader header = {};
+        header.key = key;
+        header.value_size = size;
+        header.checksum = KVChecksum(key, value, size);
+        memcpy(buf, &header, sizeof(header));
+        memcpy(buf + sizeof(header), value, size);
+        uint64_t offset = mem_manager_->OffsetOf(buf);
+        RDMA_ASSERT(offset < (1ULL << (64 - KV_ITEM_SIZE_BITS)));
+
+        uint64_t old = slot->item;
+        if (old == 0) {
+            slot->key = key;
+            nkeys_++;
+        }
+        // The item must be complete before a reader can find it.
+        __atomic_store_n(&slot->item, PackItem(offset, item_size),
+                         __ATOMIC_RELEASE);
+        if (old != 0) {
+            Retire(key, old);
+        }
+        return NOVA_KV_OK;
+    }
+
+    NovaKVStatus NovaKVIndex::Delete(uint64_t key) {
+        std::lock_guard<std::mutex> guard(mutex_);
+        FreeRetired();
+        NovaKVSlot *slot = Find(key);
+        if (slot == nullptr) {
+            return NOVA_KV_NOT_FOUND;
+        }
+        uint64_t old = slot->item;
+        __atomic_store_n(&slot->item, 0, __ATOMIC_RELEASE);
+        nkeys_--;
+        Retire(key, old);
+        return NOVA_KV_OK;
+    }
+
+    NovaKVStatus NovaKVIndex::Get(uint64_t key, char *value, uint32_t size,
+                                  uint32_t *value_size) {
+        std::lock_guard<std::mutex> guard(mutex_);
+        NovaKVSlot *slot = Find(key);
+        if (slot == nullptr) {
+            return NOVA_KV_NOT_FOUND;
+        }
+        const char *buf = mem_manager_->ItemAt(ItemOffset(slot->item));
+        NovaKVItemHeader header;
+        memcpy(&header, buf, sizeof(header));
+        memcpy(value, buf + sizeof(header), std::min(size, header.value_size));
+        *value_size = header.value_size;
+        return NOVA_KV_OK;
+    }
+
+    void NovaKVIndex::Reclaim() {
+        std::lock_guard<std::mutex> guard(mutex_);
+        FreeRetired();
+    }
+
+    void NovaKVIndex::Retire(uint64_t key, uint64_t item) {
+        RetiredItem retired = {};
+        retired.retire_us = NowMicros();
+        retired.key = key;
+        retired.buf = mem_manager_->ItemAt(ItemOffset(item));
+        retired.scid = mem_manager_->slabclassid(key, ItemSize(item));
+        retired_.push_back(retired);
+    }
+
+    void NovaKVIndex::FreeRetired() {
+        if (retired_.empty()) {
+            return;
+        }
+        uint64_t now = NowMicros();
+        while (!retired_.empty() &&
+               retired_.front().retire_us + KV_RETIRE_US <= now) {
+            const RetiredItem &retired = retired_.front();
+            mem_manager_->FreeItem(retired.key, retired.buf, retired.scid);
+            retired_.pop_front();
+        }
+    }
+
+    NovaKVServer::NovaKVServer(NovaKVIndex *index, NovaRDMABroker *broker,
+                               uint32_t max_msg_size) :
+            index_(index), broker_(broker), max_msg_size_(max_msg_size) {
+    }
+
+    bool NovaKVServer::HandleMessage(int remote_server_id, char *buf) {
+        uint32_t req_id = NovaMsgHeaderOf(buf)->req_id;
+        switch (buf[0]) {
+            case NOVA_KV_PUT_REQ: {
+                NovaTracer::SetTraceId(NovaMsgTraceId(buf));
+                if (!NovaMsgFits<NovaKVPutRequest>(buf, max_msg_size_)) {
+                    Reply(remote_server_id, req_id, NOVA_KV_BAD_REQUEST);
+                    return true;
+                }
+                const NovaKVPutRequest *req = NovaMsgDecode<NovaKVPutRequest>(
+                        buf);
+                // value_size comes off the wire. The value must lie within
+                // the message.
+                if (!NovaMsgFits<NovaKVPutRequest>(buf, max_msg_size_,
+                                                   req->value_size)) {
+                    RDMA_LOG(WARNING) << fmt::format(
+                                "kv-server: server {} puts {} bytes in a {}-byte message",
+                                remote_server_id, req->value_size,
+                                NovaMsgSize(buf));
+                    Reply(remote_server_id, req_id, NOVA_KV_BAD_REQUEST);
+                    return true;
+                }
+                NovaKVStatus status = index_->Put(
+                        req->key, NovaMsgExtra<NovaKVPutRequest>(buf),
+                        req->value_size);
+                Reply(remote_server_id, req_id, status);
+                return true;
+            }
+            case NOVA_KV_DEL_REQ: {
+                NovaTracer::SetTraceId(NovaMsgTraceId(buf));
+                if (!NovaMsgFits<NovaKVDelRequest>(buf, max_msg_size_)) {
+                    Reply(remote_server_id, req_id, NOVA_KV_BAD_REQUEST);
+                    return true;
+                }
+                const NovaKVDelRequest *req = NovaMsgDecode<NovaKVDelRequest>(
+                        buf);
+                Reply(remote_server_id, req_id, index_->Delete(req->key));
+                return true;
+            }
+            case NOVA_KV_INFO_REQ: {
+                NovaTracer::SetTraceId(NovaMsgTraceId(buf));
+                if (!NovaMsgFits<NovaKVInfoRequest>(buf, max_msg_size_)) {
+                    Reply(remote_server_id, req_id, NOVA_KV_BAD_REQUEST);
+                    return true;
+                }
+                char *sendbuf = broker_->GetSendBuf(remote_server_id);
+                NovaKVInfoReply *reply = NovaMsgEncode<NovaKVInfoReply>(
+                        sendbuf, NOVA_KV_INFO_REPLY, req_id);
+                reply->index_offset = index_->index_offset();
+                reply->nbuckets = index_->nbuckets();
+                reply->rkey = index_->rkey();
+                broker_->PostSend(sendbuf, NovaMsgSize(sendbuf),
+                                  remote_server_id, 0);
+                return true;
+            }
+            default:
+                return false;
+        }
+    }
+
+    void NovaKVServer::Reply(int remote_server_id, uint32_t req_id,
+                             NovaKVStatus status) {
+        char *sendbuf = broker_->GetSendBuf(remote_server_id);
+        NovaKVReply *reply = NovaMsgEncode<NovaKVReply>(sendbuf, NOVA_KV_REPLY,
+                                                        req_id);
+        reply->status = status;
+        broker_->PostSend(sendbuf, NovaMsgSize(sendbuf), remote_server_id, 0);
+    }
+
+    NovaKVClient::NovaKVClient(NovaRDMABroker *broker,
+                               NovaMemManager *mem_manager,
+                               uint32_t max_msg_size) :
+            broker_(broker),
+            mem_manager_(mem_manager),
+            // PostSend requires messages strictly smaller than max_msg_size.
+            max_value_size_(std::min<uint32_t>(
+                    max_msg_size - sizeof(NovaMsgHeader) -
+                    sizeof(NovaKVPutRequest) - 1,
+                    UINT16_MAX - sizeof(NovaKVPutRequest))) {
+        RDMA_ASSERT(max_msg_size >
+                    sizeof(NovaMsgHeader) + sizeof(NovaKVPutRequest));
+    }
+
+    uint32_t NovaKVClient::Connect(int server_id) {
+        req_seq_++;
+        char *sendbuf = broker_->GetSendBuf(server_id);
+        NovaMsgEncode<NovaKVInfoRequest>(sendbuf, NOVA_KV_INFO_REQ, req_seq_);
+        broker_->PostSend(sendbuf, NovaMsgSize(sendbuf), server_id, 0);
+        return req_seq_;
+    }
+
+    bool NovaKVClient::IsConnected(int server_id) {
+        return indexes_.find(server_id) != indexes_.end();
+    }
+
+    uint32_t NovaKVClient::Get(int server_id, uint64_t key) {
+        RDMA_ASSERT(IsConnected(server_id))
+            << fmt::format("kv-client: GET from server {} before Connect",
+                           server_id);
+        req_seq_++;
+        uint32_t req_id = req_seq_;
+        GetOp &op = gets_[req_id];
+        op.server_id = server_id;
+        op.key = key;
+        op.reading_item = false;
+        op.retries = 0;
+        uint32_t size = KV_MAX_PROBES * sizeof(NovaKVBucket);
+        op.buf = mem_manager_->ItemAllocHandle(
+                key, mem_manager_->slabclassid(key, size), size);
+        if (op.buf.addr == nullptr) {
+            Finish(req_id, NOVA_KV_NO_MEMORY, &op);
+            return req_id;
+        }
+        ReadBuckets(req_id, &op);
+        return req_id;
+    }
+
+    void NovaKVClient::ReadBuckets(uint32_t req_id, GetOp *op) {
+        const RemoteIndex &index = indexes_[op->server_id];
+        uint32_t size = KV_MAX_PROBES * sizeof(NovaKVBucket);
+        NovaRemoteItem remote = {};
+        remote.offset = index.offset +
+                        HomeBucket(op->key, index.nbuckets) *
+                        sizeof(NovaKVBucket);
+        remote.rkey = index.rkey;
+        remote.size = size;
+        op->reading_item = false;
+        uint64_t wr_id = broker_->PostRead(op->buf, remote, size,
+                                           op->server_id);
+        reads_[std::make_pair(op->server_id, wr_id)] = req_id;
+    }
+
+    void NovaKVClient::OnBuckets(uint32_t req_id, GetOp *op) {
+        const NovaKVSlot *slots = (const NovaKVSlot *) op->buf.addr;
+        uint64_t item = 0;
+        for (uint32_t i = 0; i < KV_MAX_PROBES * KV_SLOTS_PER_BUCKET; i++) {
+            if (slots[i].item != 0 && slots[i].key == op->key) {
+                item = slots[i].item;
+                break;
+            }
+        }
+        if (item == 0) {
+            Finish(req_id, NOVA_KV_NOT_FOUND, op);
+            return;
+        }
+        uint32_t size = ItemSize(item);
+        if (size > op->buf.size) {
+            mem_manager_->FreeItem(op->key, op->buf);
+            op->buf = mem_manager_->ItemAllocHandle(
+                    op->key, mem_manager_->slabclassid(op->key, size), size);
+            if (op->buf.addr == nullptr) {
+                Finish(req_id, NOVA_KV_NO_MEMORY, op);
+                return;
+            }
+        }
+        const RemoteIndex &index = indexes_[op->server_id];
+        NovaRemoteItem remote = {};
+        remote.offset = ItemOffset(item);
+        remote.rkey = index.rkey;
+        remote.size = size;
+        op->reading_item = true;
+        uint64_t wr_id = broker_->PostRead(op->buf, remote, size,
+                                           op->server_id);
+        reads_[std::make_pair(op->server_id, wr_id)] = req_id;
+    }
+
+    void NovaKVClient::OnItem(uint32_t req_id, GetOp *op) {
+        NovaKVItemHeader header;
+        memcpy(&header, op->buf.addr, sizeof(header));
+        const char *value = op->buf.addr + sizeof(header);
+        // The slot moved on between the two READs and the item was freed,
+        // or the item was reused before the READ finished.
+        if (header.key != op->key ||
+            sizeof(header) + header.value_size > op->buf.size ||
+            header.checksum != KVChecksum(header.key, value,
+                                          header.value_size)) {
+            op->retries++;
+            if (op->retries > KV_MAX_GET_RETRIES) {
+                Finish(req_id, NOVA_KV_CONFLICT, op);
+                return;
+            }
+            RDMA_LOG(DEBUG) << fmt::format(
+                        "kv-client: GET {} of key {} retries", req_id,
+                        op->key);
+            ReadBuckets(req_id, op);
+            return;
+        }
+        Finish(req_id, NOVA_KV_OK, op);
+    }
+
+    void NovaKVClient::Finish(uint32_t req_id, NovaKVStatus status,
+                              GetOp *op) {
+        NovaKVResult &result = results_[req_id];
+        result.req_id = req_id;
+        result.status = status;
+        result.value = nullptr;
+        result.value_size = 0;
+        result.buf = {};
+        if (status == NOVA_KV_OK) {
+            NovaKVItemHeader header;
+            memcpy(&header, op->buf.addr, sizeof(header));
+            result.value = op->buf.addr + sizeof(header);
+            result.value_size = header.value_size;
+            result.buf = op->buf;
+        } else if (op->buf.addr != nullptr) {
+            mem_manager_->FreeItem(op->key, op->buf);
+        }
+        gets_.erase(req_id);
+    }
+
+    uint32_t NovaKVClient::Put(int server_id, uint64_t key, const char *value,
+                               uint32_t size) {
+        RDMA_ASSERT(size <= max_value_size_)
+            << fmt::format("put {} bytes, at most {} per request", size,
+                           max_value_size_);
+        req_seq_++;
+        char *sendbuf = broker_->GetSendBuf(server_id);
+        NovaKVPutRequest *req = NovaMsgEncode<NovaKVPutRequest>(
+                sendbuf, NOVA_KV_PUT_REQ, req_seq_, size);
+        req->key = key;
+        req->value_size = size;
+        memcpy(NovaMsgExtra<NovaKVPutRequest>(sendbuf), value, size);
+        broker_->PostSend(sendbuf, NovaMsgSize(sendbuf), server_id, 0);
+        return req_seq_;
+    }
+
+    uint32_t NovaKVClient::Delete(int server_id, uint64_t key) {
+        req_seq_++;
+        char *sendbuf = broker_->GetSendBuf(server_id);
+        NovaKVDelRequest *req = NovaMsgEncode<NovaKVDelRequest>(
+                sendbuf, NOVA_KV_DEL_REQ, req_seq_);
+        req->key = key;
+        broker_->PostSend(sendbuf, NovaMsgSize(sendbuf), server_id, 0);
+        return req_seq_;
+    }
+
+    bool NovaKVClient::HandleMessage(int remote_server_id, char *buf) {
+        uint32_t req_id = NovaMsgHeaderOf(buf)->req_id;
+        switch (buf[0]) {
+            case NOVA_KV_REPLY: {
+                NovaTracer::SetTraceId(NovaMsgTraceId(buf));
+                const NovaKVReply *reply = NovaMsgDecode<NovaKVReply>(buf);
+                NovaKVResult &result = results_[req_id];
+                result = {};
+                result.req_id = req_id;
+                result.status = (NovaKVStatus) reply->status;
+                return true;
+            }
+            case NOVA_KV_INFO_REPLY: {
+                NovaTracer::SetTraceId(NovaMsgTraceId(buf));
+                const NovaKVInfoReply *reply = NovaMsgDecode<NovaKVInfoReply>(
+                        buf);
+                RemoteIndex &index = indexes_[remote_server_id];
+                index.offset = reply->index_offset;
+                index.nbuckets = reply->nbuckets;
+                index.rkey = reply->rkey;
+                NovaKVResult &result = results_[req_id];
+                result = {};
+                result.req_id = req_id;
+                result.status = NOVA_KV_OK;
+                return true;
+            }
+            default:
+                return false;
+        }
+    }
+
+    bool NovaKVClient::HandleCompletion(int remote_server_id, uint64_t wr_id) {
+        auto it = reads_.find(std::make_pair(remote_server_id, wr_id));
+        if (it == reads_.end()) {
+            return false;
+        }
+        uint32_t req_id = it->second;
+        reads_.erase(it);
+        GetOp *op = &gets_[req_id];
+        if (op->reading_item) {
+            OnItem(req_id, op);
+        } else {
+            OnBuckets(req_id, op);
+        }
+        return true;
+    }
+
+    bool NovaKVClient::TakeResult(uint32_t req_id, NovaKVResult *result) {
+        auto it = results_.find(req_id);
+        if (it == results_.end()) {
+            return false;
+        }
+        *result = it->second;
+        results_.erase(it);
+        return true;
+    }
+
+    void NovaKVClient::Release(NovaKVResult *result) {
+        if (result->buf.addr != nullptr) {
+            mem_manager_->FreeItem(0, result->buf);
+            result->buf = {};
+            result->value = nullptr;
+        }
+    }
+}
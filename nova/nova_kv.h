@@ -0,0 +1,279 @@
+//
+// Copyright (c) 2020 University of Southern California. All rights reserved.
+//
+
+#ifndef RLIB_NOVA_KV_H
+#define RLIB_NOVA_KV_H
+
+#include <stdint.h>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include "nova_rdma_broker.h"
+#include "nova_mem_manager.h"
+#include "nova_msg.h"
+
+#define KV_SLOTS_PER_BUCKET 4
+// A key lives in one of KV_MAX_PROBES consecutive buckets from its home
+// bucket. A GET reads all of them with one READ.
+#define KV_MAX_PROBES 4
+// The low bits of a slot's item word hold the item size, the high bits its
+// offset in the MR.
+#define KV_ITEM_SIZE_BITS 24
+// Replaced items are freed after this long, so that GETs that read the old
+// slot rarely find the item reused.
+#define KV_RETIRE_US 10000
+// A GET that finds a torn or reused item reads the index again at most this
+// often.
+#define KV_MAX_GET_RETRIES 8
+
+namespace nova {
+
+    // Message types of the KV store, the type of their NovaMsgHeader.
+    enum NovaKVMsgType {
+        NOVA_KV_PUT_REQ = 'K',
+        NOVA_KV_DEL_REQ = 'X',
+        NOVA_KV_INFO_REQ = 'I',
+        NOVA_KV_REPLY = 'k',
+        NOVA_KV_INFO_REPLY = 'i'
+    };
+
+    enum NovaKVStatus {
+        NOVA_KV_OK = 0,
+        NOVA_KV_NOT_FOUND = 1,
+        // The probe buckets of the key are full.
+        NOVA_KV_INDEX_FULL = 2,
+        NOVA_KV_NO_MEMORY = 3,
+        NOVA_KV_TOO_LARGE = 4,
+        // A GET kept finding items that were being replaced.
+        NOVA_KV_CONFLICT = 5,
+        // The request does not fit in its message.
+        NOVA_KV_BAD_REQUEST = 6
+    };
+
+    // Message bodies. They follow a NovaMsgHeader.
+
+    // Followed by value_size bytes.
+    struct NovaKVPutRequest {
+        uint64_t key;
+        uint32_t value_size;
+    };
+
+    struct NovaKVDelRequest {
+        uint64_t key;
+    };
+
+    struct NovaKVInfoRequest {
+    };
+
+    struct NovaKVReply {
+        uint32_t status;
+    };
+
+    struct NovaKVInfoReply {
+        uint64_t index_offset;
+        uint64_t nbuckets;
+        uint32_t rkey;
+    };
+
+    // A slot of the index. item is 0 if the slot is empty.
+    struct NovaKVSlot {
+        uint64_t key;
+        uint64_t item;
+    };
+
+    struct NovaKVBucket {
+        NovaKVSlot slots[KV_SLOTS_PER_BUCKET];
+    };
+
+    // Precedes the value of an item. A reader trusts the item only if key
+    // and checksum match, since the item may be replaced while it reads.
+    struct NovaKVItemHeader {
+        uint64_t key;
+        uint32_t value_size;
+        uint32_t checksum;
+    };
+
+    uint32_t KVChecksum(uint64_t key, const char *value, uint32_t size);
+
+    // The hash index of a node and the items it points to. Shared by the
+    // NovaKVServers of all threads. The index lies in registered memory so
+    // that clients READ it without the server's CPU; items come from a
+    // NovaMemManager bound to the same region.
+    //
+    // Updates are out of place: a PUT writes a new item, then swaps the
+    // slot's item word; the old item is freed KV_RETIRE_US later.
+    class NovaKVIndex {
+    public:
+        // index_buf holds IndexSize(nbuckets) bytes of the registered region
+        // outside of the pool of mem_manager. Requires BindMR.
+        NovaKVIndex(NovaMemManager *mem_manager, char *index_buf,
+                    uint64_t nbuckets);
+
+        static uint64_t IndexSize(uint64_t nbuckets);
+
+        NovaKVStatus Put(uint64_t key, const char *value, uint32_t size);
+
+        NovaKVStatus Delete(uint64_t key);
+
+        // Reads a value locally. Copies at most size bytes into value and
+        // sets *value_size to the size of the value.
+        NovaKVStatus Get(uint64_t key, char *value, uint32_t size,
+                         uint32_t *value_size);
+
+        // Frees the retired items that are old enough. Put and Delete do it
+        // too; a server calls it periodically, so that the last items
+        // replaced are freed when updates stop.
+        void Reclaim();
+
+        uint64_t index_offset() { return index_offset_; }
+
+        uint64_t nbuckets() { return nbuckets_; }
+
+        uint32_t rkey() { return rkey_; }
+
+        uint64_t nkeys() { return nkeys_; }
+
+    private:
+        struct RetiredItem {
+            uint64_t retire_us;
+            uint64_t key;
+            char *buf;
+            uint32_t scid;
+        };
+
+        // The slot holding key, nullptr if there is none. Requires mutex_.
+        NovaKVSlot *Find(uint64_t key);
+
+        // Retires the item a slot pointed to. Requires mutex_.
+        void Retire(uint64_t key, uint64_t item);
+
+        // Frees the retired items that are old enough. Requires mutex_.
+        void FreeRetired();
+
+        NovaMemManager *mem_manager_;
+        NovaKVBucket *buckets_;
+        const uint64_t nbuckets_;
+        uint64_t index_offset_;
+        uint32_t rkey_;
+        uint64_t nkeys_ = 0;
+        // Serializes updates. GETs do not take it.
+        std::mutex mutex_;
+        std::deque<RetiredItem> retired_;
+    };
+
+    // Serves PUT, DELETE and index lookups of peers. Thread local, like the
+    // broker it replies through.
+    class NovaKVServer {
+    public:
+        // max_msg_size is the size of the broker's receive buffers. Requests
+        // that do not fit in it get NOVA_KV_BAD_REQUEST.
+        NovaKVServer(NovaKVIndex *index, NovaRDMABroker *broker,
+                     uint32_t max_msg_size);
+
+        // Call from NovaMsgCallback::ProcessRDMAWC on a RECV. Returns false
+        // if buf is not a KV message.
+        bool HandleMessage(int remote_server_id, char *buf);
+
+    private:
+        void Reply(int remote_server_id, uint32_t req_id,
+                   NovaKVStatus status);
+
+        NovaKVIndex *index_;
+        NovaRDMABroker *broker_;
+        const uint32_t max_msg_size_;
+    };
+
+    struct NovaKVResult {
+        uint32_t req_id;
+        NovaKVStatus status;
+        // The value of a GET. Valid until Release.
+        char *value;
+        uint32_t value_size;
+        NovaItemHandle buf;
+    };
+
+    // Issues requests to the KV stores of peers. A GET is two one-sided
+    // READs, the probe buckets of the key and then its item, with no CPU
+    // of the peer involved. PUT and DELETE are RPCs. Thread local.
+    //
+    // Requests complete asynchronously: pass RECVs to HandleMessage and
+    // READ completions to HandleCompletion, then collect the result with
+    // TakeResult.
+    class NovaKVClient {
+    public:
+        // READs land in items of mem_manager, which must be bound to the
+        // broker's MR.
+        NovaKVClient(NovaRDMABroker *broker, NovaMemManager *mem_manager,
+                     uint32_t max_msg_size);
+
+        // Fetches where the index of server_id is. GETs to it require
+        // IsConnected.
+        uint32_t Connect(int server_id);
+
+        bool IsConnected(int server_id);
+
+        uint32_t Get(int server_id, uint64_t key);
+
+        uint32_t
+        Put(int server_id, uint64_t key, const char *value, uint32_t size);
+
+        uint32_t Delete(int server_id, uint64_t key);
+
+        // Call from NovaMsgCallback::ProcessRDMAWC on a RECV. Returns false
+        // if buf is not a KV message.
+        bool HandleMessage(int remote_server_id, char *buf);
+
+        // Call from NovaMsgCallback::ProcessRDMAWC on an RDMA READ. Returns
+        // false if wr_id is not a READ of this client.
+        bool HandleCompletion(int remote_server_id, uint64_t wr_id);
+
+        // Returns true once req_id completed. A successful GET holds a
+        // buffer until Release.
+        bool TakeResult(uint32_t req_id, NovaKVResult *result);
+
+        void Release(NovaKVResult *result);
+
+        // The largest value a PUT carries in one message.
+        uint32_t max_value_size() { return max_value_size_; }
+
+    private:
+        struct RemoteIndex {
+            uint64_t offset;
+            uint64_t nbuckets;
+            uint32_t rkey;
+        };
+
+        struct GetOp {
+            int server_id;
+            uint64_t key;
+            NovaItemHandle buf;
+            // The buckets were read, the item is being read.
+            bool reading_item;
+            uint32_t retries;
+        };
+
+        // Reads the probe buckets of op.
+        void ReadBuckets(uint32_t req_id, GetOp *op);
+
+        void OnBuckets(uint32_t req_id, GetOp *op);
+
+        void OnItem(uint32_t req_id, GetOp *op);
+
+        void Finish(uint32_t req_id, NovaKVStatus status, GetOp *op);
+
+        NovaRDMABroker *broker_;
+        NovaMemManager *mem_manager_;
+        const uint32_t max_value_size_;
+        uint32_t req_seq_ = 0;
+        std::map<int, RemoteIndex> indexes_;
+        std::map<uint32_t, GetOp> gets_;
+        // (server id, wr_id) -> req_id of the GET waiting for the READ.
+        std::map<std::pair<int, uint64_t>, uint32_t> reads_;
+        std::map<uint32_t, NovaKVResult> results_;
+    };
+}
+
+#endif //RLIB_NOVA_KV_H
@@ -0,0 +1,237 @@
+//
+// Copyright (c) 2020 University of Southern California. All rights reserved.
+//
+
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "nova_logger.h"
+
+namespace nova {
+
+    struct NovaLogRing {
+        NovaLogRecord records[LOG_RING_SIZE];
+        // Written by the owning thread only.
+        std::atomic<uint64_t> head{0};
+        // Written by the flusher only.
+        std::atomic<uint64_t> tail{0};
+        std::atomic<uint64_t> ndropped{0};
+        // The owning thread exited. The flusher frees the ring once drained.
+        std::atomic<bool> closed{false};
+    };
+
+    namespace {
+        const char *kLevelNames[] = {"EVERYTHING", "DEBUG", "INFO", "EMPH",
+                                     "WARNING", "ERROR", "FATAL"};
+
+        std::mutex rings_mutex;
+        std::vector<NovaLogRing *> rings;
+        // Serializes the flusher thread and Flush.
+        std::mutex drain_mutex;
+        std::atomic<uint64_t> ndropped_total{0};
+        std::atomic<bool> running{false};
+        std::thread flusher;
+        FILE *out_file = stdout;
+        fmt::memory_buffer out_buf;
+
+        // Owns the ring of a thread and closes it when the thread exits.
+        struct RingHolder {
+            NovaLogRing *ring = nullptr;
+
+            ~RingHolder() {
+                if (ring != nullptr) {
+                    ring->closed.store(true, std::memory_order_release);
+                }
+            }
+        };
+
+        thread_local RingHolder ring_holder;
+
+        NovaLogRing *ThisRing() {
+            if (ring_holder.ring == nullptr) {
+                NovaLogRing *ring = new NovaLogRing;
+                std::lock_guard<std::mutex> lock(rings_mutex);
+                rings.push_back(ring);
+                ring_holder.ring = ring;
+            }
+            return ring_holder.ring;
+        }
+
+        const char *Basename(const char *file) {
+            const char *slash = strrchr(file, '/');
+            return slash == nullptr ? file : slash + 1;
+        }
+
+        const char *LevelName(int level) {
+            return kLevelNames[std::min(std::max(level, 0), 6)];
+        }
+
+        void AppendPrefix(uint64_t ts_ns, int level, const char *file,
+                          int line) {
+            time_t secs = ts_ns / 1000000000;
+            struct tm tm;
+            localtime_r(&secs, &tm);
+            char date[32];
+            size_t len = strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S",
+                                  &tm);
+            fmt::format_to(out_buf, "{}.{:06d} {} [{}:{}] ",
+                           fmt::string_view(date, len),
+                           (ts_ns % 1000000000) / 1000, LevelName(level),
+                           Basename(file), line);
+        }
+
+        void AppendRecord(const NovaLogRecord &record) {
+            AppendPrefix(record.ts_ns, record.level, record.file,
+                         record.line);
+            if (record.truncated) {
+                fmt::format_to(out_buf, "{} [arguments truncated]\n",
+                               record.format);
+                return;
+            }
+            char msg[LOG_RECORD_SIZE * 4];
+            size_t len;
+            try {
+                len = record.formatter(record.format, record.args, msg,
+                                       sizeof(msg));
+            } catch (const fmt::format_error &e) {
+                fmt::format_to(out_buf, "{} [bad format: {}]\n",
+                               record.format, e.what());
+                return;
+            }
+            out_buf.append(msg, msg + std::min(len, sizeof(msg)));
+            out_buf.push_back('\n');
+        }
+
+        // Returns the number of lines written. Holds drain_mutex.
+        uint64_t Drain() {
+            std::vector<NovaLogRing *> snapshot;
+            {
+                std::lock_guard<std::mutex> lock(rings_mutex);
+                snapshot = rings;
+            }
+            uint64_t nlines = 0;
+            for (NovaLogRing *ring : snapshot) {
+                bool closed = ring->closed.load(std::memory_order_acquire);
+                uint64_t head = ring->head.load(std::memory_order_acquire);
+                uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+                for (; tail < head; tail++) {
+                    AppendRecord(ring->records[tail % LOG_RING_SIZE]);
+                    nlines++;
+                }
+                ring->tail.store(tail, std::memory_order_release);
+                if (closed) {
+                    std::lock_guard<std::mutex> lock(rings_mutex);
+                    rings.erase(std::find(rings.begin(), rings.end(), ring));
+                    delete ring;
+                }
+            }
+            if (out_buf.size() > 0) {
+                fwrite(out_buf.data(), 1, out_buf.size(), out_file);
+                fflush(out_file);
+                out_buf.clear();
+            }
+            return nlines;
+        }
+    }
+
+    std::atomic<bool> NovaLogger::started_{false};
+
+    void NovaLogger::Start(FILE *out) {
+        RDMA_ASSERT(!running.load()) << "the logger is already started";
+        static std::once_flag stop_at_exit;
+        // A joinable flusher would terminate the process when it is
+        // destroyed, and lose the pending lines, if main returns without
+        // Stop. Registered after the flusher was constructed, so it runs
+        // before the flusher is destroyed.
+        std::call_once(stop_at_exit, []() { atexit(&NovaLogger::Stop); });
+        out_file = out;
+        running.store(true);
+        flusher = std::thread(&NovaLogger::FlushLoop);
+        started_.store(true, std::memory_order_release);
+        ::rdmaio::log_sink() = &NovaLogger::LogLine;
+        ::rdmaio::log_flush() = &NovaLogger::Flush;
+    }
+
+    void NovaLogger::Stop() {
+        if (!running.load()) {
+            return;
+        }
+        ::rdmaio::log_sink() = nullptr;
+        started_.store(false, std::memory_order_release);
+        running.store(false);
+        if (flusher.joinable()) {
+            flusher.join();
+        }
+        Flush();
+        ::rdmaio::log_flush() = nullptr;
+    }
+
+    void NovaLogger::FlushLoop() {
+        while (running.load(std::memory_order_relaxed)) {
+            uint64_t nlines;
+            {
+                std::lock_guard<std::mutex> lock(drain_mutex);
+                nlines = Drain();
+            }
+            if (nlines == 0) {
+                usleep(LOG_FLUSH_INTERVAL_US);
+            }
+        }
+    }
+
+    void NovaLogger::Flush() {
+        std::lock_guard<std::mutex> lock(drain_mutex);
+        Drain();
+    }
+
+    uint64_t NovaLogger::ndropped() {
+        return ndropped_total.load(std::memory_order_relaxed);
+    }
+
+    uint64_t NovaLogger::WallNanos() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    NovaLogRecord *NovaLogger::Claim() {
+        NovaLogRing *ring = ThisRing();
+        uint64_t head = ring->head.load(std::memory_order_relaxed);
+        if (head - ring->tail.load(std::memory_order_acquire) ==
+            LOG_RING_SIZE) {
+            ring->ndropped.fetch_add(1, std::memory_order_relaxed);
+            ndropped_total.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        return &ring->records[head % LOG_RING_SIZE];
+    }
+
+    void NovaLogger::Publish() {
+        NovaLogRing *ring = ring_holder.ring;
+        ring->head.store(ring->head.load(std::memory_order_relaxed) + 1,
+                         std::memory_order_release);
+    }
+
+    void NovaLogger::LogSync(const char *file, int line, int level,
+                             const std::string &msg) {
+        std::lock_guard<std::mutex> lock(drain_mutex);
+        AppendPrefix(WallNanos(), level, file, line);
+        out_buf.append(msg.data(), msg.data() + msg.size());
+        out_buf.push_back('\n');
+        fwrite(out_buf.data(), 1, out_buf.size(), out_file);
+        fflush(out_file);
+        out_buf.clear();
+        if (level >= ::rdmaio::FATAL) {
+            abort();
+        }
+    }
+
+    void NovaLogger::LogLine(int level, const char *file, int line,
+                             const std::string &msg) {
+        Log(file, line, level, "{}", msg);
+    }
+}
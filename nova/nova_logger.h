@@ -0,0 +1,247 @@
+//
+// Copyright (c) 2020 University of Southern California. All rights reserved.
+//
+
+#ifndef RLIB_NOVA_LOGGER_H
+#define RLIB_NOVA_LOGGER_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <fmt/format.h>
+
+#include "logging.hpp"
+
+#define LOG_RECORD_SIZE 256
+// Records per thread. A thread that logs faster than the flusher drains
+// drops lines instead of blocking.
+#define LOG_RING_SIZE 4096
+#define LOG_FLUSH_INTERVAL_US 1000
+
+// Logs a line with fmt syntax. The arguments are copied into a per-thread
+// ring and formatted by the flusher thread, so an enabled line costs a clock
+// read and a few copies. Strings are copied, other arguments must be
+// trivially copyable. Lines below RDMA_LOG_LEVEL are compiled out, lines
+// below NovaLogger::SetLevel are skipped at runtime.
+#define NOVA_LOG(n, format, ...)                                           \
+    if (n >= RDMA_LOG_LEVEL &&                                             \
+        n >= ::rdmaio::log_level().load(std::memory_order_relaxed))        \
+        ::nova::NovaLogger::Log(__FILE__, __LINE__, n, format, ##__VA_ARGS__)
+
+namespace nova {
+
+    // Formats the arguments serialized in args.
+    typedef size_t (*log_formatter_t)(const char *format, const char *args,
+                                      char *out, size_t n);
+
+    struct NovaLogRecord {
+        // Wall clock.
+        uint64_t ts_ns;
+        const char *file;
+        const char *format;
+        log_formatter_t formatter;
+        uint32_t line;
+        uint8_t level;
+        // An argument did not fit into args.
+        bool truncated;
+        uint16_t args_size;
+        char args[LOG_RECORD_SIZE - 40];
+    };
+
+    // Serializes an argument into a record and reads it back in the flusher.
+    template<typename T>
+    struct NovaLogArg {
+        static_assert(std::is_trivially_copyable<T>::value,
+                      "NOVA_LOG arguments must be trivially copyable");
+        typedef T View;
+
+        static void Put(char **p, const char *end, const T &v,
+                        bool *truncated) {
+            if (*p + sizeof(T) > end) {
+                *truncated = true;
+                return;
+            }
+            memcpy(*p, &v, sizeof(T));
+            *p += sizeof(T);
+        }
+
+        static View Get(const char **p) {
+            T v;
+            memcpy(&v, *p, sizeof(T));
+            *p += sizeof(T);
+            return v;
+        }
+    };
+
+    // Strings are copied with a length prefix and truncated to fit.
+    struct NovaLogStringArg {
+        typedef fmt::string_view View;
+
+        static void Put(char **p, const char *end, const char *s, size_t len,
+                        bool *truncated) {
+            if (*p + sizeof(uint16_t) > end) {
+                *truncated = true;
+                return;
+            }
+            uint16_t n = std::min(len, (size_t) (end - *p - sizeof(uint16_t)));
+            memcpy(*p, &n, sizeof(n));
+            memcpy(*p + sizeof(n), s, n);
+            *p += sizeof(n) + n;
+        }
+
+        static View Get(const char **p) {
+            uint16_t n;
+            memcpy(&n, *p, sizeof(n));
+            View v(*p + sizeof(n), n);
+            *p += sizeof(n) + n;
+            return v;
+        }
+    };
+
+    template<>
+    struct NovaLogArg<const char *> : public NovaLogStringArg {
+        static void Put(char **p, const char *end, const char *s,
+                        bool *truncated) {
+            if (s == nullptr) {
+                s = "(null)";
+            }
+            NovaLogStringArg::Put(p, end, s, strlen(s), truncated);
+        }
+    };
+
+    template<>
+    struct NovaLogArg<char *> : public NovaLogArg<const char *> {
+    };
+
+    template<>
+    struct NovaLogArg<std::string> : public NovaLogStringArg {
+        static void Put(char **p, const char *end, const std::string &s,
+                        bool *truncated) {
+            NovaLogStringArg::Put(p, end, s.data(), s.size(), truncated);
+        }
+    };
+
+    template<size_t...>
+    struct NovaLogSeq {
+    };
+
+    template<size_t N, size_t... I>
+    struct NovaMakeLogSeq : NovaMakeLogSeq<N - 1, N - 1, I...> {
+    };
+
+    template<size_t... I>
+    struct NovaMakeLogSeq<0, I...> {
+        typedef NovaLogSeq<I...> type;
+    };
+
+    template<typename... Args>
+    struct NovaLogFormatter {
+        static size_t
+        Format(const char *format, const char *args, char *out, size_t n) {
+            return Apply(format, args, out, n,
+                         typename NovaMakeLogSeq<sizeof...(Args)>::type());
+        }
+
+        template<size_t... I>
+        static size_t Apply(const char *format, const char *args, char *out,
+                            size_t n, NovaLogSeq<I...>) {
+            const char *p = args;
+            // A braced list is evaluated left to right.
+            std::tuple<typename NovaLogArg<Args>::View...> views{
+                    NovaLogArg<Args>::Get(&p)...};
+            (void) p;
+            return fmt::format_to_n(out, n, format,
+                                    std::get<I>(views)...).size;
+        }
+    };
+
+    struct NovaLogRing;
+
+    // Asynchronous logger. Each thread appends to its own lock-free ring; a
+    // flusher thread formats the lines and writes them. Lines of a thread
+    // keep their order, lines of different threads may interleave out of
+    // time order by up to a flush interval.
+    class NovaLogger {
+    public:
+        // Starts the flusher thread writing to out and routes RDMA_LOG
+        // through the rings. Before Start, NOVA_LOG writes synchronously.
+        // Stop runs at exit if it was not called.
+        static void Start(FILE *out);
+
+        // Writes the pending lines and stops the flusher thread. Call it
+        // before main returns; a FATAL line or a failed RDMA_ASSERT flushes
+        // the pending lines before it aborts.
+        static void Stop();
+
+        // Lines below level are skipped, for NOVA_LOG and RDMA_LOG alike.
+        static void SetLevel(int level) {
+            ::rdmaio::log_level().store(level, std::memory_order_relaxed);
+        }
+
+        // Writes the pending lines of all threads.
+        static void Flush();
+
+        // Lines dropped because a ring was full.
+        static uint64_t ndropped();
+
+        template<typename... Args>
+        static void Log(const char *file, int line, int level,
+                        const char *format, const Args &... args) {
+            if (!started_.load(std::memory_order_acquire)) {
+                LogSync(file, line, level, fmt::format(format, args...));
+                return;
+            }
+            NovaLogRecord *record = Claim();
+            if (record == nullptr) {
+                return;
+            }
+            record->ts_ns = WallNanos();
+            record->file = file;
+            record->line = line;
+            record->level = level;
+            record->format = format;
+            record->truncated = false;
+            record->formatter =
+                    &NovaLogFormatter<typename std::decay<Args>::type...>::Format;
+            char *p = record->args;
+            const char *end = record->args + sizeof(record->args);
+            int unused[] = {0, (NovaLogArg<typename std::decay<Args>::type>::Put(
+                    &p, end, args, &record->truncated), 0)...};
+            (void) unused;
+            record->args_size = p - record->args;
+            Publish();
+            if (level >= ::rdmaio::FATAL) {
+                Flush();
+                abort();
+            }
+        }
+
+    private:
+        static uint64_t WallNanos();
+
+        // Returns the next free record of this thread's ring, nullptr if it
+        // is full.
+        static NovaLogRecord *Claim();
+
+        // Hands the claimed record to the flusher.
+        static void Publish();
+
+        static void LogSync(const char *file, int line, int level,
+                            const std::string &msg);
+
+        // The sink of RDMA_LOG.
+        static void LogLine(int level, const char *file, int line,
+                            const std::string &msg);
+
+        static void FlushLoop();
+
+        static std::atomic<bool> started_;
+    };
+}
+
+#endif //RLIB_NOVA_LOGGER_H
@@ -0,0 +1,539 @@
+//
+// Copyright (c) 2020 University of Southern California. All rights reserved.
+//
+
+// End-to-end tests of the services over NovaRDMALoopbackBroker, so they run
+// without an RNIC. Three nodes in one process are fully connected and driven
+// by one thread, which polls every broker until the condition a test waits
+// for holds. A failed check aborts with its line.
+//
+// Covered: leasing and freeing memory of a peer, KV PUT/GET/DELETE, pub/sub
+// fan-out over SEND and WRITE_WITH_IMM and the reclaim of the shared buffer,
+// the msg adapter, and the rejection of malformed messages by each service.
+
+#include <string.h>
+#include <functional>
+#include <string>
+#include <vector>
+#include <fmt/format.h>
+
+#include "logging.hpp"
+#include "nova_common.h"
+#include "nova_kv.h"
+#include "nova_mem_manager.h"
+#include "nova_mem_service.h"
+#include "nova_msg.h"
+#include "nova_pubsub.h"
+#include "nova_rc_msg_adapter.h"
+#include "nova_rdma_loopback_broker.h"
+
+using namespace std;
+using namespace nova;
+
+#define TEST_NODES 3
+#define TEST_MAX_NUM_SENDS 32
+#define TEST_MAX_MSG_SIZE 1024
+#define TEST_BROKER_SIZE (1ull << 20)
+#define TEST_INDEX_BUCKETS 64
+#define TEST_POOL_SIZE (16ull << 20)
+// Polls before a wait gives up.
+#define TEST_MAX_POLLS 100000
+
+namespace {
+    // Passes every completion of a node to its services.
+    class TestCallback : public NovaMsgCallback {
+    public:
+        bool
+        ProcessRDMAWC(ibv_wc_opcode type, uint64_t wr_id, int remote_server_id,
+                      char *buf, uint32_t imm_data) override {
+            switch (type) {
+                case IBV_WC_RECV:
+                    if (mem_server->HandleMessage(remote_server_id, buf) ||
+                        mem_client->HandleMessage(remote_server_id, buf) ||
+                        kv_server->HandleMessage(remote_server_id, buf) ||
+                        kv_client->HandleMessage(remote_server_id, buf) ||
+                        publisher->HandleMessage(remote_server_id, buf) ||
+                        subscriber->HandleMessage(remote_server_id, buf) ||
+                        adapter->HandleMessage(remote_server_id, buf)) {
+                        break;
+                    }
+                    RDMA_ASSERT(false) << "unknown message type " << buf[0];
+                    break;
+                case IBV_WC_RECV_RDMA_WITH_IMM:
+                    RDMA_ASSERT(subscriber->HandleWriteImm(remote_server_id,
+                                                           imm_data));
+                    break;
+                case IBV_WC_SEND:
+                case IBV_WC_RDMA_WRITE:
+                    publisher->HandleCompletion(remote_server_id, wr_id);
+                    break;
+                case IBV_WC_RDMA_READ:
+                    kv_client->HandleCompletion(remote_server_id, wr_id);
+                    break;
+                default:
+                    break;
+            }
+            return true;
+        }
+
+        void
+        ProcessRDMAError(ibv_wr_opcode type, uint64_t wr_id,
+                         int remote_server_id, char *buf,
+                         ibv_wc_status status) override {
+            RDMA_ASSERT(false) << fmt::format(
+                        "request {} to server {} failed: {}", wr_id,
+                        remote_server_id, ibv_wc_status_str(status));
+        }
+
+        NovaMemServer *mem_server = nullptr;
+        NovaMemClient *mem_client = nullptr;
+        NovaKVServer *kv_server = nullptr;
+        NovaKVClient *kv_client = nullptr;
+        NovaPublisher *publisher = nullptr;
+        NovaSubscriber *subscriber = nullptr;
+        NovaRCMsgAdapter *adapter = nullptr;
+    };
+
+    // A publication or adapter message as the callback saw it.
+    struct Received {
+        int server_id;
+        uint32_t topic;
+        string data;
+    };
+
+    // A node's registered region holds its broker's buffers, its KV index
+    // and the pool of its NovaMemManager, in that order.
+    struct TestNode {
+        uint32_t server_id;
+        char *mem;
+        uint64_t mem_size;
+        NovaMemManager *mem_manager;
+        NovaRDMALoopbackBroker *broker;
+        TestCallback callback;
+        NovaKVIndex *kv_index;
+        vector<Received> publications;
+        vector<Received> adapter_msgs;
+    };
+
+    TestNode nodes[TEST_NODES];
+
+    void CreateNode(uint32_t server_id) {
+        TestNode &node = nodes[server_id];
+        node.server_id = server_id;
+        uint64_t index_size = NovaKVIndex::IndexSize(TEST_INDEX_BUCKETS);
+        node.mem_size = TEST_BROKER_SIZE + index_size + TEST_POOL_SIZE;
+        node.mem = (char *) calloc(1, node.mem_size);
+        RDMA_ASSERT(node.mem != nullptr);
+        RDMA_ASSERT((TEST_NODES - 1) * 2 * TEST_MAX_NUM_SENDS *
+                    TEST_MAX_MSG_SIZE <= TEST_BROKER_SIZE);
+
+        vector<QPEndPoint> end_points;
+        for (uint32_t i = 0; i < TEST_NODES; i++) {
+            if (i != server_id) {
+                QPEndPoint end_point = {};
+                end_point.server_id = i;
+                end_points.push_back(end_point);
+            }
+        }
+        node.mem_manager = new NovaMemManager(
+                node.mem + TEST_BROKER_SIZE + index_size, 1, TEST_POOL_SIZE,
+                1);
+        node.mem_manager->BindMR(node.mem, 0, 0);
+        node.kv_index = new NovaKVIndex(node.mem_manager,
+                                        node.mem + TEST_BROKER_SIZE,
+                                        TEST_INDEX_BUCKETS);
+        node.broker = new NovaRDMALoopbackBroker(
+                node.mem, 0, end_points, TEST_MAX_NUM_SENDS,
+                TEST_MAX_MSG_SIZE, 4, server_id, node.mem, node.mem_size,
+                &node.callback);
+
+        TestCallback &cb = node.callback;
+        cb.mem_server = new NovaMemServer(node.mem_manager, node.broker,
+                                          TEST_MAX_MSG_SIZE);
+        cb.mem_client = new NovaMemClient(node.broker, TEST_MAX_MSG_SIZE);
+        cb.kv_server = new NovaKVServer(node.kv_index, node.broker,
+                                        TEST_MAX_MSG_SIZE);
+        cb.kv_client = new NovaKVClient(node.broker, node.mem_manager,
+                                        TEST_MAX_MSG_SIZE);
+        cb.publisher = new NovaPublisher(node.broker, node.mem_manager,
+                                         server_id, TEST_MAX_MSG_SIZE);
+        cb.subscriber = new NovaSubscriber(
+                node.broker, TEST_MAX_MSG_SIZE,
+                [&node](int publisher_id, uint32_t topic, char *payload,
+                        uint32_t size) {
+                    node.publications.push_back(
+                            {publisher_id, topic, string(payload, size)});
+                });
+        cb.adapter = new NovaRCMsgAdapter(
+                node.broker, server_id, TEST_MAX_MSG_SIZE,
+                [&node](const char *msg, int node_id, int tid) {
+                    node.adapter_msgs.push_back({node_id, 0, string(msg)});
+                });
+    }
+
+    void PollAll() {
+        for (TestNode &node : nodes) {
+            node.broker->FlushPendingSends();
+            node.broker->PollSQ();
+            node.broker->PollRQ();
+        }
+    }
+
+    // Polls until done returns true.
+    void WaitFor(const char *what, const function<bool()> &done) {
+        for (uint32_t i = 0; i < TEST_MAX_POLLS; i++) {
+            if (done()) {
+                return;
+            }
+            PollAll();
+        }
+        RDMA_ASSERT(false) << "timed out waiting for " << what;
+    }
+
+    // Polls long enough for the requests in flight to be delivered and
+    // their replies to complete.
+    void Drain() {
+        for (uint32_t i = 0; i < 16; i++) {
+            PollAll();
+        }
+    }
+
+    uint64_t LiveItems(NovaMemManager *mem_manager) {
+        uint64_t n = 0;
+        NovaMemStats stats = mem_manager->Stats();
+        for (const NovaPartitionStats &partition : stats.partitions) {
+            for (const SlabClassStats &cls : partition.slab_classes) {
+                n += cls.nallocs - cls.nfrees;
+            }
+        }
+        return n;
+    }
+
+    NovaKVResult KVWait(TestNode &node, uint32_t req_id) {
+        NovaKVResult result = {};
+        WaitFor("a KV result", [&]() {
+            return node.callback.kv_client->TakeResult(req_id, &result);
+        });
+        return result;
+    }
+
+    NovaRemoteLease LeaseWait(TestNode &node, uint32_t req_id) {
+        NovaRemoteLease lease = {};
+        WaitFor("a lease", [&]() {
+            return node.callback.mem_client->TakeLease(req_id, &lease);
+        });
+        return lease;
+    }
+
+    // Node 1 leases items of node 0, writes and reads one of them back, and
+    // frees them.
+    void TestMemService() {
+        TestNode &server = nodes[0];
+        TestNode &client = nodes[1];
+        NovaMemClient *mem_client = client.callback.mem_client;
+        uint64_t live_items = LiveItems(server.mem_manager);
+
+        NovaRemoteLease lease = LeaseWait(client,
+                                          mem_client->Alloc(0, 8, 100));
+        RDMA_ASSERT(lease.items.size() == 8) << lease.items.size();
+        RDMA_ASSERT(lease.lease_id != 0);
+        RDMA_ASSERT(server.callback.mem_server->nleased_items() == 8);
+        RDMA_ASSERT(LiveItems(server.mem_manager) == live_items + 8);
+        for (const NovaRemoteItem &item : lease.items) {
+            RDMA_ASSERT(item.size >= 100) << item.size;
+            RDMA_ASSERT(item.offset >= TEST_BROKER_SIZE &&
+                        item.offset + item.size <= server.mem_size);
+        }
+
+        // The items are usable one-sided.
+        uint32_t scid = client.mem_manager->slabclassid(0, 100);
+        NovaItemHandle local = client.mem_manager->ItemAllocHandle(0, scid,
+                                                                   100);
+        RDMA_ASSERT(local.addr != nullptr);
+        memset(local.addr, 'w', 100);
+        client.broker->PostWrite(local, lease.items[3], 100, 0, 0);
+        Drain();
+        RDMA_ASSERT(memcmp(server.mem + lease.items[3].offset, local.addr,
+                           100) == 0);
+        client.mem_manager->FreeItem(0, local);
+
+        mem_client->Free(lease, lease.items);
+        mem_client->FlushFrees();
+        WaitFor("the frees", [&]() {
+            return server.callback.mem_server->nleased_items() == 0;
+        });
+        RDMA_ASSERT(LiveItems(server.mem_manager) == live_items);
+        RDMA_ASSERT(mem_client->nerrors() == 0);
+
+        // Peers that leave without freeing are reclaimed.
+        lease = LeaseWait(client, mem_client->Alloc(0, 4, 2000));
+        RDMA_ASSERT(lease.items.size() == 4);
+        server.callback.mem_server->ReclaimPeer(1);
+        RDMA_ASSERT(server.callback.mem_server->nleased_items() == 0);
+        RDMA_ASSERT(LiveItems(server.mem_manager) == live_items);
+        printf("PASS mem service\n");
+    }
+
+    // Node 1 writes keys of node 0 that node 2 reads one-sided.
+    void TestKV() {
+        TestNode &writer = nodes[1];
+        TestNode &reader = nodes[2];
+        NovaKVClient *kv_writer = writer.callback.kv_client;
+        NovaKVClient *kv_reader = reader.callback.kv_client;
+        RDMA_ASSERT(KVWait(writer, kv_writer->Connect(0)).status == NOVA_KV_OK);
+        RDMA_ASSERT(KVWait(reader, kv_reader->Connect(0)).status == NOVA_KV_OK);
+        RDMA_ASSERT(kv_reader->IsConnected(0));
+
+        NovaKVResult result = KVWait(reader, kv_reader->Get(0, 42));
+        RDMA_ASSERT(result.status == NOVA_KV_NOT_FOUND) << result.status;
+
+        result = KVWait(writer, kv_writer->Put(0, 42, "hello", 5));
+        RDMA_ASSERT(result.status == NOVA_KV_OK) << result.status;
+        result = KVWait(reader, kv_reader->Get(0, 42));
+        RDMA_ASSERT(result.status == NOVA_KV_OK) << result.status;
+        RDMA_ASSERT(result.value_size == 5 &&
+                    memcmp(result.value, "hello", 5) == 0);
+        kv_reader->Release(&result);
+
+        // An overwrite with a value of another slab class.
+        string value(kv_writer->max_value_size(), 'v');
+        result = KVWait(writer, kv_writer->Put(0, 42, value.data(),
+                                               value.size()));
+        RDMA_ASSERT(result.status == NOVA_KV_OK) << result.status;
+        result = KVWait(reader, kv_reader->Get(0, 42));
+        RDMA_ASSERT(result.status == NOVA_KV_OK) << result.status;
+        RDMA_ASSERT(result.value_size == value.size() &&
+                    memcmp(result.value, value.data(), value.size()) == 0);
+        kv_reader->Release(&result);
+
+        for (uint64_t key = 100; key < 132; key++) {
+            result = KVWait(writer, kv_writer->Put(0, key, (char *) &key,
+                                                   sizeof(key)));
+            RDMA_ASSERT(result.status == NOVA_KV_OK) << result.status;
+        }
+        for (uint64_t key = 100; key < 132; key++) {
+            result = KVWait(reader, kv_reader->Get(0, key));
+            RDMA_ASSERT(result.status == NOVA_KV_OK) << result.status;
+            RDMA_ASSERT(result.value_size == sizeof(key) &&
+                        memcmp(result.value, &key, sizeof(key)) == 0);
+            kv_reader->Release(&result);
+        }
+        RDMA_ASSERT(nodes[0].kv_index->nkeys() == 33);
+
+        result = KVWait(writer, kv_writer->Delete(0, 42));
+        RDMA_ASSERT(result.status == NOVA_KV_OK) << result.status;
+        result = KVWait(reader, kv_reader->Get(0, 42));
+        RDMA_ASSERT(result.status == NOVA_KV_NOT_FOUND) << result.status;
+        printf("PASS kv\n");
+    }
+
+    // Node 0 publishes to node 1 over SEND and to node 2 over
+    // WRITE_WITH_IMM into a ring of node 2.
+    void TestPubSub() {
+        TestNode &pub_node = nodes[0];
+        NovaPublisher *publisher = pub_node.callback.publisher;
+        uint64_t live_items = LiveItems(pub_node.mem_manager);
+
+        nodes[1].callback.subscriber->Subscribe(0, 7);
+        uint32_t scid = nodes[2].mem_manager->slabclassid(0, 4 * 256);
+        NovaItemHandle ring = nodes[2].mem_manager->ItemAllocHandle(
+                0, scid, 4 * 256);
+        RDMA_ASSERT(ring.addr != nullptr);
+        NovaRemoteItem remote_ring = ToRemoteItem(ring);
+        remote_ring.size = 4 * 256;
+        nodes[2].callback.subscriber->Subscribe(0, 7, ring.addr, remote_ring,
+                                                4);
+        Drain();
+
+        for (uint32_t i = 0; i < 6; i++) {
+            string data = fmt::format("publication {}", i);
+            char *payload = publisher->Alloc(data.size());
+            RDMA_ASSERT(payload != nullptr);
+            memcpy(payload, data.data(), data.size());
+            uint32_t n = publisher->Publish(7, payload, data.size());
+            RDMA_ASSERT(n == 2) << n;
+            publisher->Flush();
+            Drain();
+        }
+        for (uint32_t i = 1; i < TEST_NODES; i++) {
+            const vector<Received> &received = nodes[i].publications;
+            RDMA_ASSERT(received.size() == 6) << received.size();
+            for (uint32_t j = 0; j < received.size(); j++) {
+                RDMA_ASSERT(received[j].server_id == 0 &&
+                            received[j].topic == 7);
+                RDMA_ASSERT(received[j].data ==
+                            fmt::format("publication {}", j));
+            }
+        }
+        // The buffer of a publication is freed once every subscriber has it.
+        RDMA_ASSERT(publisher->ninflight_publications() == 0);
+        RDMA_ASSERT(LiveItems(pub_node.mem_manager) == live_items);
+
+        // A publication without subscribers is freed right away.
+        char *payload = publisher->Alloc(8);
+        RDMA_ASSERT(publisher->Publish(8, payload, 8) == 0);
+        RDMA_ASSERT(LiveItems(pub_node.mem_manager) == live_items);
+
+        nodes[1].callback.subscriber->Unsubscribe(0, 7);
+        Drain();
+        payload = publisher->Alloc(8);
+        RDMA_ASSERT(publisher->Publish(7, payload, 8) == 1);
+        publisher->Flush();
+        Drain();
+        RDMA_ASSERT(nodes[1].publications.size() == 6);
+        RDMA_ASSERT(nodes[2].publications.size() == 7);
+        RDMA_ASSERT(publisher->ninflight_publications() == 0);
+        RDMA_ASSERT(LiveItems(pub_node.mem_manager) == live_items);
+
+        nodes[2].callback.subscriber->Unsubscribe(0, 7);
+        Drain();
+        nodes[2].mem_manager->FreeItem(0, ring);
+        printf("PASS pubsub\n");
+    }
+
+    void TestMsgAdapter() {
+        NovaRCMsgAdapter *adapter = nodes[0].callback.adapter;
+        RDMA_ASSERT(adapter->connect("", 0) == SUCC);
+        const char *msg = "to one";
+        RDMA_ASSERT(adapter->send_to(1, msg, strlen(msg) + 1) == SUCC);
+        Drain();
+        RDMA_ASSERT(nodes[1].adapter_msgs.size() == 1);
+        RDMA_ASSERT(nodes[1].adapter_msgs[0].server_id == 0);
+        RDMA_ASSERT(nodes[1].adapter_msgs[0].data == msg);
+
+        // A batch goes out with flush_pending.
+        msg = "to all";
+        adapter->prepare_pending();
+        for (int i = 1; i < TEST_NODES; i++) {
+            for (int j = 0; j < 3; j++) {
+                RDMA_ASSERT(adapter->send_pending(i, msg, strlen(msg) + 1) ==
+                            SUCC);
+            }
+        }
+        RDMA_ASSERT(adapter->flush_pending() == SUCC);
+        Drain();
+        RDMA_ASSERT(nodes[1].adapter_msgs.size() == 4);
+        RDMA_ASSERT(nodes[2].adapter_msgs.size() == 3);
+        for (int i = 1; i < TEST_NODES; i++) {
+            RDMA_ASSERT(nodes[i].adapter_msgs.back().data == msg);
+        }
+        printf("PASS msg adapter\n");
+    }
+
+    // Posts the message encode writes into a send buffer of from to to.
+    // encode returns its size.
+    void SendRaw(uint32_t from, uint32_t to,
+                 const function<uint32_t(char *)> &encode) {
+        char *sendbuf = nodes[from].broker->GetSendBuf(to);
+        uint32_t size = encode(sendbuf);
+        nodes[from].broker->PostSend(sendbuf, size, to, 0);
+        nodes[from].broker->FlushPendingSends(to);
+    }
+
+    void TestMalformed() {
+        TestNode &server = nodes[0];
+        TestNode &client = nodes[1];
+
+        // A PUT whose value runs past its message.
+        uint32_t req_id = 1u << 30;
+        SendRaw(1, 0, [&](char *buf) {
+            NovaKVPutRequest *req = NovaMsgEncode<NovaKVPutRequest>(
+                    buf, NOVA_KV_PUT_REQ, req_id, 8);
+            req->key = 7;
+            req->value_size = 100000;
+            return NovaMsgSize(buf);
+        });
+        NovaKVResult result = KVWait(client, req_id);
+        RDMA_ASSERT(result.status == NOVA_KV_BAD_REQUEST) << result.status;
+        RDMA_ASSERT(KVWait(client, client.callback.kv_client->Get(0, 7))
+                            .status == NOVA_KV_NOT_FOUND);
+
+        // Allocations of sizes no slab class holds.
+        NovaMemClient *mem_client = client.callback.mem_client;
+        uint64_t live_items = LiveItems(server.mem_manager);
+        NovaRemoteLease lease = LeaseWait(client, mem_client->Alloc(0, 1, 0));
+        RDMA_ASSERT(lease.items.empty());
+        lease = LeaseWait(client, mem_client->Alloc(
+                0, 1, server.mem_manager->max_item_size() + 1));
+        RDMA_ASSERT(lease.items.empty());
+        RDMA_ASSERT(mem_client->nerrors() == 2) << mem_client->nerrors();
+
+        // A free of more offsets than its message holds.
+        lease = LeaseWait(client, mem_client->Alloc(0, 2, 64));
+        RDMA_ASSERT(lease.items.size() == 2);
+        SendRaw(1, 0, [&](char *buf) {
+            NovaMemFreeRequest *req = NovaMsgEncode<NovaMemFreeRequest>(
+                    buf, NOVA_MEM_FREE_REQ, 0, 2 * sizeof(uint64_t));
+            req->nitems = 1000;
+            req->lease_id = lease.lease_id;
+            return NovaMsgSize(buf);
+        });
+        WaitFor("the rejection of a free",
+                [&]() { return mem_client->nerrors() == 3; });
+        RDMA_ASSERT(server.callback.mem_server->nleased_items() == 2);
+        mem_client->Free(lease, lease.items);
+        mem_client->FlushFrees();
+        WaitFor("the frees", [&]() {
+            return server.callback.mem_server->nleased_items() == 0;
+        });
+        RDMA_ASSERT(LiveItems(server.mem_manager) == live_items);
+
+        // A ring whose slots cannot hold a publication.
+        SendRaw(1, 0, [&](char *buf) {
+            NovaSubscribeRequest req = {};
+            req.type = NOVA_PUBSUB_SUBSCRIBE;
+            req.topic = 9;
+            req.write_imm = true;
+            req.nslots = 0;
+            req.ring.size = 1024;
+            memcpy(buf, &req, sizeof(req));
+            return (uint32_t) sizeof(req);
+        });
+        Drain();
+        char *payload = server.callback.publisher->Alloc(8);
+        RDMA_ASSERT(server.callback.publisher->Publish(9, payload, 8) == 0);
+
+        // A publication that claims more than its buffer holds.
+        size_t npublications = nodes[1].publications.size();
+        SendRaw(0, 1, [&](char *buf) {
+            NovaPubSubHeader hdr = {};
+            hdr.type = NOVA_PUBSUB_PUBLISH;
+            hdr.topic = 7;
+            hdr.size = TEST_MAX_MSG_SIZE;
+            hdr.publisher_id = 0;
+            memcpy(buf, &hdr, sizeof(hdr));
+            return (uint32_t) sizeof(hdr);
+        });
+        Drain();
+        RDMA_ASSERT(nodes[1].publications.size() == npublications);
+
+        // A message too large for the broker.
+        string big(TEST_MAX_MSG_SIZE, 'b');
+        RDMA_ASSERT(server.callback.adapter->send_to(1, big.data(),
+                                                     big.size()) ==
+                    WRONG_ARG);
+        RDMA_ASSERT(server.callback.adapter->send_to(1, big.data(), -1) ==
+                    WRONG_ARG);
+        printf("PASS malformed messages\n");
+    }
+}
+
+int main(int argc, char *argv[]) {
+    for (uint32_t i = 0; i < TEST_NODES; i++) {
+        CreateNode(i);
+    }
+    for (TestNode &node : nodes) {
+        node.broker->Init(nullptr);
+    }
+    for (TestNode &node : nodes) {
+        for (uint32_t i = 0; i < TEST_NODES; i++) {
+            RDMA_ASSERT(i == node.server_id || node.broker->IsConnected(i));
+        }
+    }
+    TestMemService();
+    TestKV();
+    TestPubSub();
+    TestMsgAdapter();
+    TestMalformed();
+    return 0;
+}
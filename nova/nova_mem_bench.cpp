@@ -0,0 +1,482 @@
+//
+// Copyright (c) 2020 University of Southern California. All rights reserved.
+//
+// Multi-threaded benchmark of NovaMemManager. Needs no RDMA hardware:
+//
+//   nova_mem_bench --threads=1,4,16 --partitions=1,4,16 --size_dist=zipf
+//
+// Each thread keeps up to --live_items items. An operation allocates an item
+// of the next size and, once the thread is at --live_items, frees a random
+// live item first, so the pool sees a steady mix of allocations and frees.
+// With --free_batch > 1, frees are queued per slab class and returned with
+// FreeItems. Results go to --csv, one row per configuration.
+//
+// Sizes are uniform or Zipf in [min_size, max_size], Zipf favoring small
+// sizes, or replayed from --trace: one "size" or "key size" per line. Keys
+// pick the partition under the key policies and are uniform, Zipf, or
+// sequential in [0, num_keys), unless the trace has them.
+//
+// Peak memory is sampled from NovaMemManager::Stats every --sample_ms.
+// Stats takes the class locks, so sampling adds a few lock waits.
+// Fragmentation is taken at the end of a run: internal is
+// NovaMemStats::live_fragmentation, the share of live item bytes not asked
+// for; slab is the share of the bytes held in slabs not taken up by live
+// items.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include <gflags/gflags.h>
+#include <fmt/format.h>
+
+#include "logging.hpp"
+#include "nova_common.h"
+#include "nova_mem_manager.h"
+
+using namespace std;
+using namespace nova;
+
+DEFINE_string(threads, "1,2,4,8", "Thread counts.");
+DEFINE_string(partitions, "1,4,16", "Partition counts.");
+DEFINE_string(policies, "key,thread",
+              "Partition policies: key, key_hash, thread, numa.");
+DEFINE_uint64(mem_pool_size_gb, 1, "Memory pool size in GB.");
+DEFINE_uint64(slab_size_mb, 1, "Slab size in MB.");
+DEFINE_string(size_dist, "uniform", "uniform, zipf, or trace.");
+DEFINE_uint64(min_size, 64, "Smallest allocation of uniform and zipf.");
+DEFINE_uint64(max_size, 8192, "Largest allocation of uniform and zipf.");
+DEFINE_string(trace, "", "Trace of --size_dist=trace.");
+DEFINE_string(key_dist, "uniform", "uniform, zipf, or sequential.");
+DEFINE_uint64(num_keys, 1000000, "Number of distinct keys.");
+DEFINE_double(zipf_theta, 0.99, "Skew of the Zipf distributions, not 1.");
+DEFINE_uint64(live_items, 4096, "Live items per thread.");
+DEFINE_uint64(free_batch, 1,
+              "Frees per FreeItems call. 1 frees with FreeItem.");
+DEFINE_uint64(duration_ms, 1000, "Duration of a configuration.");
+DEFINE_uint64(sample_ms, 10, "Interval of the peak memory samples.");
+DEFINE_string(csv, "", "CSV output file. Empty writes to stdout.");
+
+namespace {
+    enum BenchDist {
+        DIST_UNIFORM, DIST_ZIPF, DIST_SEQUENTIAL, DIST_TRACE
+    };
+
+    BenchDist ParseDist(const string &name) {
+        if (name == "uniform") {
+            return DIST_UNIFORM;
+        }
+        if (name == "zipf") {
+            return DIST_ZIPF;
+        }
+        if (name == "sequential") {
+            return DIST_SEQUENTIAL;
+        }
+        if (name == "trace") {
+            return DIST_TRACE;
+        }
+        RDMA_ASSERT(false) << "unknown distribution " << name;
+        return DIST_UNIFORM;
+    }
+
+    vector<string> SplitList(const string &list) {
+        vector<string> values;
+        stringstream ss(list);
+        string value;
+        while (getline(ss, value, ',')) {
+            if (!value.empty()) {
+                values.push_back(value);
+            }
+        }
+        RDMA_ASSERT(!values.empty()) << "empty list " << list;
+        return values;
+    }
+
+    vector<uint32_t> ParseList(const string &list) {
+        vector<uint32_t> values;
+        for (const string &value : SplitList(list)) {
+            values.push_back(stoul(value));
+        }
+        return values;
+    }
+
+    // Zipf over [0, n), 0 the most popular, from Gray et al., "Quickly
+    // generating billion-record synthetic databases". The constants are
+    // computed once and shared by the threads.
+    class ZipfGenerator {
+    public:
+        ZipfGenerator(uint64_t n, double theta) : n_(n), theta_(theta) {
+            RDMA_ASSERT(n > 0 && theta > 0 && theta != 1.0)
+                << "bad zipf parameters";
+            double zeta2 = 0;
+            for (uint64_t i = 1; i <= n; i++) {
+                zetan_ += 1.0 / pow((double) i, theta);
+                if (i == 2) {
+                    zeta2 = zetan_;
+                }
+            }
+            if (n < 2) {
+                zeta2 = zetan_;
+            }
+            alpha_ = 1.0 / (1.0 - theta);
+            eta_ = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / zetan_);
+        }
+
+        uint64_t Next(double u) const {
+            double uz = u * zetan_;
+            if (uz < 1.0) {
+                return 0;
+            }
+            if (uz < 1.0 + pow(0.5, theta_)) {
+                return std::min((uint64_t) 1, n_ - 1);
+            }
+            return std::min((uint64_t) (n_ * pow(eta_ * u - eta_ + 1, alpha_)),
+                            n_ - 1);
+        }
+
+    private:
+        uint64_t n_;
+        double theta_;
+        double zetan_ = 0;
+        double alpha_ = 0;
+        double eta_ = 0;
+    };
+
+    struct TraceRecord {
+        uint64_t key;
+        uint64_t size;
+        bool has_key;
+    };
+
+    vector<TraceRecord> ReadTrace(const string &path) {
+        vector<TraceRecord> trace;
+        ifstream in(path);
+        RDMA_ASSERT(in.good()) << "cannot open trace " << path;
+        string line;
+        while (getline(in, line)) {
+            stringstream ss(line);
+            uint64_t a, b;
+            if (!(ss >> a)) {
+                continue;
+            }
+            if (ss >> b) {
+                trace.push_back(TraceRecord{a, b, true});
+            } else {
+                trace.push_back(TraceRecord{0, a, false});
+            }
+        }
+        RDMA_ASSERT(!trace.empty()) << "empty trace " << path;
+        return trace;
+    }
+
+    struct BenchConfig {
+        string policy;
+        uint32_t nthreads;
+        uint32_t npartitions;
+    };
+
+    struct LiveItem {
+        char *buf;
+        uint64_t key;
+        uint64_t size;
+        uint32_t scid;
+    };
+
+    struct ThreadResult {
+        uint64_t nallocs = 0;
+        uint64_t nfrees = 0;
+        uint64_t nfailures = 0;
+    };
+
+    // Shared by the threads of a run.
+    struct BenchState {
+        NovaMemManager *mem_manager;
+        BenchDist size_dist;
+        BenchDist key_dist;
+        const ZipfGenerator *size_zipf;
+        const ZipfGenerator *key_zipf;
+        const vector<TraceRecord> *trace;
+        std::atomic<bool> stop{false};
+    };
+
+    class BenchThread {
+    public:
+        BenchThread(BenchState *state, uint32_t thread_id, uint32_t nthreads)
+                : state_(state), rand_(thread_id + 1) {
+            mm_ = state->mem_manager;
+            live_.reserve(FLAGS_live_items);
+            pending_.resize(MAX_NUMBER_OF_SLAB_CLASSES);
+            next_key_ = FLAGS_num_keys * thread_id / nthreads;
+            if (state->trace != nullptr) {
+                trace_pos_ = state->trace->size() * thread_id / nthreads;
+            }
+        }
+
+        void Run(ThreadResult *result) {
+            while (!state_->stop.load(std::memory_order_relaxed)) {
+                // Check the flag every few operations only.
+                for (int i = 0; i < 64; i++) {
+                    Step(result);
+                }
+            }
+            FlushFrees(result);
+        }
+
+    private:
+        void Step(ThreadResult *result) {
+            if (live_.size() >= FLAGS_live_items) {
+                FreeRandom(result);
+            }
+            LiveItem item;
+            NextRequest(&item.key, &item.size);
+            item.scid = mm_->slabclassid(item.key, item.size);
+            item.buf = mm_->ItemAlloc(item.key, item.scid, item.size);
+            if (item.buf == nullptr) {
+                result->nfailures++;
+                // Make room and go on.
+                if (!live_.empty()) {
+                    FreeRandom(result);
+                }
+                FlushFrees(result);
+                return;
+            }
+            result->nallocs++;
+            live_.push_back(item);
+        }
+
+        void FreeRandom(ThreadResult *result) {
+            uint64_t i = rand_() % live_.size();
+            LiveItem item = live_[i];
+            live_[i] = live_.back();
+            live_.pop_back();
+            if (FLAGS_free_batch <= 1) {
+                mm_->FreeItem(item.key, item.buf, item.scid);
+                result->nfrees++;
+                return;
+            }
+            vector<char *> &pending = pending_[item.scid];
+            pending.push_back(item.buf);
+            if (pending.size() >= FLAGS_free_batch) {
+                mm_->FreeItems(item.key, pending, item.scid);
+                result->nfrees += pending.size();
+                pending.clear();
+            }
+        }
+
+        void FlushFrees(ThreadResult *result) {
+            for (uint32_t scid = 0; scid < pending_.size(); scid++) {
+                if (pending_[scid].empty()) {
+                    continue;
+                }
+                mm_->FreeItems(0, pending_[scid], scid);
+                result->nfrees += pending_[scid].size();
+                pending_[scid].clear();
+            }
+        }
+
+        double Uniform() {
+            return std::uniform_real_distribution<double>(0, 1)(rand_);
+        }
+
+        void NextRequest(uint64_t *key, uint64_t *size) {
+            bool has_key = false;
+            switch (state_->size_dist) {
+                case DIST_ZIPF:
+                    *size = FLAGS_min_size +
+                            state_->size_zipf->Next(Uniform());
+                    break;
+                case DIST_TRACE: {
+                    const TraceRecord &record = (*state_->trace)[trace_pos_];
+                    trace_pos_ = (trace_pos_ + 1) % state_->trace->size();
+                    *size = record.size;
+                    *key = record.key;
+                    has_key = record.has_key;
+                    break;
+                }
+                default:
+                    *size = FLAGS_min_size +
+                            rand_() % (FLAGS_max_size - FLAGS_min_size + 1);
+                    break;
+            }
+            if (has_key) {
+                return;
+            }
+            switch (state_->key_dist) {
+                case DIST_ZIPF:
+                    *key = state_->key_zipf->Next(Uniform());
+                    break;
+                case DIST_SEQUENTIAL:
+                    *key = next_key_;
+                    next_key_ = (next_key_ + 1) % FLAGS_num_keys;
+                    break;
+                default:
+                    *key = rand_() % FLAGS_num_keys;
+                    break;
+            }
+        }
+
+        BenchState *state_;
+        NovaMemManager *mm_;
+        std::mt19937_64 rand_;
+        vector<LiveItem> live_;
+        // Frees queued per slab class for FreeItems.
+        vector<vector<char *>> pending_;
+        uint64_t next_key_ = 0;
+        uint64_t trace_pos_ = 0;
+    };
+
+    // Bytes held by live items and by slabs.
+    void MemoryInUse(const NovaMemStats &stats, uint64_t *items,
+                     uint64_t *slabs) {
+        *items = 0;
+        *slabs = 0;
+        for (const auto &partition : stats.partitions) {
+            *slabs += (partition.nslabs - partition.nfree_slabs) *
+                      FLAGS_slab_size_mb * 1024 * 1024;
+            for (const auto &sc : partition.slab_classes) {
+                *items += sc.nitems_allocated * sc.item_size;
+            }
+        }
+    }
+
+    void RunConfig(char *pool, BenchState *state, const BenchConfig &config,
+                   FILE *csv) {
+        // Managers are not freed; they only hold bookkeeping and the pool
+        // is reused by the next configuration.
+        NovaMemPartitionPolicy policy = ParseMemPartitionPolicy(config.policy);
+        if (policy == PARTITION_BY_NUMA_NODE) {
+            // The pool was faulted in by earlier configurations; this moves
+            // its pages to the nodes of this one.
+            NovaMemManager::PlaceNUMAPartitions(
+                    pool, config.npartitions,
+                    FLAGS_mem_pool_size_gb * 1024 * 1024 * 1024);
+        }
+        state->mem_manager = new NovaMemManager(pool, config.npartitions,
+                                                FLAGS_mem_pool_size_gb *
+                                                1024 * 1024 * 1024,
+                                                FLAGS_slab_size_mb, policy);
+        state->stop.store(false);
+        vector<ThreadResult> results(config.nthreads);
+        vector<BenchThread *> threads;
+        for (uint32_t i = 0; i < config.nthreads; i++) {
+            threads.push_back(new BenchThread(state, i, config.nthreads));
+        }
+        uint64_t start = NowNanos();
+        vector<std::thread> workers;
+        for (uint32_t i = 0; i < config.nthreads; i++) {
+            workers.emplace_back(&BenchThread::Run, threads[i], &results[i]);
+        }
+        uint64_t end = start + FLAGS_duration_ms * 1000000;
+        uint64_t peak_items = 0;
+        uint64_t peak_slabs = 0;
+        while (NowNanos() < end) {
+            usleep(FLAGS_sample_ms * 1000);
+            uint64_t items, slabs;
+            MemoryInUse(state->mem_manager->Stats(), &items, &slabs);
+            peak_items = std::max(peak_items, items);
+            peak_slabs = std::max(peak_slabs, slabs);
+        }
+        state->stop.store(true);
+        for (auto &worker : workers) {
+            worker.join();
+        }
+        double seconds = (NowNanos() - start) / 1e9;
+        for (BenchThread *thread : threads) {
+            delete thread;
+        }
+
+        NovaMemStats stats = state->mem_manager->Stats();
+        uint64_t items, slabs;
+        MemoryInUse(stats, &items, &slabs);
+        peak_items = std::max(peak_items, items);
+        peak_slabs = std::max(peak_slabs, slabs);
+        ThreadResult total;
+        for (const ThreadResult &result : results) {
+            total.nallocs += result.nallocs;
+            total.nfrees += result.nfrees;
+            total.nfailures += result.nfailures;
+        }
+        uint64_t nops = total.nallocs + total.nfrees;
+        // The threads are done, so items are the item bytes of the live
+        // items.
+        double internal_frag = stats.live_fragmentation();
+        double slab_frag = slabs == 0 ? 0 : 1.0 -
+                (double) items / (double) slabs;
+        fmt::print(csv,
+                   "{},{},{},{},{},{},{:.0f},{},{},{},{},{:.1f},{},{},{:.3f},{:.3f}\n",
+                   config.policy, config.nthreads, config.npartitions,
+                   FLAGS_size_dist, FLAGS_key_dist, nops, nops / seconds,
+                   total.nallocs, total.nfrees, total.nfailures,
+                   stats.nlock_waits(),
+                   nops == 0 ? 0.0 : (double) stats.lock_wait_ns() / nops,
+                   peak_items, peak_slabs, internal_frag, slab_frag);
+        fflush(csv);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+    RDMA_ASSERT(FLAGS_min_size > 0 && FLAGS_min_size <= FLAGS_max_size)
+        << "need 0 < --min_size <= --max_size";
+    RDMA_ASSERT(FLAGS_max_size <= FLAGS_slab_size_mb * 1024 * 1024)
+        << "--max_size must fit into a slab";
+    RDMA_ASSERT(FLAGS_live_items > 0) << "--live_items must be positive";
+    vector<string> policies = SplitList(FLAGS_policies);
+    vector<uint32_t> thread_counts = ParseList(FLAGS_threads);
+    vector<uint32_t> partition_counts = ParseList(FLAGS_partitions);
+
+    BenchState state;
+    state.size_dist = ParseDist(FLAGS_size_dist);
+    state.key_dist = ParseDist(FLAGS_key_dist);
+    RDMA_ASSERT(state.size_dist != DIST_SEQUENTIAL)
+        << "--size_dist must be uniform, zipf, or trace";
+    RDMA_ASSERT(state.key_dist != DIST_TRACE)
+        << "--key_dist must be uniform, zipf, or sequential";
+    ZipfGenerator *size_zipf = nullptr;
+    ZipfGenerator *key_zipf = nullptr;
+    vector<TraceRecord> trace;
+    if (state.size_dist == DIST_ZIPF) {
+        size_zipf = new ZipfGenerator(FLAGS_max_size - FLAGS_min_size + 1,
+                                      FLAGS_zipf_theta);
+    }
+    if (state.key_dist == DIST_ZIPF) {
+        key_zipf = new ZipfGenerator(FLAGS_num_keys, FLAGS_zipf_theta);
+    }
+    if (state.size_dist == DIST_TRACE) {
+        trace = ReadTrace(FLAGS_trace);
+    }
+    state.size_zipf = size_zipf;
+    state.key_zipf = key_zipf;
+    state.trace = trace.empty() ? nullptr : &trace;
+
+    uint64_t pool_size = FLAGS_mem_pool_size_gb * 1024 * 1024 * 1024;
+    char *pool = (char *) malloc(pool_size);
+    RDMA_ASSERT(pool != nullptr) << "cannot allocate the pool";
+
+    FILE *csv = stdout;
+    if (!FLAGS_csv.empty()) {
+        csv = fopen(FLAGS_csv.c_str(), "w");
+        RDMA_ASSERT(csv != nullptr) << "cannot open " << FLAGS_csv;
+    }
+    fmt::print(csv,
+               "policy,threads,partitions,size_dist,key_dist,ops,ops_per_sec,allocs,frees,alloc_failures,lock_waits,lock_wait_ns_per_op,peak_item_bytes,peak_slab_bytes,internal_frag,slab_frag\n");
+    for (const string &policy : policies) {
+        for (uint32_t npartitions : partition_counts) {
+            for (uint32_t nthreads : thread_counts) {
+                BenchConfig config = {policy, nthreads, npartitions};
+                RunConfig(pool, &state, config, csv);
+            }
+        }
+    }
+    if (csv != stdout) {
+        fclose(csv);
+    }
+    return 0;
+}
@@ -5,6 +5,9 @@
 //
 
 #include <fmt/core.h>
+#include <sys/time.h>
+#include <algorithm>
+#include <atomic>
 
 #include "nova_mem_manager.h"
 #include "nova/nova_common.h"
@@ -12,6 +15,7 @@
 namespace nova {
 
     Slab::Slab(char *base, uint64_t slab_size_mb) {
+        this->base = base;
         next_ = base;
         slab_size_mb_ = slab_size_mb;
     }
@@ -21,6 +25,7 @@ namespace nova {
         item_size_ = item_size;
         auto num_items = static_cast<uint32_t>(size / item_size);
         available_bytes_ = item_size * num_items;
+        requested_.resize(num_items);
     }
 
     char *Slab::AllocItem() {
@@ -33,6 +38,17 @@ namespace nova {
         return buf;
     }
 
+    uint32_t Slab::AllocItems(uint32_t n, std::vector<char *> *items) {
+        uint32_t nitems = 0;
+        while (nitems < n && available_bytes_ >= item_size_) {
+            items->push_back(next_);
+            next_ += item_size_;
+            available_bytes_ -= item_size_;
+            nitems++;
+        }
+        return nitems;
+    }
+
     char *SlabClass::AllocItem() {
         // check free list first.
         if (!free_list.empty()) {
@@ -50,6 +66,20 @@ namespace nova {
         return slab->AllocItem();
     }
 
+    uint32_t SlabClass::AllocItems(uint32_t n, std::vector<char *> *items) {
+        uint32_t nitems = 0;
+        while (nitems < n && !free_list.empty()) {
+            RDMA_ASSERT(free_list.front() != nullptr);
+            items->push_back(free_list.front());
+            free_list.pop();
+            nitems++;
+        }
+        if (nitems < n && !slabs.empty()) {
+            nitems += slabs[slabs.size() - 1]->AllocItems(n - nitems, items);
+        }
+        return nitems;
+    }
+
     void SlabClass::FreeItem(char *buf) {
         free_list.push(buf);
     }
@@ -58,10 +88,130 @@ namespace nova {
         slabs.push_back(slab);
     }
 
+    SlabClassStats SlabClass::Stats(uint32_t scid) {
+        SlabClassStats stats = {};
+        stats.scid = scid;
+        stats.item_size = size;
+        stats.nslabs = slabs.size();
+        stats.nitems_allocated = nallocs - nfrees;
+        stats.nitems_free = free_list.size();
+        stats.nallocs = nallocs;
+        stats.nfrees = nfrees;
+        stats.nalloc_failures = nalloc_failures;
+        stats.lifetime_bytes_requested = lifetime_bytes_requested;
+        stats.lifetime_bytes_used = nallocs * size;
+        stats.live_bytes_requested = live_bytes_requested;
+        stats.live_bytes_used = (nallocs - nfrees) * size;
+        stats.nlock_waits = nlock_waits;
+        stats.lock_wait_ns = lock_wait_ns;
+        return stats;
+    }
+
+    uint64_t NovaMemStats::nallocs() const {
+        uint64_t n = 0;
+        for (const auto &partition : partitions) {
+            for (const auto &sc : partition.slab_classes) {
+                n += sc.nallocs;
+            }
+        }
+        return n;
+    }
+
+    uint64_t NovaMemStats::nalloc_failures() const {
+        uint64_t n = 0;
+        for (const auto &partition : partitions) {
+            for (const auto &sc : partition.slab_classes) {
+                n += sc.nalloc_failures;
+            }
+        }
+        return n;
+    }
+
+    uint64_t NovaMemStats::nlock_waits() const {
+        uint64_t n = 0;
+        for (const auto &partition : partitions) {
+            for (const auto &sc : partition.slab_classes) {
+                n += sc.nlock_waits;
+            }
+        }
+        return n;
+    }
+
+    uint64_t NovaMemStats::lock_wait_ns() const {
+        uint64_t n = 0;
+        for (const auto &partition : partitions) {
+            for (const auto &sc : partition.slab_classes) {
+                n += sc.lock_wait_ns;
+            }
+        }
+        return n;
+    }
+
+    double NovaMemStats::lifetime_fragmentation() const {
+        uint64_t requested = 0;
+        uint64_t used = 0;
+        for (const auto &partition : partitions) {
+            for (const auto &sc : partition.slab_classes) {
+                requested += sc.lifetime_bytes_requested;
+                used += sc.lifetime_bytes_used;
+            }
+        }
+        if (used == 0) {
+            return 0;
+        }
+        return 1.0 - (double) requested / (double) used;
+    }
+
+    double NovaMemStats::live_fragmentation() const {
+        uint64_t requested = 0;
+        uint64_t used = 0;
+        for (const auto &partition : partitions) {
+            for (const auto &sc : partition.slab_classes) {
+                requested += sc.live_bytes_requested;
+                used += sc.live_bytes_used;
+            }
+        }
+        if (used == 0) {
+            return 0;
+        }
+        return 1.0 - (double) requested / (double) used;
+    }
+
+    double NovaMemStats::AllocsPerSec(const NovaMemStats &prev,
+                                      const NovaMemStats &cur) {
+        if (cur.timestamp_us <= prev.timestamp_us) {
+            return 0;
+        }
+        return (double) (cur.nallocs() - prev.nallocs()) * 1000000.0 /
+               (double) (cur.timestamp_us - prev.timestamp_us);
+    }
+
+    std::string NovaMemStats::ToString() const {
+        std::string str = fmt::format(
+                "nallocs:{} nfailures:{} live-fragmentation:{:.3f} lifetime-fragmentation:{:.3f} lock-waits:{} lock-wait-ns:{}\n",
+                nallocs(), nalloc_failures(), live_fragmentation(),
+                lifetime_fragmentation(), nlock_waits(), lock_wait_ns());
+        for (const auto &partition : partitions) {
+            str += fmt::format("partition {} slabs:{} free-slabs:{}\n",
+                               partition.pid, partition.nslabs,
+                               partition.nfree_slabs);
+            for (const auto &sc : partition.slab_classes) {
+                str += fmt::format(
+                        "  slab class {} size:{} slabs:{} allocated:{} free:{} allocs:{} frees:{} failures:{} live-requested:{} live-used:{} lifetime-requested:{} lifetime-used:{} lock-waits:{} lock-wait-ns:{}\n",
+                        sc.scid, sc.item_size, sc.nslabs,
+                        sc.nitems_allocated, sc.nitems_free, sc.nallocs,
+                        sc.nfrees, sc.nalloc_failures, sc.live_bytes_requested,
+                        sc.live_bytes_used, sc.lifetime_bytes_requested,
+                        sc.lifetime_bytes_used, sc.nlock_waits, sc.lock_wait_ns);
+            }
+        }
+        return str;
+    }
+
     NovaPartitionedMemManager::NovaPartitionedMemManager(int pid, char *buf,
                                                          uint64_t data_size,
                                                          uint64_t slab_size_mb)
-            : slab_size_mb_(slab_size_mb) {
+            : pid_(pid), slab_size_mb_(slab_size_mb) {
         uint64_t slab_size = slab_size_mb * 1024 * 1024;
 //        uint64_t slab_sizes[] = {8192, 1024 };
 
@@ -85,14 +235,11 @@ namespace nova {
                 << fmt::format("slab size mb:{} nslabs:{}", slab_size_mb,
                                ndataslabs);
         }
-        free_slabs_ = (Slab **) malloc(ndataslabs * sizeof(Slab *));
-        free_slab_index_ = ndataslabs - 1;
-        char *slab_buf = buf;
-        for (int i = 0; i < ndataslabs; i++) {
-            auto *slab = new Slab(slab_buf, slab_size_mb);
-            free_slabs_[i] = slab;
-            slab_buf += slab_size;
-        }
+        next_free_slab_ = buf;
+        nslabs_ = ndataslabs;
+        nfree_slabs_ = ndataslabs;
+        slabs_base_ = buf;
+        slabs_.resize(ndataslabs, nullptr);
     }
 
     // ML: seems like finding the appropriate "class of slab" for a "size" item
@@ -108,65 +255,148 @@ namespace nova {
         return res;
     }
 
-    char *NovaPartitionedMemManager::ItemAlloc(uint32_t scid) {
-        char *free_item = nullptr;
-        Slab *slab = nullptr;
-
-        slab_class_mutex_[scid].lock();
-        free_item = slab_classes_[scid].AllocItem(); // ML: items are of fixed size, set upon initialization!
-        if (free_item != nullptr) {
-            slab_class_mutex_[scid].unlock();
-            return free_item;
+    NovaPartitionStats NovaPartitionedMemManager::Stats() {
+        NovaPartitionStats stats = {};
+        stats.pid = pid_;
+        stats.nslabs = nslabs_;
+        free_slabs_mutex_.lock();
+        stats.nfree_slabs = nfree_slabs_;
+        free_slabs_mutex_.unlock();
+        for (uint32_t i = 0; i < MAX_NUMBER_OF_SLAB_CLASSES; i++) {
+            slab_class_mutex_[i].lock();
+            SlabClassStats sc = slab_classes_[i].Stats(i);
+            slab_class_mutex_[i].unlock();
+            if (sc.nslabs == 0 && sc.nallocs == 0 &&
+                sc.nalloc_failures == 0) {
+                continue;
+            }
+            stats.slab_classes.push_back(sc);
         }
+        return stats;
+    }
+
+    bool NovaPartitionedMemManager::GrowSlabClass(uint32_t scid) {
         // Grab a slab from the free list.
         free_slabs_mutex_.lock();
-        if (free_slab_index_ == -1) {
+        if (nfree_slabs_ == 0) {
             free_slabs_mutex_.unlock();
-            slab_class_mutex_[scid].unlock();
-
-            oom_lock.lock();
-            if (!print_class_oom) {
-                RDMA_LOG(INFO) << "No free slabs: Print slab class usages.";
-                print_class_oom = true;
-                for (int i = 0; i < MAX_NUMBER_OF_SLAB_CLASSES; i++) {
-                    slab_class_mutex_[scid].lock();
-                    RDMA_LOG(INFO) << fmt::format(
-                                "slab class {} size:{} nfreeitems:{} slabs:{}",
-                                i,
-                                slab_classes_[i].size,
-                                slab_classes_[i].free_list.size(),
-                                slab_classes_[i].slabs.size());
-                    slab_class_mutex_[scid].unlock();
-                }
-            }
-            oom_lock.unlock();
-            return nullptr;
+            return false;
         }
-        slab = free_slabs_[free_slab_index_];
-        free_slab_index_--;
+        char *slab_buf = next_free_slab_;
+        next_free_slab_ += slab_size_mb_ * 1024 * 1024;
+        nfree_slabs_--;
         free_slabs_mutex_.unlock();
 
+        Slab *slab = new Slab(slab_buf, slab_size_mb_);
         slab->Init(static_cast<uint32_t>(slab_classes_[scid].size));
-
+        slabs_[(slab_buf - slabs_base_) / slab_size()] = slab;
         slab_classes_[scid].AddSlab(slab);
-        free_item = slab->AllocItem();
+        return true;
+    }
+
+    void NovaPartitionedMemManager::LockSlabClass(uint32_t scid) {
+        if (slab_class_mutex_[scid].try_lock()) {
+            return;
+        }
+        uint64_t start = NowNanos();
+        slab_class_mutex_[scid].lock();
+        slab_classes_[scid].nlock_waits++;
+        slab_classes_[scid].lock_wait_ns += NowNanos() - start;
+    }
+
+    void NovaPartitionedMemManager::LogOOM() {
+        oom_lock.lock();
+        if (!print_class_oom) {
+            print_class_oom = true;
+            RDMA_LOG(INFO) << "No free slabs: Print slab class usages.\n"
+                           << NovaMemStats{0, {Stats()}}.ToString();
+        }
+        oom_lock.unlock();
+    }
+
+    char *NovaPartitionedMemManager::ItemAlloc(uint32_t scid, uint64_t size) {
+        char *free_item = nullptr;
+        SlabClass &slab_class = slab_classes_[scid];
+        if (size == 0) {
+            size = slab_class.size;
+        }
+
+        LockSlabClass(scid);
+        free_item = slab_class.AllocItem(); // ML: items are of fixed size, set upon initialization!
+        if (free_item == nullptr && GrowSlabClass(scid)) {
+            free_item = slab_class.AllocItem();
+        }
+        if (free_item == nullptr) {
+            slab_class.nalloc_failures++;
+            slab_class_mutex_[scid].unlock();
+            LogOOM();
+            return nullptr;
+        }
+        slab_class.nallocs++;
+        slab_class.lifetime_bytes_requested += size;
+        slab_class.live_bytes_requested += size;
+        SlabOf(free_item)->SetRequested(free_item, size);
         slab_class_mutex_[scid].unlock();
         return free_item;
     }
 
+    void NovaPartitionedMemManager::RecordRequested(
+            SlabClass &slab_class, const std::vector<char *> &items,
+            uint32_t nitems, uint64_t size) {
+        for (size_t i = items.size() - nitems; i < items.size(); i++) {
+            SlabOf(items[i])->SetRequested(items[i], size);
+        }
+        slab_class.live_bytes_requested += size * nitems;
+    }
+
+    uint32_t
+    NovaPartitionedMemManager::ItemAllocBatch(uint32_t scid, uint32_t n,
+                                              std::vector<char *> *items,
+                                              uint64_t size) {
+        SlabClass &slab_class = slab_classes_[scid];
+        if (size == 0) {
+            size = slab_class.size;
+        }
+        items->reserve(items->size() + n);
+
+        LockSlabClass(scid);
+        uint32_t nitems = slab_class.AllocItems(n, items);
+        while (nitems < n && GrowSlabClass(scid)) {
+            nitems += slab_class.AllocItems(n - nitems, items);
+        }
+        slab_class.nallocs += nitems;
+        slab_class.lifetime_bytes_requested += size * nitems;
+        RecordRequested(slab_class, *items, nitems, size);
+        bool oom = nitems < n;
+        if (oom) {
+            slab_class.nalloc_failures++;
+        }
+        slab_class_mutex_[scid].unlock();
+        if (oom) {
+            LogOOM();
+        }
+        return nitems;
+    }
+
     void NovaPartitionedMemManager::FreeItem(char *buf, uint32_t scid) {
 //        memset(buf, 0, slab_classes_[scid].size);
-        slab_class_mutex_[scid].lock();
+        LockSlabClass(scid);
         slab_classes_[scid].FreeItem(buf);
+        slab_classes_[scid].nfrees++;
+        slab_classes_[scid].live_bytes_requested -=
+                SlabOf(buf)->Requested(buf);
         slab_class_mutex_[scid].unlock();
     }
 
     void NovaPartitionedMemManager::FreeItems(const std::vector<char *> &items,
                                               uint32_t scid) {
-        slab_class_mutex_[scid].lock();
+        LockSlabClass(scid);
         for (auto buf : items) {
             slab_classes_[scid].FreeItem(buf);
+            slab_classes_[scid].live_bytes_requested -=
+                    SlabOf(buf)->Requested(buf);
         }
+        slab_classes_[scid].nfrees += items.size();
         slab_class_mutex_[scid].unlock();
     }
 
@@ -179,21 +409,29 @@ namespace nova {
     // "rdma_backing_mem", which is "malloc()"ed at run time.
     //
     // "num_mem_partitions" is total # of memory partitions managed by
-    // this "NovaMemManager". "mem_pool_size_gb" is total amount of memory
-    // managed by this "NovaMemManager", passed in as a command-line argument
-    // upon run time.
+    // this "NovaMemManager". "pool_size" is total bytes of memory managed by
+    // this "NovaMemManager", what remains of the backing memory after
+    // whatever the caller placed before "buf".
     //
-    // Therefore, total "mem_pool_size_gb" memory is partitioned into
+    // Therefore, total "pool_size" memory is partitioned into
     // "num_mem_partitions" number of partitions.
     //
     // Finally, "slab_size_mb" is simply passed onto "NovaPartitionMemManager".
     NovaMemManager::NovaMemManager(char *buf, uint32_t num_mem_partitions,
-                                   uint64_t mem_pool_size_gb,
-                                   uint64_t slab_size_mb) {
-        uint64_t partition_size = mem_pool_size_gb * 1024 * 1024 * 1024 /
-                                  num_mem_partitions;
+                                   uint64_t pool_size,
+                                   uint64_t slab_size_mb,
+                                   NovaMemPartitionPolicy policy)
+            : policy_(policy), base_(buf) {
+        uint64_t partition_size = pool_size / num_mem_partitions;
+        partition_size_ = partition_size;
+        uint32_t nnodes = 1;
+        if (policy_ == PARTITION_BY_NUMA_NODE) {
+            nnodes = std::min(NumNUMANodes(), num_mem_partitions);
+        }
+        node_partitions_.resize(nnodes);
         char *base = buf;
         for (int i = 0; i < num_mem_partitions; i++) {
+            node_partitions_[i % nnodes].push_back(i);
             partitioned_mem_managers_.push_back(
                     new NovaPartitionedMemManager(i, base, partition_size,
                                                   slab_size_mb));
@@ -201,30 +439,186 @@ namespace nova {
         }
     }
 
-    char *NovaMemManager::ItemAlloc(uint64_t key, uint32_t scid) {
-        return partitioned_mem_managers_[key %
-                                         partitioned_mem_managers_.size()]->ItemAlloc(
-                scid);
+    void NovaMemManager::PlaceNUMAPartitions(char *buf,
+                                             uint32_t num_mem_partitions,
+                                             uint64_t pool_size) {
+        uint32_t nnodes = std::min(NumNUMANodes(), num_mem_partitions);
+        uint64_t partition_size = pool_size / num_mem_partitions;
+        for (uint32_t i = 0; i < num_mem_partitions; i++) {
+            BindMemToNUMANode(buf + i * partition_size, partition_size,
+                              i % nnodes);
+        }
+    }
+
+    NovaMemPartitionPolicy ParseMemPartitionPolicy(const std::string &name) {
+        if (name == "key") {
+            return PARTITION_BY_KEY;
+        }
+        if (name == "key_hash") {
+            return PARTITION_BY_KEY_HASH;
+        }
+        if (name == "thread") {
+            return PARTITION_BY_THREAD;
+        }
+        if (name == "numa") {
+            return PARTITION_BY_NUMA_NODE;
+        }
+        RDMA_ASSERT(false) << "unknown partition policy " << name;
+        return PARTITION_BY_KEY;
+    }
+
+    namespace {
+        // The MurmurHash3 64-bit finalizer.
+        uint64_t mix64(uint64_t key) {
+            key ^= key >> 33;
+            key *= 0xff51afd7ed558ccdULL;
+            key ^= key >> 33;
+            key *= 0xc4ceb9fe1a85ec53ULL;
+            key ^= key >> 33;
+            return key;
+        }
+
+        std::atomic<uint32_t> thread_seq_counter(0);
+
+        uint32_t thread_seq() {
+            static thread_local uint32_t seq = thread_seq_counter.fetch_add(
+                    1);
+            return seq;
+        }
+
+        uint32_t thread_numa_node() {
+            // Cached: workers are expected to be pinned.
+            static thread_local uint32_t node = CurrentNUMANode();
+            return node;
+        }
+    }
+
+    uint32_t NovaMemManager::AllocPartition(uint64_t key) {
+        uint32_t npartitions = partitioned_mem_managers_.size();
+        switch (policy_) {
+            case PARTITION_BY_KEY:
+                return key % npartitions;
+            case PARTITION_BY_KEY_HASH:
+                return mix64(key) % npartitions;
+            case PARTITION_BY_THREAD:
+                return thread_seq() % npartitions;
+            case PARTITION_BY_NUMA_NODE: {
+                const std::vector<uint32_t> &partitions = node_partitions_[
+                        thread_numa_node() % node_partitions_.size()];
+                return partitions[thread_seq() % partitions.size()];
+            }
+        }
+        return key % npartitions;
+    }
+
+    uint32_t NovaMemManager::OwnerPartition(const char *buf) {
+        RDMA_ASSERT(buf >= base_) << "item does not belong to this manager";
+        uint64_t pid = (buf - base_) / partition_size_;
+        RDMA_ASSERT(pid < partitioned_mem_managers_.size())
+            << "item does not belong to this manager";
+        return pid;
+    }
+
+    char *NovaMemManager::ItemAlloc(uint64_t key, uint32_t scid,
+                                    uint64_t size) {
+        return partitioned_mem_managers_[AllocPartition(key)]->ItemAlloc(
+                scid, size);
+    }
+
+    uint32_t NovaMemManager::ItemAllocBatch(uint64_t key, uint32_t scid,
+                                            uint32_t n,
+                                            std::vector<char *> *items,
+                                            uint64_t size) {
+        return partitioned_mem_managers_[AllocPartition(key)]->ItemAllocBatch(
+                scid, n, items, size);
     }
 
     uint32_t NovaMemManager::slabclassid(uint64_t key, uint64_t size) {
-        return partitioned_mem_managers_[key %
-                                         partitioned_mem_managers_.size()]->slabclassid(
-                size);
+        // All partitions share the same slab geometry.
+        return partitioned_mem_managers_[0]->slabclassid(size);
+    }
+
+    void NovaMemManager::BindMR(const char *mr_base, uint32_t lkey,
+                                uint32_t rkey) {
+        RDMA_ASSERT(mr_base <= base_) << "the pool is outside of the MR";
+        mr_base_ = mr_base;
+        lkey_ = lkey;
+        rkey_ = rkey;
+    }
+
+    NovaItemHandle NovaMemManager::ToHandle(char *buf, uint32_t scid) {
+        RDMA_ASSERT(mr_base_ != nullptr) << "BindMR is not called";
+        NovaItemHandle handle = {};
+        handle.addr = buf;
+        handle.offset = buf - mr_base_;
+        handle.lkey = lkey_;
+        handle.rkey = rkey_;
+        handle.scid = scid;
+        handle.size = static_cast<uint32_t>(
+                partitioned_mem_managers_[0]->slabclasssize(scid));
+        return handle;
     }
 
+    NovaItemHandle
+    NovaMemManager::ItemAllocHandle(uint64_t key, uint32_t scid,
+                                    uint64_t size) {
+        char *buf = ItemAlloc(key, scid, size);
+        if (buf == nullptr) {
+            NovaItemHandle handle = {};
+            return handle;
+        }
+        return ToHandle(buf, scid);
+    }
+
+    void NovaMemManager::FreeItem(uint64_t key, const NovaItemHandle &handle) {
+        FreeItem(key, handle.addr, handle.scid);
+    }
+
+    // Frees go to the partition that owns the item. Under the thread and
+    // NUMA policies the key does not tell which partition that is.
     void NovaMemManager::FreeItem(uint64_t key, char *buf, uint32_t scid) {
-        partitioned_mem_managers_[key %
-                                  partitioned_mem_managers_.size()]->FreeItem(
-                buf, scid);
+        partitioned_mem_managers_[OwnerPartition(buf)]->FreeItem(buf, scid);
     }
 
     void NovaMemManager::FreeItems(uint64_t key,
                                    const std::vector<char *> &items,
                                    uint32_t scid) {
-        partitioned_mem_managers_[key %
-                                  partitioned_mem_managers_.size()]->FreeItems(
-                items, scid);
+        if (items.empty()) {
+            return;
+        }
+        uint32_t pid = OwnerPartition(items[0]);
+        bool same_partition = true;
+        for (auto buf : items) {
+            if (OwnerPartition(buf) != pid) {
+                same_partition = false;
+                break;
+            }
+        }
+        if (same_partition) {
+            partitioned_mem_managers_[pid]->FreeItems(items, scid);
+            return;
+        }
+        std::vector<std::vector<char *>> partition_items(
+                partitioned_mem_managers_.size());
+        for (auto buf : items) {
+            partition_items[OwnerPartition(buf)].push_back(buf);
+        }
+        for (uint32_t i = 0; i < partition_items.size(); i++) {
+            if (!partition_items[i].empty()) {
+                partitioned_mem_managers_[i]->FreeItems(partition_items[i],
+                                                        scid);
+            }
+        }
     }
 
-}
\ No newline at end of file
+    NovaMemStats NovaMemManager::Stats() {
+        NovaMemStats stats = {};
+        struct timeval now;
+        gettimeofday(&now, nullptr);
+        stats.timestamp_us = now.tv_sec * 1000000 + now.tv_usec;
+        for (auto partition : partitioned_mem_managers_) {
+            stats.partitions.push_back(partition->Stats());
+        }
+        return stats;
+    }
+}
@@ -9,6 +9,7 @@
 
 #include <stdint.h>
 #include <cstring>
+#include <string>
 #include <vector>
 #include <queue>
 #include <mutex>
@@ -19,6 +20,47 @@ namespace nova {
 #define SLAB_SIZE_FACTOR 2
 #define NOVA_MEM_PARTITIONS 4
 
+    // How NovaMemManager maps an allocation to a partition.
+    enum NovaMemPartitionPolicy {
+        // key % number of partitions.
+        PARTITION_BY_KEY = 0,
+        // A 64-bit mixing function of the key. Clustered keys spread evenly.
+        PARTITION_BY_KEY_HASH = 1,
+        // Each thread sticks to one partition, assigned round robin on its
+        // first allocation. Threads do not contend unless they share one.
+        PARTITION_BY_THREAD = 2,
+        // Partition i is placed on NUMA node i % number of nodes. A thread
+        // allocates from the partitions on the node it runs on.
+        PARTITION_BY_NUMA_NODE = 3
+    };
+
+    // "key", "key_hash", "thread" or "numa".
+    NovaMemPartitionPolicy ParseMemPartitionPolicy(const std::string &name);
+
+    // A slab item that can be used directly in RDMA work requests.
+    struct NovaItemHandle {
+        char *addr;
+        // Offset of addr from the base of the registered memory region.
+        uint64_t offset;
+        uint32_t lkey;
+        uint32_t rkey;
+        uint32_t scid;
+        // The item size of the slab class.
+        uint32_t size;
+    };
+
+    // What a peer needs to READ/WRITE an item one-sided. It is plain data
+    // and can be copied into a message as is.
+    struct NovaRemoteItem {
+        uint64_t offset;
+        uint32_t rkey;
+        uint32_t size;
+    };
+
+    inline NovaRemoteItem ToRemoteItem(const NovaItemHandle &handle) {
+        return NovaRemoteItem{handle.offset, handle.rkey, handle.size};
+    }
+
     class Slab {
     public:
         Slab(char *base, uint64_t slab_size_mb);
@@ -27,27 +69,113 @@ namespace nova {
 
         char *AllocItem();
 
+        // Carves up to n consecutive items. Returns the number carved.
+        uint32_t AllocItems(uint32_t n, std::vector<char *> *items);
+
+        // The size asked for the item at buf while it is allocated.
+        void SetRequested(const char *buf, uint32_t size) {
+            requested_[(buf - base) / item_size_] = size;
+        }
+
+        uint32_t Requested(const char *buf) {
+            return requested_[(buf - base) / item_size_];
+        }
+
         char *base;
     private:
         uint32_t item_size_;
+        std::vector<uint32_t> requested_;
         char *next_;
         uint64_t available_bytes_;
         uint64_t slab_size_mb_;
     };
 
+    // Counters of one slab class. Cumulative counters only grow; the
+    // allocs/sec rate is derived from two snapshots.
+    struct SlabClassStats {
+        uint32_t scid;
+        uint64_t item_size;
+        uint64_t nslabs;
+        uint64_t nitems_allocated;
+        uint64_t nitems_free;
+        uint64_t nallocs;
+        uint64_t nfrees;
+        uint64_t nalloc_failures;
+        // Sum of the sizes asked for and of the item sizes handed out over
+        // the lifetime of the class. Their ratio is the internal
+        // fragmentation of all allocations so far.
+        uint64_t lifetime_bytes_requested;
+        uint64_t lifetime_bytes_used;
+        // The same for the items allocated now; frees subtract.
+        uint64_t live_bytes_requested;
+        uint64_t live_bytes_used;
+        // Acquisitions of the class lock that found it taken by another
+        // thread, and the time they waited.
+        uint64_t nlock_waits;
+        uint64_t lock_wait_ns;
+    };
+
+    struct NovaPartitionStats {
+        uint32_t pid;
+        uint64_t nslabs;
+        uint64_t nfree_slabs;
+        // Only slab classes that own a slab or saw an allocation.
+        std::vector<SlabClassStats> slab_classes;
+    };
+
+    struct NovaMemStats {
+        uint64_t timestamp_us;
+        std::vector<NovaPartitionStats> partitions;
+
+        uint64_t nallocs() const;
+
+        uint64_t nalloc_failures() const;
+
+        uint64_t nlock_waits() const;
+
+        uint64_t lock_wait_ns() const;
+
+        // Internal fragmentation over all allocations so far, from the
+        // lifetime byte counts of the slab classes.
+        double lifetime_fragmentation() const;
+
+        // Internal fragmentation of the items allocated now.
+        double live_fragmentation() const;
+
+        std::string ToString() const;
+
+        static double
+        AllocsPerSec(const NovaMemStats &prev, const NovaMemStats &cur);
+    };
+
     class SlabClass {
     public:
         char *AllocItem();
 
+        // Takes up to n items from the free list and the current slab.
+        // Returns the number appended to items.
+        uint32_t AllocItems(uint32_t n, std::vector<char *> *items);
+
         void FreeItem(char *buf);
 
         void AddSlab(Slab *slab);
 
+        SlabClassStats Stats(uint32_t scid);
+
         uint64_t nitems_per_slab;
         uint64_t size;
         std::vector<Slab *> slabs;
         std::queue<char *> free_list;
 
+        // Guarded by the class mutex of the owning partition.
+        uint64_t nallocs = 0;
+        uint64_t nfrees = 0;
+        uint64_t nalloc_failures = 0;
+        uint64_t lifetime_bytes_requested = 0;
+        uint64_t live_bytes_requested = 0;
+        uint64_t nlock_waits = 0;
+        uint64_t lock_wait_ns = 0;
+
         Slab *get_slab(int index) {
             return slabs[index];
         }
@@ -62,7 +190,12 @@ namespace nova {
         NovaPartitionedMemManager(int pid, char *buf, uint64_t data_size,
                                   uint64_t slab_size_mb);
 
-        char *ItemAlloc(uint32_t scid);
+        // size is the number of bytes the caller needs. It is only used for
+        // statistics; 0 counts the whole item as requested.
+        char *ItemAlloc(uint32_t scid, uint64_t size = 0);
+
+        uint32_t ItemAllocBatch(uint32_t scid, uint32_t n,
+                                std::vector<char *> *items, uint64_t size = 0);
 
         void FreeItem(char *buf, uint32_t scid);
 
@@ -71,23 +204,78 @@ namespace nova {
 
         uint32_t slabclassid(uint64_t  size);
 
+        uint64_t slabclasssize(uint32_t scid) {
+            return slab_classes_[scid].size;
+        }
+
+        uint64_t slab_size() {
+            return slab_size_mb_ * 1024 * 1024;
+        }
+
+        NovaPartitionStats Stats();
+
     private:
+        // Moves a free slab to the slab class. Requires the class lock.
+        // Returns false if the partition has no free slab.
+        bool GrowSlabClass(uint32_t scid);
+
+        // Takes the class lock. Only a contended acquisition reads the
+        // clock, to account for its wait.
+        void LockSlabClass(uint32_t scid);
+
+        // The slab that holds buf.
+        Slab *SlabOf(const char *buf) {
+            return slabs_[(buf - slabs_base_) / slab_size()];
+        }
+
+        // Records the size asked for the last nitems of items. Requires
+        // the class lock.
+        void RecordRequested(SlabClass &slab_class,
+                             const std::vector<char *> &items,
+                             uint32_t nitems, uint64_t size);
+
+        void LogOOM();
+
+        const uint32_t pid_;
+        uint64_t nslabs_ = 0;
         std::mutex slab_class_mutex_[MAX_NUMBER_OF_SLAB_CLASSES];
         SlabClass slab_classes_[MAX_NUMBER_OF_SLAB_CLASSES];
         std::mutex oom_lock;
         bool print_class_oom = false;
         std::mutex free_slabs_mutex_;
-        Slab **free_slabs_ = nullptr;
-        uint64_t free_slab_index_ = 0;
+        // Slabs are carved lazily from [next_free_slab_, end) the first time
+        // a slab class needs one, so untouched slabs cost nothing.
+        char *next_free_slab_ = nullptr;
+        uint64_t nfree_slabs_ = 0;
+        // Slab i starts at slabs_base_ + i * slab_size(). An entry is set
+        // when its slab is carved, under the lock of the class it joins.
+        char *slabs_base_ = nullptr;
+        std::vector<Slab *> slabs_;
         uint64_t slab_size_mb_ = 0;
     };
 
     class NovaMemManager {
     public:
+        // Manages the pool_size bytes at buf.
         NovaMemManager(char *buf, uint32_t num_mem_partitions,
-                       uint64_t mem_pool_size_gb, uint64_t slab_size_mb);
+                       uint64_t pool_size, uint64_t slab_size_mb,
+                       NovaMemPartitionPolicy policy = PARTITION_BY_KEY);
 
-        char *ItemAlloc(uint64_t key, uint32_t scid) ;
+        // Binds partition i of a pool to NUMA node i % number of nodes, as
+        // PARTITION_BY_NUMA_NODE expects. The constructor does not place the
+        // pool; call it before the pool is prefaulted, so that the pages are
+        // faulted in on their node instead of being moved.
+        static void PlaceNUMAPartitions(char *buf, uint32_t num_mem_partitions,
+                                        uint64_t pool_size);
+
+        char *ItemAlloc(uint64_t key, uint32_t scid, uint64_t size = 0) ;
+
+        // Allocates n items of slab class scid under a single acquisition of
+        // the class lock and appends them to items. Returns the number
+        // allocated, which is less than n only if the partition is full.
+        uint32_t ItemAllocBatch(uint64_t key, uint32_t scid, uint32_t n,
+                                std::vector<char *> *items,
+                                uint64_t size = 0);
 
         void FreeItem(uint64_t key, char *buf, uint32_t scid) ;
 
@@ -97,8 +285,59 @@ namespace nova {
 
         uint32_t slabclassid(uint64_t key, uint64_t  size) ;
 
+        // The largest size slabclassid accepts.
+        uint64_t max_item_size() {
+            return partitioned_mem_managers_[0]->slab_size();
+        }
+
+        // Records the memory region the pool was registered in. Handles
+        // carry offsets from mr_base and these keys.
+        void BindMR(const char *mr_base, uint32_t lkey, uint32_t rkey);
+
+        // Same as ItemAlloc but returns a handle ready for RDMA. The handle's
+        // addr is nullptr if there is no memory. Requires BindMR.
+        NovaItemHandle
+        ItemAllocHandle(uint64_t key, uint32_t scid, uint64_t size = 0);
+
+        NovaItemHandle ToHandle(char *buf, uint32_t scid);
+
+        // The item at offset from the MR base. Inverse of handle.offset.
+        char *ItemAt(uint64_t offset) {
+            return (char *) mr_base_ + offset;
+        }
+
+        // The offset of buf from the MR base. Inverse of ItemAt; buf may be
+        // any address in the registered region.
+        uint64_t OffsetOf(const char *buf) {
+            return buf - mr_base_;
+        }
+
+        uint32_t rkey() {
+            return rkey_;
+        }
+
+        void FreeItem(uint64_t key, const NovaItemHandle &handle);
+
+        // Takes each class lock briefly; safe to call while allocating.
+        NovaMemStats Stats();
+
     private:
+        // The partition to allocate from. key is ignored by the thread and
+        // NUMA policies.
+        uint32_t AllocPartition(uint64_t key);
+
+        // The partition that owns buf, regardless of the policy.
+        uint32_t OwnerPartition(const char *buf);
+
+        const NovaMemPartitionPolicy policy_;
+        char *base_ = nullptr;
+        const char *mr_base_ = nullptr;
+        uint32_t lkey_ = 0;
+        uint32_t rkey_ = 0;
+        uint64_t partition_size_ = 0;
         std::vector<NovaPartitionedMemManager *> partitioned_mem_managers_;
+        // Partitions placed on each NUMA node.
+        std::vector<std::vector<uint32_t>> node_partitions_;
     };
 }
 
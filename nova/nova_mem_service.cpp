@@ -0,0 +1,280 @@
+//
+// Copyright (c) 2020 University of Southern California. All rights reserved.
+//
+
+#include <algorithm>
+#include <cstring>
+#include <fmt/core.h>
+
+#include "nova_mem_service.h"
+
+namespace nova {
+
+    NovaMemServer::NovaMemServer(NovaMemManager *mem_manager,
+                                 NovaRDMABroker *broker,
+                                 uint32_t max_msg_size) :
+            mem_manager_(mem_manager),
+            broker_(broker),
+            max_msg_size_(max_msg_size),
+            // PostSend requires messages strictly smaller than max_msg_size.
+            max_items_per_msg_((max_msg_size - sizeof(NovaMsgHeader) -
+                                sizeof(NovaMemAllocReply) - 1) /
+                               sizeof(uint64_t)) {
+        RDMA_ASSERT(max_msg_size >
+                    sizeof(NovaMsgHeader) + sizeof(NovaMemAllocReply));
+    }
+
+    bool NovaMemServer::HandleMessage(int remote_server_id, char *buf) {
+        switch (buf[0]) {
+            case NOVA_MEM_ALLOC_REQ:
+                NovaTracer::SetTraceId(NovaMsgTraceId(buf));
+                ProcessAlloc(remote_server_id, buf);
+                return true;
+            case NOVA_MEM_FREE_REQ:
+                NovaTracer::SetTraceId(NovaMsgTraceId(buf));
+                ProcessFree(remote_server_id, buf);
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    void NovaMemServer::ProcessAlloc(int remote_server_id, const char *buf) {
+        if (!NovaMsgFits<NovaMemAllocRequest>(buf, max_msg_size_)) {
+            ReplyError(remote_server_id, buf);
+            return;
+        }
+        const NovaMemAllocRequest *req = NovaMsgDecode<NovaMemAllocRequest>(
+                buf);
+        // slabclassid asserts on a size no slab class holds.
+        if (req->item_size == 0 ||
+            req->item_size > mem_manager_->max_item_size()) {
+            RDMA_LOG(WARNING) << fmt::format(
+                        "mem-server: server {} allocates items of {} bytes",
+                        remote_server_id, req->item_size);
+            ReplyError(remote_server_id, buf);
+            return;
+        }
+        uint32_t nitems = std::min(req->nitems, max_items_per_msg_);
+        uint32_t scid = mem_manager_->slabclassid(remote_server_id,
+                                                  req->item_size);
+        items_.clear();
+        // Partition by peer so that peers do not contend for one class lock.
+        nitems = mem_manager_->ItemAllocBatch(remote_server_id, scid, nitems,
+                                              &items_, req->item_size);
+
+        char *sendbuf = broker_->GetSendBuf(remote_server_id);
+        NovaMemAllocReply *reply = NovaMsgEncode<NovaMemAllocReply>(
+                sendbuf, NOVA_MEM_ALLOC_REPLY, NovaMsgHeaderOf(buf)->req_id,
+                nitems * sizeof(uint64_t));
+        reply->nitems = nitems;
+        reply->rkey = 0;
+        reply->item_size = 0;
+        reply->lease_id = 0;
+        if (nitems > 0) {
+            lease_seq_++;
+            Lease &lease = leases_[lease_seq_];
+            lease.server_id = remote_server_id;
+            lease.scid = scid;
+            uint64_t *offsets = (uint64_t *) NovaMsgExtra<NovaMemAllocReply>(
+                    sendbuf);
+            for (uint32_t i = 0; i < nitems; i++) {
+                NovaItemHandle handle = mem_manager_->ToHandle(items_[i],
+                                                               scid);
+                offsets[i] = handle.offset;
+                lease.offsets.insert(handle.offset);
+                reply->rkey = handle.rkey;
+                reply->item_size = handle.size;
+            }
+            reply->lease_id = lease_seq_;
+            nleased_items_ += nitems;
+        }
+        RDMA_LOG(DEBUG) << fmt::format(
+                    "mem-server: lease {} of {}/{} items to server {}",
+                    reply->lease_id, nitems, req->nitems, remote_server_id);
+        broker_->PostSend(sendbuf, NovaMsgSize(sendbuf), remote_server_id,
+                          0);
+    }
+
+    void NovaMemServer::ProcessFree(int remote_server_id, const char *buf) {
+        // nitems comes off the wire. The offsets must lie within the message.
+        if (!NovaMsgFits<NovaMemFreeRequest>(buf, max_msg_size_)) {
+            ReplyError(remote_server_id, buf);
+            return;
+        }
+        const NovaMemFreeRequest *req = NovaMsgDecode<NovaMemFreeRequest>(
+                buf);
+        if (req->nitems > max_items_per_msg_ ||
+            !NovaMsgFits<NovaMemFreeRequest>(
+                    buf, max_msg_size_, req->nitems * sizeof(uint64_t))) {
+            RDMA_LOG(WARNING) << fmt::format(
+                        "mem-server: server {} frees {} items in a {}-byte message",
+                        remote_server_id, req->nitems,
+                        NovaMsgSize(buf));
+            ReplyError(remote_server_id, buf);
+            return;
+        }
+        auto it = leases_.find(req->lease_id);
+        if (it == leases_.end() || it->second.server_id != remote_server_id) {
+            RDMA_LOG(WARNING) << fmt::format(
+                        "mem-server: server {} frees unknown lease {}",
+                        remote_server_id, req->lease_id);
+            return;
+        }
+        const uint64_t *offsets =
+                (const uint64_t *) NovaMsgExtra<NovaMemFreeRequest>(buf);
+        items_.clear();
+        for (uint32_t i = 0; i < req->nitems; i++) {
+            // Ignore double frees instead of corrupting the free list.
+            if (it->second.offsets.erase(offsets[i]) == 1) {
+                items_.push_back(mem_manager_->ItemAt(offsets[i]));
+            }
+        }
+        mem_manager_->FreeItems(remote_server_id, items_, it->second.scid);
+        nleased_items_ -= items_.size();
+        if (it->second.offsets.empty()) {
+            leases_.erase(it);
+        }
+    }
+
+    void NovaMemServer::ReplyError(int remote_server_id, const char *buf) {
+        char *sendbuf = broker_->GetSendBuf(remote_server_id);
+        NovaMemErrorReply *reply = NovaMsgEncode<NovaMemErrorReply>(
+                sendbuf, NOVA_MEM_ERROR_REPLY, NovaMsgHeaderOf(buf)->req_id);
+        reply->req_type = buf[0];
+        broker_->PostSend(sendbuf, NovaMsgSize(sendbuf), remote_server_id,
+                          0);
+    }
+
+    void NovaMemServer::ReleaseLease(std::map<uint64_t, Lease>::iterator it) {
+        items_.clear();
+        for (uint64_t offset : it->second.offsets) {
+            items_.push_back(mem_manager_->ItemAt(offset));
+        }
+        mem_manager_->FreeItems(it->second.server_id, items_,
+                                it->second.scid);
+        nleased_items_ -= items_.size();
+    }
+
+    void NovaMemServer::ReclaimPeer(int remote_server_id) {
+        auto it = leases_.begin();
+        while (it != leases_.end()) {
+            if (it->second.server_id == remote_server_id) {
+                ReleaseLease(it);
+                it = leases_.erase(it);
+            } else {
+                it++;
+            }
+        }
+    }
+
+    NovaMemClient::NovaMemClient(NovaRDMABroker *broker,
+                                 uint32_t max_msg_size) :
+            broker_(broker),
+            // PostSend requires messages strictly smaller than max_msg_size.
+            max_items_per_msg_((max_msg_size - sizeof(NovaMsgHeader) -
+                                sizeof(NovaMemAllocReply) - 1) /
+                               sizeof(uint64_t)) {
+        RDMA_ASSERT(max_msg_size >
+                    sizeof(NovaMsgHeader) + sizeof(NovaMemAllocReply));
+    }
+
+    uint32_t
+    NovaMemClient::Alloc(int server_id, uint32_t nitems, uint32_t item_size) {
+        RDMA_ASSERT(nitems <= max_items_per_msg_)
+            << fmt::format("alloc {} items, at most {} per request", nitems,
+                           max_items_per_msg_);
+        req_seq_++;
+        char *sendbuf = broker_->GetSendBuf(server_id);
+        NovaMemAllocRequest *req = NovaMsgEncode<NovaMemAllocRequest>(
+                sendbuf, NOVA_MEM_ALLOC_REQ, req_seq_);
+        req->nitems = nitems;
+        req->item_size = item_size;
+        broker_->PostSend(sendbuf, NovaMsgSize(sendbuf), server_id, 0);
+        return req_seq_;
+    }
+
+    bool NovaMemClient::HandleMessage(int remote_server_id, char *buf) {
+        if (buf[0] == NOVA_MEM_ERROR_REPLY) {
+            NovaTracer::SetTraceId(NovaMsgTraceId(buf));
+            const NovaMemErrorReply *reply = NovaMsgDecode<NovaMemErrorReply>(
+                    buf);
+            uint32_t req_id = NovaMsgHeaderOf(buf)->req_id;
+            RDMA_LOG(WARNING) << fmt::format(
+                        "mem-client: server {} rejected request {} of type {}",
+                        remote_server_id, req_id, reply->req_type);
+            nerrors_++;
+            if (reply->req_type == NOVA_MEM_ALLOC_REQ) {
+                // An empty lease, so that TakeLease does not wait forever.
+                NovaRemoteLease &lease = replies_[req_id];
+                lease.server_id = remote_server_id;
+                lease.req_id = req_id;
+                lease.lease_id = 0;
+                lease.items.clear();
+            }
+            return true;
+        }
+        if (buf[0] != NOVA_MEM_ALLOC_REPLY) {
+            return false;
+        }
+        NovaTracer::SetTraceId(NovaMsgTraceId(buf));
+        const NovaMemAllocReply *reply = NovaMsgDecode<NovaMemAllocReply>(
+                buf);
+        uint32_t req_id = NovaMsgHeaderOf(buf)->req_id;
+        NovaRemoteLease &lease = replies_[req_id];
+        lease.server_id = remote_server_id;
+        lease.req_id = req_id;
+        lease.lease_id = reply->lease_id;
+        lease.items.clear();
+        const uint64_t *offsets =
+                (const uint64_t *) NovaMsgExtra<NovaMemAllocReply>(buf);
+        for (uint32_t i = 0; i < reply->nitems; i++) {
+            lease.items.push_back(
+                    NovaRemoteItem{offsets[i], reply->rkey, reply->item_size});
+        }
+        return true;
+    }
+
+    bool NovaMemClient::TakeLease(uint32_t req_id, NovaRemoteLease *lease) {
+        auto it = replies_.find(req_id);
+        if (it == replies_.end()) {
+            return false;
+        }
+        *lease = std::move(it->second);
+        replies_.erase(it);
+        return true;
+    }
+
+    void NovaMemClient::Free(const NovaRemoteLease &lease,
+                             const std::vector<NovaRemoteItem> &items) {
+        std::vector<uint64_t> &offsets = pending_frees_[lease.server_id][lease.lease_id];
+        for (const auto &item : items) {
+            offsets.push_back(item.offset);
+        }
+    }
+
+    void NovaMemClient::FlushFrees() {
+        for (auto &server : pending_frees_) {
+            for (auto &lease : server.second) {
+                const std::vector<uint64_t> &offsets = lease.second;
+                for (uint32_t i = 0; i < offsets.size();
+                     i += max_items_per_msg_) {
+                    uint32_t nitems = std::min(max_items_per_msg_,
+                                               (uint32_t) offsets.size() - i);
+                    char *sendbuf = broker_->GetSendBuf(server.first);
+                    NovaMemFreeRequest *req = NovaMsgEncode<NovaMemFreeRequest>(
+                            sendbuf, NOVA_MEM_FREE_REQ, 0,
+                            nitems * sizeof(uint64_t));
+                    req->nitems = nitems;
+                    req->lease_id = lease.first;
+                    memcpy(NovaMsgExtra<NovaMemFreeRequest>(sendbuf),
+                           &offsets[i], nitems * sizeof(uint64_t));
+                    broker_->PostSend(sendbuf, NovaMsgSize(sendbuf),
+                                      server.first, 0);
+                }
+            }
+            broker_->FlushPendingSends(server.first);
+        }
+        pending_frees_.clear();
+    }
+}
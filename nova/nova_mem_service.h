@@ -0,0 +1,147 @@
+//
+// Copyright (c) 2020 University of Southern California. All rights reserved.
+//
+
+#ifndef RLIB_NOVA_MEM_SERVICE_H
+#define RLIB_NOVA_MEM_SERVICE_H
+
+#include <stdint.h>
+#include <map>
+#include <set>
+#include <vector>
+
+#include "nova_rdma_broker.h"
+#include "nova_mem_manager.h"
+#include "nova_msg.h"
+
+namespace nova {
+
+    // Message types of the remote allocation service, the type of their
+    // NovaMsgHeader.
+    enum NovaMemServiceMsgType {
+        NOVA_MEM_ALLOC_REQ = 'A',
+        NOVA_MEM_ALLOC_REPLY = 'a',
+        NOVA_MEM_FREE_REQ = 'F',
+        // The server rejected a malformed request.
+        NOVA_MEM_ERROR_REPLY = 'e'
+    };
+
+    // Message bodies. They follow a NovaMsgHeader.
+    struct NovaMemAllocRequest {
+        uint32_t nitems;
+        uint32_t item_size;
+    };
+
+    // Followed by nitems offsets.
+    struct NovaMemAllocReply {
+        uint32_t nitems;
+        uint32_t rkey;
+        uint32_t item_size;
+        uint64_t lease_id;
+    };
+
+    // Followed by nitems offsets.
+    struct NovaMemFreeRequest {
+        uint32_t nitems;
+        uint64_t lease_id;
+    };
+
+    struct NovaMemErrorReply {
+        // The type of the rejected request.
+        char req_type;
+    };
+
+    // Items a peer granted to this node. They stay valid until they are
+    // freed or the peer reclaims the lease.
+    struct NovaRemoteLease {
+        int server_id;
+        uint32_t req_id;
+        uint64_t lease_id;
+        std::vector<NovaRemoteItem> items;
+    };
+
+    // Serves allocation requests from peers out of the local NovaMemManager.
+    // Thread local, like the broker it replies through.
+    class NovaMemServer {
+    public:
+        NovaMemServer(NovaMemManager *mem_manager, NovaRDMABroker *broker,
+                      uint32_t max_msg_size);
+
+        // Call from NovaMsgCallback::ProcessRDMAWC on a RECV. Returns false
+        // if buf is not a remote allocation message.
+        bool HandleMessage(int remote_server_id, char *buf);
+
+        // Frees every item still leased to a peer, e.g., after it left.
+        void ReclaimPeer(int remote_server_id);
+
+        uint64_t nleased_items() { return nleased_items_; }
+
+    private:
+        struct Lease {
+            int server_id;
+            uint32_t scid;
+            std::set<uint64_t> offsets;
+        };
+
+        void ProcessAlloc(int remote_server_id, const char *buf);
+
+        void ProcessFree(int remote_server_id, const char *buf);
+
+        void ReleaseLease(std::map<uint64_t, Lease>::iterator it);
+
+        void ReplyError(int remote_server_id, const char *buf);
+
+        NovaMemManager *mem_manager_;
+        NovaRDMABroker *broker_;
+        const uint32_t max_msg_size_;
+        const uint32_t max_items_per_msg_;
+        uint64_t lease_seq_ = 0;
+        uint64_t nleased_items_ = 0;
+        std::map<uint64_t, Lease> leases_;
+        std::vector<char *> items_;
+    };
+
+    // Allocates memory on peers. The peer's CPU is involved only in
+    // allocating and freeing; the data is moved with PostWrite/PostRead
+    // against the returned NovaRemoteItems.
+    class NovaMemClient {
+    public:
+        NovaMemClient(NovaRDMABroker *broker, uint32_t max_msg_size);
+
+        // Asks server_id for nitems items of item_size bytes. Returns the
+        // request id to pass to TakeLease. Like any PostSend, the request
+        // goes out with the next doorbell of the broker.
+        uint32_t Alloc(int server_id, uint32_t nitems, uint32_t item_size);
+
+        // Call from NovaMsgCallback::ProcessRDMAWC on a RECV. Returns false
+        // if buf is not a remote allocation message.
+        bool HandleMessage(int remote_server_id, char *buf);
+
+        // Returns true once the reply of req_id arrived. A lease with fewer
+        // items than requested means the peer is out of memory.
+        bool TakeLease(uint32_t req_id, NovaRemoteLease *lease);
+
+        // Queues items of a lease to be freed. They are sent back in batches
+        // by FlushFrees.
+        void Free(const NovaRemoteLease &lease,
+                  const std::vector<NovaRemoteItem> &items);
+
+        void FlushFrees();
+
+        uint32_t max_items_per_msg() { return max_items_per_msg_; }
+
+        // Requests the servers rejected as malformed.
+        uint64_t nerrors() { return nerrors_; }
+
+    private:
+        NovaRDMABroker *broker_;
+        const uint32_t max_items_per_msg_;
+        uint32_t req_seq_ = 0;
+        uint64_t nerrors_ = 0;
+        std::map<uint32_t, NovaRemoteLease> replies_;
+        // server id -> lease id -> offsets to free.
+        std::map<int, std::map<uint64_t, std::vector<uint64_t>>> pending_frees_;
+    };
+}
+
+#endif //RLIB_NOVA_MEM_SERVICE_H
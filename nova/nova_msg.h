@@ -0,0 +1,97 @@
+//
+// Copyright (c) 2020 University of Southern California. All rights reserved.
+//
+
+#ifndef RLIB_NOVA_MSG_H
+#define RLIB_NOVA_MSG_H
+
+#include <stdint.h>
+
+#include "nova_common.h"
+#include "nova_tracer.h"
+
+namespace nova {
+
+    // Precedes the body of every request and reply of the RPC services. The
+    // type comes first, so callbacks dispatch on buf[0]. It is never '~',
+    // which the broker uses to mark a free buffer.
+    //
+    // Messages are encoded and decoded in place: the sender fills the body
+    // in the buffer of GetSendBuf and the receiver reads it from the receive
+    // buffer, with no copy and no parsing.
+    struct NovaMsgHeader {
+        char type;
+        uint8_t reserved;
+        // Bytes that follow the header.
+        uint16_t body_size;
+        uint32_t req_id;
+        // NovaTracer::trace_id() of the sender.
+        uint64_t trace_id;
+    };
+
+    static_assert(sizeof(NovaMsgHeader) == 16,
+                  "the body must stay 8-byte aligned");
+
+    // Writes the header of a message into buf and returns its body, a T
+    // followed by extra_size bytes, for the caller to fill in.
+    template<typename T>
+    inline T *NovaMsgEncode(char *buf, char type, uint32_t req_id,
+                            uint32_t extra_size = 0) {
+        uint32_t body_size = sizeof(T) + extra_size;
+        RDMA_ASSERT(body_size <= UINT16_MAX) << body_size;
+        NovaMsgHeader *header = (NovaMsgHeader *) buf;
+        header->type = type;
+        header->reserved = 0;
+        header->body_size = body_size;
+        header->req_id = req_id;
+        header->trace_id = NovaTracer::trace_id();
+        return (T *) (buf + sizeof(NovaMsgHeader));
+    }
+
+    // The bytes to post for the message encoded in buf.
+    inline uint32_t NovaMsgSize(const char *buf) {
+        return sizeof(NovaMsgHeader) +
+               ((const NovaMsgHeader *) buf)->body_size;
+    }
+
+    inline const NovaMsgHeader *NovaMsgHeaderOf(const char *buf) {
+        return (const NovaMsgHeader *) buf;
+    }
+
+    // Whether the message in buf, a receive buffer of max_msg_size bytes,
+    // holds a body T followed by extra_size bytes. Check it before trusting
+    // a count or size in a peer's message.
+    template<typename T>
+    inline bool NovaMsgFits(const char *buf, uint32_t max_msg_size,
+                            uint64_t extra_size = 0) {
+        uint32_t body_size = NovaMsgHeaderOf(buf)->body_size;
+        return sizeof(T) + extra_size <= body_size &&
+               sizeof(NovaMsgHeader) + body_size <= max_msg_size;
+    }
+
+    // The trace id of the sender of a received message. A handler passes it
+    // to NovaTracer::SetTraceId, so that its spans and replies join the
+    // request; the broker restores the thread's id after the callback.
+    inline uint64_t NovaMsgTraceId(const char *buf) {
+        return NovaMsgHeaderOf(buf)->trace_id;
+    }
+
+    // The body of a received message.
+    template<typename T>
+    inline const T *NovaMsgDecode(const char *buf) {
+        return (const T *) (buf + sizeof(NovaMsgHeader));
+    }
+
+    // The bytes that follow the body T, e.g., a value or a list of offsets.
+    template<typename T>
+    inline char *NovaMsgExtra(char *buf) {
+        return buf + sizeof(NovaMsgHeader) + sizeof(T);
+    }
+
+    template<typename T>
+    inline const char *NovaMsgExtra(const char *buf) {
+        return buf + sizeof(NovaMsgHeader) + sizeof(T);
+    }
+}
+
+#endif //RLIB_NOVA_MSG_H
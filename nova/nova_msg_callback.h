@@ -9,6 +9,7 @@
 
 #include "rdma_ctrl.hpp"
 #include "nova_common.h"
+#include "nova_logger.h"
 
 namespace nova {
     class NovaMsgCallback {
@@ -16,6 +17,18 @@ namespace nova {
         virtual bool
         ProcessRDMAWC(ibv_wc_opcode type, uint64_t wr_id, int remote_server_id,
                       char *buf, uint32_t imm_data) = 0;
+
+        // A request posted with wr_id failed and will not be retried, e.g.,
+        // its QP broke. type is the opcode it was posted with.
+        virtual void
+        ProcessRDMAError(ibv_wr_opcode type, uint64_t wr_id,
+                         int remote_server_id, char *buf,
+                         ibv_wc_status status) {
+            RDMA_LOG(WARNING) << fmt::format(
+                        "failed t:{} wr:{} remote:{} status:{}",
+                        ibv_wr_opcode_str(type), wr_id, remote_server_id,
+                        ibv_wc_status_str(status));
+        }
     };
 
     class DummyNovaMsgCallback : public NovaMsgCallback {
@@ -23,9 +36,9 @@ namespace nova {
         bool
         ProcessRDMAWC(ibv_wc_opcode type, uint64_t wr_id, int remote_server_id,
                       char *buf, uint32_t imm_data) override {
-            RDMA_LOG(INFO) << fmt::format("t:{} wr:{} remote:{} buf:{} imm:{}",
-                                          ibv_wc_opcode_str(type), wr_id,
-                                          remote_server_id, buf[0], imm_data);
+            NOVA_LOG(INFO, "t:{} wr:{} remote:{} buf:{} imm:{}",
+                     ibv_wc_opcode_str(type), wr_id, remote_server_id, buf[0],
+                     imm_data);
             return true;
         }
     };
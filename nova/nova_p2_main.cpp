@@ -7,6 +7,8 @@
 #include "nova_config.h"
 #include "nova_rdma_rc_broker.h"
 #include "nova_mem_manager.h"
+#include "nova_kv.h"
+#include "nova_logger.h"
 
 #include <stdlib.h>
 #include <sys/stat.h>
@@ -17,8 +19,6 @@
 #include <csignal>
 #include <gflags/gflags.h>
 
-#include <sstream> // ML: for saving memory address (pointed-to) as a string, so it can be send over RDMA
-
 using namespace std;
 using namespace rdmaio;
 using namespace nova;
@@ -38,68 +38,69 @@ DEFINE_uint64(rdma_max_num_sends, 0,
 DEFINE_uint64(rdma_doorbell_batch_size, 0, "The doorbell batch size.");
 DEFINE_uint32(nrdma_workers, 0,
               "Number of rdma threads.");
-
-// ML: first step is to implement NovaMsgCallback interface
+DEFINE_uint32(mem_init_threads, 0,
+              "Number of threads used to prefault the memory pool before it is registered. 0 uses all cores.");
+DEFINE_uint32(mem_partitions, 1, "Number of partitions of the memory pool.");
+DEFINE_string(mem_partition_policy, "key",
+              "How allocations map to partitions: key, key_hash, thread, or numa.");
+DEFINE_uint64(kv_buckets, 1 << 16,
+              "Number of buckets of the KV index of server 0.");
+DEFINE_uint64(kv_keys, 1000, "Number of keys each client PUTs and GETs.");
+DEFINE_uint32(kv_value_size, 100, "Value size in bytes.");
+DEFINE_int32(log_level, rdmaio::INFO,
+             "Lines below this level are not logged. 1 is DEBUG, 2 is INFO, 4 is WARNING.");
+
+// Dispatches completions to the KV store. Server 0 serves the index, the
+// other servers are clients.
 class P2MsgCallback : public NovaMsgCallback {
 public:
-    P2MsgCallback();
-
-    // used to record received message
-    deque<string> recv_history_;
-    bool read_complete_;
+    NovaKVServer *kv_server_ = nullptr;
+    NovaKVClient *kv_client_ = nullptr;
 
-    // TODO! figure out why an RDMA READ attempt result in receiving an
-    // empty string in here...
     bool
     ProcessRDMAWC(ibv_wc_opcode type, uint64_t wr_id, int remote_server_id,
                   char *buf, uint32_t imm_data) override {
-        string bufContent(buf);
-        RDMA_LOG(INFO) << fmt::format("t:{} wr:{} remote:{} buf:\"{}\" imm:{}",
-                                      ibv_wc_opcode_str(type), wr_id,
-                                      remote_server_id, bufContent, imm_data);
         if (type == IBV_WC_RECV) {
-            this->recv_history_.push_back(bufContent);
-        }
-        else if (type == IBV_WC_RDMA_READ) {
-            RDMA_LOG(INFO) << fmt::format("OH FUCK YEAHH READ COMPLETED, buf:\"{}\"", bufContent);
-            this->read_complete_ = true;
-            // TODO! WHY THE FUCK CAN'T I JUST GET THE READ DATA ALREADY??
+            if (kv_server_ && kv_server_->HandleMessage(remote_server_id, buf)) {
+                return true;
+            }
+            if (kv_client_ && kv_client_->HandleMessage(remote_server_id, buf)) {
+                return true;
+            }
+            RDMA_LOG(WARNING) << fmt::format(
+                        "unknown message type {} from server {}", buf[0],
+                        remote_server_id);
+        } else if (type == IBV_WC_RDMA_READ) {
+            if (kv_client_) {
+                kv_client_->HandleCompletion(remote_server_id, wr_id);
+            }
         }
         return true;
     }
 };
 
-P2MsgCallback::P2MsgCallback() {
-    this->read_complete_ = false; // initialize to false on construction
-}
-
-
-
-
-
-
-
-
-
 class ExampleRDMAThread {
 private:
     NovaMemManager *nmm_;
     NovaRDMARCBroker *broker_;
     P2MsgCallback *p2mc_;
-    char *readbuf_;
-    // const uint32_t my_server_id_;
+
+    // Polls until req_id completes.
+    NovaKVResult Wait(NovaKVClient *client, uint32_t req_id);
+
+    void Serve();
+
+    void RunClient();
 
 public:
     ExampleRDMAThread(NovaMemManager*);
     void Start();
 
-    void ReceiveRDMAReadInstruction();
-    void ExecuteRDMARead(string instruction);
-
     RdmaCtrl *ctrl_;
     std::vector<QPEndPoint> endpoints_;
     char *rdma_backing_mem_;
     char *circular_buffer_;
+    char *kv_index_buf_;
 };
 
 ExampleRDMAThread::ExampleRDMAThread(NovaMemManager *mem_manager) {
@@ -108,37 +109,9 @@ ExampleRDMAThread::ExampleRDMAThread(NovaMemManager *mem_manager) {
     this->nmm_ = mem_manager;
 }
 
-// ML: This is what i should mainly be editing. Let's dictate that node-0 wakes
-// up to write some naive data in a known location (or that location can be
-// obtained and sent to node-1 at run time). Then, run the same code on node-1
-// which wakes up to immediately [look for that location and then] read from
-// node-0's that location.
-// After reading <Intro to IB> it becomes clearer: node-0 upon detecting that
-// itself being node-0, should: 1. register a memory location 2. send that
-// location information as a SEND to node-1 3. wait until node-1 somehow signals
-// it back that the memory location is good to be freed. On the other hand,
-// node-1 should: 1. wait to RECV a msg from node-0 indication memory location,
-// 2. use RDMA READ to obtain data from that location 3. use SEND to signal
-// node-0 to free that memory.
 void ExampleRDMAThread::Start() {
-// A thread i at server j connects to thread i of all other servers.
-
-    // Some setup work:
-
-    // Setup RDMA READ buffer, this is only useful for node-1 but we do it for
-    // all nodes anyway, for now.
-    // TODO how should I work with a reasonable slab size (like 40) without
-    // conflicting with the same buffer written into in main()?
-    uint32_t scid = nmm_->slabclassid(0, 2000); // using 2000 ( >> 40) results
-                                                // in a different slab class
-                                                // which doesn't collide with
-                                                // *readbuf from main()
-    this->readbuf_ = nmm_->ItemAlloc(0, scid);
-
-    // Setup message callback class interface
+    // A thread i at server j connects to thread i of all other servers.
     this->p2mc_ = new P2MsgCallback;
-
-    // Setup broker; this is mandatory!
     this->broker_ = new NovaRDMARCBroker(circular_buffer_, 0,
                                     endpoints_,
                                     FLAGS_rdma_max_num_sends,
@@ -153,180 +126,90 @@ void ExampleRDMAThread::Start() {
                                     p2mc_);
     broker_->Init(ctrl_);
 
-    if (FLAGS_server_id == 0) {
-        // step 1- setup a memory block to store data item
-        uint32_t scid = nmm_->slabclassid(0, 40);
-        char *databuf = nmm_->ItemAlloc(0, scid); // allocate an item of "size =
-                                                  // 40 bytes" slab class
-        // Do sth with the buf.
-        // databuf[0] = 'L';
-        // databuf[1] = 'O';
-        // databuf[2] = 'L';
-        // databuf[3] = '\0';
-        // *databuf = 'x';
-
-        int server_id = 1;
-        char *sendbuf = broker_->GetSendBuf(server_id);// DONE: check what's the
-                                                       // size of this message
-                                                       // buffer. Data buffer is
-                                                       // clearly 40-bytes.
-                                                       // Seems it's set in cmd-
-                                                       // line args, and it's
-                                                       // 1024 bytes. Should be
-                                                       // sufficient to hold the
-                                                       // message.
-
-        // Write a request into the buf.
-        // Goal: Request i.e. sendbuf = "P2GET 0 0x480f56 15"
-        // ("COMMAND THIS_SERVER_ID MEM_ADDR LENGTH_TO_READ")
-        // Mind overflow! *sendbuf should hold 1024 bytes.
-        // Part 1- COMMAND
-        string thisPart = "P2GET";
-        // use for loop to deep-copy
-        size_t j = 0; // add'l counter to concatenate 4 parts of entire msg
-        for (size_t i; i < thisPart.length(); i++) {
-            sendbuf[j] = thisPart[i];
-            j++;
-        }
-        sendbuf[j] = ' ';
-        j++; // point to the next empty space in sendbuf
-        // Part 2- THIS_SERVER_ID
-        stringstream ss1;
-        ss1 << FLAGS_server_id;
-        ss1 >> thisPart;
-        for (size_t i; i < thisPart.length(); i++) {
-            sendbuf[j] = thisPart[i];
-            j++;
-        }
-        sendbuf[j] = ' ';
-        j++;
-        // Part 3- MEM_ADDR // TODO!!!!!!!! try using memcpy()
-        stringstream ss2;
-        ss2 << (uint64_t)databuf;
-        ss2 >> thisPart;
-        for (size_t i; i < thisPart.length(); i++) {
-            sendbuf[j] = thisPart[i];
-            j++;
-        }
-        // TODO!!!!!!!!!!! memcpy(); increment j accordingly
-        // memcpy(sendbuf[j], (uint64_t)databuf, sizeof(uint64_t));
-        // j += (sizeof(uint64_t)/sizeof(char));
-        sendbuf[j] = ' ';
-        j++;
-        // Part 4- LENGTH_TO_READ
-        size_t datalen = strlen(databuf);
-        stringstream ss3;
-        ss3 << datalen;
-        ss3 >> thisPart;
-        for (size_t i; i < thisPart.length(); i++) {
-            sendbuf[j] = thisPart[i];
-            j++;
-        }
-        // Finished building message string (sendbuf).
+    // Items carry offsets from the registered region, so peers can READ
+    // them without knowing our virtual addresses.
+    MemoryAttr local_mr = ctrl_->get_local_mr(FLAGS_server_id);
+    nmm_->BindMR(rdma_backing_mem_, local_mr.key, local_mr.key);
 
-        uint64_t wr_id = broker_->PostSend(sendbuf, strlen(sendbuf), server_id, 1);
-        RDMA_LOG(INFO) << fmt::format("PostSend(): sendbuf \"{}\", wr:{} imm:1", sendbuf, wr_id);
-        broker_->FlushPendingSends(server_id);
-        broker_->PollSQ(server_id);
-        broker_->PollRQ(server_id);
-    }
-    else { // should be node-1 executing this block
-        ReceiveRDMAReadInstruction(); // Also, by now RECV haven't finished.
+    if (FLAGS_server_id == 0) {
+        Serve();
+    } else {
+        RunClient();
     }
+}
 
+void ExampleRDMAThread::Serve() {
+    NovaKVIndex *index = new NovaKVIndex(nmm_, kv_index_buf_,
+                                         FLAGS_kv_buckets);
+    p2mc_->kv_server_ = new NovaKVServer(index, broker_,
+                                         FLAGS_rdma_max_msg_size);
+    // GETs do not reach this thread; it only serves PUTs.
+    uint64_t last_reclaim_us = NowMicros();
     while (true) {
         broker_->PollRQ();
         broker_->PollSQ();
-        if (FLAGS_server_id == 0) {
-            continue;
-        }
-        else { // RECV should've completed somewhere within while(true)
-            if (p2mc_->read_complete_ == false) {
-                ReceiveRDMAReadInstruction();
-            }
-            else {
-                p2mc_->read_complete_ = false; // suppress
-                assert(readbuf_);
-                RDMA_LOG(INFO) << fmt::format("Finally received *readbuf_: \"{}\"", this->readbuf_);
-            }
+        // PUTs free the items they replaced earlier; once they stop, the
+        // last ones are freed here.
+        uint64_t now = NowMicros();
+        if (now - last_reclaim_us >= KV_RETIRE_US) {
+            index->Reclaim();
+            last_reclaim_us = now;
         }
     }
 }
 
-void ExampleRDMAThread::ReceiveRDMAReadInstruction() {
-    assert(FLAGS_server_id == 1); // let upper level ensure this
-    if (p2mc_->recv_history_.size() != 0) {
-        // if (p2mc_->recv_history.size() == 1 && p2mc_->recv_history_[0].length() == 0) {
-        //     return;
-        // }
-        string recvMsg = p2mc_->recv_history_[0];
-        RDMA_LOG(INFO) << fmt::format("i'm node-1, entry point 2, popping recv_history_[0]: \"{}\"", recvMsg);
-        p2mc_->recv_history_.pop_front();
-        if (recvMsg.substr(0, 5) != "P2GET") {
-            RDMA_LOG(INFO) << fmt::format("Weird recv_history_[0] content: \"{}\"", recvMsg);
-            return;
-        }
-        else {
-            // with a recvMsg starting with "P2GET", initiate RDMA read
-            ExecuteRDMARead(recvMsg);
-        }
+NovaKVResult ExampleRDMAThread::Wait(NovaKVClient *client, uint32_t req_id) {
+    NovaKVResult result = {};
+    broker_->FlushPendingSends();
+    while (!client->TakeResult(req_id, &result)) {
+        broker_->PollSQ();
+        broker_->PollRQ();
     }
+    return result;
 }
 
-void ExampleRDMAThread::ExecuteRDMARead(string instruction) {
-    // TODO how do I do sanity check?
-    // TODO faster (index-based) instruction argument parsing?
-
-    assert(instruction.substr(0, 5) == "P2GET"); // TODO remove?
-
-    // stringstream ss; ss << instruction; // both this and the line below works
-    stringstream ss(instruction.c_str());
-
-    string command;
-    ss >> command; // TODO command gets "P2GET", how to skip this?
-    int supplierServerID;
-    ss >> supplierServerID;
-    uint64_t memAddr;
-    ss >> memAddr;
-    uint32_t length;
-    ss >> length;
-    RDMA_LOG(INFO) << fmt::format("ExecuteRDMARead(): supplier_server_id: {}, mem_addr: {}, length: {}", supplierServerID, memAddr, length);
-
-    // DONE: initiate RDMA READ
-
-    // RDMA Read might work with a memory region that is NOT registerd with RNIC
-    // but I'm not sure. To be safe, start with RNIC-registered block, but later
-    // on try good o' malloc() to see if I can reduce RNIC-registered memory
-    // usage.
-    // Additionally, instead of using broker_->GetSendBuf(), try ItemAlloc()
-    // first.
-
-    // uint64_t PostRead(char *localbuf, uint32_t size, int remote_server_id,
-    //                   uint64_t local_offset,
-    //                   uint64_t remote_addr, bool is_remote_offset);
-
-    // readbuf_ = "myass\0"; // writing into local read buffer will result in LOCAL PROTECTION ERROR on SERVER 0???
-    RDMA_LOG(INFO) << fmt::format("PostRead(): readbuf_ before read: \"{}\"", readbuf_); // examine if readbuf_ contains stuff to begin with
-    // try with local_offset = 0 (should be correct)
-    // TODO fiddle with read size = 3
-
-    uint64_t wr_id = broker_->PostRead(readbuf_, length, supplierServerID, 0, memAddr, false); // trying with "true" for is_remote_offset
-
-    // There is no elegant way to convert remote server memory addresses
-    // (where to read from) to a string, and convert it back. Try using uint64_t
-    // from the very beginning, with some format-specified printing in RDMA_LOG
-    // should make things work. Update: Haoyu said simply cast to uint64_t from
-    // the very beginning, where node-0 constructs char *sendbuf
-    // Update 2: not just simply cast to uint64_t after RECV, but also store
-    // node-0's message as uint64_t for memAddr. memcpy().
-
-    // this line below is VERY problematic! Basically when hitting this line,
-    // RDMA READ is NOT YET complete! Only when msgCallback is hit, that means
-    // this readbuf_ should be populated!
-    RDMA_LOG(INFO) << fmt::format("PostRead(): readbuf_ right after read attempt \"{}\", wr:{} imm:1", readbuf_, wr_id);
-
-    // TODO do i need the line below?
-    broker_->FlushPendingSends(supplierServerID);
+void ExampleRDMAThread::RunClient() {
+    NovaKVClient *client = new NovaKVClient(broker_, nmm_,
+                                            FLAGS_rdma_max_msg_size);
+    p2mc_->kv_client_ = client;
+    int server_id = 0;
+    Wait(client, client->Connect(server_id));
+    RDMA_ASSERT(FLAGS_kv_value_size <= client->max_value_size())
+        << fmt::format("value size {}, at most {}", FLAGS_kv_value_size,
+                       client->max_value_size());
+
+    std::vector<char> value(FLAGS_kv_value_size);
+    // Keys of different clients do not collide.
+    uint64_t first_key = (uint64_t) FLAGS_server_id << 32;
+    uint64_t start = NowMicros();
+    for (uint64_t i = 0; i < FLAGS_kv_keys; i++) {
+        memset(value.data(), 'a' + i % 26, value.size());
+        NovaKVResult result = Wait(client,
+                                   client->Put(server_id, first_key + i,
+                                               value.data(), value.size()));
+        RDMA_ASSERT(result.status == NOVA_KV_OK)
+            << fmt::format("PUT {}: status {}", first_key + i,
+                           result.status);
+    }
+    uint64_t put_us = NowMicros() - start;
+
+    uint64_t mismatches = 0;
+    start = NowMicros();
+    for (uint64_t i = 0; i < FLAGS_kv_keys; i++) {
+        memset(value.data(), 'a' + i % 26, value.size());
+        NovaKVResult result = Wait(client, client->Get(server_id,
+                                                       first_key + i));
+        if (result.status != NOVA_KV_OK ||
+            result.value_size != value.size() ||
+            memcmp(result.value, value.data(), value.size()) != 0) {
+            mismatches++;
+        }
+        client->Release(&result);
+    }
+    uint64_t get_us = NowMicros() - start;
+    RDMA_LOG(INFO) << fmt::format(
+                "{} PUTs in {} us, {} GETs in {} us, {} mismatches",
+                FLAGS_kv_keys, put_us, FLAGS_kv_keys, get_us, mismatches);
 }
 
 int main(int argc, char *argv[]) {
@@ -340,11 +223,10 @@ int main(int argc, char *argv[]) {
         printf("%s=%s\n", flag.name.c_str(),
                flag.current_value.c_str());
     }
+    NovaLogger::SetLevel(FLAGS_log_level);
+    NovaLogger::Start(stdout);
 
 
-    char *rdma_backing_mem = (char *) malloc(
-            FLAGS_mem_pool_size_gb * 1024 * 1024 * 1024);
-    memset(rdma_backing_mem, 0, FLAGS_mem_pool_size_gb * 1024 * 1024 * 1024);
     std::vector<Host> hosts = convert_hosts(FLAGS_servers);
 
     NovaConfig::config = new NovaConfig;
@@ -356,6 +238,28 @@ int main(int argc, char *argv[]) {
     NovaConfig::config->max_msg_size = FLAGS_rdma_max_msg_size;                 // ML: set to 1024
     NovaConfig::config->rdma_max_num_sends = FLAGS_rdma_max_num_sends;          // ML: set to 128 in command-line execution
 
+    NovaMemPartitionPolicy policy = ParseMemPartitionPolicy(
+            FLAGS_mem_partition_policy);
+    uint64_t backing_mem_size = FLAGS_mem_pool_size_gb * 1024 * 1024 * 1024;
+    char *rdma_backing_mem = AllocRDMABackingMem(backing_mem_size);
+    // The KV index follows the broker buffers, so that it is registered as
+    // well.
+    char *kv_index_buf = rdma_backing_mem + nrdma_buf_total();
+    uint64_t index_size = NovaKVIndex::IndexSize(FLAGS_kv_buckets);
+    char *user_memory = kv_index_buf + index_size;
+    RDMA_ASSERT(nrdma_buf_total() + index_size < backing_mem_size)
+        << fmt::format(
+                "{} bytes of broker buffers and {} bytes of index, {} bytes of memory",
+                nrdma_buf_total(), index_size, backing_mem_size);
+    // The pool gets what the broker buffers and the index leave.
+    uint64_t pool_size = backing_mem_size - nrdma_buf_total() - index_size;
+    if (policy == PARTITION_BY_NUMA_NODE) {
+        // Before the prefault, so that pages are faulted in on their node.
+        NovaMemManager::PlaceNUMAPartitions(
+                user_memory, FLAGS_mem_partitions, pool_size);
+    }
+    PrefaultMem(rdma_backing_mem, backing_mem_size, FLAGS_mem_init_threads);
+
     RdmaCtrl *ctrl = new RdmaCtrl(FLAGS_server_id, FLAGS_rdma_port);
     std::vector<QPEndPoint> endpoints;
     for (int i = 0; i < hosts.size(); i++) {
@@ -376,39 +280,20 @@ int main(int argc, char *argv[]) {
     // We register all memory to the RNIC.
     // RDMA verbs can only work on the memory registered in RNIC.
     // You may use nova mem manager to manage this memory.
-    char *user_memory = rdma_backing_mem + nrdma_buf_total();
-    uint32_t partitions = 1;
     uint32_t slab_mb = 1;
-    NovaMemManager *mem_manager = new NovaMemManager(user_memory, partitions,
-                                                     FLAGS_mem_pool_size_gb,
-                                                     slab_mb);
-    uint32_t scid = mem_manager->slabclassid(0, 40);
-    char *buf = mem_manager->ItemAlloc(0, scid); // allocate an item of "size=40" slab class
-    // Do sth with the buf.
-    // buf[0] = 'n';
-    // buf[1] = 'o';
-    // buf[2] = 'd';
-    // buf[3] = 't';
-    // buf[4] = '\0';
-    // *buf = "what";
-    strcpy(buf, "what");
-    // TODO have the other node notify upon finish reading
-
-    // finally free it
-    mem_manager->FreeItem(0, buf, scid);
-
-    // ML: look at above, a design decision is needed here. Do I instantiate
-    // NovaMemManager here, or should I move it into the thread class? Thread
-    // need to be able to allocate multiple buffers as it sees fit. Would it
-    // still work if NovaMemManager instantiation is moved into thread class?
-    // ANSWER: just pass-by-reference a NovaMemManager instance to the thread
-    // class!
+    NovaMemManager *mem_manager = new NovaMemManager(user_memory,
+                                                     FLAGS_mem_partitions,
+                                                     pool_size,
+                                                     slab_mb, policy);
+
     ExampleRDMAThread *example = new ExampleRDMAThread(mem_manager); // with pass-by-pointer
     example->circular_buffer_ = rdma_backing_mem; // ML: this is simply a char*, and it's meaningful-ness is interpreted at ExampleRDMAThread -> initializing NovaRDMARCBroker
     example->ctrl_ = ctrl;
     example->endpoints_ = endpoints;
     example->rdma_backing_mem_ = rdma_backing_mem;
+    example->kv_index_buf_ = kv_index_buf;
     std::thread t(&ExampleRDMAThread::Start, example);
     t.join();
+    NovaLogger::Stop();
     return 0;
 }
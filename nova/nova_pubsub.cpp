@@ -0,0 +1,306 @@
+//
+// Copyright (c) 2020 University of Southern California. All rights reserved.
+//
+
+#include <cstring>
+#include <fmt/core.h>
+
+#include "nova_pubsub.h"
+
+namespace nova {
+
+    NovaPublisher::NovaPublisher(NovaRDMABroker *broker,
+                                 NovaMemManager *mem_manager,
+                                 uint32_t my_server_id,
+                                 uint32_t max_msg_size) :
+            broker_(broker),
+            mem_manager_(mem_manager),
+            my_server_id_(my_server_id),
+            // PostSend requires messages strictly smaller than max_msg_size.
+            max_payload_size_(max_msg_size - sizeof(NovaPubSubHeader) - 1) {
+        RDMA_ASSERT(max_msg_size > sizeof(NovaPubSubHeader) + 1);
+    }
+
+    void NovaPublisher::AddSubscriber(uint32_t topic, int server_id) {
+        topics_[topic].insert(server_id);
+        subscribers_[server_id].topics.insert(topic);
+    }
+
+    void NovaPublisher::RemoveSubscriber(uint32_t topic, int server_id) {
+        auto it = topics_.find(topic);
+        if (it != topics_.end()) {
+            it->second.erase(server_id);
+            if (it->second.empty()) {
+                topics_.erase(it);
+            }
+        }
+        auto sit = subscribers_.find(server_id);
+        if (sit != subscribers_.end()) {
+            sit->second.topics.erase(topic);
+            if (sit->second.topics.empty()) {
+                subscribers_.erase(sit);
+            }
+        }
+    }
+
+    void NovaPublisher::RemoveSubscriber(int server_id) {
+        auto sit = subscribers_.find(server_id);
+        if (sit == subscribers_.end()) {
+            return;
+        }
+        std::set<uint32_t> topics = sit->second.topics;
+        for (uint32_t topic : topics) {
+            RemoveSubscriber(topic, server_id);
+        }
+    }
+
+    char *NovaPublisher::Alloc(uint32_t size) {
+        RDMA_ASSERT(size <= max_payload_size_)
+            << fmt::format("payload size:{} max:{}", size, max_payload_size_);
+        uint64_t key = broker_->thread_id();
+        uint64_t total = sizeof(NovaPubSubHeader) + size;
+        uint32_t scid = mem_manager_->slabclassid(key, total);
+        NovaItemHandle handle = mem_manager_->ItemAllocHandle(key, scid,
+                                                              total);
+        if (handle.addr == nullptr) {
+            return nullptr;
+        }
+        char *payload = handle.addr + sizeof(NovaPubSubHeader);
+        Publication &pub = publications_[payload];
+        pub.handle = handle;
+        pub.nrefs = 0;
+        return payload;
+    }
+
+    uint32_t
+    NovaPublisher::Publish(uint32_t topic, char *payload, uint32_t size) {
+        auto pit = publications_.find(payload);
+        RDMA_ASSERT(pit != publications_.end())
+            << "payload is not from Alloc or already published";
+        Publication &pub = pit->second;
+        RDMA_ASSERT(pub.nrefs == 0) << "payload is already published";
+        RDMA_ASSERT(sizeof(NovaPubSubHeader) + size <= pub.handle.size);
+
+        NovaPubSubHeader hdr = {};
+        hdr.type = NOVA_PUBSUB_PUBLISH;
+        hdr.topic = topic;
+        hdr.size = size;
+        hdr.publisher_id = my_server_id_;
+        hdr.seq = ++seq_;
+        memcpy(pub.handle.addr, &hdr, sizeof(hdr));
+        uint32_t total = sizeof(hdr) + size;
+
+        // Held while posting so that a completion polled by the broker in
+        // the middle of the fan-out does not free the buffer.
+        pub.nrefs = 1;
+        uint32_t nsubscribers = 0;
+        auto it = topics_.find(topic);
+        if (it != topics_.end()) {
+            for (int server_id : it->second) {
+                Subscriber &sub = subscribers_[server_id];
+                uint64_t wr_id;
+                if (sub.write_imm) {
+                    if (total > sub.slot_size) {
+                        // The subscriber chose the slot size.
+                        RDMA_LOG(WARNING) << fmt::format(
+                                    "pubsub: publication size:{} exceeds slot:{} of server {}",
+                                    total, sub.slot_size, server_id);
+                        continue;
+                    }
+                    uint32_t slot = sub.next_slot;
+                    sub.next_slot = (sub.next_slot + 1) % sub.nslots;
+                    NovaRemoteItem remote = {};
+                    remote.offset = sub.ring.offset +
+                                    (uint64_t) slot * sub.slot_size;
+                    remote.rkey = sub.ring.rkey;
+                    remote.size = sub.slot_size;
+                    wr_id = broker_->PostWrite(pub.handle, remote, total,
+                                               server_id,
+                                               PUBSUB_IMM_FLAG | slot);
+                } else {
+                    wr_id = broker_->PostSend(pub.handle, total, server_id,
+                                              0);
+                }
+                inflight_[to_inflight_key(server_id, wr_id)] = payload;
+                pub.nrefs++;
+                nsubscribers++;
+                pending_servers_.insert(server_id);
+            }
+        }
+        RDMA_LOG(DEBUG) << fmt::format(
+                    "pubsub: publish {} bytes of topic {} seq {} to {} subscribers",
+                    size, topic, hdr.seq, nsubscribers);
+        Release(payload);
+        return nsubscribers;
+    }
+
+    void NovaPublisher::Flush() {
+        for (int server_id : pending_servers_) {
+            broker_->FlushPendingSends(server_id);
+        }
+        pending_servers_.clear();
+    }
+
+    bool NovaPublisher::HandleMessage(int remote_server_id, char *buf) {
+        if (buf[0] != NOVA_PUBSUB_SUBSCRIBE &&
+            buf[0] != NOVA_PUBSUB_UNSUBSCRIBE) {
+            return false;
+        }
+        NovaSubscribeRequest req;
+        memcpy(&req, buf, sizeof(req));
+        if (req.type == NOVA_PUBSUB_UNSUBSCRIBE) {
+            RemoveSubscriber(req.topic, remote_server_id);
+            return true;
+        }
+        if (req.write_imm &&
+            (req.nslots == 0 || req.nslots >= PUBSUB_IMM_FLAG ||
+             req.ring.size / req.nslots <= sizeof(NovaPubSubHeader))) {
+            // The ring comes off the wire. Its slot number must fit into the
+            // immediate data and a slot must hold a header.
+            RDMA_LOG(WARNING) << fmt::format(
+                        "pubsub: server {} subscribed to topic {} with {} slots in {} bytes",
+                        remote_server_id, req.topic, req.nslots,
+                        req.ring.size);
+            return true;
+        }
+        Subscriber &sub = subscribers_[remote_server_id];
+        if (req.write_imm) {
+            uint32_t slot_size = req.ring.size / req.nslots;
+            // A new ring restarts at its first slot.
+            if (!sub.write_imm || sub.ring.offset != req.ring.offset ||
+                sub.ring.rkey != req.ring.rkey ||
+                sub.slot_size != slot_size) {
+                sub.next_slot = 0;
+            }
+            sub.ring = req.ring;
+            sub.nslots = req.nslots;
+            sub.slot_size = slot_size;
+        }
+        sub.write_imm = req.write_imm;
+        AddSubscriber(req.topic, remote_server_id);
+        RDMA_LOG(DEBUG) << fmt::format(
+                    "pubsub: server {} subscribed to topic {} write_imm:{}",
+                    remote_server_id, req.topic, req.write_imm);
+        return true;
+    }
+
+    bool NovaPublisher::HandleCompletion(int remote_server_id,
+                                         uint64_t wr_id) {
+        auto it = inflight_.find(to_inflight_key(remote_server_id, wr_id));
+        if (it == inflight_.end()) {
+            return false;
+        }
+        char *payload = it->second;
+        inflight_.erase(it);
+        Release(payload);
+        return true;
+    }
+
+    void NovaPublisher::Release(char *payload) {
+        auto it = publications_.find(payload);
+        RDMA_ASSERT(it != publications_.end());
+        it->second.nrefs--;
+        if (it->second.nrefs == 0) {
+            // The last subscriber has it.
+            mem_manager_->FreeItem(broker_->thread_id(), it->second.handle);
+            publications_.erase(it);
+        }
+    }
+
+    NovaSubscriber::NovaSubscriber(NovaRDMABroker *broker,
+                                   uint32_t max_msg_size,
+                                   PublicationCallback callback) :
+            broker_(broker),
+            max_msg_size_(max_msg_size),
+            callback_(callback) {
+        RDMA_ASSERT(max_msg_size > sizeof(NovaPubSubHeader));
+    }
+
+    void NovaSubscriber::SendRequest(int publisher_id,
+                                     const NovaSubscribeRequest &req) {
+        char *sendbuf = broker_->GetSendBuf(publisher_id);
+        memcpy(sendbuf, &req, sizeof(req));
+        broker_->PostSend(sendbuf, sizeof(req), publisher_id, 0);
+    }
+
+    void NovaSubscriber::Subscribe(int publisher_id, uint32_t topic) {
+        NovaSubscribeRequest req = {};
+        req.type = NOVA_PUBSUB_SUBSCRIBE;
+        req.topic = topic;
+        req.write_imm = false;
+        SendRequest(publisher_id, req);
+    }
+
+    void NovaSubscriber::Subscribe(int publisher_id, uint32_t topic,
+                                   char *ring_base,
+                                   const NovaRemoteItem &ring,
+                                   uint32_t nslots) {
+        RDMA_ASSERT(nslots > 0 && ring.size / nslots >
+                                  sizeof(NovaPubSubHeader));
+        Ring &r = rings_[publisher_id];
+        r.base = ring_base;
+        r.nslots = nslots;
+        r.slot_size = ring.size / nslots;
+
+        NovaSubscribeRequest req = {};
+        req.type = NOVA_PUBSUB_SUBSCRIBE;
+        req.topic = topic;
+        req.write_imm = true;
+        req.nslots = nslots;
+        req.ring = ring;
+        SendRequest(publisher_id, req);
+    }
+
+    void NovaSubscriber::Unsubscribe(int publisher_id, uint32_t topic) {
+        NovaSubscribeRequest req = {};
+        req.type = NOVA_PUBSUB_UNSUBSCRIBE;
+        req.topic = topic;
+        SendRequest(publisher_id, req);
+    }
+
+    void NovaSubscriber::Deliver(int remote_server_id, char *buf,
+                                 uint32_t capacity) {
+        NovaPubSubHeader hdr;
+        memcpy(&hdr, buf, sizeof(hdr));
+        // size comes from the publisher. The payload must lie within buf.
+        if (hdr.size > capacity - sizeof(hdr)) {
+            RDMA_LOG(WARNING) << fmt::format(
+                        "pubsub: server {} publishes {} bytes in a {}-byte buffer",
+                        remote_server_id, hdr.size, capacity);
+            return;
+        }
+        RDMA_LOG(DEBUG) << fmt::format(
+                    "pubsub: {} bytes of topic {} seq {} from server {}",
+                    hdr.size, hdr.topic, hdr.seq, remote_server_id);
+        callback_(remote_server_id, hdr.topic, buf + sizeof(hdr), hdr.size);
+    }
+
+    bool NovaSubscriber::HandleMessage(int remote_server_id, char *buf) {
+        if (buf[0] != NOVA_PUBSUB_PUBLISH) {
+            return false;
+        }
+        Deliver(remote_server_id, buf, max_msg_size_);
+        return true;
+    }
+
+    bool NovaSubscriber::HandleWriteImm(int remote_server_id,
+                                        uint32_t imm_data) {
+        if ((imm_data & PUBSUB_IMM_FLAG) == 0) {
+            return false;
+        }
+        auto it = rings_.find(remote_server_id);
+        if (it == rings_.end()) {
+            return false;
+        }
+        uint32_t slot = imm_data & ~PUBSUB_IMM_FLAG;
+        char *buf = it->second.base + (uint64_t) slot * it->second.slot_size;
+        if (slot >= it->second.nslots || buf[0] != NOVA_PUBSUB_PUBLISH) {
+            RDMA_LOG(WARNING) << fmt::format(
+                        "pubsub: server {} wrote an invalid slot {}",
+                        remote_server_id, slot);
+            return true;
+        }
+        Deliver(remote_server_id, buf, it->second.slot_size);
+        return true;
+    }
+}
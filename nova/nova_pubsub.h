@@ -0,0 +1,199 @@
+//
+// Copyright (c) 2020 University of Southern California. All rights reserved.
+//
+
+#ifndef RLIB_NOVA_PUBSUB_H
+#define RLIB_NOVA_PUBSUB_H
+
+#include <stdint.h>
+#include <functional>
+#include <map>
+#include <set>
+#include <vector>
+
+#include "nova_rdma_broker.h"
+#include "nova_mem_manager.h"
+
+// imm_data of a publication written into a subscriber's ring. The low bits
+// are the slot.
+#define PUBSUB_IMM_FLAG 0x80000000u
+
+namespace nova {
+
+    // Message types of publish/subscribe. The first byte of a message is its
+    // type. It is never '~', which the broker uses to mark a free buffer.
+    enum NovaPubSubMsgType {
+        NOVA_PUBSUB_SUBSCRIBE = 'S',
+        NOVA_PUBSUB_UNSUBSCRIBE = 'U',
+        NOVA_PUBSUB_PUBLISH = 'P'
+    };
+
+    struct NovaSubscribeRequest {
+        char type;
+        uint32_t topic;
+        // Publications are written into ring with WRITE_WITH_IMM instead of
+        // sent. ring holds nslots slots of ring.size / nslots bytes.
+        bool write_imm;
+        uint32_t nslots;
+        NovaRemoteItem ring;
+    };
+
+    // Precedes the payload of every publication.
+    struct NovaPubSubHeader {
+        char type;
+        uint32_t topic;
+        uint32_t size;
+        uint32_t publisher_id;
+        uint64_t seq;
+    };
+
+    // Thread local. Fans a publication out to all subscribers of its topic.
+    // The publisher writes the payload once into a registered buffer from
+    // Alloc; every subscriber is sent, or written, the same buffer, so the
+    // cost of a publication does not grow with a memcpy per subscriber. The
+    // requests are chained into the broker's doorbell batch of each
+    // subscriber and Flush rings one doorbell per subscriber. The buffer is
+    // freed when the last of its requests completes.
+    class NovaPublisher {
+    public:
+        // Buffers come from mem_manager, which must be bound to the region
+        // registered with broker.
+        NovaPublisher(NovaRDMABroker *broker, NovaMemManager *mem_manager,
+                      uint32_t my_server_id, uint32_t max_msg_size);
+
+        // Subscribes server_id to topic locally, e.g., for static
+        // configurations. Peers subscribe themselves with
+        // NovaSubscriber::Subscribe.
+        void AddSubscriber(uint32_t topic, int server_id);
+
+        void RemoveSubscriber(uint32_t topic, int server_id);
+
+        // Drops server_id from all topics, e.g., after it left.
+        void RemoveSubscriber(int server_id);
+
+        // Returns a buffer for a payload of size bytes, nullptr if out of
+        // memory. Write the payload into it and pass it to Publish.
+        char *Alloc(uint32_t size);
+
+        // Posts payload to every subscriber of topic, except those whose
+        // ring slots are too small for it. Returns the number of
+        // subscribers it was posted to. payload must not be touched afterwards; it is freed
+        // once delivered, or right away without subscribers.
+        uint32_t Publish(uint32_t topic, char *payload, uint32_t size);
+
+        // Rings one doorbell per subscriber with publications not posted
+        // yet.
+        void Flush();
+
+        // Call from NovaMsgCallback::ProcessRDMAWC on a RECV. Returns false
+        // if buf is not a subscription request. A request for a ring whose
+        // slots cannot hold a publication header is dropped.
+        bool HandleMessage(int remote_server_id, char *buf);
+
+        // Call from NovaMsgCallback::ProcessRDMAWC on a SEND or RDMA_WRITE
+        // completion and from ProcessRDMAError. Returns false if wr_id is
+        // not a request of a publication.
+        bool HandleCompletion(int remote_server_id, uint64_t wr_id);
+
+        uint32_t max_payload_size() { return max_payload_size_; }
+
+        uint64_t ninflight_publications() { return publications_.size(); }
+
+    private:
+        struct Subscriber {
+            bool write_imm = false;
+            NovaRemoteItem ring = {};
+            uint32_t nslots = 0;
+            uint32_t slot_size = 0;
+            uint32_t next_slot = 0;
+            std::set<uint32_t> topics;
+        };
+
+        struct Publication {
+            NovaItemHandle handle;
+            uint32_t nrefs;
+        };
+
+        // Drops a reference to a publication and frees it with the last one.
+        void Release(char *payload);
+
+        uint64_t to_inflight_key(int server_id, uint64_t wr_id) {
+            return ((uint64_t) server_id << 32) | wr_id;
+        }
+
+        NovaRDMABroker *broker_;
+        NovaMemManager *mem_manager_;
+        const uint32_t my_server_id_;
+        const uint32_t max_payload_size_;
+        uint64_t seq_ = 0;
+
+        std::map<uint32_t, std::set<int>> topics_;
+        std::map<int, Subscriber> subscribers_;
+        // Keyed by the address of the payload.
+        std::map<char *, Publication> publications_;
+        // (server id, wr_id) of a posted request -> payload.
+        std::map<uint64_t, char *> inflight_;
+        // Subscribers with publications not posted yet.
+        std::set<int> pending_servers_;
+    };
+
+    // Thread local. Receives the publications of the topics it subscribed
+    // to.
+    class NovaSubscriber {
+    public:
+        // Called with the publisher, the topic and the payload. The payload
+        // is valid until the callback returns.
+        typedef std::function<void(int, uint32_t, char *, uint32_t)>
+                PublicationCallback;
+
+        // max_msg_size is the size of the broker's receive buffers. A
+        // publication that claims more than its buffer or slot holds is
+        // dropped.
+        NovaSubscriber(NovaRDMABroker *broker, uint32_t max_msg_size,
+                       PublicationCallback callback);
+
+        // Asks publisher_id to send the publications of topic. Like any
+        // PostSend, the request goes out with the next doorbell of the
+        // broker.
+        void Subscribe(int publisher_id, uint32_t topic);
+
+        // Asks publisher_id to write the publications of topic into ring,
+        // nslots slots of ring.size / nslots bytes in this node's registered
+        // memory, at ring_base. A slot is reused after nslots publications
+        // of the publisher, so the callback must keep up; this suits
+        // broadcasts like cache invalidations where only recent ones
+        // matter. All topics of a publisher share one ring.
+        void Subscribe(int publisher_id, uint32_t topic, char *ring_base,
+                       const NovaRemoteItem &ring, uint32_t nslots);
+
+        void Unsubscribe(int publisher_id, uint32_t topic);
+
+        // Call from NovaMsgCallback::ProcessRDMAWC on a RECV. Returns false
+        // if buf is not a publication.
+        bool HandleMessage(int remote_server_id, char *buf);
+
+        // Call from NovaMsgCallback::ProcessRDMAWC on a
+        // RECV_RDMA_WITH_IMM. Returns false if imm_data is not a
+        // publication.
+        bool HandleWriteImm(int remote_server_id, uint32_t imm_data);
+
+    private:
+        struct Ring {
+            char *base;
+            uint32_t nslots;
+            uint32_t slot_size;
+        };
+
+        void SendRequest(int publisher_id, const NovaSubscribeRequest &req);
+
+        // buf holds capacity bytes.
+        void Deliver(int remote_server_id, char *buf, uint32_t capacity);
+
+        NovaRDMABroker *broker_;
+        const uint32_t max_msg_size_;
+        PublicationCallback callback_;
+        std::map<int, Ring> rings_;
+    };
+}
+
+#endif //RLIB_NOVA_PUBSUB_H
@@ -0,0 +1,90 @@
+//
+// Copyright (c) 2020 University of Southern California. All rights reserved.
+//
+
+#include <cstring>
+#include <fmt/core.h>
+
+#include "nova_rc_msg_adapter.h"
+#include "nova_tracer.h"
+
+namespace nova {
+
+    NovaRCMsgAdapter::NovaRCMsgAdapter(NovaRDMABroker *broker,
+                                       uint32_t my_server_id,
+                                       uint32_t max_msg_size,
+                                       msg_callback_t_ callback) :
+            MsgAdapter(callback),
+            broker_(broker),
+            my_server_id_(my_server_id),
+            max_msg_size_(max_msg_size) {
+    }
+
+    ConnStatus NovaRCMsgAdapter::connect(std::string ip, int port) {
+        return SUCC;
+    }
+
+    ConnStatus
+    NovaRCMsgAdapter::send_to(int node_id, const char *msg, int len) {
+        ConnStatus ret = send_pending(node_id, msg, len);
+        broker_->FlushPendingSends(node_id);
+        pending_nodes_.erase(node_id);
+        return ret;
+    }
+
+    void NovaRCMsgAdapter::prepare_pending() {
+        // Messages queued since the last flush go out with their own
+        // doorbells instead of being dropped from the batch.
+        flush_pending();
+    }
+
+    ConnStatus
+    NovaRCMsgAdapter::send_pending(int node_id, const char *msg, int len) {
+        if (len < 0 || sizeof(NovaMsgMeta) + len >= max_msg_size_) {
+            RDMA_LOG(WARNING) << fmt::format(
+                        "msg-adapter: a message of {} bytes to server {} does not fit into {} bytes",
+                        len, node_id, max_msg_size_);
+            return WRONG_ARG;
+        }
+        char *sendbuf = broker_->GetSendBuf(node_id);
+        NovaMsgMeta meta = {};
+        meta.type = NOVA_MSG_ADAPTER_MSG;
+        meta.tid = broker_->thread_id();
+        meta.node_id = my_server_id_;
+        meta.len = len;
+        meta.trace_id = NovaTracer::trace_id();
+        memcpy(sendbuf, &meta, sizeof(meta));
+        memcpy(sendbuf + sizeof(meta), msg, len);
+        // The broker chains it into the doorbell batch of node_id.
+        broker_->PostSend(sendbuf, sizeof(meta) + len, node_id, 0);
+        pending_nodes_.insert(node_id);
+        return SUCC;
+    }
+
+    ConnStatus NovaRCMsgAdapter::flush_pending() {
+        for (int node_id : pending_nodes_) {
+            broker_->FlushPendingSends(node_id);
+        }
+        pending_nodes_.clear();
+        return SUCC;
+    }
+
+    void NovaRCMsgAdapter::poll_comps() {
+        broker_->PollRQ();
+        broker_->PollSQ();
+    }
+
+    bool NovaRCMsgAdapter::HandleMessage(int remote_server_id, char *buf) {
+        if (buf[0] != NOVA_MSG_ADAPTER_MSG) {
+            return false;
+        }
+        NovaMsgMeta meta;
+        memcpy(&meta, buf, sizeof(meta));
+        RDMA_LOG(DEBUG) << fmt::format(
+                    "msg-adapter: {} bytes from server {} thread {}",
+                    meta.len, meta.node_id, meta.tid);
+        NovaTracer::SetTraceId(meta.trace_id);
+        callback_(buf + sizeof(meta), meta.node_id, meta.tid);
+        return true;
+    }
+}
@@ -0,0 +1,81 @@
+//
+// Copyright (c) 2020 University of Southern California. All rights reserved.
+//
+
+#ifndef RLIB_NOVA_RC_MSG_ADAPTER_H
+#define RLIB_NOVA_RC_MSG_ADAPTER_H
+
+#include <stdint.h>
+#include <set>
+
+#include "msg_interface.hpp"
+#include "nova_rdma_broker.h"
+
+namespace nova {
+
+    // The first byte of a message of NovaRCMsgAdapter. It is never '~', which
+    // the broker uses to mark a free buffer.
+    enum NovaMsgAdapterMsgType {
+        NOVA_MSG_ADAPTER_MSG = 'M'
+    };
+
+    // Precedes the payload of every message.
+    struct NovaMsgMeta {
+        char type;
+        uint16_t tid;
+        uint32_t node_id;
+        uint32_t len;
+        // NovaTracer::trace_id() of the sender.
+        uint64_t trace_id;
+    };
+
+    // rdmaio::MsgAdapter over a NovaRDMABroker, e.g., a NovaRDMARCBroker,
+    // so that rlib-style code runs on the broker. Thread local, like the broker. send_pending queues
+    // a message in the broker's doorbell batch of its destination and
+    // flush_pending rings one doorbell per destination. The target thread
+    // of a node is the one its broker pairs with ours; the tid argument of
+    // send_to is ignored.
+    class NovaRCMsgAdapter : public MsgAdapter {
+    public:
+        // max_msg_size is the message size of the broker.
+        NovaRCMsgAdapter(NovaRDMABroker *broker, uint32_t my_server_id,
+                         uint32_t max_msg_size, msg_callback_t_ callback);
+
+        // Peers are connected by the broker. Returns SUCC.
+        ConnStatus connect(std::string ip, int port) override;
+
+        ConnStatus send_to(int node_id, const char *msg, int len) override;
+
+        // Flushes the messages still pending from an earlier batch.
+        void prepare_pending() override;
+
+        // Returns WRONG_ARG if the message and its NovaMsgMeta do not fit
+        // into a message of the broker.
+        ConnStatus
+        send_pending(int node_id, const char *msg, int len) override;
+
+        ConnStatus flush_pending() override;
+
+        // Polls the broker. Messages are passed to the callback through
+        // HandleMessage.
+        void poll_comps() override;
+
+        int msg_meta_len() override {
+            return sizeof(NovaMsgMeta);
+        }
+
+        // Call from NovaMsgCallback::ProcessRDMAWC on a RECV. Calls the
+        // callback with the payload, the sender node and its thread.
+        // Returns false if buf is not a message of the adapter.
+        bool HandleMessage(int remote_server_id, char *buf);
+
+    private:
+        NovaRDMABroker *broker_;
+        const uint32_t my_server_id_;
+        const uint32_t max_msg_size_;
+        // Destinations with messages not posted yet.
+        std::set<int> pending_nodes_;
+    };
+}
+
+#endif //RLIB_NOVA_RC_MSG_ADAPTER_H
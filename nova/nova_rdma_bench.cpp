@@ -0,0 +1,518 @@
+//
+// Copyright (c) 2020 University of Southern California. All rights reserved.
+//
+// perftest-style microbenchmarks of NovaRDMARCBroker. Server 0 runs the
+// tests against server 1, which echoes. Both run the same command line:
+//
+//   nova_rdma_bench --servers=node-0:11211,node-1:11211 --server_id=0
+//   nova_rdma_bench --servers=node-0:11211,node-1:11211 --server_id=1
+//
+// On one host over Soft-RoCE, give both servers the host's address and
+// different ports. Results go to --csv, one row per configuration.
+//
+// Latency tests are ping-pongs with one request in flight and report the
+// one-way latency, half the round trip, except read_lat, which reports the
+// completion time of a READ. Bandwidth tests keep depth requests in flight
+// and ring a doorbell every batch requests; their percentiles are the
+// post-to-completion times from the broker's latency stats.
+//
+// Without an RNIC, --transport=loopback runs both servers in one process
+// over NovaRDMALoopbackBroker and measures the CPU side alone. Bandwidth
+// tests then report no percentiles.
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include <gflags/gflags.h>
+
+#include "rdma_ctrl.hpp"
+#include "nova_common.h"
+#include "nova_histogram.h"
+#include "nova_rdma_rc_broker.h"
+#include "nova_rdma_loopback_broker.h"
+
+using namespace std;
+using namespace rdmaio;
+using namespace nova;
+
+DEFINE_string(servers, "node-0:11211,node-1:11211",
+              "The two servers, host:port.");
+DEFINE_int64(server_id, -1, "0 runs the tests, 1 echoes.");
+DEFINE_uint64(rdma_port, 0, "The port used by RDMA to setup QPs.");
+DEFINE_string(tests, "send_lat,write_lat,read_lat,send_bw,write_bw,read_bw",
+              "Tests to run.");
+DEFINE_string(sizes, "8,64,512,4096", "Message sizes in bytes.");
+DEFINE_string(batches, "1,8,32",
+              "Doorbell batch sizes of the bandwidth tests.");
+DEFINE_string(depths, "1,16,64",
+              "Requests in flight per thread of the bandwidth tests.");
+DEFINE_string(threads, "1,2,4", "Thread counts.");
+DEFINE_uint64(duration_ms, 1000, "Duration of a configuration.");
+DEFINE_uint64(warmup_ms, 100,
+              "Warmup of a configuration, excluded from the results.");
+DEFINE_uint64(connect_timeout_ms, 30000, "Timeout to connect to the peer.");
+DEFINE_string(csv, "", "CSV output file. Empty writes to stdout.");
+DEFINE_string(transport, "rc",
+              "rc, or loopback to run both servers in this process over "
+              "NovaRDMALoopbackBroker.");
+
+namespace {
+    // The first byte of a SEND of the benchmark.
+    enum BenchMsgType {
+        BENCH_BW = 'b',
+        // Echo a message of the size that follows.
+        BENCH_PING = 'p',
+        BENCH_QUIT = 'q'
+    };
+
+    enum BenchTest {
+        SEND_LAT, WRITE_LAT, READ_LAT, SEND_BW, WRITE_BW, READ_BW
+    };
+
+    const char *kTestNames[] = {"send_lat", "write_lat", "read_lat",
+                                "send_bw", "write_bw", "read_bw"};
+
+    struct BenchConfig {
+        BenchTest test;
+        uint32_t nthreads;
+        uint32_t size;
+        uint32_t batch;
+        uint32_t depth;
+    };
+
+    struct BenchResult {
+        uint64_t nops = 0;
+        double seconds = 0;
+        NovaHistogram latency;
+    };
+
+    vector<uint32_t> ParseList(const string &list) {
+        vector<uint32_t> values;
+        stringstream ss(list);
+        string value;
+        while (getline(ss, value, ',')) {
+            if (!value.empty()) {
+                values.push_back(stoul(value));
+            }
+        }
+        RDMA_ASSERT(!values.empty()) << "empty list " << list;
+        return values;
+    }
+
+    uint32_t MaxOf(const vector<uint32_t> &values) {
+        return *max_element(values.begin(), values.end());
+    }
+
+    // Counts the completions of one thread and echoes on the responder.
+    class BenchCallback : public NovaMsgCallback {
+    public:
+        bool
+        ProcessRDMAWC(ibv_wc_opcode type, uint64_t wr_id, int remote_server_id,
+                      char *buf, uint32_t imm_data) override {
+            switch (type) {
+                case IBV_WC_SEND:
+                case IBV_WC_RDMA_WRITE:
+                case IBV_WC_RDMA_READ:
+                    ncompleted++;
+                    break;
+                case IBV_WC_RECV:
+                    nreplies++;
+                    if (buf[0] == BENCH_QUIT) {
+                        quit = true;
+                    } else if (responder && buf[0] == BENCH_PING) {
+                        uint32_t size;
+                        memcpy(&size, buf + 1, sizeof(size));
+                        char *sendbuf = broker->GetSendBuf(remote_server_id);
+                        sendbuf[0] = BENCH_PING;
+                        memcpy(sendbuf + 1, &size, sizeof(size));
+                        broker->PostSend(sendbuf, size, remote_server_id, 0);
+                    }
+                    break;
+                case IBV_WC_RECV_RDMA_WITH_IMM:
+                    nreplies++;
+                    if (responder) {
+                        // imm_data is the size.
+                        broker->PostWrite(nullptr, imm_data, remote_server_id,
+                                          scratch_offset, true, imm_data);
+                    }
+                    break;
+                default:
+                    break;
+            }
+            return true;
+        }
+
+        NovaRDMABroker *broker = nullptr;
+        bool responder = false;
+        uint64_t scratch_offset = 0;
+        uint64_t ncompleted = 0;
+        uint64_t nreplies = 0;
+        bool quit = false;
+    };
+
+    struct BenchThread {
+        NovaRDMABroker *broker;
+        // broker if it is an RC broker, for its latency stats.
+        NovaRDMARCBroker *rc_broker;
+        BenchCallback *callback;
+        // The server id of the other server.
+        int peer;
+    };
+
+    void WaitCompletions(BenchThread *t, uint64_t nposted) {
+        t->broker->FlushPendingSends(t->peer);
+        while (t->callback->ncompleted < nposted) {
+            t->broker->PollSQ(t->peer);
+        }
+    }
+
+    uint64_t
+    PostOne(BenchThread *t, const BenchConfig &config, bool ping) {
+        BenchCallback *cb = t->callback;
+        switch (config.test) {
+            case SEND_LAT:
+            case SEND_BW: {
+                char *sendbuf = t->broker->GetSendBuf(t->peer);
+                sendbuf[0] = ping ? BENCH_PING : BENCH_BW;
+                memcpy(sendbuf + 1, &config.size, sizeof(config.size));
+                return t->broker->PostSend(sendbuf, config.size, t->peer, 0);
+            }
+            case WRITE_LAT:
+                return t->broker->PostWrite(nullptr, config.size, t->peer,
+                                            cb->scratch_offset, true,
+                                            config.size);
+            case WRITE_BW:
+                return t->broker->PostWrite(nullptr, config.size, t->peer,
+                                            cb->scratch_offset, true, 0);
+            case READ_LAT:
+            case READ_BW:
+                return t->broker->PostRead(nullptr, config.size, t->peer, 0,
+                                           cb->scratch_offset, true);
+        }
+        return 0;
+    }
+
+    void RunLatency(BenchThread *t, const BenchConfig &config,
+                    BenchResult *result) {
+        BenchCallback *cb = t->callback;
+        uint64_t start = NowNanos();
+        uint64_t warmup_end = start + FLAGS_warmup_ms * 1000000;
+        uint64_t end = warmup_end + FLAGS_duration_ms * 1000000;
+        uint64_t measure_start = 0;
+        uint64_t nposted = cb->ncompleted;
+        uint64_t now = start;
+        while (now < end) {
+            uint64_t op_start = NowNanos();
+            uint64_t replies = cb->nreplies;
+            PostOne(t, config, true);
+            nposted++;
+            t->broker->FlushPendingSends(t->peer);
+            if (config.test == READ_LAT) {
+                while (cb->ncompleted < nposted) {
+                    t->broker->PollSQ(t->peer);
+                }
+            } else {
+                while (cb->nreplies == replies) {
+                    t->broker->PollRQ(t->peer);
+                    t->broker->PollSQ(t->peer);
+                }
+            }
+            now = NowNanos();
+            if (op_start < warmup_end) {
+                continue;
+            }
+            if (measure_start == 0) {
+                measure_start = op_start;
+            }
+            uint64_t latency = now - op_start;
+            result->latency.Add(config.test == READ_LAT ? latency
+                                                        : latency / 2);
+            result->nops++;
+        }
+        result->seconds = (now - measure_start) / 1e9;
+        WaitCompletions(t, nposted);
+    }
+
+    void RunBandwidth(BenchThread *t, const BenchConfig &config,
+                      BenchResult *result) {
+        BenchCallback *cb = t->callback;
+        if (t->rc_broker != nullptr) {
+            t->rc_broker->EnableLatencyStats(true);
+        }
+        uint64_t start = NowNanos();
+        uint64_t warmup_end = start + FLAGS_warmup_ms * 1000000;
+        uint64_t end = warmup_end + FLAGS_duration_ms * 1000000;
+        uint64_t nposted = cb->ncompleted;
+        uint64_t measure_completed = 0;
+        uint64_t measure_start = 0;
+        uint32_t unflushed = 0;
+        uint64_t now = start;
+        while (now < end) {
+            while (nposted - cb->ncompleted < config.depth) {
+                PostOne(t, config, false);
+                nposted++;
+                unflushed++;
+                if (unflushed == config.batch) {
+                    t->broker->FlushPendingSends(t->peer);
+                    unflushed = 0;
+                }
+            }
+            if (unflushed > 0) {
+                // The window is full; ring the partial batch.
+                t->broker->FlushPendingSends(t->peer);
+                unflushed = 0;
+            }
+            t->broker->PollSQ(t->peer);
+            now = NowNanos();
+            if (measure_start == 0 && now >= warmup_end) {
+                measure_start = now;
+                measure_completed = cb->ncompleted;
+                if (t->rc_broker != nullptr) {
+                    t->rc_broker->LatencySnapshot(true);
+                }
+            }
+        }
+        result->nops = cb->ncompleted - measure_completed;
+        result->seconds = (now - measure_start) / 1e9;
+        if (t->rc_broker != nullptr) {
+            for (const NovaOpLatency &lat : t->rc_broker->LatencySnapshot(
+                    true)) {
+                result->latency.Merge(lat.total);
+            }
+        }
+        WaitCompletions(t, nposted);
+        if (t->rc_broker != nullptr) {
+            // The stamps would add to the latency tests.
+            t->rc_broker->EnableLatencyStats(false);
+        }
+    }
+
+    void RunConfig(vector<BenchThread> &threads, const BenchConfig &config,
+                   FILE *csv) {
+        vector<BenchResult> results(config.nthreads);
+        vector<std::thread> workers;
+        bool latency = config.test == SEND_LAT || config.test == WRITE_LAT ||
+                       config.test == READ_LAT;
+        for (uint32_t i = 0; i < config.nthreads; i++) {
+            workers.push_back(std::thread([&, i, latency]() {
+                if (latency) {
+                    RunLatency(&threads[i], config, &results[i]);
+                } else {
+                    RunBandwidth(&threads[i], config, &results[i]);
+                }
+            }));
+        }
+        for (auto &worker : workers) {
+            worker.join();
+        }
+        BenchResult total;
+        double ops_per_sec = 0;
+        for (const BenchResult &result : results) {
+            total.nops += result.nops;
+            total.latency.Merge(result.latency);
+            if (result.seconds > 0) {
+                ops_per_sec += result.nops / result.seconds;
+            }
+        }
+        double gbps = ops_per_sec * config.size * 8 / 1e9;
+        fmt::print(csv, "{},{},{},{},{},{},{:.0f},{:.3f},{:.1f},{},{},{},{}\n",
+                   kTestNames[config.test], config.nthreads, config.size,
+                   config.batch, config.depth, total.nops, ops_per_sec, gbps,
+                   total.latency.Mean(), total.latency.Percentile(50),
+                   total.latency.Percentile(99),
+                   total.latency.Percentile(99.9), total.latency.max());
+        fflush(csv);
+    }
+
+    // Buffer sizes shared by both servers.
+    struct BenchLayout {
+        uint32_t nthreads;
+        uint32_t max_num_sends;
+        uint32_t max_msg_size;
+        uint32_t doorbell_batch_size;
+        uint64_t nbuf_per_broker;
+        uint64_t scratch_base;
+        uint64_t mem_size;
+    };
+
+    // Creates the brokers of server me, 0 or 1, without initializing them.
+    vector<BenchThread>
+    CreateThreads(const vector<Host> &hosts, int me, const BenchLayout &layout,
+                  bool loopback) {
+        char *mem = AllocRDMABackingMem(layout.mem_size);
+        PrefaultMem(mem, layout.mem_size, 0);
+        int peer_id = 1 - me;
+        vector<BenchThread> threads(layout.nthreads);
+        for (uint32_t i = 0; i < layout.nthreads; i++) {
+            QPEndPoint endpoint = {};
+            endpoint.thread_id = i;
+            endpoint.server_id = hosts[peer_id].server_id;
+            endpoint.host = hosts[peer_id];
+            BenchCallback *callback = new BenchCallback;
+            callback->responder = me == 1;
+            callback->scratch_offset =
+                    layout.scratch_base + (uint64_t) i * layout.max_msg_size;
+            threads[i].callback = callback;
+            threads[i].peer = hosts[peer_id].server_id;
+            threads[i].rc_broker = nullptr;
+            char *buf = mem + layout.nbuf_per_broker * i;
+            if (loopback) {
+                threads[i].broker = new NovaRDMALoopbackBroker(
+                        buf, i, {endpoint}, layout.max_num_sends,
+                        layout.max_msg_size, layout.doorbell_batch_size, me,
+                        mem, layout.mem_size, callback);
+            } else {
+                threads[i].rc_broker = new NovaRDMARCBroker(
+                        buf, i, {endpoint}, layout.max_num_sends,
+                        layout.max_msg_size, layout.doorbell_batch_size, me,
+                        mem, layout.mem_size, FLAGS_rdma_port, callback);
+                threads[i].broker = threads[i].rc_broker;
+            }
+            callback->broker = threads[i].broker;
+        }
+        return threads;
+    }
+
+    // Echoes until the tests are done.
+    void Respond(vector<BenchThread> &threads) {
+        vector<std::thread> responders;
+        for (uint32_t i = 0; i < threads.size(); i++) {
+            responders.push_back(std::thread([&threads, i]() {
+                BenchThread &t = threads[i];
+                while (!t.callback->quit) {
+                    t.broker->PollRQ(t.peer);
+                    t.broker->PollSQ(t.peer);
+                }
+            }));
+        }
+        for (auto &responder : responders) {
+            responder.join();
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+    bool loopback = FLAGS_transport == "loopback";
+    RDMA_ASSERT(loopback || FLAGS_transport == "rc")
+        << "--transport must be rc or loopback";
+    RDMA_ASSERT(loopback || FLAGS_server_id == 0 || FLAGS_server_id == 1)
+        << "--server_id must be 0 or 1";
+    vector<Host> hosts = convert_hosts(FLAGS_servers);
+    RDMA_ASSERT(hosts.size() == 2) << "--servers must list two servers";
+
+    vector<uint32_t> sizes = ParseList(FLAGS_sizes);
+    vector<uint32_t> batches = ParseList(FLAGS_batches);
+    vector<uint32_t> depths = ParseList(FLAGS_depths);
+    vector<uint32_t> thread_counts = ParseList(FLAGS_threads);
+    BenchLayout layout = {};
+    layout.nthreads = MaxOf(thread_counts);
+    // A SEND must be smaller than max_msg_size and hold the header.
+    layout.max_msg_size = std::max(MaxOf(sizes), (uint32_t) 8) + 1;
+    // One more than the deepest window, so the broker never polls the SQ by
+    // itself: a full window must return to the caller.
+    layout.max_num_sends = MaxOf(depths) + 1;
+    layout.doorbell_batch_size = MaxOf(batches);
+    for (uint32_t size : sizes) {
+        RDMA_ASSERT(size > sizeof(uint32_t))
+            << "sizes must exceed the 5-byte ping header";
+    }
+
+    // Broker buffers of every thread, then a scratch slot per thread that
+    // the peer WRITEs to and READs from.
+    layout.nbuf_per_broker =
+            (uint64_t) layout.max_num_sends * layout.max_msg_size * 2;
+    layout.scratch_base = layout.nbuf_per_broker * layout.nthreads;
+    uint64_t mem_size = layout.scratch_base +
+                        (uint64_t) layout.max_msg_size * layout.nthreads;
+    uint64_t align = 2 * 1024 * 1024;
+    layout.mem_size = (mem_size + align - 1) / align * align;
+
+    vector<BenchThread> threads;
+    vector<BenchThread> echo_threads;
+    std::thread echo;
+    if (loopback) {
+        // Server 1 echoes on threads of this process.
+        threads = CreateThreads(hosts, 0, layout, true);
+        echo_threads = CreateThreads(hosts, 1, layout, true);
+        for (uint32_t i = 0; i < layout.nthreads; i++) {
+            threads[i].broker->Init(nullptr);
+            echo_threads[i].broker->Init(nullptr);
+        }
+        echo = std::thread(Respond, std::ref(echo_threads));
+    } else {
+        threads = CreateThreads(hosts, FLAGS_server_id, layout, false);
+        RdmaCtrl *ctrl = new RdmaCtrl(FLAGS_server_id, FLAGS_rdma_port);
+        vector<NovaRDMARCBroker *> brokers;
+        for (uint32_t i = 0; i < layout.nthreads; i++) {
+            brokers.push_back(threads[i].rc_broker);
+        }
+        RDMA_ASSERT(NovaRDMARCBroker::InitAll(ctrl, brokers,
+                                              FLAGS_connect_timeout_ms * 1000))
+            << "cannot connect to server " << threads[0].peer;
+        if (FLAGS_server_id == 1) {
+            Respond(threads);
+            return 0;
+        }
+    }
+
+    FILE *csv = stdout;
+    if (!FLAGS_csv.empty()) {
+        csv = fopen(FLAGS_csv.c_str(), "w");
+        RDMA_ASSERT(csv != nullptr) << "cannot open " << FLAGS_csv;
+    }
+    fmt::print(csv,
+               "test,threads,size,batch,depth,ops,ops_per_sec,gbps,mean_ns,p50_ns,p99_ns,p999_ns,max_ns\n");
+    stringstream ss(FLAGS_tests);
+    string name;
+    while (getline(ss, name, ',')) {
+        int test = find(begin(kTestNames), end(kTestNames), name) -
+                   begin(kTestNames);
+        RDMA_ASSERT(test < 6) << "unknown test " << name;
+        BenchConfig config = {};
+        config.test = (BenchTest) test;
+        for (uint32_t nthreads : thread_counts) {
+            config.nthreads = nthreads;
+            for (uint32_t size : sizes) {
+                config.size = size;
+                if (test <= READ_LAT) {
+                    config.batch = 1;
+                    config.depth = 1;
+                    RunConfig(threads, config, csv);
+                    continue;
+                }
+                for (uint32_t depth : depths) {
+                    for (uint32_t batch : batches) {
+                        // A doorbell cannot batch more than is in flight.
+                        if (batch > depth) {
+                            continue;
+                        }
+                        config.batch = batch;
+                        config.depth = depth;
+                        RunConfig(threads, config, csv);
+                    }
+                }
+            }
+        }
+    }
+
+    for (uint32_t i = 0; i < layout.nthreads; i++) {
+        BenchThread &t = threads[i];
+        uint64_t nposted = t.callback->ncompleted + 1;
+        char *sendbuf = t.broker->GetSendBuf(t.peer);
+        sendbuf[0] = BENCH_QUIT;
+        t.broker->PostSend(sendbuf, 1, t.peer, 0);
+        WaitCompletions(&t, nposted);
+    }
+    if (loopback) {
+        echo.join();
+    }
+    if (csv != stdout) {
+        fclose(csv);
+    }
+    return 0;
+}
@@ -8,6 +8,7 @@
 #define RLIB_NOVA_RDMA_BROKER_H
 
 #include "rdma_ctrl.hpp"
+#include "nova_mem_manager.h"
 
 namespace nova {
     using namespace rdmaio;
@@ -29,6 +30,21 @@ namespace nova {
                   uint64_t remote_offset,
                   bool is_remote_offset, uint32_t imm_data) = 0;
 
+        // Handle-based variants. local comes from a NovaMemManager bound to
+        // the registered region and remote is a peer's NovaRemoteItem, so
+        // callers need no address arithmetic.
+        virtual uint64_t
+        PostRead(const NovaItemHandle &local, const NovaRemoteItem &remote,
+                 uint32_t size, int server_id) = 0;
+
+        virtual uint64_t
+        PostSend(const NovaItemHandle &local, uint32_t size, int server_id,
+                 uint32_t imm_data) = 0;
+
+        virtual uint64_t
+        PostWrite(const NovaItemHandle &local, const NovaRemoteItem &remote,
+                  uint32_t size, int server_id, uint32_t imm_data) = 0;
+
         virtual void FlushPendingSends() = 0;
 
         virtual void FlushPendingSends(int peer_sid) = 0;
@@ -67,6 +83,17 @@ namespace nova {
                            uint64_t remote_offset, bool is_remote_offset,
                            uint32_t imm_data) { return 0; }
 
+        uint64_t PostRead(const NovaItemHandle &local,
+                          const NovaRemoteItem &remote, uint32_t size,
+                          int server_id) { return 0; }
+
+        uint64_t PostSend(const NovaItemHandle &local, uint32_t size,
+                          int server_id, uint32_t imm_data) { return 0; }
+
+        uint64_t PostWrite(const NovaItemHandle &local,
+                           const NovaRemoteItem &remote, uint32_t size,
+                           int server_id, uint32_t imm_data) { return 0; }
+
         void FlushPendingSends(int peer_sid) {}
 
         void FlushPendingSends() {}
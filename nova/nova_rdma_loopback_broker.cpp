@@ -0,0 +1,430 @@
+//
+// Copyright (c) 2020 University of Southern California. All rights reserved.
+//
+
+#include <mutex>
+
+#include "nova_rdma_loopback_broker.h"
+
+namespace nova {
+
+    namespace {
+        // Attached brokers by (server id, thread id).
+        std::mutex fabric_mutex;
+        std::map<std::pair<uint32_t, uint32_t>, NovaRDMALoopbackBroker *> fabric;
+
+        ibv_wc_opcode ToWCOpcode(ibv_wr_opcode opcode) {
+            switch (opcode) {
+                case IBV_WR_RDMA_READ:
+                    return IBV_WC_RDMA_READ;
+                case IBV_WR_RDMA_WRITE:
+                case IBV_WR_RDMA_WRITE_WITH_IMM:
+                    return IBV_WC_RDMA_WRITE;
+                default:
+                    return IBV_WC_SEND;
+            }
+        }
+    }
+
+    NovaRDMALoopbackBroker::NovaRDMALoopbackBroker(char *buf, int thread_id,
+                                                   const std::vector<QPEndPoint> &end_points,
+                                                   uint32_t max_num_sends,
+                                                   uint32_t max_msg_size,
+                                                   uint32_t doorbell_batch_size,
+                                                   uint32_t my_server_id,
+                                                   char *mr_buf,
+                                                   uint64_t mr_size,
+                                                   NovaMsgCallback *callback)
+            : my_server_id_(my_server_id),
+              mr_buf_(mr_buf),
+              mr_size_(mr_size),
+              max_num_sends_(max_num_sends),
+              max_msg_size_(max_msg_size),
+              doorbell_batch_size_(doorbell_batch_size),
+              thread_id_(thread_id),
+              rdma_buf_(buf),
+              callback_(callback),
+              end_points_(end_points) {
+        RDMA_LOG(INFO)
+            << fmt::format("lo[{}]: create loopback {} {} {} {} {}.",
+                           thread_id_, max_num_sends_, max_msg_size_,
+                           doorbell_batch_size_, my_server_id_, mr_size_);
+        int num_servers = end_points.size();
+        peers_ = (NovaRDMALoopbackBroker **) malloc(
+                num_servers * sizeof(NovaRDMALoopbackBroker *));
+        rdma_send_buf_ = (char **) malloc(num_servers * sizeof(char *));
+        rdma_recv_buf_ = (char **) malloc(num_servers * sizeof(char *));
+        posted_wrs_ = (LoopbackWR **) malloc(num_servers * sizeof(LoopbackWR *));
+        npending_doorbell_ = (uint32_t *) malloc(num_servers * sizeof(uint32_t));
+        npending_send_ = (uint32_t *) malloc(num_servers * sizeof(uint32_t));
+        psend_index_ = (uint32_t *) malloc(num_servers * sizeof(uint32_t));
+        send_cqes_ = new std::deque<LoopbackCQE>[num_servers];
+        rqs_ = new LoopbackRQ[num_servers];
+
+        // The same layout as NovaRDMARCBroker.
+        uint64_t nsendbuf = max_num_sends * max_msg_size;
+        uint64_t nrecvbuf = max_num_sends * max_msg_size;
+        uint64_t nbuf = nsendbuf + nrecvbuf;
+        for (int i = 0; i < num_servers; i++) {
+            peers_[i] = nullptr;
+            rdma_recv_buf_[i] = buf + nbuf * i;
+            rdma_send_buf_[i] = rdma_recv_buf_[i] + nrecvbuf;
+            // Do not rely on the caller's memory being zero.
+            memset(rdma_recv_buf_[i], 0, nbuf);
+            posted_wrs_[i] = (LoopbackWR *) malloc(
+                    max_num_sends * sizeof(LoopbackWR));
+            npending_doorbell_[i] = 0;
+            npending_send_[i] = 0;
+            psend_index_[i] = 0;
+            server_qp_idx_map[end_points[i].server_id] = i;
+        }
+    }
+
+    void NovaRDMALoopbackBroker::Init(RdmaCtrl *rdma_ctrl) {
+        for (uint32_t i = 0; i < end_points_.size(); i++) {
+            for (uint32_t j = 0; j < max_num_sends_; j++) {
+                PostRecv(end_points_[i].server_id, j);
+            }
+        }
+        std::lock_guard<std::mutex> lock(fabric_mutex);
+        auto key = std::make_pair(my_server_id_, (uint32_t) thread_id_);
+        RDMA_ASSERT(fabric.find(key) == fabric.end())
+            << fmt::format("lo[{}]: server {} thread {} is already attached",
+                           thread_id_, my_server_id_, thread_id_);
+        fabric[key] = this;
+        RDMA_LOG(INFO) << fmt::format("lo[{}]: attached server {}",
+                                      thread_id_, my_server_id_);
+    }
+
+    uint32_t NovaRDMALoopbackBroker::to_qp_idx(uint32_t server_id) {
+        // Also called by the threads of peers; the map is never modified
+        // after construction.
+        auto it = server_qp_idx_map.find(server_id);
+        RDMA_ASSERT(it != server_qp_idx_map.end())
+            << fmt::format("lo[{}]: unknown server {}", thread_id_,
+                           server_id);
+        return it->second;
+    }
+
+    NovaRDMALoopbackBroker *NovaRDMALoopbackBroker::Peer(int qp_idx) {
+        if (peers_[qp_idx] == nullptr) {
+            std::lock_guard<std::mutex> lock(fabric_mutex);
+            auto it = fabric.find(
+                    std::make_pair(end_points_[qp_idx].server_id,
+                                   end_points_[qp_idx].thread_id));
+            if (it != fabric.end()) {
+                peers_[qp_idx] = it->second;
+            }
+        }
+        return peers_[qp_idx];
+    }
+
+    bool NovaRDMALoopbackBroker::IsConnected(int server_id) {
+        return Peer(to_qp_idx(server_id)) != nullptr;
+    }
+
+    uint64_t
+    NovaRDMALoopbackBroker::PostRDMASEND(const char *localbuf,
+                                         ibv_wr_opcode opcode, uint32_t size,
+                                         int server_id,
+                                         uint64_t local_offset,
+                                         uint64_t remote_addr, bool is_offset,
+                                         uint32_t imm_data) {
+        uint32_t qp_idx = to_qp_idx(server_id);
+        RDMA_ASSERT(Peer(qp_idx) != nullptr)
+            << fmt::format("lo[{}]: server {} is not attached", thread_id_,
+                           server_id);
+        uint64_t wr_id = psend_index_[qp_idx];
+        const char *sendbuf = rdma_send_buf_[qp_idx] + wr_id * max_msg_size_;
+        if (localbuf != nullptr) {
+            sendbuf = localbuf;
+        }
+        LoopbackWR &wr = posted_wrs_[qp_idx][wr_id];
+        wr.opcode = opcode;
+        wr.addr = (char *) sendbuf + local_offset;
+        wr.size = size;
+        wr.remote_addr = remote_addr;
+        wr.is_offset = is_offset;
+        wr.imm_data = imm_data;
+        psend_index_[qp_idx]++;
+        npending_send_[qp_idx]++;
+        npending_doorbell_[qp_idx]++;
+        NOVA_LOG(DEBUG,
+                 "lo[{}]: SQ: {} request to server {} wr:{} imm:{} roffset:{} isoff:{} size:{}",
+                 thread_id_, ibv_wr_opcode_str(opcode), server_id, wr_id,
+                 imm_data, remote_addr, is_offset, size);
+        if (npending_doorbell_[qp_idx] == doorbell_batch_size_) {
+            FlushPendingSends(server_id);
+        }
+        while (npending_send_[qp_idx] == max_num_sends_) {
+            // The queue is full. Ring the partial batch so it can drain.
+            FlushPendingSends(server_id);
+            PollSQ(server_id);
+        }
+        if (psend_index_[qp_idx] == max_num_sends_) {
+            psend_index_[qp_idx] = 0;
+        }
+        return wr_id;
+    }
+
+    ibv_wc_status
+    NovaRDMALoopbackBroker::Execute(int qp_idx, const LoopbackWR &wr) {
+        NovaRDMALoopbackBroker *peer = peers_[qp_idx];
+        if (wr.opcode == IBV_WR_SEND || wr.opcode == IBV_WR_SEND_WITH_IMM) {
+            peer->Deliver(my_server_id_, IBV_WC_RECV, wr.addr, wr.size,
+                          wr.imm_data);
+            return IBV_WC_SUCCESS;
+        }
+        uint64_t offset = wr.remote_addr;
+        if (!wr.is_offset) {
+            if (wr.remote_addr < (uintptr_t) peer->mr_buf_) {
+                return IBV_WC_REM_ACCESS_ERR;
+            }
+            offset = wr.remote_addr - (uintptr_t) peer->mr_buf_;
+        }
+        if (offset > peer->mr_size_ || wr.size > peer->mr_size_ - offset) {
+            return IBV_WC_REM_ACCESS_ERR;
+        }
+        char *remote = peer->mr_buf_ + offset;
+        if (wr.opcode == IBV_WR_RDMA_READ) {
+            memcpy(wr.addr, remote, wr.size);
+            return IBV_WC_SUCCESS;
+        }
+        memcpy(remote, wr.addr, wr.size);
+        if (wr.opcode == IBV_WR_RDMA_WRITE_WITH_IMM) {
+            // Consumes a receive buffer but writes nothing into it.
+            peer->Deliver(my_server_id_, IBV_WC_RECV_RDMA_WITH_IMM, nullptr,
+                          0, wr.imm_data);
+        }
+        return IBV_WC_SUCCESS;
+    }
+
+    void NovaRDMALoopbackBroker::Deliver(uint32_t from_server_id,
+                                         ibv_wc_opcode opcode,
+                                         const char *data, uint32_t size,
+                                         uint32_t imm_data) {
+        uint32_t qp_idx = to_qp_idx(from_server_id);
+        LoopbackRQ &rq = rqs_[qp_idx];
+        rq.lock.lock();
+        if (rq.backlog.empty() && !rq.recvs.empty()) {
+            int recv_buf_index = rq.recvs.front();
+            rq.recvs.pop_front();
+            Receive(qp_idx, recv_buf_index, opcode, data, size, imm_data);
+        } else {
+            // Receiver not ready. Keep the order of the messages.
+            LoopbackMsg msg;
+            msg.opcode = opcode;
+            msg.imm_data = imm_data;
+            msg.data.assign(data, size);
+            rq.backlog.push_back(std::move(msg));
+        }
+        rq.lock.unlock();
+    }
+
+    void NovaRDMALoopbackBroker::Receive(int qp_idx, int recv_buf_index,
+                                         ibv_wc_opcode opcode,
+                                         const char *data, uint32_t size,
+                                         uint32_t imm_data) {
+        if (size > 0) {
+            memcpy(rdma_recv_buf_[qp_idx] + max_msg_size_ * recv_buf_index,
+                   data, size);
+        }
+        rqs_[qp_idx].cqes.push_back(
+                LoopbackCQE{(uint64_t) recv_buf_index, opcode,
+                            IBV_WC_SUCCESS, imm_data});
+    }
+
+    uint64_t
+    NovaRDMALoopbackBroker::PostRead(char *localbuf, uint32_t size,
+                                     int server_id, uint64_t local_offset,
+                                     uint64_t remote_addr, bool is_offset) {
+        return PostRDMASEND(localbuf, IBV_WR_RDMA_READ, size, server_id,
+                            local_offset, remote_addr, is_offset, 0);
+    }
+
+    uint64_t
+    NovaRDMALoopbackBroker::PostSend(const char *localbuf, uint32_t size,
+                                     int server_id, uint32_t imm_data) {
+        ibv_wr_opcode wr = IBV_WR_SEND;
+        if (imm_data != 0) {
+            wr = IBV_WR_SEND_WITH_IMM;
+        }
+        RDMA_ASSERT(size < max_msg_size_);
+        return PostRDMASEND(localbuf, wr, size, server_id, 0, 0, false,
+                            imm_data);
+    }
+
+    uint64_t
+    NovaRDMALoopbackBroker::PostWrite(const char *localbuf, uint32_t size,
+                                      int server_id, uint64_t remote_offset,
+                                      bool is_remote_offset,
+                                      uint32_t imm_data) {
+        ibv_wr_opcode wr = IBV_WR_RDMA_WRITE;
+        if (imm_data != 0) {
+            wr = IBV_WR_RDMA_WRITE_WITH_IMM;
+        }
+        return PostRDMASEND(localbuf, wr, size, server_id, 0, remote_offset,
+                            is_remote_offset, imm_data);
+    }
+
+    uint64_t
+    NovaRDMALoopbackBroker::PostRead(const NovaItemHandle &local,
+                                     const NovaRemoteItem &remote,
+                                     uint32_t size, int server_id) {
+        RDMA_ASSERT(size <= local.size && size <= remote.size)
+            << fmt::format("read size:{} local:{} remote:{}", size,
+                           local.size, remote.size);
+        return PostRDMASEND(local.addr, IBV_WR_RDMA_READ, size, server_id, 0,
+                            remote.offset, true, 0);
+    }
+
+    uint64_t
+    NovaRDMALoopbackBroker::PostSend(const NovaItemHandle &local,
+                                     uint32_t size, int server_id,
+                                     uint32_t imm_data) {
+        RDMA_ASSERT(size <= local.size);
+        return PostSend(local.addr, size, server_id, imm_data);
+    }
+
+    uint64_t
+    NovaRDMALoopbackBroker::PostWrite(const NovaItemHandle &local,
+                                      const NovaRemoteItem &remote,
+                                      uint32_t size, int server_id,
+                                      uint32_t imm_data) {
+        RDMA_ASSERT(size <= local.size && size <= remote.size)
+            << fmt::format("write size:{} local:{} remote:{}", size,
+                           local.size, remote.size);
+        return PostWrite(local.addr, size, server_id, remote.offset, true,
+                         imm_data);
+    }
+
+    void NovaRDMALoopbackBroker::FlushPendingSends(int server_id) {
+        if ((uint32_t) server_id == my_server_id_) {
+            return;
+        }
+        uint32_t qp_idx = to_qp_idx(server_id);
+        int n = npending_doorbell_[qp_idx];
+        if (n == 0) {
+            return;
+        }
+        NOVA_LOG(DEBUG, "lo[{}]: flush pending sends {}", thread_id_, n);
+        npending_doorbell_[qp_idx] = 0;
+        int first = (psend_index_[qp_idx] + max_num_sends_ - n) %
+                    max_num_sends_;
+        for (int i = 0; i < n; i++) {
+            uint64_t wr_id = (first + i) % max_num_sends_;
+            const LoopbackWR &wr = posted_wrs_[qp_idx][wr_id];
+            ibv_wc_status status = Execute(qp_idx, wr);
+            send_cqes_[qp_idx].push_back(
+                    LoopbackCQE{wr_id, ToWCOpcode(wr.opcode), status,
+                                wr.imm_data});
+        }
+    }
+
+    void NovaRDMALoopbackBroker::FlushPendingSends() {
+        for (const QPEndPoint &peer : end_points_) {
+            FlushPendingSends(peer.server_id);
+        }
+    }
+
+    uint32_t NovaRDMALoopbackBroker::PollSQ(int server_id) {
+        if ((uint32_t) server_id == my_server_id_) {
+            return 0;
+        }
+        uint32_t qp_idx = to_qp_idx(server_id);
+        std::deque<LoopbackCQE> &cqes = send_cqes_[qp_idx];
+        // Completions of requests the callbacks post wait for the next poll.
+        uint32_t n = cqes.size();
+        for (uint32_t i = 0; i < n; i++) {
+            LoopbackCQE cqe = cqes.front();
+            cqes.pop_front();
+            char *buf = rdma_send_buf_[qp_idx] + cqe.wr_id * max_msg_size_;
+            if (cqe.status != IBV_WC_SUCCESS) {
+                callback_->ProcessRDMAError(
+                        posted_wrs_[qp_idx][cqe.wr_id].opcode, cqe.wr_id,
+                        server_id, buf, cqe.status);
+            } else {
+                NOVA_LOG(DEBUG,
+                         "lo[{}]: SQ: poll complete from server {} wr:{} op:{}",
+                         thread_id_, server_id, cqe.wr_id,
+                         ibv_wc_opcode_str(cqe.opcode));
+                callback_->ProcessRDMAWC(cqe.opcode, cqe.wr_id, server_id,
+                                         buf, cqe.imm_data);
+            }
+            buf[0] = '~';
+            npending_send_[qp_idx] -= 1;
+        }
+        return n;
+    }
+
+    uint32_t NovaRDMALoopbackBroker::PollSQ() {
+        uint32_t size = 0;
+        for (const QPEndPoint &peer : end_points_) {
+            size += PollSQ(peer.server_id);
+        }
+        return size;
+    }
+
+    void NovaRDMALoopbackBroker::PostRecv(int server_id, int recv_buf_index) {
+        uint32_t qp_idx = to_qp_idx(server_id);
+        rdma_recv_buf_[qp_idx][max_msg_size_ * recv_buf_index] = '~';
+        LoopbackRQ &rq = rqs_[qp_idx];
+        rq.lock.lock();
+        if (!rq.backlog.empty()) {
+            const LoopbackMsg &msg = rq.backlog.front();
+            Receive(qp_idx, recv_buf_index, msg.opcode, msg.data.data(),
+                    msg.data.size(), msg.imm_data);
+            rq.backlog.pop_front();
+        } else {
+            rq.recvs.push_back(recv_buf_index);
+        }
+        rq.lock.unlock();
+    }
+
+    void NovaRDMALoopbackBroker::FlushPendingRecvs() {}
+
+    uint32_t NovaRDMALoopbackBroker::PollRQ(int server_id) {
+        uint32_t qp_idx = to_qp_idx(server_id);
+        LoopbackRQ &rq = rqs_[qp_idx];
+        uint32_t n = 0;
+        while (n < max_num_sends_) {
+            rq.lock.lock();
+            if (rq.cqes.empty()) {
+                rq.lock.unlock();
+                break;
+            }
+            LoopbackCQE cqe = rq.cqes.front();
+            rq.cqes.pop_front();
+            rq.lock.unlock();
+            NOVA_LOG(DEBUG, "lo[{}]: RQ: received from server {} wr:{} imm:{}",
+                     thread_id_, server_id, cqe.wr_id, cqe.imm_data);
+            char *buf = rdma_recv_buf_[qp_idx] + max_msg_size_ * cqe.wr_id;
+            NovaTraceIdScope trace_scope(0);
+            callback_->ProcessRDMAWC(cqe.opcode, cqe.wr_id, server_id, buf,
+                                     cqe.imm_data);
+            // Post another receive event.
+            PostRecv(server_id, cqe.wr_id);
+            n++;
+        }
+        // Flush all pending send requests.
+        FlushPendingSends(server_id);
+        return n;
+    }
+
+    uint32_t NovaRDMALoopbackBroker::PollRQ() {
+        uint32_t size = 0;
+        for (const QPEndPoint &peer : end_points_) {
+            size += PollRQ(peer.server_id);
+        }
+        return size;
+    }
+
+    char *NovaRDMALoopbackBroker::GetSendBuf() {
+        return NULL;
+    }
+
+    char *NovaRDMALoopbackBroker::GetSendBuf(int server_id) {
+        uint32_t qp_idx = to_qp_idx(server_id);
+        return rdma_send_buf_[qp_idx] + psend_index_[qp_idx] * max_msg_size_;
+    }
+}
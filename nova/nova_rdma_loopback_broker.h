@@ -0,0 +1,198 @@
+//
+// Copyright (c) 2020 University of Southern California. All rights reserved.
+//
+
+#ifndef RLIB_NOVA_RDMA_LOOPBACK_BROKER_H
+#define RLIB_NOVA_RDMA_LOOPBACK_BROKER_H
+
+#include <fmt/core.h>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "rdma_ctrl.hpp"
+#include "nova_rdma_broker.h"
+#include "nova_msg_callback.h"
+#include "nova_common.h"
+#include "nova_tracer.h"
+
+namespace nova {
+
+    using namespace rdmaio;
+
+    // Thread local. A software RC transport between brokers of the same
+    // process, so that nodes, services and benchmarks run without an RNIC
+    // and the CPU side of a request (posting, polling, callbacks, allocator)
+    // can be profiled anywhere. Thread i of a server talks to thread i of its
+    // peers, like NovaRDMARCBroker, and the buffer layout, wr_ids and
+    // completions are the same, so a callback written for one runs on the
+    // other.
+    //
+    // The "RNIC" runs on the posting thread when the doorbell rings: a
+    // SEND or WRITE_WITH_IMM is copied into the next receive buffer the peer
+    // posted, a WRITE or READ copies to or from the peer's MR. A message
+    // that finds no receive buffer waits at the peer until one is posted, as
+    // RC retries on RNR. Requests complete in order at the next PollSQ. An
+    // access outside the peer's MR fails with IBV_WC_REM_ACCESS_ERR. Keys
+    // are not checked.
+    class NovaRDMALoopbackBroker : public NovaRDMABroker {
+    public:
+        // Same arguments as NovaRDMARCBroker without the port. mr_buf and
+        // mr_size are the region peers READ and WRITE.
+        NovaRDMALoopbackBroker(char *buf, int thread_id,
+                               const std::vector<QPEndPoint> &end_points,
+                               uint32_t max_num_sends,
+                               uint32_t max_msg_size,
+                               uint32_t doorbell_batch_size,
+                               uint32_t my_server_id,
+                               char *mr_buf,
+                               uint64_t mr_size,
+                               NovaMsgCallback *callback);
+
+        // Attaches the broker to the process-wide fabric and posts its
+        // receive buffers. rdma_ctrl is not used and may be nullptr. Peers
+        // may attach later; check IsConnected before posting to them.
+        void Init(RdmaCtrl *rdma_ctrl);
+
+        // The peer's broker has attached.
+        bool IsConnected(int remote_server_id);
+
+        uint64_t PostRead(char *localbuf, uint32_t size, int remote_server_id,
+                          uint64_t local_offset,
+                          uint64_t remote_addr, bool is_remote_offset);
+
+        uint64_t
+        PostSend(const char *localbuf, uint32_t size, int remote_server_id,
+                 uint32_t imm_data);
+
+        uint64_t
+        PostWrite(const char *localbuf, uint32_t size, int remote_server_id,
+                  uint64_t remote_offset, bool is_remote_offset,
+                  uint32_t imm_data);
+
+        uint64_t PostRead(const NovaItemHandle &local,
+                          const NovaRemoteItem &remote, uint32_t size,
+                          int remote_server_id);
+
+        uint64_t PostSend(const NovaItemHandle &local, uint32_t size,
+                          int remote_server_id, uint32_t imm_data);
+
+        uint64_t PostWrite(const NovaItemHandle &local,
+                           const NovaRemoteItem &remote, uint32_t size,
+                           int remote_server_id, uint32_t imm_data);
+
+        void FlushPendingSends();
+
+        void FlushPendingSends(int remote_server_id);
+
+        uint32_t PollSQ(int remote_server_id);
+
+        uint32_t PollSQ();
+
+        void PostRecv(int remote_server_id, int recv_buf_index);
+
+        void FlushPendingRecvs();
+
+        uint32_t PollRQ();
+
+        uint32_t PollRQ(int remote_server_id);
+
+        char *GetSendBuf();
+
+        char *GetSendBuf(int remote_server_id);
+
+        uint32_t thread_id() { return thread_id_; }
+
+    private:
+        // A posted request, executed when its doorbell rings.
+        struct LoopbackWR {
+            ibv_wr_opcode opcode;
+            char *addr;
+            uint32_t size;
+            // Absolute if is_offset is false.
+            uint64_t remote_addr;
+            bool is_offset;
+            uint32_t imm_data;
+        };
+
+        // A completion of a send or receive queue.
+        struct LoopbackCQE {
+            uint64_t wr_id;
+            ibv_wc_opcode opcode;
+            ibv_wc_status status;
+            uint32_t imm_data;
+        };
+
+        // A SEND or WRITE_WITH_IMM waiting for a receive buffer.
+        struct LoopbackMsg {
+            ibv_wc_opcode opcode;
+            uint32_t imm_data;
+            std::string data;
+        };
+
+        // The receive side of the QP from a peer. Written by the peer's
+        // thread when it rings a doorbell, so it has a lock.
+        struct LoopbackRQ {
+            NovaSpinLock lock;
+            // Indexes of the posted receive buffers, in posting order.
+            std::deque<int> recvs;
+            std::deque<LoopbackCQE> cqes;
+            std::deque<LoopbackMsg> backlog;
+        };
+
+        uint32_t to_qp_idx(uint32_t remote_server_id);
+
+        uint64_t
+        PostRDMASEND(const char *localbuf, ibv_wr_opcode opcode,
+                     uint32_t size, int remote_server_id,
+                     uint64_t local_offset, uint64_t remote_addr,
+                     bool is_offset, uint32_t imm_data);
+
+        // The broker of the peer in slot qp_idx, nullptr if it has not
+        // attached yet.
+        NovaRDMALoopbackBroker *Peer(int qp_idx);
+
+        // Executes a request to the peer in slot qp_idx.
+        ibv_wc_status Execute(int qp_idx, const LoopbackWR &wr);
+
+        // Delivers a message into the receive queue of this broker from
+        // from_server_id. Called by the sender's thread.
+        void Deliver(uint32_t from_server_id, ibv_wc_opcode opcode,
+                     const char *data, uint32_t size, uint32_t imm_data);
+
+        // Copies a message into receive buffer recv_buf_index of slot
+        // qp_idx. Requires the lock of the slot's queue.
+        void Receive(int qp_idx, int recv_buf_index, ibv_wc_opcode opcode,
+                     const char *data, uint32_t size, uint32_t imm_data);
+
+        const uint32_t my_server_id_;
+        char *mr_buf_;
+        const uint64_t mr_size_;
+        const uint32_t max_num_sends_;
+        const uint32_t max_msg_size_;
+        const uint32_t doorbell_batch_size_;
+        const int thread_id_;
+        const char *rdma_buf_;
+        NovaMsgCallback *callback_;
+
+        std::map<uint32_t, int> server_qp_idx_map;
+        std::vector<QPEndPoint> end_points_;
+
+        // Per peer slot.
+        NovaRDMALoopbackBroker **peers_;
+        char **rdma_send_buf_;
+        char **rdma_recv_buf_;
+        LoopbackWR **posted_wrs_;
+        // Requests posted but not rung yet, starting at wr_id
+        // psend_index_ - npending_doorbell_.
+        uint32_t *npending_doorbell_;
+        uint32_t *npending_send_;
+        uint32_t *psend_index_;
+        // Completions of the send queue, in posting order.
+        std::deque<LoopbackCQE> *send_cqes_;
+        LoopbackRQ *rqs_;
+    };
+}
+
+#endif //RLIB_NOVA_RDMA_LOOPBACK_BROKER_H
@@ -5,6 +5,8 @@
 //
 
 #include <malloc.h>
+#include <algorithm>
+#include <thread>
 #include <fmt/core.h>
 #include "nova_rdma_rc_broker.h"
 
@@ -14,7 +16,11 @@ namespace nova {
     RNicHandler *device = nullptr;
 
     uint32_t NovaRDMARCBroker::to_qp_idx(uint32_t server_id) {
-        return server_qp_idx_map[server_id];
+        auto it = server_qp_idx_map.find(server_id);
+        RDMA_ASSERT(it != server_qp_idx_map.end())
+            << fmt::format("rdma-rc[{}]: unknown server {}", thread_id_,
+                           server_id);
+        return it->second;
     }
 
     // ML: char *buf is circular_buffer_ from main.cpp
@@ -25,7 +31,8 @@ namespace nova {
                                      uint32_t doorbell_batch_size,
                                      uint32_t my_server_id, char *mr_buf,
                                      uint64_t mr_size, uint64_t rdma_port,
-                                     nova::NovaMsgCallback *callback) :
+                                     nova::NovaMsgCallback *callback,
+                                     uint32_t max_num_peers) :
             rdma_buf_(buf),
             thread_id_(thread_id),
             end_points_(end_points),
@@ -47,10 +54,20 @@ namespace nova {
                            mr_size_,
                            rdma_port_);
         int max_num_wrs = max_num_sends;
-        int num_servers = end_points_.size();
+        int num_servers = std::max((uint32_t) end_points.size(),
+                                   max_num_peers);
+        end_points_.resize(num_servers);
+        connectors_.resize(num_servers);
 
         wcs_ = (ibv_wc *) malloc(max_num_wrs * sizeof(ibv_wc));
         qp_ = (RCQP **) malloc(num_servers * sizeof(RCQP *));
+        peer_state_ = new std::atomic<int>[num_servers];
+        connector_done_ = new std::atomic<bool>[num_servers];
+        handshake_done_ = new std::atomic<bool>[num_servers];
+        posted_wrs_ = (PostedWR **) malloc(num_servers * sizeof(PostedWR *));
+        last_used_us_ = (uint64_t *) malloc(num_servers * sizeof(uint64_t));
+        recovery_.resize(num_servers);
+        reclaiming_.resize(num_servers, false);
         rdma_send_buf_ = (char **) malloc(num_servers * sizeof(char *)); // ML: Think of it as "aray of char*", therefore "one-char*-per-server"
         rdma_recv_buf_ = (char **) malloc(num_servers * sizeof(char *));
         send_sges_ = (struct ibv_sge **) malloc(
@@ -73,13 +90,22 @@ namespace nova {
 
             send_sge_index_[i] = 0;
             qp_[i] = NULL;
+            peer_state_[i] = PEER_FREE;
+            connector_done_[i] = false;
+            handshake_done_[i] = false;
+            last_used_us_[i] = 0;
 
+            // Do not rely on the caller's memory being zero. The slices are
+            // only the broker's buffers, a small part of the pool, so this
+            // does not undo the parallel prefault of the pool.
             rdma_recv_buf_[i] = rdma_buf_start + nbuf * i;
             memset(rdma_recv_buf_[i], 0, nrecvbuf);
 
             rdma_send_buf_[i] = rdma_recv_buf_[i] + nrecvbuf; // ML: point to right after the corresponding recv_buf (which starts at recv_buf_[i] and has length nrecvbuf)
             memset(rdma_send_buf_[i], 0, nsendbuf);
 
+            posted_wrs_[i] = (PostedWR *) malloc(
+                    max_num_sends * sizeof(PostedWR));
             send_sges_[i] = (ibv_sge *) malloc(
                     doorbell_batch_size * sizeof(struct ibv_sge));
             send_wrs_[i] = (ibv_send_wr *) malloc(
@@ -88,28 +114,119 @@ namespace nova {
                 memset(&send_sges_[i][j], 0, sizeof(struct ibv_sge));
                 memset(&send_wrs_[i][j], 0, sizeof(struct ibv_send_wr));
             }
+        }
+        for (int i = 0; i < end_points.size(); i++) {
             server_qp_idx_map[end_points[i].server_id] = i;
+            peer_state_[i] = PEER_CONNECTING;
         }
         RDMA_LOG(INFO) << "rc[" << thread_id << "]: " << "created rdma";
     }
 
+    namespace {
+        // Sleeps for backoff and doubles it. Returns false if the deadline
+        // has passed.
+        bool Backoff(uint64_t deadline_us, uint64_t *backoff) {
+            uint64_t now = NowMicros();
+            if (deadline_us != 0 && now >= deadline_us) {
+                return false;
+            }
+            uint64_t sleep_us = *backoff;
+            if (deadline_us != 0) {
+                sleep_us = std::min(sleep_us, deadline_us - now);
+            }
+            usleep(sleep_us);
+            *backoff = std::min(*backoff * 2, (uint64_t) CONN_BACKOFF_MAX);
+            return true;
+        }
+    }
+
     void NovaRDMARCBroker::Init(RdmaCtrl *rdma_ctrl) {
+        Init(rdma_ctrl, 0);
+    }
+
+    bool NovaRDMARCBroker::Init(RdmaCtrl *rdma_ctrl, uint64_t timeout_us) {
         RDMA_LOG(INFO) << "RDMA client thread " << thread_id_
                        << " initializing";
+        rdma_ctrl_ = rdma_ctrl;
+        OpenDevice();
+        if (lazy_) {
+            for (int peer_id = 0; peer_id < end_points_.size(); peer_id++) {
+                if (peer_state_[peer_id] == PEER_CONNECTING) {
+                    peer_state_[peer_id] = PEER_IDLE;
+                }
+            }
+            rdma_ctrl_->register_qp_factory(
+                    thread_id_,
+                    [this](const QPConnArg &arg, const QPAttr &attr,
+                           const MemoryAttr &mr, qp_accept_t accept) {
+                        AcceptPeer(arg, attr, mr, accept);
+                    });
+            RDMA_LOG(INFO) << fmt::format(
+                        "RDMA client thread {} initialized, connecting lazily",
+                        thread_id_);
+            return true;
+        }
+        bool all_connected = ConnectPeers(timeout_us);
+        RDMA_LOG(INFO)
+            << fmt::format("RDMA client thread {} initialized", thread_id_);
+        return all_connected;
+    }
+
+    bool NovaRDMARCBroker::InitAll(RdmaCtrl *rdma_ctrl,
+                                   const std::vector<NovaRDMARCBroker *> &brokers,
+                                   uint64_t timeout_us) {
+        uint64_t start = NowMicros();
+        uint64_t deadline_us = timeout_us == 0 ? 0 : start + timeout_us;
+        // peer server id -> QPs of all brokers to it.
+        std::map<uint32_t, std::vector<std::pair<NovaRDMARCBroker *, int>>> peers;
+        for (NovaRDMARCBroker *broker : brokers) {
+            broker->rdma_ctrl_ = rdma_ctrl;
+            broker->OpenDevice();
+            for (int peer_id = 0;
+                 peer_id < broker->end_points_.size(); peer_id++) {
+                if (broker->peer_state_[peer_id] != PEER_CONNECTING) {
+                    continue;
+                }
+                broker->CreateQP(peer_id);
+                peers[broker->end_points_[peer_id].server_id].push_back(
+                        std::make_pair(broker, peer_id));
+            }
+        }
+        std::vector<std::thread> threads;
+        for (auto &peer : peers) {
+            threads.emplace_back(&NovaRDMARCBroker::ConnectBatch, peer.second,
+                                 deadline_us);
+        }
+        for (auto &t : threads) {
+            t.join();
+        }
+
+        uint32_t nunreachable = 0;
+        for (NovaRDMARCBroker *broker : brokers) {
+            nunreachable += broker->UnreachablePeers().size();
+        }
+        RDMA_LOG(INFO)
+            << fmt::format(
+                    "rdma-rc: connected {} brokers to {} peers in {} us, {} QPs unreachable",
+                    brokers.size(), peers.size(), NowMicros() - start,
+                    nunreachable);
+        return nunreachable == 0;
+    }
+
+    void NovaRDMARCBroker::OpenDevice() {
         RdmaCtrl::DevIdx idx{.dev_id = 0, .port_id = 1}; // using the first RNIC's first port
         const char *cache_buf = mr_buf_;
-        int num_servers = end_points_.size();
         uint64_t my_memory_id = my_server_id_;
 
         open_device_mutex.lock();
         if (!is_device_opened) {
-            device = rdma_ctrl->open_device(idx);
+            device = rdma_ctrl_->open_device(idx);
             is_device_opened = true;
             RDMA_ASSERT(
-                    rdma_ctrl->register_memory(my_memory_id,
-                                               cache_buf,
-                                               mr_size_,
-                                               device));
+                    rdma_ctrl_->register_memory(my_memory_id,
+                                                cache_buf,
+                                                mr_size_,
+                                                device));
         }
         open_device_mutex.unlock();
 
@@ -117,64 +234,537 @@ namespace nova {
                        << mr_size_
                        << " my memory id: "
                        << my_memory_id;
-        for (int peer_id = 0; peer_id < num_servers; peer_id++) {
-            QPEndPoint peer_store = end_points_[peer_id];
-            QPIdx my_rc_key = create_rc_idx(my_server_id_, thread_id_,
-                                            peer_store.server_id);
-            QPIdx peer_rc_key = create_rc_idx(peer_store.server_id,
-                                              peer_store.thread_id,
-                                              my_server_id_);
-            uint64_t peer_memory_id = static_cast<uint64_t >(peer_store.server_id);
-            RDMA_LOG(INFO) << "rdma-rc[" << thread_id_
-                           << "]: my rc key " << my_rc_key.node_id << ":"
-                           << my_rc_key.worker_id << ":" << my_rc_key.index;
-
-            RDMA_LOG(INFO) << "rdma-rc[" << thread_id_
-                           << "]: connecting to peer rc key "
-                           << peer_store.host.ip << ":" << peer_rc_key.node_id
-                           << ":" << peer_rc_key.worker_id << ":"
-                           << peer_rc_key.index;
-            MemoryAttr local_mr = rdma_ctrl->get_local_mr(
-                    my_memory_id);
-            ibv_cq *cq = rdma_ctrl->create_cq(
-                    device, max_num_sends_);
-            ibv_cq *recv_cq = rdma_ctrl->create_cq(
-                    device, max_num_sends_);
-            qp_[peer_id] = rdma_ctrl->create_rc_qp(my_rc_key,
-                                                   device,
-                                                   &local_mr,
-                                                   cq, recv_cq);
-            // get remote server's memory information
+    }
+
+    bool NovaRDMARCBroker::ConnectPeers(uint64_t timeout_us) {
+        RDMA_ASSERT(rdma_ctrl_ != nullptr) << "call Init first";
+        uint64_t start = NowMicros();
+        uint64_t deadline_us = timeout_us == 0 ? 0 : start + timeout_us;
+        // One thread per peer so that a slow peer does not hold up the
+        // others.
+        std::vector<std::thread> threads;
+        for (int peer_id = 0; peer_id < end_points_.size(); peer_id++) {
+            if (peer_state_[peer_id] != PEER_CONNECTING ||
+                connectors_[peer_id].joinable()) {
+                continue;
+            }
+            threads.emplace_back(&NovaRDMARCBroker::ConnectPeer, this,
+                                 peer_id, deadline_us);
+        }
+        for (auto &t : threads) {
+            t.join();
+        }
+
+        std::vector<uint32_t> unreachable = UnreachablePeers();
+        std::string peers;
+        for (uint32_t server_id : unreachable) {
+            peers += fmt::format("{} ", server_id);
+        }
+        RDMA_LOG_IF(WARNING, !unreachable.empty())
+            << fmt::format("rdma-rc[{}]: {} peers unreachable after {} us: {}",
+                           thread_id_, unreachable.size(),
+                           NowMicros() - start, peers);
+        RDMA_LOG(INFO)
+            << fmt::format("rdma-rc[{}]: connected {} of {} peers in {} us",
+                           thread_id_,
+                           server_qp_idx_map.size() - unreachable.size(),
+                           server_qp_idx_map.size(), NowMicros() - start);
+        return unreachable.empty();
+    }
+
+    void NovaRDMARCBroker::CreateQP(int peer_id) {
+        if (qp_[peer_id] != NULL) {
+            return;
+        }
+        QPEndPoint peer_store = end_points_[peer_id];
+        QPIdx my_rc_key = MyQPIdx(peer_store.server_id);
+        RDMA_LOG(INFO) << "rdma-rc[" << thread_id_
+                       << "]: my rc key " << my_rc_key.node_id << ":"
+                       << my_rc_key.worker_id << ":" << my_rc_key.index;
+        MemoryAttr local_mr = rdma_ctrl_->get_local_mr(my_server_id_);
+        ibv_cq *cq = rdma_ctrl_->create_cq(
+                device, max_num_sends_);
+        ibv_cq *recv_cq = rdma_ctrl_->create_cq(
+                device, max_num_sends_);
+        if (qp_type_ == IBV_QPT_UC) {
+            qp_[peer_id] = rdma_ctrl_->create_uc_qp(my_rc_key, device,
+                                                    &local_mr, cq, recv_cq);
+        } else {
+            qp_[peer_id] = rdma_ctrl_->create_rc_qp(my_rc_key,
+                                                    device,
+                                                    &local_mr,
+                                                    cq, recv_cq);
+        }
+    }
+
+    bool NovaRDMARCBroker::ConnectPeer(int peer_id, uint64_t deadline_us) {
+        CreateQP(peer_id);
+        return ConnectBatch({std::make_pair(this, peer_id)}, deadline_us);
+    }
+
+    bool NovaRDMARCBroker::ConnectBatch(
+            std::vector<std::pair<NovaRDMARCBroker *, int>> qps,
+            uint64_t deadline_us) {
+        RDMA_ASSERT(!qps.empty());
+        const QPEndPoint &peer_store = qps[0].first->end_points_[qps[0].second];
+        uint64_t rdma_port = qps[0].first->rdma_port_;
+        uint64_t backoff = CONN_BACKOFF_MIN;
+        while (true) {
+            // skip peers removed in the meantime
+            auto removed = std::remove_if(qps.begin(), qps.end(),
+                                          [](const std::pair<NovaRDMARCBroker *, int> &qp) {
+                                              return qp.first->peer_state_[qp.second] !=
+                                                     PEER_CONNECTING;
+                                          });
+            qps.erase(removed, qps.end());
+            if (qps.empty()) {
+                return false;
+            }
+            std::vector<QPConnArg> args;
+            for (auto &qp : qps) {
+                NovaRDMARCBroker *broker = qp.first;
+                const QPEndPoint &peer = broker->end_points_[qp.second];
+                QPIdx peer_rc_key = broker->PeerQPIdx(peer);
+                QPConnArg arg = {};
+                arg.from_node = peer_rc_key.node_id;
+                arg.from_worker = peer_rc_key.worker_id;
+                arg.from_index = peer_rc_key.index;
+                arg.qp_type = broker->qp_type_;
+                args.push_back(arg);
+            }
+            RDMA_LOG(INFO) << fmt::format(
+                        "rdma-rc: connecting {} QPs to server {}:{}", qps.size(),
+                        peer_store.host.ip, peer_store.server_id);
+            // get remote server's memory and QP information in one exchange
             MemoryAttr remote_mr;
-            while (QP::get_remote_mr(peer_store.host.ip,
-                                     rdma_port_,
-                                     peer_memory_id, &remote_mr) != SUCC) {
-                usleep(CONN_SLEEP);
-            }
-            qp_[peer_id]->bind_remote_mr(remote_mr);
-            RDMA_LOG(INFO) << "rdma-rc[" << thread_id_
-                           << "]: connect to server "
-                           << peer_store.host.ip << ":" << peer_store.host.port
-                           << ":" << peer_store.thread_id;
-            // bind to the previous allocated mr
-            while (qp_[peer_id]->connect(peer_store.host.ip,
-                                         rdma_port_,
-                                         peer_rc_key) != SUCC) {
-                usleep(CONN_SLEEP);
-            }
-            RDMA_LOG(INFO)
+            std::vector<QPAttr> attrs;
+            if (QPImpl::get_remote_batch(peer_store.host.ip, rdma_port,
+                                         peer_store.server_id, args,
+                                         &remote_mr, &attrs) == SUCC) {
+                std::vector<std::pair<NovaRDMARCBroker *, int>> remaining;
+                for (int i = 0; i < qps.size(); i++) {
+                    NovaRDMARCBroker *broker = qps[i].first;
+                    int peer_id = qps[i].second;
+                    // the peer has not created this QP yet
+                    if (attrs[i].qpn == 0) {
+                        remaining.push_back(qps[i]);
+                        continue;
+                    }
+                    broker->qp_[peer_id]->bind_remote_mr(remote_mr);
+                    if (broker->qp_[peer_id]->connect_with_attr(attrs[i]) !=
+                        SUCC) {
+                        remaining.push_back(qps[i]);
+                        continue;
+                    }
+                    broker->OnConnected(peer_id);
+                }
+                if (remaining.empty()) {
+                    return true;
+                }
+                if (remaining.size() < qps.size()) {
+                    backoff = CONN_BACKOFF_MIN;
+                }
+                qps.swap(remaining);
+            }
+            if (!Backoff(deadline_us, &backoff)) {
+                return false;
+            }
+        }
+    }
+
+    void NovaRDMARCBroker::OnConnected(int peer_id) {
+        QPEndPoint peer_store = end_points_[peer_id];
+        RDMA_LOG(INFO)
+            << fmt::format(
+                    "rdma-rc[{}]: connected to server {}:{}:{}. Posting {} recvs.",
+                    thread_id_, peer_store.host.ip,
+                    peer_store.host.port, peer_store.thread_id,
+                    max_num_sends_);
+
+        for (int i = 0; i < max_num_sends_; i++) {
+            PostRecvAt(peer_id, i);
+        }
+        // RemovePeer may have started draining it.
+        int state = PEER_CONNECTING;
+        peer_state_[peer_id].compare_exchange_strong(state, PEER_CONNECTED);
+    }
+
+    std::vector<uint32_t> NovaRDMARCBroker::UnreachablePeers() {
+        std::vector<uint32_t> peers;
+        for (int peer_id = 0; peer_id < end_points_.size(); peer_id++) {
+            if (peer_state_[peer_id] == PEER_CONNECTING) {
+                peers.push_back(end_points_[peer_id].server_id);
+            }
+        }
+        return peers;
+    }
+
+    bool NovaRDMARCBroker::IsConnected(int server_id) {
+        auto it = server_qp_idx_map.find(server_id);
+        return it != server_qp_idx_map.end() &&
+               peer_state_[it->second] == PEER_CONNECTED;
+    }
+
+    void NovaRDMARCBroker::AddPeer(const QPEndPoint &peer) {
+        RDMA_ASSERT(rdma_ctrl_ != nullptr) << "call Init first";
+        FinishRemovals();
+        auto removed = server_qp_idx_map.find(peer.server_id);
+        if (removed != server_qp_idx_map.end() &&
+            peer_state_[removed->second] == PEER_DRAINING) {
+            // Added back before its removal finished.
+            int removed_id = removed->second;
+            if (connectors_[removed_id].joinable()) {
+                connectors_[removed_id].join();
+            }
+            while (!DrainPeer(removed_id)) {
+            }
+            FinishRemoval(removed_id);
+        }
+        RDMA_ASSERT(server_qp_idx_map.find(peer.server_id) ==
+                    server_qp_idx_map.end())
+            << fmt::format("rdma-rc[{}]: server {} already added", thread_id_,
+                           peer.server_id);
+        int peer_id = 0;
+        while (peer_id < end_points_.size() &&
+               peer_state_[peer_id] != PEER_FREE) {
+            peer_id++;
+        }
+        RDMA_ASSERT(peer_id < end_points_.size())
+            << fmt::format("rdma-rc[{}]: no free slot for server {}",
+                           thread_id_, peer.server_id);
+        if (connectors_[peer_id].joinable()) {
+            connectors_[peer_id].join();
+        }
+        end_points_[peer_id] = peer;
+        server_qp_idx_map[peer.server_id] = peer_id;
+        RDMA_LOG(INFO) << fmt::format("rdma-rc[{}]: add server {} at slot {}",
+                                      thread_id_, peer.server_id, peer_id);
+        if (lazy_) {
+            peer_state_[peer_id] = PEER_IDLE;
+            return;
+        }
+        peer_state_[peer_id] = PEER_CONNECTING;
+        connector_done_[peer_id] = false;
+        connectors_[peer_id] = std::thread([this, peer_id]() {
+            ConnectPeer(peer_id, 0);
+            connector_done_[peer_id] = true;
+        });
+    }
+
+    void NovaRDMARCBroker::RemovePeer(int server_id) {
+        auto it = server_qp_idx_map.find(server_id);
+        if (it == server_qp_idx_map.end()) {
+            return;
+        }
+        if (peer_state_[it->second] == PEER_DRAINING) {
+            // A reclaim in progress ends with the removal instead.
+            reclaiming_[it->second] = false;
+            return;
+        }
+        BeginRemoval(it->second, true);
+    }
+
+    void NovaRDMARCBroker::BeginRemoval(int peer_id, bool notify_peer) {
+        StopPeer(peer_id, notify_peer);
+        reclaiming_[peer_id] = false;
+    }
+
+    void NovaRDMARCBroker::StopPeer(int peer_id, bool notify_peer) {
+        int state = peer_state_[peer_id];
+        if (qp_[peer_id] != NULL &&
+            (state == PEER_CONNECTED || state == PEER_ERROR)) {
+            if (notify_peer) {
+                // Otherwise the peer keeps posting to a QP that is gone and
+                // retries its recovery forever.
+                NotifyDisconnect(peer_id);
+            } else {
+                // The peer's QP is gone. Flush the requests to it instead of
+                // waiting for them to time out.
+                struct ibv_qp_attr qp_attr = {};
+                qp_attr.qp_state = IBV_QPS_ERR;
+                RDMA_VERIFY(WARNING,
+                            ibv_modify_qp(qp_[peer_id]->qp_, &qp_attr,
+                                          IBV_QP_STATE) == 0)
+                    << "change qp status to error failed: "
+                    << strerror(errno);
+            }
+        }
+        // The connector gives up on its next attempt.
+        peer_state_[peer_id] = PEER_DRAINING;
+        // Requests waiting for a reconnect fail.
+        FailRetries(peer_id);
+        removing_.push_back(peer_id);
+    }
+
+    void NovaRDMARCBroker::NotifyDisconnect(int peer_id) {
+        // A connector that connected the peer has exited or is about to.
+        if (connectors_[peer_id].joinable()) {
+            connectors_[peer_id].join();
+        }
+        const QPEndPoint peer = end_points_[peer_id];
+        QPIdx peer_rc_key = PeerQPIdx(peer);
+        RCQP *qp = qp_[peer_id];
+        // FinishRemovals keeps the QP until the notification is sent.
+        connector_done_[peer_id] = false;
+        connectors_[peer_id] = std::thread([this, peer_id, peer, peer_rc_key,
+                                            qp]() {
+            RDMA_LOG_IF(WARNING,
+                        qp->request_remote_disconnect(peer.host.ip,
+                                                      rdma_port_,
+                                                      peer_rc_key) != SUCC)
                 << fmt::format(
-                        "rdma-rc[{}]: connected to server {}:{}:{}. Posting {} recvs.",
-                        thread_id_, peer_store.host.ip,
-                        peer_store.host.port, peer_store.thread_id,
-                        max_num_sends_);
+                        "rdma-rc[{}]: server {} did not ack the disconnect",
+                        thread_id_, peer.server_id);
+            connector_done_[peer_id] = true;
+        });
+    }
 
-            for (int i = 0; i < max_num_sends_; i++) {
-                PostRecv(peer_store.server_id, i);
+    bool NovaRDMARCBroker::DrainPeer(int peer_id) {
+        if (connectors_[peer_id].joinable() && !connector_done_[peer_id]) {
+            return false;
+        }
+        if (recovery_[peer_id].handshake.joinable() &&
+            !handshake_done_[peer_id]) {
+            return false;
+        }
+        if (qp_[peer_id] == NULL) {
+            return true;
+        }
+        int server_id = end_points_[peer_id].server_id;
+        FlushPendingSends(server_id);
+        PollSQ(server_id);
+        return npending_send_[peer_id] == 0;
+    }
+
+    void NovaRDMARCBroker::FinishRemovals() {
+        std::vector<int> removing;
+        removing.swap(removing_);
+        for (int peer_id : removing) {
+            if (!DrainPeer(peer_id)) {
+                removing_.push_back(peer_id);
+                continue;
+            }
+            if (!reclaiming_[peer_id]) {
+                FinishRemoval(peer_id);
+                continue;
+            }
+            if (connectors_[peer_id].joinable()) {
+                connectors_[peer_id].join();
+            }
+            TearDownPeer(peer_id);
+            peer_state_[peer_id] = PEER_IDLE;
+        }
+    }
+
+    void NovaRDMARCBroker::FinishRemoval(int peer_id) {
+        if (connectors_[peer_id].joinable()) {
+            connectors_[peer_id].join();
+        }
+        removing_.erase(std::remove(removing_.begin(), removing_.end(),
+                                    peer_id), removing_.end());
+        int server_id = end_points_[peer_id].server_id;
+        TearDownPeer(peer_id);
+        server_qp_idx_map.erase(server_id);
+        // The slot is reused by the next AddPeer.
+        for (int op = 0; op < LAT_NUM_OPCODES && !latency_.empty(); op++) {
+            delete latency_[peer_id * LAT_NUM_OPCODES + op];
+            latency_[peer_id * LAT_NUM_OPCODES + op] = nullptr;
+        }
+        peer_state_[peer_id] = PEER_FREE;
+        RDMA_LOG(INFO) << fmt::format("rdma-rc[{}]: removed server {}",
+                                      thread_id_, server_id);
+    }
+
+    void NovaRDMARCBroker::TearDownPeer(int peer_id) {
+        int server_id = end_points_[peer_id].server_id;
+        if (recovery_[peer_id].handshake.joinable()) {
+            recovery_[peer_id].handshake.join();
+        }
+        if (qp_[peer_id] != NULL) {
+            rdma_ctrl_->destroy_rc_qp(
+                    MyQPIdx(server_id));
+            qp_[peer_id] = NULL;
+        }
+        npending_send_[peer_id] = 0;
+        psend_index_[peer_id] = 0;
+        send_sge_index_[peer_id] = 0;
+    }
+
+    void NovaRDMARCBroker::SetQPType(ibv_qp_type qp_type) {
+        RDMA_ASSERT(rdma_ctrl_ == nullptr) << "call before Init";
+        RDMA_ASSERT(qp_type == IBV_QPT_RC || qp_type == IBV_QPT_UC)
+            << qp_type;
+        qp_type_ = qp_type;
+    }
+
+    QPIdx NovaRDMARCBroker::MyQPIdx(uint32_t peer_server_id) {
+        int base = qp_type_ == IBV_QPT_UC ? UC_ID_BASE : RC_ID_BASE;
+        return create_rc_idx(my_server_id_, thread_id_,
+                             base + peer_server_id);
+    }
+
+    QPIdx NovaRDMARCBroker::PeerQPIdx(const QPEndPoint &peer) {
+        int base = qp_type_ == IBV_QPT_UC ? UC_ID_BASE : RC_ID_BASE;
+        return create_rc_idx(peer.server_id, peer.thread_id,
+                             base + my_server_id_);
+    }
+
+    void NovaRDMARCBroker::SetLazyConnect(uint64_t idle_timeout_us,
+                                          uint64_t connect_timeout_us) {
+        RDMA_ASSERT(rdma_ctrl_ == nullptr) << "call before Init";
+        lazy_ = true;
+        idle_timeout_us_ = idle_timeout_us;
+        connect_timeout_us_ = connect_timeout_us;
+    }
+
+    bool NovaRDMARCBroker::EnsureConnected(int qp_idx) {
+        if (!lazy_) {
+            return true;
+        }
+        if ((peer_state_[qp_idx] == PEER_CONNECTED ||
+             peer_state_[qp_idx] == PEER_ERROR) &&
+            qp_[qp_idx]->disconnect_requested_) {
+            Reclaim(qp_idx, false);
+        }
+        if ((peer_state_[qp_idx] == PEER_IDLE ||
+             peer_state_[qp_idx] == PEER_CONNECTING ||
+             (peer_state_[qp_idx] == PEER_DRAINING && reclaiming_[qp_idx])) &&
+            !ConnectOnDemand(qp_idx)) {
+            return false;
+        }
+        last_used_us_[qp_idx] = NowMicros();
+        return true;
+    }
+
+    bool NovaRDMARCBroker::ConnectOnDemand(int qp_idx) {
+        const QPEndPoint &peer = end_points_[qp_idx];
+        uint64_t deadline_us = NowMicros() + connect_timeout_us_;
+        uint64_t backoff = CONN_BACKOFF_MIN;
+        while (peer_state_[qp_idx] != PEER_CONNECTED) {
+            uint64_t now = NowMicros();
+            if (now >= deadline_us) {
+                RDMA_LOG(WARNING) << fmt::format(
+                            "rdma-rc[{}]: server {} unreachable for {} us",
+                            thread_id_, peer.server_id, connect_timeout_us_);
+                return false;
+            }
+            if (peer_state_[qp_idx] == PEER_DRAINING) {
+                // The previous connection is still being reclaimed.
+                FinishRemovals();
+            }
+            if (peer_state_[qp_idx] == PEER_IDLE) {
+                peer_state_[qp_idx] = PEER_CONNECTING;
+                CreateQP(qp_idx);
+                QPIdx peer_rc_key = PeerQPIdx(peer);
+                if (qp_[qp_idx]->connect_on_demand(peer.host.ip, rdma_port_,
+                                                   peer_rc_key) == SUCC) {
+                    OnConnected(qp_idx);
+                    break;
+                }
+                // Let the peer's request through in case it is connecting
+                // to us at the same time.
+                peer_state_[qp_idx] = PEER_IDLE;
+            }
+            // The higher server id backs off longer, so that one of two
+            // peers connecting to each other wins. The peer's request is
+            // accepted while we wait.
+            uint64_t wait_us = my_server_id_ > peer.server_id ? backoff * 2
+                                                              : backoff;
+            WaitForAccepts(std::min(wait_us, deadline_us - now));
+            backoff = std::min(backoff * 2, (uint64_t) CONN_BACKOFF_MAX);
+        }
+        return true;
+    }
+
+    void NovaRDMARCBroker::AcceptPeer(const QPConnArg &arg,
+                                      const QPAttr &remote_attr,
+                                      const MemoryAttr &remote_mr,
+                                      qp_accept_t accept) {
+        std::lock_guard<std::mutex> lock(accept_mutex_);
+        accepts_.push_back({arg, remote_attr, remote_mr, accept});
+        naccepts_++;
+        accept_cv_.notify_all();
+    }
+
+    void NovaRDMARCBroker::ServeAccepts() {
+        std::deque<AcceptRequest> accepts;
+        {
+            std::lock_guard<std::mutex> lock(accept_mutex_);
+            accepts.swap(accepts_);
+            naccepts_ = 0;
+        }
+        // A peer that stopped waiting for the reply retries, and its retry
+        // finds the QP accepted here.
+        for (AcceptRequest &req : accepts) {
+            req.accept(Accept(req.arg, req.remote_attr, req.remote_mr));
+        }
+    }
+
+    void NovaRDMARCBroker::WaitForAccepts(uint64_t timeout_us) {
+        {
+            std::unique_lock<std::mutex> lock(accept_mutex_);
+            accept_cv_.wait_for(lock, std::chrono::microseconds(timeout_us),
+                                [this]() { return !accepts_.empty(); });
+        }
+        ServeAccepts();
+    }
+
+    RCQP *NovaRDMARCBroker::Accept(const QPConnArg &arg,
+                                   const QPAttr &remote_attr,
+                                   const MemoryAttr &remote_mr) {
+        for (int peer_id = 0; peer_id < end_points_.size(); peer_id++) {
+            if (peer_state_[peer_id] == PEER_FREE ||
+                MyQPIdx(end_points_[peer_id].server_id).index !=
+                arg.from_index) {
+                continue;
+            }
+            RCQP *qp = qp_[peer_id];
+            if (peer_state_[peer_id] == PEER_CONNECTED &&
+                qp->remote_attr_.qpn == remote_attr.qpn) {
+                // A retry of a request that was accepted after the peer
+                // stopped waiting for the reply.
+                return qp;
+            }
+            if (peer_state_[peer_id] != PEER_IDLE) {
+                return nullptr;
+            }
+            peer_state_[peer_id] = PEER_CONNECTING;
+            CreateQP(peer_id);
+            qp = qp_[peer_id];
+            qp->bind_remote_mr(remote_mr);
+            if (qp->connect_with_attr(remote_attr) != SUCC) {
+                rdma_ctrl_->destroy_rc_qp(
+                        MyQPIdx(end_points_[peer_id].server_id));
+                qp_[peer_id] = NULL;
+                peer_state_[peer_id] = PEER_IDLE;
+                return nullptr;
+            }
+            last_used_us_[peer_id] = NowMicros();
+            // Receives are posted before the peer learns about the QP.
+            OnConnected(peer_id);
+            return qp;
+        }
+        return nullptr;
+    }
+
+    void NovaRDMARCBroker::Reclaim(int peer_id, bool notify_peer) {
+        RDMA_LOG(INFO) << fmt::format(
+                    "rdma-rc[{}]: disconnect idle server {}", thread_id_,
+                    end_points_[peer_id].server_id);
+        StopPeer(peer_id, notify_peer);
+        reclaiming_[peer_id] = true;
+    }
+
+    void NovaRDMARCBroker::ReclaimIdlePeers() {
+        uint64_t now = NowMicros();
+        for (int peer_id = 0; peer_id < end_points_.size(); peer_id++) {
+            if (peer_state_[peer_id] == PEER_CONNECTED &&
+                npending_send_[peer_id] == 0 &&
+                send_sge_index_[peer_id] == 0 &&
+                now - last_used_us_[peer_id] > idle_timeout_us_) {
+                Reclaim(peer_id, true);
             }
         }
-        RDMA_LOG(INFO)
-            << fmt::format("RDMA client thread {} initialized", thread_id_);
     }
 
     uint64_t
@@ -184,55 +774,123 @@ namespace nova {
                                   uint64_t local_offset,
                                   uint64_t remote_addr, bool is_offset,
                                   uint32_t imm_data) {
-        uint32_t qp_idx = to_qp_idx(server_id);
+        uint32_t qp_idx;
+        if (!PreparePost(server_id, &qp_idx)) {
+            return FailPost(qp_idx, opcode, localbuf);
+        }
+        // The keys are only read once the peer is known to have a QP.
+        RCQP *qp = qp_[qp_idx];
+        return PostRDMASEND(localbuf, opcode, size, qp_idx, local_offset,
+                            remote_addr, is_offset, imm_data,
+                            qp->local_mr_.key, qp->remote_mr_.key);
+    }
+
+    bool NovaRDMARCBroker::PreparePost(int server_id, uint32_t *qp_idx) {
+        *qp_idx = to_qp_idx(server_id);
+        if (!EnsureConnected(*qp_idx)) {
+            return false;
+        }
+        RDMA_ASSERT(peer_state_[*qp_idx] == PEER_CONNECTED ||
+                    peer_state_[*qp_idx] == PEER_ERROR)
+            << fmt::format("rdma-rc[{}]: server {} is not connected",
+                           thread_id_, server_id);
+        return true;
+    }
+
+    uint64_t NovaRDMARCBroker::FailPost(uint32_t qp_idx, ibv_wr_opcode opcode,
+                                        const char *localbuf) {
+        // The request never took its slot, so no counter changes.
+        uint64_t wr_id = psend_index_[qp_idx];
+        const char *buf = rdma_send_buf_[qp_idx] + wr_id * max_msg_size_;
+        if (localbuf != nullptr) {
+            buf = localbuf;
+        }
+        callback_->ProcessRDMAError(opcode, wr_id,
+                                    end_points_[qp_idx].server_id,
+                                    (char *) buf, IBV_WC_RETRY_EXC_ERR);
+        return wr_id;
+    }
+
+    uint64_t
+    NovaRDMARCBroker::PostRDMASEND(const char *localbuf, ibv_wr_opcode opcode,
+                                  uint32_t size,
+                                  uint32_t qp_idx,
+                                  uint64_t local_offset,
+                                  uint64_t remote_addr, bool is_offset,
+                                  uint32_t imm_data, uint32_t lkey,
+                                  uint32_t rkey) {
+        RDMA_ASSERT(qp_type_ != IBV_QPT_UC || opcode != IBV_WR_RDMA_READ)
+            << "UC QPs do not support RDMA READ";
+        int server_id = end_points_[qp_idx].server_id;
         uint64_t wr_id = psend_index_[qp_idx];
         const char *sendbuf = rdma_send_buf_[qp_idx] + wr_id * max_msg_size_;
         if (localbuf != nullptr) {
             sendbuf = localbuf;
         }
-        int ssge_idx = send_sge_index_[qp_idx];
-        ibv_sge *ssge = send_sges_[qp_idx];
-        ibv_send_wr *swr = send_wrs_[qp_idx];
-        ssge[ssge_idx].addr = (uintptr_t) sendbuf + local_offset;
-        ssge[ssge_idx].length = size;
-        ssge[ssge_idx].lkey = qp_[qp_idx]->local_mr_.key;
-        swr[ssge_idx].wr_id = wr_id;
-        swr[ssge_idx].sg_list = &ssge[ssge_idx];
-        swr[ssge_idx].num_sge = 1;
-        swr[ssge_idx].opcode = opcode;
-        swr[ssge_idx].imm_data = imm_data;
-        swr[ssge_idx].send_flags = IBV_SEND_SIGNALED;
-        if (is_offset) {
-            swr[ssge_idx].wr.rdma.remote_addr =
-                    qp_[qp_idx]->remote_mr_.buf + remote_addr;
+        PostedWR &posted = posted_wrs_[qp_idx][wr_id];
+        posted.opcode = opcode;
+        posted.addr = (uintptr_t) sendbuf + local_offset;
+        posted.size = size;
+        posted.lkey = lkey;
+        posted.remote_addr = is_offset ? qp_[qp_idx]->remote_mr_.buf +
+                                         remote_addr : remote_addr;
+        posted.rkey = rkey;
+        posted.imm_data = imm_data;
+        posted.retries = 0;
+        posted.post_ns = stamping() ? NowNanos() : 0;
+        posted.doorbell_ns = 0;
+        posted.trace_id = NovaTracer::enabled() ? NovaTracer::trace_id() : 0;
+        if (peer_state_[qp_idx] == PEER_ERROR) {
+            // The QP is being reconnected.
+            psend_index_[qp_idx]++;
+            npending_send_[qp_idx]++;
+            FailOrRetry(qp_idx, wr_id, IBV_WC_WR_FLUSH_ERR);
         } else {
-            swr[ssge_idx].wr.rdma.remote_addr = remote_addr;
-        }
-        swr[ssge_idx].wr.rdma.rkey = qp_[qp_idx]->remote_mr_.key;
-        if (ssge_idx + 1 < doorbell_batch_size_) {
-            swr[ssge_idx].next = &swr[ssge_idx + 1];
-        } else {
-            swr[ssge_idx].next = NULL;
-        }
-        psend_index_[qp_idx]++;
-        npending_send_[qp_idx]++;
-        send_sge_index_[qp_idx]++;
-        RDMA_LOG(DEBUG) << fmt::format(
-                    "rdma-rc[{}]: SQ: rdma {} request to server {} wr:{} imm:{} roffset:{} isoff:{} size:{} p:{}:{}",
-                    thread_id_, ibv_wr_opcode_str(opcode), server_id, wr_id,
-                    imm_data,
-                    remote_addr, is_offset, size, psend_index_[qp_idx],
-                    npending_send_[qp_idx]);
-        if (send_sge_index_[qp_idx] == doorbell_batch_size_) {
-            // post send a batch of requests.
-            send_sge_index_[qp_idx] = 0;
-            ibv_send_wr *bad_sr;
-            int ret = ibv_post_send(qp_[qp_idx]->qp_, &swr[0], &bad_sr);
-            RDMA_ASSERT(ret == 0) << ret;
-            RDMA_LOG(DEBUG) << "rdma-rc[" << thread_id_ << "]: "
-                            << "SQ: posting "
-                            << doorbell_batch_size_
-                            << " requests";
+            int ssge_idx = send_sge_index_[qp_idx];
+            ibv_sge *ssge = send_sges_[qp_idx];
+            ibv_send_wr *swr = send_wrs_[qp_idx];
+            ssge[ssge_idx].addr = (uintptr_t) sendbuf + local_offset;
+            ssge[ssge_idx].length = size;
+            ssge[ssge_idx].lkey = lkey;
+            swr[ssge_idx].wr_id = wr_id;
+            swr[ssge_idx].sg_list = &ssge[ssge_idx];
+            swr[ssge_idx].num_sge = 1;
+            swr[ssge_idx].opcode = opcode;
+            swr[ssge_idx].imm_data = imm_data;
+            swr[ssge_idx].send_flags = IBV_SEND_SIGNALED;
+            if (is_offset) {
+                swr[ssge_idx].wr.rdma.remote_addr =
+                        qp_[qp_idx]->remote_mr_.buf + remote_addr;
+            } else {
+                swr[ssge_idx].wr.rdma.remote_addr = remote_addr;
+            }
+            swr[ssge_idx].wr.rdma.rkey = rkey;
+            if (ssge_idx + 1 < doorbell_batch_size_) {
+                swr[ssge_idx].next = &swr[ssge_idx + 1];
+            } else {
+                swr[ssge_idx].next = NULL;
+            }
+            psend_index_[qp_idx]++;
+            npending_send_[qp_idx]++;
+            send_sge_index_[qp_idx]++;
+            NOVA_LOG(DEBUG,
+                     "rdma-rc[{}]: SQ: rdma {} request to server {} wr:{} imm:{} roffset:{} isoff:{} size:{} p:{}:{}",
+                     thread_id_, ibv_wr_opcode_str(opcode), server_id, wr_id,
+                     imm_data,
+                     remote_addr, is_offset, size, psend_index_[qp_idx],
+                     npending_send_[qp_idx]);
+            if (send_sge_index_[qp_idx] == doorbell_batch_size_) {
+                // post send a batch of requests.
+                if (stamping()) {
+                    StampDoorbell(qp_idx, doorbell_batch_size_);
+                }
+                send_sge_index_[qp_idx] = 0;
+                ibv_send_wr *bad_sr;
+                int ret = ibv_post_send(qp_[qp_idx]->qp_, &swr[0], &bad_sr);
+                RDMA_ASSERT(ret == 0) << ret;
+                NOVA_LOG(DEBUG, "rdma-rc[{}]: SQ: posting {} requests",
+                         thread_id_, doorbell_batch_size_);
+            }
         }
 
         while (npending_send_[qp_idx] == max_num_sends_) {
@@ -272,6 +930,57 @@ namespace nova {
                             imm_data);
     }
 
+    uint64_t
+    NovaRDMARCBroker::PostRead(const NovaItemHandle &local,
+                               const NovaRemoteItem &remote, uint32_t size,
+                               int server_id) {
+        RDMA_ASSERT(size <= local.size && size <= remote.size)
+            << fmt::format("read size:{} local:{} remote:{}", size,
+                           local.size, remote.size);
+        uint32_t qp_idx;
+        if (!PreparePost(server_id, &qp_idx)) {
+            return FailPost(qp_idx, IBV_WR_RDMA_READ, local.addr);
+        }
+        return PostRDMASEND(local.addr, IBV_WR_RDMA_READ, size, qp_idx, 0,
+                            remote.offset, true, 0, local.lkey, remote.rkey);
+    }
+
+    uint64_t
+    NovaRDMARCBroker::PostSend(const NovaItemHandle &local, uint32_t size,
+                               int server_id, uint32_t imm_data) {
+        ibv_wr_opcode wr = IBV_WR_SEND;
+        if (imm_data != 0) {
+            wr = IBV_WR_SEND_WITH_IMM;
+        }
+        RDMA_ASSERT(size < max_msg_size_ && size <= local.size);
+        uint32_t qp_idx;
+        if (!PreparePost(server_id, &qp_idx)) {
+            return FailPost(qp_idx, wr, local.addr);
+        }
+        return PostRDMASEND(local.addr, wr, size, qp_idx, 0, 0, false,
+                            imm_data, local.lkey, qp_[qp_idx]->remote_mr_.key);
+    }
+
+    uint64_t
+    NovaRDMARCBroker::PostWrite(const NovaItemHandle &local,
+                                const NovaRemoteItem &remote, uint32_t size,
+                                int server_id, uint32_t imm_data) {
+        ibv_wr_opcode wr = IBV_WR_RDMA_WRITE;
+        if (imm_data != 0) {
+            wr = IBV_WR_RDMA_WRITE_WITH_IMM;
+        }
+        RDMA_ASSERT(size <= local.size && size <= remote.size)
+            << fmt::format("write size:{} local:{} remote:{}", size,
+                           local.size, remote.size);
+        uint32_t qp_idx;
+        if (!PreparePost(server_id, &qp_idx)) {
+            return FailPost(qp_idx, wr, local.addr);
+        }
+        return PostRDMASEND(local.addr, wr, size, qp_idx, 0,
+                            remote.offset, true, imm_data, local.lkey,
+                            remote.rkey);
+    }
+
     void NovaRDMARCBroker::FlushPendingSends(int remote_server_id) {
         if (remote_server_id == my_server_id_) {
             return;
@@ -280,10 +989,12 @@ namespace nova {
         if (send_sge_index_[qp_idx] == 0) {
             return;
         }
-        RDMA_LOG(DEBUG) << "rdma-rc[" << thread_id_ << "]: "
-                        << "flush pending sends "
-                        << send_sge_index_[qp_idx];
+        NOVA_LOG(DEBUG, "rdma-rc[{}]: flush pending sends {}", thread_id_,
+                 send_sge_index_[qp_idx]);
         send_wrs_[qp_idx][send_sge_index_[qp_idx] - 1].next = NULL;
+        if (stamping()) {
+            StampDoorbell(qp_idx, send_sge_index_[qp_idx]);
+        }
         send_sge_index_[qp_idx] = 0;
         ibv_send_wr *bad_sr;
         int ret = ibv_post_send(qp_[qp_idx]->qp_, &send_wrs_[qp_idx][0],
@@ -294,6 +1005,9 @@ namespace nova {
 
     void NovaRDMARCBroker::FlushPendingSends() {
         for (int peer_id = 0; peer_id < end_points_.size(); peer_id++) {
+            if (peer_state_[peer_id] == PEER_FREE) {
+                continue;
+            }
             QPEndPoint peer_store = end_points_[peer_id];
             FlushPendingSends(peer_store.server_id);
         }
@@ -317,6 +1031,9 @@ namespace nova {
             return 0;
         }
         uint32_t qp_idx = to_qp_idx(server_id);
+        if (peer_state_[qp_idx] == PEER_ERROR) {
+            TryRecover(qp_idx);
+        }
         int npending = npending_send_[qp_idx];
         if (npending == 0) {
             return 0;
@@ -325,20 +1042,44 @@ namespace nova {
         // FIFO.
         int n = ibv_poll_cq(qp_[qp_idx]->cq_, max_num_sends_, wcs_);
         for (int i = 0; i < n; i++) {
-            RDMA_ASSERT(wcs_[i].status == IBV_WC_SUCCESS)
-                << "rdma-rc[" << thread_id_ << "]: " << "SQ error wc status "
-                << wcs_[i].status << " str:"
-                << ibv_wc_status_str(wcs_[i].status) << " serverid "
-                << server_id;
-
-            RDMA_LOG(DEBUG) << fmt::format(
-                        "rdma-rc[{}]: SQ: poll complete from server {} wr:{} op:{}",
-                        thread_id_, server_id, wcs_[i].wr_id,
-                        ibv_wc_opcode_str(wcs_[i].opcode));
+            if (wcs_[i].status != IBV_WC_SUCCESS &&
+                peer_state_[qp_idx] == PEER_DRAINING) {
+                // The peer is leaving. Its failed requests are dropped.
+                rdma_send_buf_[qp_idx][wcs_[i].wr_id * max_msg_size_] = '~';
+                npending_send_[qp_idx] -= 1;
+                continue;
+            }
+            if (wcs_[i].status != IBV_WC_SUCCESS) {
+                RDMA_LOG_IF(WARNING, peer_state_[qp_idx] == PEER_CONNECTED)
+                    << "rdma-rc[" << thread_id_ << "]: "
+                    << "SQ error wc status " << wcs_[i].status << " str:"
+                    << ibv_wc_status_str(wcs_[i].status) << " serverid "
+                    << server_id;
+                if (peer_state_[qp_idx] == PEER_CONNECTED) {
+                    EnterError(qp_idx, true);
+                }
+                FailOrRetry(qp_idx, wcs_[i].wr_id, wcs_[i].status);
+                continue;
+            }
+
+            NOVA_LOG(DEBUG,
+                     "rdma-rc[{}]: SQ: poll complete from server {} wr:{} op:{}",
+                     thread_id_, server_id, wcs_[i].wr_id,
+                     ibv_wc_opcode_str(wcs_[i].opcode));
+            uint64_t cqe_ns = 0;
+            if (stamping()) {
+                cqe_ns = NowNanos();
+            }
+            if (latency_stats_) {
+                RecordLatency(qp_idx, wcs_[i].wr_id, cqe_ns);
+            }
             char *buf = rdma_send_buf_[qp_idx] +
                         wcs_[i].wr_id * max_msg_size_;
             callback_->ProcessRDMAWC(wcs_[i].opcode, wcs_[i].wr_id, server_id,
                                      buf, wcs_[i].imm_data);
+            if (NovaTracer::enabled()) {
+                TraceRequest(qp_idx, wcs_[i].wr_id, cqe_ns);
+            }
             // Send is complete.
             buf[0] = '~';
             npending_send_[qp_idx] -= 1;
@@ -349,6 +1090,9 @@ namespace nova {
     uint32_t NovaRDMARCBroker::PollSQ() {
         uint32_t size = 0;
         for (int peer_id = 0; peer_id < end_points_.size(); peer_id++) {
+            if (peer_state_[peer_id] == PEER_FREE) {
+                continue;
+            }
             QPEndPoint peer_store = end_points_[peer_id];
             size += PollSQ(peer_store.server_id);
         }
@@ -359,7 +1103,10 @@ namespace nova {
     // P2_b receive P2_a's memory (addr, len), that I'm looking for?
     // TODO
     void NovaRDMARCBroker::PostRecv(int server_id, int recv_buf_index) {
-        uint32_t qp_idx = to_qp_idx(server_id);
+        PostRecvAt(to_qp_idx(server_id), recv_buf_index);
+    }
+
+    void NovaRDMARCBroker::PostRecvAt(int qp_idx, int recv_buf_index) {
         char *local_buf =
                 rdma_recv_buf_[qp_idx] + max_msg_size_ * recv_buf_index;
         local_buf[0] = '~';
@@ -372,33 +1119,412 @@ namespace nova {
 
     uint32_t NovaRDMARCBroker::PollRQ(int server_id) {
         uint32_t qp_idx = to_qp_idx(server_id);
+        if (peer_state_[qp_idx] == PEER_ERROR) {
+            TryRecover(qp_idx);
+        }
+        if (peer_state_[qp_idx] != PEER_CONNECTED &&
+            peer_state_[qp_idx] != PEER_ERROR) {
+            return 0;
+        }
+        if (qp_[qp_idx]->disconnect_requested_) {
+            // Also in PEER_ERROR: posting to the QP the peer tore down is
+            // what broke ours, and the peer cannot reset it.
+            if (lazy_) {
+                // The peer reclaimed the idle connection.
+                Reclaim(qp_idx, false);
+            } else {
+                // The peer removed us.
+                BeginRemoval(qp_idx, false);
+            }
+            return 0;
+        }
+        if (peer_state_[qp_idx] != PEER_CONNECTED) {
+            return 0;
+        }
+        if (qp_[qp_idx]->reset_requested_) {
+            // The peer broke its side and waits for us to reset ours.
+            EnterError(qp_idx, false);
+            return 0;
+        }
         int n = ibv_poll_cq(qp_[qp_idx]->recv_cq_, max_num_sends_, wcs_);
         for (int i = 0; i < n; i++) {
             uint64_t wr_id = wcs_[i].wr_id;
             RDMA_ASSERT(wr_id < max_num_sends_);
-            RDMA_ASSERT(wcs_[i].status == IBV_WC_SUCCESS)
-                << "rdma-rc[" << thread_id_ << "]: " << "RQ error wc status "
-                << ibv_wc_status_str(wcs_[i].status);
+            if (wcs_[i].status != IBV_WC_SUCCESS) {
+                RDMA_LOG_IF(WARNING, peer_state_[qp_idx] == PEER_CONNECTED)
+                    << "rdma-rc[" << thread_id_ << "]: "
+                    << "RQ error wc status "
+                    << ibv_wc_status_str(wcs_[i].status) << " serverid "
+                    << server_id;
+                if (peer_state_[qp_idx] == PEER_CONNECTED) {
+                    EnterError(qp_idx, true);
+                }
+                // Receives are posted again once reconnected.
+                continue;
+            }
 
-            RDMA_LOG(DEBUG)
-                << fmt::format(
-                        "rdma-rc[{}]: RQ: received from server {} wr:{} imm:{}",
-                        thread_id_, server_id, wr_id, wcs_[i].imm_data);
-            char *buf = rdma_recv_buf_[qp_idx] + max_msg_size_ * wr_id;
-            callback_->ProcessRDMAWC(wcs_[i].opcode, wcs_[i].wr_id, server_id,
-                                     buf, wcs_[i].imm_data);
+            DeliverRecv(qp_idx, wcs_[i]);
             // Post another receive event.
             PostRecv(server_id, wr_id);
         }
+        if (n > 0 && idle_timeout_us_ > 0) {
+            last_used_us_[qp_idx] = NowMicros();
+        }
 
         // Flush all pending send requests.
         FlushPendingSends(server_id);
         return n;
     }
 
+    void NovaRDMARCBroker::DeliverRecv(int qp_idx, const ibv_wc &wc) {
+        int server_id = end_points_[qp_idx].server_id;
+        NOVA_LOG(DEBUG,
+                 "rdma-rc[{}]: RQ: received from server {} wr:{} imm:{}",
+                 thread_id_, server_id, wc.wr_id, wc.imm_data);
+        char *buf = rdma_recv_buf_[qp_idx] + max_msg_size_ * wc.wr_id;
+        bool tracing = NovaTracer::enabled();
+        NovaTraceSpan span = {};
+        // The callback sets the trace id carried by the message.
+        NovaTraceIdScope trace_scope(0);
+        if (tracing) {
+            span.start_ns = NowNanos();
+        }
+        callback_->ProcessRDMAWC(wc.opcode, wc.wr_id, server_id, buf,
+                                 wc.imm_data);
+        if (tracing) {
+            span.name = "rq_callback";
+            span.end_ns = NowNanos();
+            span.trace_id = NovaTracer::trace_id();
+            span.wr_id = wc.wr_id;
+            span.peer = server_id;
+            span.thread_id = thread_id_;
+            span.opcode = -1;
+            span.flow = TRACE_FLOW_IN;
+            NovaTracer::Record(span);
+        }
+    }
+
+    void NovaRDMARCBroker::SetErrorPolicy(NovaErrorPolicy policy,
+                                          uint32_t max_retries,
+                                          uint64_t retry_timeout_us) {
+        error_policy_ = policy;
+        max_retries_ = max_retries;
+        retry_timeout_us_ = retry_timeout_us;
+    }
+
+    void NovaRDMARCBroker::EnableLatencyStats(bool enable) {
+        if (enable && latency_.empty()) {
+            latency_.resize(end_points_.size() * LAT_NUM_OPCODES, nullptr);
+        }
+        latency_stats_ = enable;
+    }
+
+    void NovaRDMARCBroker::StampDoorbell(int qp_idx, int nwrs) {
+        uint64_t now = NowNanos();
+        for (int i = 0; i < nwrs; i++) {
+            posted_wrs_[qp_idx][send_wrs_[qp_idx][i].wr_id].doorbell_ns = now;
+        }
+    }
+
+    void NovaRDMARCBroker::RecordLatency(int qp_idx, uint64_t wr_id,
+                                         uint64_t cqe_ns) {
+        const PostedWR &posted = posted_wrs_[qp_idx][wr_id];
+        if (posted.post_ns == 0 || posted.doorbell_ns == 0) {
+            // Posted before the stats were enabled.
+            return;
+        }
+        RDMA_ASSERT(posted.opcode < LAT_NUM_OPCODES) << posted.opcode;
+        NovaOpLatency *&lat = latency_[qp_idx * LAT_NUM_OPCODES +
+                                       posted.opcode];
+        if (lat == nullptr) {
+            lat = new NovaOpLatency;
+            lat->opcode = posted.opcode;
+        }
+        lat->server_id = end_points_[qp_idx].server_id;
+        lat->queue.Add(posted.doorbell_ns - posted.post_ns);
+        lat->completion.Add(cqe_ns - posted.doorbell_ns);
+        lat->total.Add(cqe_ns - posted.post_ns);
+    }
+
+    void NovaRDMARCBroker::TraceRequest(int qp_idx, uint64_t wr_id,
+                                        uint64_t cqe_ns) {
+        const PostedWR &posted = posted_wrs_[qp_idx][wr_id];
+        if (posted.post_ns == 0 || posted.doorbell_ns == 0) {
+            return;
+        }
+        NovaTraceSpan span = {};
+        span.trace_id = posted.trace_id;
+        span.wr_id = wr_id;
+        span.peer = end_points_[qp_idx].server_id;
+        span.thread_id = thread_id_;
+        span.opcode = posted.opcode;
+        // Waiting in the doorbell batch.
+        span.name = "post";
+        span.start_ns = posted.post_ns;
+        span.end_ns = posted.doorbell_ns;
+        // Messages carry the trace id to the peer; READs and WRITEs do not.
+        if (posted.opcode == IBV_WR_SEND ||
+            posted.opcode == IBV_WR_SEND_WITH_IMM ||
+            posted.opcode == IBV_WR_RDMA_WRITE_WITH_IMM) {
+            span.flow = TRACE_FLOW_OUT;
+        }
+        NovaTracer::Record(span);
+        span.flow = TRACE_FLOW_NONE;
+        span.name = "rnic";
+        span.start_ns = posted.doorbell_ns;
+        span.end_ns = cqe_ns;
+        NovaTracer::Record(span);
+        span.name = "sq_callback";
+        span.start_ns = cqe_ns;
+        span.end_ns = NowNanos();
+        NovaTracer::Record(span);
+    }
+
+    std::vector<NovaOpLatency>
+    NovaRDMARCBroker::LatencySnapshot(bool reset) {
+        std::vector<NovaOpLatency> snapshot;
+        for (NovaOpLatency *lat : latency_) {
+            if (lat == nullptr || lat->total.count() == 0) {
+                continue;
+            }
+            snapshot.push_back(*lat);
+            if (reset) {
+                lat->queue.Reset();
+                lat->completion.Reset();
+                lat->total.Reset();
+            }
+        }
+        return snapshot;
+    }
+
+    void NovaRDMARCBroker::EnterError(int qp_idx, bool notify_peer) {
+        RDMA_LOG(WARNING) << fmt::format(
+                    "rdma-rc[{}]: QP to server {} broke, reconnecting",
+                    thread_id_, end_points_[qp_idx].server_id);
+        peer_state_[qp_idx] = PEER_ERROR;
+        PeerRecovery &recovery = recovery_[qp_idx];
+        recovery.next_attempt_us = NowMicros();
+        recovery.backoff_us = CONN_BACKOFF_MIN;
+        recovery.deadline_us = recovery.next_attempt_us + retry_timeout_us_;
+        recovery.notify_peer = notify_peer;
+        recovery.qp_reset = false;
+        // Flush the outstanding requests so that they complete with errors.
+        struct ibv_qp_attr qp_attr = {};
+        qp_attr.qp_state = IBV_QPS_ERR;
+        RDMA_VERIFY(WARNING,
+                    ibv_modify_qp(qp_[qp_idx]->qp_, &qp_attr,
+                                  IBV_QP_STATE) == 0)
+            << "change qp status to error failed: " << strerror(errno);
+    }
+
+    void NovaRDMARCBroker::FailOrRetry(int qp_idx, uint64_t wr_id,
+                                       ibv_wc_status status) {
+        PostedWR &posted = posted_wrs_[qp_idx][wr_id];
+        if (error_policy_ == NOVA_ERROR_RETRY &&
+            posted.retries < max_retries_ &&
+            NowMicros() < recovery_[qp_idx].deadline_us) {
+            posted.retries++;
+            recovery_[qp_idx].retry_wrs.push_back(wr_id);
+            return;
+        }
+        // The callback gets the buffer of the request, which is not the
+        // send buffer slot if the caller posted its own buffer.
+        callback_->ProcessRDMAError(posted.opcode, wr_id,
+                                    end_points_[qp_idx].server_id,
+                                    (char *) posted.addr, status);
+        rdma_send_buf_[qp_idx][wr_id * max_msg_size_] = '~';
+        npending_send_[qp_idx] -= 1;
+    }
+
+    void NovaRDMARCBroker::FailRetries(int qp_idx) {
+        int server_id = end_points_[qp_idx].server_id;
+        for (uint64_t wr_id : recovery_[qp_idx].retry_wrs) {
+            PostedWR &posted = posted_wrs_[qp_idx][wr_id];
+            callback_->ProcessRDMAError(posted.opcode, wr_id, server_id,
+                                        (char *) posted.addr,
+                                        IBV_WC_WR_FLUSH_ERR);
+            rdma_send_buf_[qp_idx][wr_id * max_msg_size_] = '~';
+            npending_send_[qp_idx] -= 1;
+        }
+        recovery_[qp_idx].retry_wrs.clear();
+    }
+
+    void NovaRDMARCBroker::RetryRecoveryLater(int qp_idx) {
+        PeerRecovery &recovery = recovery_[qp_idx];
+        recovery.next_attempt_us = NowMicros() + recovery.backoff_us;
+        recovery.backoff_us = std::min(recovery.backoff_us * 2,
+                                       (uint64_t) CONN_BACKOFF_MAX);
+    }
+
+    void NovaRDMARCBroker::TryRecover(int qp_idx) {
+        PeerRecovery &recovery = recovery_[qp_idx];
+        uint64_t now = NowMicros();
+        if (now >= recovery.deadline_us && !recovery.retry_wrs.empty()) {
+            RDMA_LOG(WARNING) << fmt::format(
+                        "rdma-rc[{}]: server {} unreachable for {} us, failing {} requests",
+                        thread_id_, end_points_[qp_idx].server_id,
+                        retry_timeout_us_, recovery.retry_wrs.size());
+            FailRetries(qp_idx);
+        }
+        if (now < recovery.next_attempt_us) {
+            return;
+        }
+        const QPEndPoint &peer = end_points_[qp_idx];
+        // Wait until every outstanding request completed with an error.
+        FlushPendingSends(peer.server_id);
+        if (npending_send_[qp_idx] > recovery.retry_wrs.size()) {
+            return;
+        }
+        RCQP *qp = qp_[qp_idx];
+        if (!recovery.qp_reset) {
+            // Messages that arrived before the QP broke are still
+            // delivered; only the flushed receives are dropped. All receives
+            // are posted again after the reset. The callback may poll and
+            // reuse wcs_, so the completions are copied out first.
+            std::vector<ibv_wc> received;
+            int n;
+            while ((n = ibv_poll_cq(qp->recv_cq_, max_num_sends_, wcs_)) > 0) {
+                for (int i = 0; i < n; i++) {
+                    if (wcs_[i].status == IBV_WC_SUCCESS) {
+                        received.push_back(wcs_[i]);
+                    }
+                }
+            }
+            for (const ibv_wc &wc : received) {
+                DeliverRecv(qp_idx, wc);
+            }
+            if (qp->reset() != SUCC) {
+                RetryRecoveryLater(qp_idx);
+                return;
+            }
+            // Receives are posted before the peer can send to the new QP.
+            for (int i = 0; i < max_num_sends_; i++) {
+                PostRecvAt(qp_idx, i);
+            }
+            recovery.qp_reset = true;
+        }
+        bool handshake_done = false;
+        if (recovery.handshake.joinable()) {
+            if (!handshake_done_[qp_idx]) {
+                return;
+            }
+            recovery.handshake.join();
+            handshake_done = true;
+        }
+        QPAttr remote_attr = {};
+        bool requested = qp->reset_requested_;
+        if (requested) {
+            // The peer reset its side first, or at the same time as we did,
+            // and sent its new attributes with the request.
+            remote_attr = qp->reset_attr();
+        } else {
+            if (!handshake_done) {
+                StartResetHandshake(qp_idx);
+                return;
+            }
+            ConnStatus ret = recovery.handshake_status;
+            if (ret == NO_QP && lazy_) {
+                // The peer reclaimed the connection. It is connected again
+                // on demand.
+                RDMA_LOG(INFO) << fmt::format(
+                            "rdma-rc[{}]: server {} has no QP to reset",
+                            thread_id_, peer.server_id);
+                Reclaim(qp_idx, false);
+                return;
+            }
+            if (ret != SUCC) {
+                RetryRecoveryLater(qp_idx);
+                return;
+            }
+            remote_attr = recovery.handshake_attr;
+        }
+        if (qp->connect_with_attr(remote_attr) != SUCC) {
+            RetryRecoveryLater(qp_idx);
+            return;
+        }
+        // A request of the peer that crossed ours is answered as well.
+        qp->reset_requested_ = false;
+        if (requested) {
+            qp->reset_done_ = true;
+        }
+        peer_state_[qp_idx] = PEER_CONNECTED;
+        RDMA_LOG(INFO) << fmt::format(
+                    "rdma-rc[{}]: reconnected to server {}, retrying {} requests",
+                    thread_id_, peer.server_id, recovery.retry_wrs.size());
+        for (uint64_t wr_id : recovery.retry_wrs) {
+            PostRecorded(qp_idx, wr_id);
+        }
+        recovery.retry_wrs.clear();
+    }
+
+    void NovaRDMARCBroker::StartResetHandshake(int qp_idx) {
+        const QPEndPoint peer = end_points_[qp_idx];
+        QPIdx peer_rc_key = PeerQPIdx(peer);
+        RCQP *qp = qp_[qp_idx];
+        handshake_done_[qp_idx] = false;
+        recovery_[qp_idx].handshake = std::thread(
+                [this, qp_idx, peer, peer_rc_key, qp]() {
+                    PeerRecovery &recovery = recovery_[qp_idx];
+                    ConnStatus ret = SUCC;
+                    if (recovery.notify_peer) {
+                        ret = qp->request_remote_reset(peer.host.ip,
+                                                       rdma_port_,
+                                                       peer_rc_key);
+                        if (ret == SUCC) {
+                            recovery.notify_peer = false;
+                        }
+                    }
+                    if (ret == SUCC) {
+                        // The peer's PSN changes with the reset. Posting
+                        // before the peer replies would use its old QP.
+                        ret = qp->query_remote_reset(
+                                peer.host.ip, rdma_port_, peer_rc_key,
+                                &recovery.handshake_attr);
+                    }
+                    recovery.handshake_status = ret;
+                    handshake_done_[qp_idx] = true;
+                });
+    }
+
+    void NovaRDMARCBroker::PostRecorded(int qp_idx, uint64_t wr_id) {
+        PostedWR &posted = posted_wrs_[qp_idx][wr_id];
+        if (stamping()) {
+            // The queueing delay of a retry includes the reconnect.
+            posted.doorbell_ns = NowNanos();
+        }
+        ibv_sge sge = {};
+        sge.addr = posted.addr;
+        sge.length = posted.size;
+        sge.lkey = posted.lkey;
+        ibv_send_wr wr = {};
+        wr.wr_id = wr_id;
+        wr.sg_list = &sge;
+        wr.num_sge = 1;
+        wr.opcode = posted.opcode;
+        wr.imm_data = posted.imm_data;
+        wr.send_flags = IBV_SEND_SIGNALED;
+        wr.wr.rdma.remote_addr = posted.remote_addr;
+        wr.wr.rdma.rkey = posted.rkey;
+        ibv_send_wr *bad_sr;
+        int ret = ibv_post_send(qp_[qp_idx]->qp_, &wr, &bad_sr);
+        RDMA_ASSERT(ret == 0) << ret;
+    }
+
     uint32_t NovaRDMARCBroker::PollRQ() {
+        if (naccepts_ > 0) {
+            ServeAccepts();
+        }
+        if (!removing_.empty()) {
+            FinishRemovals();
+        }
+        if (idle_timeout_us_ > 0) {
+            ReclaimIdlePeers();
+        }
         uint32_t size = 0;
         for (int peer_id = 0; peer_id < end_points_.size(); peer_id++) {
+            if (peer_state_[peer_id] == PEER_FREE) {
+                continue;
+            }
             QPEndPoint peer_store = end_points_[peer_id];
             size += PollRQ(peer_store.server_id);
         }
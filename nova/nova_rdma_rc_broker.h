@@ -8,19 +8,77 @@
 #define RLIB_NOVA_RDMA_RC_BROKER_H
 
 #include <fmt/core.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
 
 #include "rdma_ctrl.hpp"
 #include "nova_rdma_broker.h"
 #include "nova_msg_callback.h"
 #include "nova_common.h"
+#include "nova_histogram.h"
+#include "nova_logger.h"
+#include "nova_tracer.h"
+
+// IBV_WR_RDMA_WRITE up to IBV_WR_ATOMIC_FETCH_AND_ADD.
+#define LAT_NUM_OPCODES 7
+// How long NOVA_ERROR_RETRY keeps requests for a broken QP by default, in
+// microseconds.
+#define RETRY_TIMEOUT_US 10000000
+// How long a post in lazy mode tries to connect its peer by default before
+// it fails, in microseconds.
+#define LAZY_CONNECT_TIMEOUT_US 10000000
 
 namespace nova {
 
     using namespace rdmaio;
 
+    // The RNIC and MR are opened once per process by the first broker.
+    extern mutex open_device_mutex;
+    extern bool is_device_opened;
+    extern RNicHandler *device;
+
+    // State of a peer slot of a broker.
+    enum NovaPeerState {
+        PEER_FREE = 0,
+        PEER_CONNECTING = 1,
+        PEER_CONNECTED = 2,
+        PEER_DRAINING = 3,
+        // The QP broke. It is reset and reconnected by PollSQ/PollRQ.
+        PEER_ERROR = 4,
+        // Lazy mode: a known peer without a QP. It is connected on the
+        // first post to it or the first request from it.
+        PEER_IDLE = 5
+    };
+
+    // What happens to requests that fail because their QP broke.
+    enum NovaErrorPolicy {
+        // Report them through NovaMsgCallback::ProcessRDMAError.
+        NOVA_ERROR_FAIL = 0,
+        // Post them again once the QP is reconnected. A SEND or WRITE that
+        // reached the peer before the error may be delivered twice.
+        NOVA_ERROR_RETRY = 1
+    };
+
+    // Latencies of the requests of one opcode to one peer, in nanoseconds.
+    struct NovaOpLatency {
+        uint32_t server_id;
+        ibv_wr_opcode opcode;
+        // From the post to the doorbell that handed it to the RNIC.
+        NovaHistogram queue;
+        // From the doorbell to the poll of its completion.
+        NovaHistogram completion;
+        // From the post to the poll of its completion.
+        NovaHistogram total;
+    };
+
     // Thread local. One thread has one RDMA RC Broker.
     class NovaRDMARCBroker : public NovaRDMABroker {
     public:
+        // buf holds the send and recv buffers of max_num_peers peers, 0 means
+        // end_points.size(). Peers beyond end_points can join with AddPeer.
         NovaRDMARCBroker(char *buf, int thread_id,
                          const std::vector<QPEndPoint> &end_points,
                          uint32_t max_num_sends,
@@ -30,10 +88,74 @@ namespace nova {
                          char *mr_buf,
                          uint64_t mr_size,
                          uint64_t rdma_port,
-                         NovaMsgCallback *callback);
+                         NovaMsgCallback *callback,
+                         uint32_t max_num_peers = 0);
 
         void Init(RdmaCtrl *rdma_ctrl);
 
+        // Connects to all peers concurrently. Each peer is retried with
+        // exponential backoff until timeout_us elapses, 0 waits forever.
+        // Returns true if all peers are connected.
+        bool Init(RdmaCtrl *rdma_ctrl, uint64_t timeout_us);
+
+        // Retries the peers that are not connected yet.
+        bool ConnectPeers(uint64_t timeout_us);
+
+        // Initializes the brokers of all threads of this node together. The
+        // MR and the QPs of all brokers are fetched from a peer node in one
+        // exchange, so setup cost grows with the number of nodes instead of
+        // nodes x threads. Returns true if all peers are connected.
+        static bool InitAll(RdmaCtrl *rdma_ctrl,
+                            const std::vector<NovaRDMARCBroker *> &brokers,
+                            uint64_t timeout_us);
+
+        // Server ids of the peers that are not connected yet.
+        std::vector<uint32_t> UnreachablePeers();
+
+        bool IsConnected(int remote_server_id);
+
+        // Adds a peer after Init. It is connected in the background; the
+        // other peers keep running. Check IsConnected before posting to it.
+        void AddPeer(const QPEndPoint &peer);
+
+        // Tells the peer to drop its QP to us and stops using the peer at
+        // once. The notification is sent in the background. The QP is
+        // destroyed in a later PollRQ once its pending requests completed
+        // and its connector gave up, so the caller never waits for the peer.
+        // The slot is then reused by the next AddPeer.
+        void RemovePeer(int remote_server_id);
+
+        // Call before Init. Peers are connected on the first post to them or
+        // the first request from them instead of in Init. A connection
+        // unused for idle_timeout_us is torn down on both sides, 0 keeps it.
+        // A post that cannot connect its peer within connect_timeout_us
+        // fails through NovaMsgCallback::ProcessRDMAError.
+        // All nodes must use lazy mode.
+        void SetLazyConnect(uint64_t idle_timeout_us,
+                            uint64_t connect_timeout_us = LAZY_CONNECT_TIMEOUT_US);
+
+        // Call before Init. IBV_QPT_UC QPs skip the ACKs of RC for WRITE,
+        // WRITE_WITH_IMM and SEND streams that tolerate loss: a request
+        // completes once it left the RNIC, and a lost one is not reported.
+        // UC has no RDMA READ. All nodes must use the same type.
+        void SetQPType(ibv_qp_type qp_type);
+
+        // A request is retried at most max_retries times before it fails.
+        // Requests also fail once their QP stayed broken for
+        // retry_timeout_us, so that a post to a dead peer with a full send
+        // queue returns.
+        void SetErrorPolicy(NovaErrorPolicy policy, uint32_t max_retries,
+                            uint64_t retry_timeout_us = RETRY_TIMEOUT_US);
+
+        // Timestamps every request when it is posted, when its doorbell
+        // rings and when its completion is polled, and keeps histograms per
+        // opcode and peer. Costs three clock reads per request.
+        void EnableLatencyStats(bool enable);
+
+        // Copies the histograms that have samples and clears them if reset.
+        // Call on the broker's thread.
+        std::vector<NovaOpLatency> LatencySnapshot(bool reset);
+
         uint64_t PostRead(char *localbuf, uint32_t size, int remote_server_id,
                           uint64_t local_offset,
                           uint64_t remote_addr, bool is_remote_offset);
@@ -47,6 +169,17 @@ namespace nova {
                   uint64_t remote_offset, bool is_remote_offset,
                   uint32_t imm_data);
 
+        uint64_t PostRead(const NovaItemHandle &local,
+                          const NovaRemoteItem &remote, uint32_t size,
+                          int remote_server_id);
+
+        uint64_t PostSend(const NovaItemHandle &local, uint32_t size,
+                          int remote_server_id, uint32_t imm_data);
+
+        uint64_t PostWrite(const NovaItemHandle &local,
+                           const NovaRemoteItem &remote, uint32_t size,
+                           int remote_server_id, uint32_t imm_data);
+
         void FlushPendingSends();
 
         void FlushPendingSends(int remote_server_id) override;
@@ -69,16 +202,153 @@ namespace nova {
 
         uint32_t thread_id() { return thread_id_; }
 
+        // A message, headers included, must be shorter than it.
+        uint32_t max_msg_size() { return max_msg_size_; }
+
     private:
         uint32_t to_qp_idx(uint32_t remote_server_id);
 
+        // Keys of our QP to a peer and of the peer's QP to us.
+        QPIdx MyQPIdx(uint32_t peer_server_id);
+
+        QPIdx PeerQPIdx(const QPEndPoint &peer);
+
+        void OpenDevice();
+
+        void CreateQP(int peer_id);
+
+        // Connects to end_points_[peer_id]. Gives up at deadline_us if it is
+        // not 0.
+        bool ConnectPeer(int peer_id, uint64_t deadline_us);
+
+        // Connects QPs of one or more brokers to the same peer node, given as
+        // (broker, peer index) pairs, using batched exchanges.
+        static bool
+        ConnectBatch(std::vector<std::pair<NovaRDMARCBroker *, int>> qps,
+                     uint64_t deadline_us);
+
+        void OnConnected(int peer_id);
+
+        void PostRecvAt(int peer_id, int recv_buf_index);
+
+        // Hands a received message of peer_id to the callback.
+        void DeliverRecv(int peer_id, const ibv_wc &wc);
+
+        // Moves the QP of peer_id to the error state and starts recovery.
+        void EnterError(int peer_id, bool notify_peer);
+
+        // Resets and reconnects the QP of peer_id once all its requests
+        // are flushed. The side that broke first asks the peer to reset,
+        // then waits for the peer's new attributes before it posts again;
+        // the peer connects with the attributes sent in the request.
+        void TryRecover(int peer_id);
+
+        // Runs the reset request and the query for the peer's new
+        // attributes on a helper thread. TryRecover picks up the result.
+        void StartResetHandshake(int peer_id);
+
+        // Retries or fails a request posted to a broken QP.
+        void FailOrRetry(int peer_id, uint64_t wr_id, ibv_wc_status status);
+
+        // Fails the requests of peer_id that wait for a reconnect.
+        void FailRetries(int peer_id);
+
+        // Backs off the next recovery attempt of peer_id.
+        void RetryRecoveryLater(int peer_id);
+
+        void PostRecorded(int peer_id, uint64_t wr_id);
+
+        // Stamps the first nwrs requests of the doorbell batch of peer_id.
+        void StampDoorbell(int peer_id, int nwrs);
+
+        void RecordLatency(int peer_id, uint64_t wr_id, uint64_t cqe_ns);
+
+        // Records the spans of a completed request for NovaTracer.
+        void TraceRequest(int peer_id, uint64_t wr_id, uint64_t cqe_ns);
+
+        // Requests are timestamped for latency stats or tracing.
+        bool stamping() {
+            return latency_stats_ || NovaTracer::enabled();
+        }
+
+        // Lazy mode. Connects peer_id if it is not connected yet. Returns
+        // false if it could not be connected in time.
+        bool EnsureConnected(int peer_id);
+
+        bool ConnectOnDemand(int peer_id);
+
+        // Serves a QP_CONNECT request on the connection handler's thread.
+        // Peers are only touched by the broker's thread, so it hands the
+        // request to ServeAccepts, which answers it through accept.
+        void AcceptPeer(const QPConnArg &arg, const QPAttr &remote_attr,
+                        const MemoryAttr &remote_mr, qp_accept_t accept);
+
+        // Accepts the QP_CONNECT requests handed over by AcceptPeer.
+        void ServeAccepts();
+
+        // Sleeps for at most timeout_us, or until AcceptPeer hands over a
+        // request, and serves the requests.
+        void WaitForAccepts(uint64_t timeout_us);
+
+        RCQP *Accept(const QPConnArg &arg, const QPAttr &remote_attr,
+                     const MemoryAttr &remote_mr);
+
+        // Starts removing peer_id. See RemovePeer.
+        void BeginRemoval(int peer_id, bool notify_peer);
+
+        // Moves peer_id to PEER_DRAINING and queues it for FinishRemovals.
+        // A peer that did not ask for it is told to drop its QP.
+        void StopPeer(int peer_id, bool notify_peer);
+
+        // Sends the peer a QP_DISCONNECT on the connector thread of its
+        // slot.
+        void NotifyDisconnect(int peer_id);
+
+        // Polls the requests of a draining peer_id. Returns true once they
+        // completed and its connector exited.
+        bool DrainPeer(int peer_id);
+
+        // Frees the slots of removed peers, and makes reclaimed peers
+        // PEER_IDLE, once they are drained.
+        void FinishRemovals();
+
+        // Waits for the connector of peer_id, tears it down and frees its
+        // slot.
+        void FinishRemoval(int peer_id);
+
+        // Destroys the QP of the drained peer_id.
+        void TearDownPeer(int peer_id);
+
+        // Starts tearing down the QP of peer_id. FinishRemovals makes it
+        // PEER_IDLE.
+        void Reclaim(int peer_id, bool notify_peer);
+
+        void ReclaimIdlePeers();
+
+        // Sets the slot of server_id and connects it in lazy mode. Returns
+        // false if it could not be connected; asserts that the peer is not
+        // being removed.
+        bool PreparePost(int server_id, uint32_t *qp_idx);
+
+        // Fails a request to the peer at qp_idx that could not be posted.
+        uint64_t FailPost(uint32_t qp_idx, ibv_wr_opcode opcode,
+                          const char *localbuf);
+
         uint64_t
         PostRDMASEND(const char *localbuf, ibv_wr_opcode type, uint32_t size,
-                     int qp_idx,
+                     int remote_server_id,
                      uint64_t local_offset,
                      uint64_t remote_addr, bool is_offset,
                      uint32_t imm_data);
 
+        // Posts to the slot qp_idx returned by PreparePost.
+        uint64_t
+        PostRDMASEND(const char *localbuf, ibv_wr_opcode type, uint32_t size,
+                     uint32_t qp_idx,
+                     uint64_t local_offset,
+                     uint64_t remote_addr, bool is_offset,
+                     uint32_t imm_data, uint32_t lkey, uint32_t rkey);
+
         const uint32_t my_server_id_;
         const char *mr_buf_;
         const uint64_t mr_size_;
@@ -88,13 +358,25 @@ namespace nova {
         const uint32_t doorbell_batch_size_;
 
         std::map<uint32_t, int> server_qp_idx_map;
+        // One slot per peer. Slots of removed peers are PEER_FREE.
         std::vector<QPEndPoint> end_points_;
+        // Connects peers added by AddPeer. A connector sets connector_done_
+        // of its slot when it exits.
+        std::vector<std::thread> connectors_;
+        std::atomic<bool> *connector_done_;
+        std::atomic<bool> *handshake_done_;
+        // Slots of removed or reclaimed peers that are still draining.
+        std::vector<int> removing_;
+        // The draining slot becomes PEER_IDLE instead of PEER_FREE.
+        std::vector<bool> reclaiming_;
         const int thread_id_;
         const char *rdma_buf_;
+        RdmaCtrl *rdma_ctrl_ = nullptr;
 
         // RDMA variables
         ibv_wc *wcs_;
         RCQP **qp_;
+        std::atomic<int> *peer_state_;
         char **rdma_send_buf_;
         char **rdma_recv_buf_;
 
@@ -106,6 +388,70 @@ namespace nova {
         int *npending_send_;
         int *psend_index_;
         NovaMsgCallback *callback_;
+
+        // A posted request, kept until it completes so that it can be posted
+        // again after its QP is reconnected.
+        struct PostedWR {
+            ibv_wr_opcode opcode;
+            uint64_t addr;
+            uint32_t size;
+            uint32_t lkey;
+            uint64_t remote_addr;
+            uint32_t rkey;
+            uint32_t imm_data;
+            uint32_t retries;
+            // Timestamps if latency stats or tracing are enabled.
+            uint64_t post_ns;
+            uint64_t doorbell_ns;
+            uint64_t trace_id;
+        };
+
+        struct PeerRecovery {
+            uint64_t next_attempt_us;
+            uint64_t backoff_us;
+            // Retried requests fail after it.
+            uint64_t deadline_us;
+            bool notify_peer;
+            // The QP was reset and its receives posted again.
+            bool qp_reset;
+            // The reset handshake and its result, valid once
+            // handshake_done_ is set.
+            std::thread handshake;
+            ConnStatus handshake_status;
+            QPAttr handshake_attr;
+            // requests to post again once reconnected, in posting order.
+            std::vector<uint64_t> retry_wrs;
+        };
+
+        PostedWR **posted_wrs_;
+        std::vector<PeerRecovery> recovery_;
+        NovaErrorPolicy error_policy_ = NOVA_ERROR_FAIL;
+        uint32_t max_retries_ = 0;
+        uint64_t retry_timeout_us_ = RETRY_TIMEOUT_US;
+
+        ibv_qp_type qp_type_ = IBV_QPT_RC;
+
+        bool lazy_ = false;
+        uint64_t idle_timeout_us_ = 0;
+        uint64_t connect_timeout_us_ = LAZY_CONNECT_TIMEOUT_US;
+        uint64_t *last_used_us_;
+
+        // A QP_CONNECT request on its way from AcceptPeer to ServeAccepts.
+        struct AcceptRequest {
+            QPConnArg arg;
+            QPAttr remote_attr;
+            MemoryAttr remote_mr;
+            qp_accept_t accept;
+        };
+
+        std::mutex accept_mutex_;
+        std::condition_variable accept_cv_;
+        std::deque<AcceptRequest> accepts_;
+        std::atomic<int> naccepts_{0};
+
+        bool latency_stats_ = false;
+        // peer_id * LAT_NUM_OPCODES + opcode, allocated on first use.
+        std::vector<NovaOpLatency *> latency_;
     };
 }
 
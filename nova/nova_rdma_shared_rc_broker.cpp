@@ -0,0 +1,518 @@
+//
+// Copyright (c) 2020 University of Southern California. All rights reserved.
+//
+
+#include <malloc.h>
+#include <algorithm>
+#include <thread>
+#include <fmt/core.h>
+#include "nova_rdma_shared_rc_broker.h"
+
+namespace nova {
+
+    namespace {
+        // The thread that posted a request or a receive buffer is kept in the
+        // upper 32 bits of its wr_id, the index of its buffer in the lower.
+        uint64_t SharedWRId(uint32_t thread_id, uint64_t index) {
+            return ((uint64_t) thread_id << 32) | index;
+        }
+
+        uint32_t SharedWRThread(uint64_t wr_id) {
+            return (uint32_t) (wr_id >> 32);
+        }
+
+        uint64_t SharedWRIndex(uint64_t wr_id) {
+            return wr_id & 0xFFFFFFFF;
+        }
+    }
+
+    NovaSharedRCQPs::NovaSharedRCQPs(const std::vector<QPEndPoint> &end_points,
+                                     uint32_t nthreads,
+                                     uint32_t max_num_sends,
+                                     uint32_t my_server_id, char *mr_buf,
+                                     uint64_t mr_size, uint64_t rdma_port) :
+            end_points_(end_points),
+            nthreads_(nthreads),
+            max_num_sends_(max_num_sends),
+            my_server_id_(my_server_id),
+            mr_buf_(mr_buf),
+            mr_size_(mr_size),
+            rdma_port_(rdma_port) {
+        RDMA_ASSERT(nthreads * max_num_sends <= RC_MAX_SEND_SIZE)
+            << fmt::format("{} threads x {} sends exceed the QP depth {}",
+                           nthreads, max_num_sends, RC_MAX_SEND_SIZE);
+        RDMA_ASSERT(nthreads < SHARED_QP_WORKER_ID);
+        qps_ = new SharedQP[end_points.size()];
+        inboxes_ = new Inbox[nthreads];
+        for (uint32_t i = 0; i < end_points.size(); i++) {
+            server_peer_map_[end_points[i].server_id] = i;
+        }
+    }
+
+    bool NovaSharedRCQPs::Init(RdmaCtrl *rdma_ctrl, uint64_t timeout_us) {
+        rdma_ctrl_ = rdma_ctrl;
+        RdmaCtrl::DevIdx idx{.dev_id = 0, .port_id = 1}; // using the first RNIC's first port
+        open_device_mutex.lock();
+        if (!is_device_opened) {
+            device = rdma_ctrl_->open_device(idx);
+            is_device_opened = true;
+            RDMA_ASSERT(
+                    rdma_ctrl_->register_memory(my_server_id_, mr_buf_,
+                                                mr_size_, device));
+        }
+        open_device_mutex.unlock();
+
+        // Create all QPs first so that peers find them when they connect.
+        MemoryAttr local_mr = rdma_ctrl_->get_local_mr(my_server_id_);
+        for (uint32_t peer_id = 0; peer_id < end_points_.size(); peer_id++) {
+            QPIdx my_rc_key = create_rc_idx(my_server_id_, SHARED_QP_WORKER_ID,
+                                            end_points_[peer_id].server_id);
+            ibv_cq *cq = rdma_ctrl_->create_cq(
+                    device, nthreads_ * max_num_sends_);
+            ibv_cq *recv_cq = rdma_ctrl_->create_cq(
+                    device, nthreads_ * max_num_sends_);
+            qps_[peer_id].qp = rdma_ctrl_->create_rc_qp(my_rc_key, device,
+                                                        &local_mr, cq,
+                                                        recv_cq);
+        }
+
+        uint64_t start = NowMicros();
+        uint64_t deadline_us = timeout_us == 0 ? 0 : start + timeout_us;
+        std::vector<std::thread> threads;
+        std::atomic<uint32_t> nconnected(0);
+        for (uint32_t peer_id = 0; peer_id < end_points_.size(); peer_id++) {
+            threads.emplace_back([this, peer_id, deadline_us, &nconnected]() {
+                if (ConnectPeer(peer_id, deadline_us)) {
+                    nconnected++;
+                }
+            });
+        }
+        for (auto &t : threads) {
+            t.join();
+        }
+        RDMA_LOG(INFO) << fmt::format(
+                    "rdma-shared-rc: connected {}/{} peers for {} threads in {} us",
+                    nconnected, end_points_.size(), nthreads_,
+                    NowMicros() - start);
+        return nconnected == end_points_.size();
+    }
+
+    bool NovaSharedRCQPs::ConnectPeer(int peer_id, uint64_t deadline_us) {
+        const QPEndPoint &peer = end_points_[peer_id];
+        RCQP *qp = qps_[peer_id].qp;
+        QPIdx peer_rc_key = create_rc_idx(peer.server_id, SHARED_QP_WORKER_ID,
+                                          my_server_id_);
+        QPConnArg arg = {};
+        arg.from_node = peer_rc_key.node_id;
+        arg.from_worker = peer_rc_key.worker_id;
+        arg.from_index = peer_rc_key.index;
+        arg.qp_type = IBV_QPT_RC;
+        uint64_t backoff = CONN_BACKOFF_MIN;
+        while (true) {
+            MemoryAttr remote_mr;
+            std::vector<QPAttr> attrs;
+            if (QPImpl::get_remote_batch(peer.host.ip, rdma_port_,
+                                         peer.server_id, {arg}, &remote_mr,
+                                         &attrs) == SUCC &&
+                attrs[0].qpn != 0) {
+                qp->bind_remote_mr(remote_mr);
+                if (qp->connect_with_attr(attrs[0]) == SUCC) {
+                    RDMA_LOG(INFO) << fmt::format(
+                                "rdma-shared-rc: connected to server {}:{}",
+                                peer.host.ip, peer.server_id);
+                    return true;
+                }
+            }
+            uint64_t now = NowMicros();
+            if (deadline_us != 0 && now >= deadline_us) {
+                RDMA_LOG(WARNING) << fmt::format(
+                            "rdma-shared-rc: server {}:{} is unreachable",
+                            peer.host.ip, peer.server_id);
+                return false;
+            }
+            usleep(deadline_us == 0 ? backoff : std::min(backoff,
+                                                         deadline_us - now));
+            backoff = std::min(backoff * 2, (uint64_t) CONN_BACKOFF_MAX);
+        }
+    }
+
+    void NovaSharedRCQPs::Poll(int peer_id, bool send_cq, ibv_wc *wcs) {
+        SharedQP &shared = qps_[peer_id];
+        if (!shared.lock.try_lock()) {
+            // Another thread is polling it and routes our completions too.
+            return;
+        }
+        ibv_cq *cq = send_cq ? shared.qp->cq_ : shared.qp->recv_cq_;
+        int n = ibv_poll_cq(cq, max_num_sends_, wcs);
+        // Route while holding the QP lock so that every thread sees its
+        // completions in order.
+        for (int i = 0; i < n; i++) {
+            Inbox &inbox = inboxes_[SharedWRThread(wcs[i].wr_id)];
+            inbox.lock.lock();
+            if (send_cq) {
+                inbox.sends.push_back({peer_id, wcs[i]});
+            } else {
+                inbox.recvs.push_back({peer_id, wcs[i]});
+            }
+            inbox.lock.unlock();
+        }
+        shared.lock.unlock();
+    }
+
+    NovaRDMASharedRCBroker::NovaRDMASharedRCBroker(char *buf, int thread_id,
+                                                   NovaSharedRCQPs *qps,
+                                                   uint32_t max_msg_size,
+                                                   uint32_t doorbell_batch_size,
+                                                   NovaMsgCallback *callback)
+            :
+            thread_id_(thread_id),
+            qps_(qps),
+            npeers_(qps->end_points_.size()),
+            max_num_sends_(qps->max_num_sends_),
+            max_msg_size_(max_msg_size),
+            doorbell_batch_size_(doorbell_batch_size),
+            callback_(callback) {
+        RDMA_ASSERT(thread_id >= 0 && (uint32_t) thread_id < qps->nthreads_);
+        wcs_ = (ibv_wc *) malloc(max_num_sends_ * sizeof(ibv_wc));
+        rdma_send_buf_ = (char **) malloc(npeers_ * sizeof(char *));
+        rdma_recv_buf_ = (char **) malloc(npeers_ * sizeof(char *));
+        posted_opcodes_ = (ibv_wr_opcode **) malloc(
+                npeers_ * sizeof(ibv_wr_opcode *));
+        send_sges_ = (struct ibv_sge **) malloc(
+                npeers_ * sizeof(struct ibv_sge *));
+        send_wrs_ = (ibv_send_wr **) malloc(
+                npeers_ * sizeof(struct ibv_send_wr *));
+        send_sge_index_ = (uint32_t *) malloc(npeers_ * sizeof(uint32_t));
+        npending_send_ = (uint32_t *) malloc(npeers_ * sizeof(uint32_t));
+        psend_index_ = (uint32_t *) malloc(npeers_ * sizeof(uint32_t));
+
+        uint64_t nsendbuf = max_num_sends_ * max_msg_size;
+        uint64_t nrecvbuf = max_num_sends_ * max_msg_size;
+        uint64_t nbuf = nsendbuf + nrecvbuf;
+        for (uint32_t i = 0; i < npeers_; i++) {
+            npending_send_[i] = 0;
+            psend_index_[i] = 0;
+            send_sge_index_[i] = 0;
+            rdma_recv_buf_[i] = buf + nbuf * i;
+            rdma_send_buf_[i] = rdma_recv_buf_[i] + nrecvbuf;
+            // Do not rely on the caller's memory being zero.
+            memset(rdma_recv_buf_[i], 0, nbuf);
+            posted_opcodes_[i] = (ibv_wr_opcode *) malloc(
+                    max_num_sends_ * sizeof(ibv_wr_opcode));
+            send_sges_[i] = (ibv_sge *) malloc(
+                    doorbell_batch_size * sizeof(struct ibv_sge));
+            send_wrs_[i] = (ibv_send_wr *) malloc(
+                    doorbell_batch_size * sizeof(struct ibv_send_wr));
+            for (uint32_t j = 0; j < doorbell_batch_size; j++) {
+                memset(&send_sges_[i][j], 0, sizeof(struct ibv_sge));
+                memset(&send_wrs_[i][j], 0, sizeof(struct ibv_send_wr));
+            }
+        }
+        RDMA_LOG(INFO) << "shared-rc[" << thread_id << "]: " << "created rdma";
+    }
+
+    int NovaRDMASharedRCBroker::to_peer_id(int server_id) {
+        // The map is shared by all threads and must not be modified.
+        auto it = qps_->server_peer_map_.find(server_id);
+        RDMA_ASSERT(it != qps_->server_peer_map_.end())
+            << fmt::format("shared-rc[{}]: unknown server {}", thread_id_,
+                           server_id);
+        return it->second;
+    }
+
+    void NovaRDMASharedRCBroker::Init(RdmaCtrl *rdma_ctrl) {
+        RDMA_ASSERT(qps_->rdma_ctrl_ != nullptr) << "call NovaSharedRCQPs::Init first";
+        for (uint32_t peer_id = 0; peer_id < npeers_; peer_id++) {
+            for (uint32_t i = 0; i < max_num_sends_; i++) {
+                PostRecv(qps_->end_points_[peer_id].server_id, i);
+            }
+        }
+        RDMA_LOG(INFO) << fmt::format(
+                    "RDMA shared-rc thread {} initialized, posted {} recvs to {} peers",
+                    thread_id_, max_num_sends_, npeers_);
+    }
+
+    uint64_t
+    NovaRDMASharedRCBroker::PostRDMASEND(const char *localbuf,
+                                         ibv_wr_opcode opcode, uint32_t size,
+                                         int server_id, uint64_t local_offset,
+                                         uint64_t remote_addr, bool is_offset,
+                                         uint32_t imm_data, uint32_t lkey,
+                                         uint32_t rkey) {
+        int peer_id = to_peer_id(server_id);
+        RCQP *qp = qps_->qps_[peer_id].qp;
+        uint64_t wr_id = psend_index_[peer_id];
+        const char *sendbuf = rdma_send_buf_[peer_id] + wr_id * max_msg_size_;
+        if (localbuf != nullptr) {
+            sendbuf = localbuf;
+        }
+        posted_opcodes_[peer_id][wr_id] = opcode;
+        uint32_t ssge_idx = send_sge_index_[peer_id];
+        ibv_sge *ssge = send_sges_[peer_id];
+        ibv_send_wr *swr = send_wrs_[peer_id];
+        ssge[ssge_idx].addr = (uintptr_t) sendbuf + local_offset;
+        ssge[ssge_idx].length = size;
+        ssge[ssge_idx].lkey = lkey;
+        swr[ssge_idx].wr_id = SharedWRId(thread_id_, wr_id);
+        swr[ssge_idx].sg_list = &ssge[ssge_idx];
+        swr[ssge_idx].num_sge = 1;
+        swr[ssge_idx].opcode = opcode;
+        swr[ssge_idx].imm_data = imm_data;
+        swr[ssge_idx].send_flags = IBV_SEND_SIGNALED;
+        if (is_offset) {
+            swr[ssge_idx].wr.rdma.remote_addr = qp->remote_mr_.buf + remote_addr;
+        } else {
+            swr[ssge_idx].wr.rdma.remote_addr = remote_addr;
+        }
+        swr[ssge_idx].wr.rdma.rkey = rkey;
+        if (ssge_idx + 1 < doorbell_batch_size_) {
+            swr[ssge_idx].next = &swr[ssge_idx + 1];
+        } else {
+            swr[ssge_idx].next = NULL;
+        }
+        psend_index_[peer_id]++;
+        npending_send_[peer_id]++;
+        send_sge_index_[peer_id]++;
+        RDMA_LOG(DEBUG) << fmt::format(
+                    "shared-rc[{}]: SQ: rdma {} request to server {} wr:{} imm:{} roffset:{} isoff:{} size:{} p:{}:{}",
+                    thread_id_, ibv_wr_opcode_str(opcode), server_id, wr_id,
+                    imm_data, remote_addr, is_offset, size,
+                    psend_index_[peer_id], npending_send_[peer_id]);
+        if (send_sge_index_[peer_id] == doorbell_batch_size_) {
+            FlushPendingSends(server_id);
+        }
+
+        while (npending_send_[peer_id] == max_num_sends_) {
+            // poll sq as it is full.
+            PollSQ(server_id);
+        }
+
+        if (psend_index_[peer_id] == max_num_sends_) {
+            psend_index_[peer_id] = 0;
+        }
+        return wr_id;
+    }
+
+    uint64_t
+    NovaRDMASharedRCBroker::PostRead(char *localbuf, uint32_t size,
+                                     int server_id, uint64_t local_offset,
+                                     uint64_t remote_addr, bool is_offset) {
+        RCQP *qp = qps_->qps_[to_peer_id(server_id)].qp;
+        return PostRDMASEND(localbuf, IBV_WR_RDMA_READ, size, server_id,
+                            local_offset, remote_addr, is_offset, 0,
+                            qp->local_mr_.key, qp->remote_mr_.key);
+    }
+
+    uint64_t
+    NovaRDMASharedRCBroker::PostSend(const char *localbuf, uint32_t size,
+                                     int server_id, uint32_t imm_data) {
+        ibv_wr_opcode wr = IBV_WR_SEND;
+        if (imm_data != 0) {
+            wr = IBV_WR_SEND_WITH_IMM;
+        }
+        RDMA_ASSERT(size < max_msg_size_);
+        RCQP *qp = qps_->qps_[to_peer_id(server_id)].qp;
+        return PostRDMASEND(localbuf, wr, size, server_id, 0, 0, false,
+                            imm_data, qp->local_mr_.key, qp->remote_mr_.key);
+    }
+
+    uint64_t
+    NovaRDMASharedRCBroker::PostWrite(const char *localbuf, uint32_t size,
+                                      int server_id, uint64_t remote_offset,
+                                      bool is_remote_offset,
+                                      uint32_t imm_data) {
+        ibv_wr_opcode wr = IBV_WR_RDMA_WRITE;
+        if (imm_data != 0) {
+            wr = IBV_WR_RDMA_WRITE_WITH_IMM;
+        }
+        RCQP *qp = qps_->qps_[to_peer_id(server_id)].qp;
+        return PostRDMASEND(localbuf, wr, size, server_id, 0, remote_offset,
+                            is_remote_offset, imm_data, qp->local_mr_.key,
+                            qp->remote_mr_.key);
+    }
+
+    uint64_t
+    NovaRDMASharedRCBroker::PostRead(const NovaItemHandle &local,
+                                     const NovaRemoteItem &remote,
+                                     uint32_t size, int server_id) {
+        RDMA_ASSERT(size <= local.size && size <= remote.size)
+            << fmt::format("read size:{} local:{} remote:{}", size,
+                           local.size, remote.size);
+        return PostRDMASEND(local.addr, IBV_WR_RDMA_READ, size, server_id, 0,
+                            remote.offset, true, 0, local.lkey, remote.rkey);
+    }
+
+    uint64_t
+    NovaRDMASharedRCBroker::PostSend(const NovaItemHandle &local,
+                                     uint32_t size, int server_id,
+                                     uint32_t imm_data) {
+        ibv_wr_opcode wr = IBV_WR_SEND;
+        if (imm_data != 0) {
+            wr = IBV_WR_SEND_WITH_IMM;
+        }
+        RDMA_ASSERT(size < max_msg_size_ && size <= local.size);
+        RCQP *qp = qps_->qps_[to_peer_id(server_id)].qp;
+        return PostRDMASEND(local.addr, wr, size, server_id, 0, 0, false,
+                            imm_data, local.lkey, qp->remote_mr_.key);
+    }
+
+    uint64_t
+    NovaRDMASharedRCBroker::PostWrite(const NovaItemHandle &local,
+                                      const NovaRemoteItem &remote,
+                                      uint32_t size, int server_id,
+                                      uint32_t imm_data) {
+        ibv_wr_opcode wr = IBV_WR_RDMA_WRITE;
+        if (imm_data != 0) {
+            wr = IBV_WR_RDMA_WRITE_WITH_IMM;
+        }
+        RDMA_ASSERT(size <= local.size && size <= remote.size)
+            << fmt::format("write size:{} local:{} remote:{}", size,
+                           local.size, remote.size);
+        return PostRDMASEND(local.addr, wr, size, server_id, 0,
+                            remote.offset, true, imm_data, local.lkey,
+                            remote.rkey);
+    }
+
+    void NovaRDMASharedRCBroker::FlushPendingSends(int server_id) {
+        int peer_id = to_peer_id(server_id);
+        if (send_sge_index_[peer_id] == 0) {
+            return;
+        }
+        send_wrs_[peer_id][send_sge_index_[peer_id] - 1].next = NULL;
+        send_sge_index_[peer_id] = 0;
+        // One doorbell per batch. The chains of different threads must not
+        // interleave on the QP.
+        NovaSharedRCQPs::SharedQP &shared = qps_->qps_[peer_id];
+        ibv_send_wr *bad_sr;
+        shared.lock.lock();
+        int ret = ibv_post_send(shared.qp->qp_, &send_wrs_[peer_id][0],
+                                &bad_sr);
+        shared.lock.unlock();
+        RDMA_ASSERT(ret == 0) << ret;
+    }
+
+    void NovaRDMASharedRCBroker::FlushPendingSends() {
+        for (uint32_t peer_id = 0; peer_id < npeers_; peer_id++) {
+            FlushPendingSends(qps_->end_points_[peer_id].server_id);
+        }
+    }
+
+    uint32_t NovaRDMASharedRCBroker::PollSQ(int server_id) {
+        int peer_id = to_peer_id(server_id);
+        if (npending_send_[peer_id] > 0) {
+            qps_->Poll(peer_id, true, wcs_);
+        }
+        return DrainSends();
+    }
+
+    uint32_t NovaRDMASharedRCBroker::PollSQ() {
+        for (uint32_t peer_id = 0; peer_id < npeers_; peer_id++) {
+            if (npending_send_[peer_id] > 0) {
+                qps_->Poll(peer_id, true, wcs_);
+            }
+        }
+        return DrainSends();
+    }
+
+    uint32_t NovaRDMASharedRCBroker::DrainSends() {
+        NovaSharedRCQPs::Inbox &inbox = qps_->inboxes_[thread_id_];
+        inbox.lock.lock();
+        drained_.swap(inbox.sends);
+        inbox.lock.unlock();
+        for (const NovaSharedRCQPs::Completion &c : drained_) {
+            int server_id = qps_->end_points_[c.peer_id].server_id;
+            uint64_t wr_id = SharedWRIndex(c.wc.wr_id);
+            char *buf = rdma_send_buf_[c.peer_id] + wr_id * max_msg_size_;
+            if (c.wc.status != IBV_WC_SUCCESS) {
+                RDMA_LOG(WARNING) << fmt::format(
+                            "shared-rc[{}]: SQ error wc status {} serverid {}",
+                            thread_id_, ibv_wc_status_str(c.wc.status),
+                            server_id);
+                callback_->ProcessRDMAError(posted_opcodes_[c.peer_id][wr_id],
+                                            wr_id, server_id, buf,
+                                            c.wc.status);
+            } else {
+                callback_->ProcessRDMAWC(c.wc.opcode, wr_id, server_id, buf,
+                                         c.wc.imm_data);
+            }
+            // Send is complete.
+            buf[0] = '~';
+            npending_send_[c.peer_id] -= 1;
+        }
+        uint32_t n = drained_.size();
+        drained_.clear();
+        return n;
+    }
+
+    void NovaRDMASharedRCBroker::PostRecv(int server_id, int recv_buf_index) {
+        int peer_id = to_peer_id(server_id);
+        char *local_buf =
+                rdma_recv_buf_[peer_id] + max_msg_size_ * recv_buf_index;
+        local_buf[0] = '~';
+        NovaSharedRCQPs::SharedQP &shared = qps_->qps_[peer_id];
+        shared.lock.lock();
+        auto ret = shared.qp->post_recv(local_buf, max_msg_size_,
+                                        SharedWRId(thread_id_,
+                                                   recv_buf_index));
+        shared.lock.unlock();
+        RDMA_ASSERT(ret == SUCC) << ret;
+    }
+
+    void NovaRDMASharedRCBroker::FlushPendingRecvs() {}
+
+    uint32_t NovaRDMASharedRCBroker::PollRQ(int server_id) {
+        qps_->Poll(to_peer_id(server_id), false, wcs_);
+        uint32_t n = DrainRecvs();
+        // Flush all pending send requests.
+        FlushPendingSends(server_id);
+        return n;
+    }
+
+    uint32_t NovaRDMASharedRCBroker::PollRQ() {
+        for (uint32_t peer_id = 0; peer_id < npeers_; peer_id++) {
+            qps_->Poll(peer_id, false, wcs_);
+        }
+        uint32_t n = DrainRecvs();
+        FlushPendingSends();
+        return n;
+    }
+
+    uint32_t NovaRDMASharedRCBroker::DrainRecvs() {
+        NovaSharedRCQPs::Inbox &inbox = qps_->inboxes_[thread_id_];
+        inbox.lock.lock();
+        drained_.swap(inbox.recvs);
+        inbox.lock.unlock();
+        for (const NovaSharedRCQPs::Completion &c : drained_) {
+            int server_id = qps_->end_points_[c.peer_id].server_id;
+            uint64_t wr_id = SharedWRIndex(c.wc.wr_id);
+            RDMA_ASSERT(wr_id < max_num_sends_);
+            if (c.wc.status != IBV_WC_SUCCESS) {
+                // The shared QP is not recovered; its peer is lost.
+                RDMA_LOG(WARNING) << fmt::format(
+                            "shared-rc[{}]: RQ error wc status {} serverid {}",
+                            thread_id_, ibv_wc_status_str(c.wc.status),
+                            server_id);
+                continue;
+            }
+            char *buf = rdma_recv_buf_[c.peer_id] + max_msg_size_ * wr_id;
+            NovaTraceIdScope trace_scope(0);
+            callback_->ProcessRDMAWC(c.wc.opcode, wr_id, server_id, buf,
+                                     c.wc.imm_data);
+            // Post another receive event.
+            PostRecv(server_id, wr_id);
+        }
+        uint32_t n = drained_.size();
+        drained_.clear();
+        return n;
+    }
+
+    char *NovaRDMASharedRCBroker::GetSendBuf() {
+        return NULL;
+    }
+
+    char *NovaRDMASharedRCBroker::GetSendBuf(int server_id) {
+        int peer_id = to_peer_id(server_id);
+        return rdma_send_buf_[peer_id] +
+               psend_index_[peer_id] * max_msg_size_;
+    }
+}
@@ -0,0 +1,196 @@
+//
+// Copyright (c) 2020 University of Southern California. All rights reserved.
+//
+
+#ifndef RLIB_NOVA_RDMA_SHARED_RC_BROKER_H
+#define RLIB_NOVA_RDMA_SHARED_RC_BROKER_H
+
+#include <fmt/core.h>
+#include <map>
+#include <vector>
+
+#include "rdma_ctrl.hpp"
+#include "nova_rdma_broker.h"
+#include "nova_rdma_rc_broker.h"
+#include "nova_msg_callback.h"
+#include "nova_common.h"
+
+// Shared QPs are keyed with this worker id so that they do not collide with
+// the per-thread QPs of NovaRDMARCBroker.
+#define SHARED_QP_WORKER_ID 255
+
+namespace nova {
+
+    using namespace rdmaio;
+
+    class NovaRDMASharedRCBroker;
+
+    // One RC QP per peer node, shared by the brokers of all threads of this
+    // node. A node then has peers QPs instead of threads x peers, which keeps
+    // the QP contexts in the RNIC's cache at scale. All nodes must use it.
+    class NovaSharedRCQPs {
+    public:
+        // end_points has one entry per peer node, thread_id is ignored.
+        // Every thread may have max_num_sends requests outstanding per peer.
+        NovaSharedRCQPs(const std::vector<QPEndPoint> &end_points,
+                        uint32_t nthreads,
+                        uint32_t max_num_sends,
+                        uint32_t my_server_id,
+                        char *mr_buf,
+                        uint64_t mr_size,
+                        uint64_t rdma_port);
+
+        // Connects to all peers concurrently, retrying each until timeout_us
+        // elapses, 0 waits forever. Call before the Init of the brokers.
+        // Returns true if all peers are connected.
+        bool Init(RdmaCtrl *rdma_ctrl, uint64_t timeout_us);
+
+        uint32_t nthreads() { return nthreads_; }
+
+    private:
+        friend class NovaRDMASharedRCBroker;
+
+        struct Completion {
+            int peer_id;
+            ibv_wc wc;
+        };
+
+        // Completions of the requests and receive buffers of one thread.
+        struct Inbox {
+            NovaSpinLock lock;
+            std::vector<Completion> sends;
+            std::vector<Completion> recvs;
+        };
+
+        struct SharedQP {
+            RCQP *qp = nullptr;
+            // Held to post a doorbell batch or to poll the CQs of the QP.
+            NovaSpinLock lock;
+        };
+
+        bool ConnectPeer(int peer_id, uint64_t deadline_us);
+
+        // Polls a CQ of the QP of peer_id and moves the completions to the
+        // inboxes of the threads that posted them. Does nothing if another
+        // thread is polling it already.
+        void Poll(int peer_id, bool send_cq, ibv_wc *wcs);
+
+        const std::vector<QPEndPoint> end_points_;
+        const uint32_t nthreads_;
+        const uint32_t max_num_sends_;
+        const uint32_t my_server_id_;
+        const char *mr_buf_;
+        const uint64_t mr_size_;
+        const uint64_t rdma_port_;
+        RdmaCtrl *rdma_ctrl_ = nullptr;
+
+        std::map<uint32_t, int> server_peer_map_;
+        SharedQP *qps_;
+        Inbox *inboxes_;
+    };
+
+    // Thread local. Posts through the QPs of a NovaSharedRCQPs. A request
+    // completes on the thread that posted it. A message is received by the
+    // thread whose receive buffer the RNIC consumed, which may not be the
+    // thread the sender had in mind. Put the target thread in the message or
+    // in imm_data if it matters.
+    class NovaRDMASharedRCBroker : public NovaRDMABroker {
+    public:
+        // buf has the same layout as for NovaRDMARCBroker, with one slot per
+        // peer of qps.
+        NovaRDMASharedRCBroker(char *buf, int thread_id,
+                               NovaSharedRCQPs *qps,
+                               uint32_t max_msg_size,
+                               uint32_t doorbell_batch_size,
+                               NovaMsgCallback *callback);
+
+        // Posts the receive buffers. qps must be initialized.
+        void Init(RdmaCtrl *rdma_ctrl);
+
+        uint64_t PostRead(char *localbuf, uint32_t size, int remote_server_id,
+                          uint64_t local_offset,
+                          uint64_t remote_addr, bool is_remote_offset);
+
+        uint64_t
+        PostSend(const char *localbuf, uint32_t size, int remote_server_id,
+                 uint32_t imm_data);
+
+        uint64_t
+        PostWrite(const char *localbuf, uint32_t size, int remote_server_id,
+                  uint64_t remote_offset, bool is_remote_offset,
+                  uint32_t imm_data);
+
+        uint64_t PostRead(const NovaItemHandle &local,
+                          const NovaRemoteItem &remote, uint32_t size,
+                          int remote_server_id);
+
+        uint64_t PostSend(const NovaItemHandle &local, uint32_t size,
+                          int remote_server_id, uint32_t imm_data);
+
+        uint64_t PostWrite(const NovaItemHandle &local,
+                           const NovaRemoteItem &remote, uint32_t size,
+                           int remote_server_id, uint32_t imm_data);
+
+        void FlushPendingSends();
+
+        void FlushPendingSends(int remote_server_id) override;
+
+        uint32_t PollSQ(int remote_server_id);
+
+        uint32_t PollSQ();
+
+        void PostRecv(int remote_server_id, int recv_buf_index);
+
+        void FlushPendingRecvs();
+
+        uint32_t PollRQ();
+
+        uint32_t PollRQ(int remote_server_id);
+
+        char *GetSendBuf();
+
+        char *GetSendBuf(int remote_server_id);
+
+        uint32_t thread_id() { return thread_id_; }
+
+    private:
+        int to_peer_id(int server_id);
+
+        uint64_t
+        PostRDMASEND(const char *localbuf, ibv_wr_opcode type, uint32_t size,
+                     int server_id,
+                     uint64_t local_offset,
+                     uint64_t remote_addr, bool is_offset,
+                     uint32_t imm_data, uint32_t lkey, uint32_t rkey);
+
+        // Processes the completions routed to this thread.
+        uint32_t DrainSends();
+
+        uint32_t DrainRecvs();
+
+        const int thread_id_;
+        NovaSharedRCQPs *qps_;
+        const uint32_t npeers_;
+        const uint32_t max_num_sends_;
+        const uint32_t max_msg_size_;
+        const uint32_t doorbell_batch_size_;
+        NovaMsgCallback *callback_;
+
+        ibv_wc *wcs_;
+        std::vector<NovaSharedRCQPs::Completion> drained_;
+        char **rdma_send_buf_;
+        char **rdma_recv_buf_;
+        // Opcode of each outstanding request, reported if it fails.
+        ibv_wr_opcode **posted_opcodes_;
+
+        struct ibv_sge **send_sges_;
+        ibv_send_wr **send_wrs_;
+        uint32_t *send_sge_index_;
+
+        // pending sends.
+        uint32_t *npending_send_;
+        uint32_t *psend_index_;
+    };
+}
+
+#endif //RLIB_NOVA_RDMA_SHARED_RC_BROKER_H
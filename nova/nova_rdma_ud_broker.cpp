@@ -0,0 +1,573 @@
+//
+// Copyright (c) 2020 University of Southern California. All rights reserved.
+//
+
+#include <malloc.h>
+#include <algorithm>
+#include <fmt/core.h>
+#include "nova_rdma_ud_broker.h"
+
+namespace nova {
+
+    namespace {
+        // a is before b in a wrapping sequence space.
+        bool SeqBefore(uint32_t a, uint32_t b) {
+            return (int32_t) (a - b) < 0;
+        }
+    }
+
+    NovaRDMAUDBroker::NovaRDMAUDBroker(char *buf, int thread_id,
+                                       const std::vector<QPEndPoint> &end_points,
+                                       uint32_t max_num_sends,
+                                       uint32_t max_msg_size,
+                                       uint32_t nrecvs,
+                                       uint32_t my_server_id, char *mr_buf,
+                                       uint64_t mr_size, uint64_t rdma_port,
+                                       NovaMsgCallback *callback) :
+            thread_id_(thread_id),
+            end_points_(end_points),
+            max_num_sends_(max_num_sends),
+            max_msg_size_(max_msg_size),
+            nrecvs_(nrecvs),
+            my_server_id_(my_server_id),
+            mr_buf_(mr_buf),
+            mr_size_(mr_size),
+            rdma_port_(rdma_port),
+            callback_(callback),
+            rdma_buf_(buf) {
+        RDMA_ASSERT(nrecvs <= RC_MAX_RECV_SIZE)
+            << fmt::format("{} recvs exceed the QP depth {}", nrecvs,
+                           RC_MAX_RECV_SIZE);
+        RDMA_ASSERT(max_num_sends <= RC_MAX_SEND_SIZE);
+        peers_.resize(end_points.size());
+        for (uint32_t i = 0; i < end_points.size(); i++) {
+            server_peer_map_[end_points[i].server_id] = i;
+            peers_[i].reasm_buf = (char *) malloc(max_msg_size);
+        }
+        ready_buf_ = (char *) malloc((uint64_t) nrecvs * UD_MAX_MTU);
+        for (uint32_t i = 0; i < nrecvs; i++) {
+            free_ready_.push_back(nrecvs - 1 - i);
+        }
+        wcs_ = (ibv_wc *) malloc(max_num_sends * sizeof(ibv_wc));
+        send_sges_ = (ibv_sge *) malloc(max_num_sends * sizeof(ibv_sge));
+        send_wrs_ = (ibv_send_wr *) malloc(
+                max_num_sends * sizeof(ibv_send_wr));
+        memset(send_sges_, 0, max_num_sends * sizeof(ibv_sge));
+        memset(send_wrs_, 0, max_num_sends * sizeof(ibv_send_wr));
+        // Do not rely on the caller's memory being zero.
+        memset(rdma_buf_, 0, BufSize(end_points.size(), max_num_sends,
+                                     max_msg_size, nrecvs));
+        RDMA_LOG(INFO) << fmt::format(
+                    "ud[{}]: create rdma {} {} {} {} peers", thread_id_,
+                    max_num_sends_, max_msg_size_, nrecvs_,
+                    end_points.size());
+    }
+
+    // [nrecvs receive buffers][per peer: send slots | packet ring]
+    uint64_t NovaRDMAUDBroker::BufSize(uint32_t npeers, uint32_t max_num_sends,
+                                       uint32_t max_msg_size,
+                                       uint32_t nrecvs) {
+        return (uint64_t) nrecvs * (UD_GRH_SIZE + UD_MAX_MTU) +
+               (uint64_t) npeers * max_num_sends *
+               (max_msg_size + UD_MAX_MTU);
+    }
+
+    char *NovaRDMAUDBroker::RecvBuf(uint64_t recv_buf_index) {
+        return rdma_buf_ + recv_buf_index * (UD_GRH_SIZE + UD_MAX_MTU);
+    }
+
+    char *NovaRDMAUDBroker::ReadyBuf(uint32_t slot) {
+        return ready_buf_ + (uint64_t) slot * UD_MAX_MTU;
+    }
+
+    char *NovaRDMAUDBroker::SendSlot(int peer_id, uint64_t wr_id) {
+        uint64_t npeer = (uint64_t) max_num_sends_ *
+                         (max_msg_size_ + UD_MAX_MTU);
+        return RecvBuf(nrecvs_) + peer_id * npeer + wr_id * max_msg_size_;
+    }
+
+    char *NovaRDMAUDBroker::Packet(int peer_id, uint32_t seq) {
+        return SendSlot(peer_id, max_num_sends_) +
+               (uint64_t) (seq % max_num_sends_) * UD_MAX_MTU;
+    }
+
+    int NovaRDMAUDBroker::to_peer_id(int server_id) {
+        auto it = server_peer_map_.find(server_id);
+        RDMA_ASSERT(it != server_peer_map_.end())
+            << fmt::format("ud[{}]: unknown server {}", thread_id_,
+                           server_id);
+        return it->second;
+    }
+
+    void NovaRDMAUDBroker::Init(RdmaCtrl *rdma_ctrl) {
+        Init(rdma_ctrl, 0);
+    }
+
+    bool NovaRDMAUDBroker::Init(RdmaCtrl *rdma_ctrl, uint64_t timeout_us) {
+        rdma_ctrl_ = rdma_ctrl;
+        RdmaCtrl::DevIdx idx{.dev_id = 0, .port_id = 1}; // using the first RNIC's first port
+        open_device_mutex.lock();
+        if (!is_device_opened) {
+            device = rdma_ctrl_->open_device(idx);
+            is_device_opened = true;
+            RDMA_ASSERT(
+                    rdma_ctrl_->register_memory(my_server_id_, mr_buf_,
+                                                mr_size_, device));
+        }
+        open_device_mutex.unlock();
+
+        ibv_port_attr port_attr;
+        RDMA_ASSERT(ibv_query_port(device->ctx, device->port_id,
+                                   &port_attr) == 0) << strerror(errno);
+        mtu_ = convert_mtu(port_attr.active_mtu);
+        RDMA_ASSERT(mtu_ <= UD_MAX_MTU) << mtu_;
+        max_payload_ = mtu_ - sizeof(NovaUDHeader);
+        uint32_t max_packets = (max_msg_size_ + max_payload_ - 1) /
+                               max_payload_;
+        RDMA_ASSERT(max_packets <= max_num_sends_)
+            << fmt::format("a message of {} bytes needs {} packets of MTU {}",
+                           max_msg_size_, max_packets, mtu_);
+
+        MemoryAttr local_mr = rdma_ctrl_->get_local_mr(my_server_id_);
+        qp_ = rdma_ctrl_->create_ud_qp(create_ud_idx(thread_id_, UD_ID_BASE),
+                                       device, &local_mr);
+        for (uint32_t i = 0; i < nrecvs_; i++) {
+            PostRecv(0, i);
+        }
+        // peers may fetch it now.
+        qp_->set_ready();
+
+        // The address handles are kept by the broker, not by the QP, so
+        // that the number of peers is not capped by MAX_SERVER_SUPPORTED.
+        uint64_t start = NowMicros();
+        uint64_t deadline_us = timeout_us == 0 ? 0 : start + timeout_us;
+        uint64_t backoff = CONN_BACKOFF_MIN;
+        std::vector<int> remaining;
+        for (uint32_t peer_id = 0; peer_id < peers_.size(); peer_id++) {
+            remaining.push_back(peer_id);
+        }
+        while (!remaining.empty()) {
+            std::vector<int> unreachable;
+            for (int peer_id : remaining) {
+                const QPEndPoint &peer = end_points_[peer_id];
+                ConnArg arg = {};
+                ConnReply reply = {};
+                arg.type = ConnArg::QP;
+                arg.payload.qp.from_worker = peer.thread_id;
+                arg.payload.qp.from_index = UD_ID_BASE;
+                arg.payload.qp.qp_type = IBV_QPT_UD;
+                if (QPImpl::get_remote_helper(&arg, &reply, peer.host.ip,
+                                              rdma_port_) != SUCC) {
+                    unreachable.push_back(peer_id);
+                    continue;
+                }
+                peers_[peer_id].ah = UDQPImpl::create_ah(device,
+                                                         reply.payload.qp);
+                peers_[peer_id].qpn = reply.payload.qp.qpn;
+            }
+            remaining.swap(unreachable);
+            if (remaining.empty()) {
+                break;
+            }
+            uint64_t now = NowMicros();
+            if (deadline_us != 0 && now >= deadline_us) {
+                break;
+            }
+            usleep(deadline_us == 0 ? backoff : std::min(backoff,
+                                                         deadline_us - now));
+            backoff = std::min(backoff * 2, (uint64_t) CONN_BACKOFF_MAX);
+        }
+        RDMA_LOG(INFO) << fmt::format(
+                    "RDMA ud thread {} initialized: mtu {}, {}/{} peers reachable in {} us",
+                    thread_id_, mtu_, peers_.size() - remaining.size(),
+                    peers_.size(), NowMicros() - start);
+        return remaining.empty();
+    }
+
+    void NovaRDMAUDBroker::PostPackets(int peer_id, uint32_t from_seq,
+                                       uint32_t to_seq) {
+        UDPeer &peer = peers_[peer_id];
+        uint32_t n = to_seq - from_seq;
+        RDMA_ASSERT(n > 0 && n <= max_num_sends_);
+        while (nposted_ + n > RC_MAX_SEND_SIZE) {
+            PollSendCQ();
+        }
+        for (uint32_t i = 0; i < n; i++) {
+            char *pkt = Packet(peer_id, from_seq + i);
+            NovaUDHeader *hdr = (NovaUDHeader *) pkt;
+            // a retransmission carries the latest ack.
+            hdr->ack = peer.expected_seq;
+            send_sges_[i].addr = (uintptr_t) pkt;
+            send_sges_[i].length = sizeof(NovaUDHeader) + hdr->payload_size;
+            send_sges_[i].lkey = qp_->local_mr_.key;
+            send_wrs_[i].wr_id = from_seq + i;
+            send_wrs_[i].sg_list = &send_sges_[i];
+            send_wrs_[i].num_sge = 1;
+            send_wrs_[i].opcode = IBV_WR_SEND;
+            send_wrs_[i].send_flags = IBV_SEND_SIGNALED;
+            send_wrs_[i].wr.ud.ah = peer.ah;
+            send_wrs_[i].wr.ud.remote_qpn = peer.qpn;
+            send_wrs_[i].wr.ud.remote_qkey = DEFAULT_QKEY;
+            send_wrs_[i].next = i + 1 < n ? &send_wrs_[i + 1] : NULL;
+        }
+        ibv_send_wr *bad_sr;
+        int ret = ibv_post_send(qp_->qp_, &send_wrs_[0], &bad_sr);
+        RDMA_ASSERT(ret == 0) << ret;
+        nposted_ += n;
+        // the ack is piggybacked.
+        peer.ack_due = false;
+    }
+
+    void NovaRDMAUDBroker::SendAck(int peer_id) {
+        UDPeer &peer = peers_[peer_id];
+        while (nposted_ + 1 > RC_MAX_SEND_SIZE) {
+            PollSendCQ();
+        }
+        NovaUDHeader hdr = {};
+        hdr.src_server_id = my_server_id_;
+        hdr.ack = peer.expected_seq;
+        hdr.type = UD_PACKET_ACK;
+        // small enough to be inlined, so hdr may live on the stack.
+        ibv_sge sge = {};
+        sge.addr = (uintptr_t) &hdr;
+        sge.length = sizeof(hdr);
+        ibv_send_wr wr = {};
+        wr.sg_list = &sge;
+        wr.num_sge = 1;
+        wr.opcode = IBV_WR_SEND;
+        wr.send_flags = IBV_SEND_SIGNALED | IBV_SEND_INLINE;
+        wr.wr.ud.ah = peer.ah;
+        wr.wr.ud.remote_qpn = peer.qpn;
+        wr.wr.ud.remote_qkey = DEFAULT_QKEY;
+        ibv_send_wr *bad_sr;
+        int ret = ibv_post_send(qp_->qp_, &wr, &bad_sr);
+        RDMA_ASSERT(ret == 0) << ret;
+        nposted_++;
+        peer.ack_due = false;
+    }
+
+    uint64_t
+    NovaRDMAUDBroker::PostSend(const char *localbuf, uint32_t size,
+                               int server_id, uint32_t imm_data) {
+        RDMA_ASSERT(size < max_msg_size_);
+        int peer_id = to_peer_id(server_id);
+        UDPeer &peer = peers_[peer_id];
+        RDMA_ASSERT(peer.ah != nullptr)
+            << fmt::format("ud[{}]: server {} is not reachable", thread_id_,
+                           server_id);
+        uint64_t wr_id = peer.psend_index;
+        const char *msg = localbuf;
+        if (msg == nullptr) {
+            msg = SendSlot(peer_id, wr_id);
+        }
+        uint32_t npackets = std::max((uint32_t) 1,
+                                     (size + max_payload_ - 1) / max_payload_);
+        while (max_num_sends_ - (peer.next_seq - peer.acked_seq) < npackets) {
+            // the window is full.
+            PollSQ();
+        }
+
+        bool idle = peer.next_seq == peer.acked_seq;
+        uint32_t from_seq = peer.next_seq;
+        uint32_t offset = 0;
+        for (uint32_t i = 0; i < npackets; i++) {
+            char *pkt = Packet(peer_id, peer.next_seq);
+            NovaUDHeader *hdr = (NovaUDHeader *) pkt;
+            hdr->src_server_id = my_server_id_;
+            hdr->seq = peer.next_seq;
+            hdr->msg_size = size;
+            hdr->payload_size = std::min(max_payload_, size - offset);
+            hdr->imm_data = imm_data;
+            hdr->type = UD_PACKET_DATA;
+            hdr->last = i + 1 == npackets;
+            memcpy(pkt + sizeof(NovaUDHeader), msg + offset,
+                   hdr->payload_size);
+            offset += hdr->payload_size;
+            peer.next_seq++;
+        }
+        PostPackets(peer_id, from_seq, peer.next_seq);
+        if (idle) {
+            peer.last_tx_us = NowMicros();
+            peer.rto_us = UD_RTO_MIN;
+        }
+        peer.msgs.push_back({wr_id, peer.next_seq});
+        peer.npending++;
+        peer.psend_index++;
+        if (peer.psend_index == max_num_sends_) {
+            peer.psend_index = 0;
+        }
+        RDMA_LOG(DEBUG) << fmt::format(
+                    "ud[{}]: SQ: send to server {} wr:{} imm:{} size:{} seq:[{},{})",
+                    thread_id_, server_id, wr_id, imm_data, size, from_seq,
+                    peer.next_seq);
+
+        while (peer.npending == max_num_sends_) {
+            // poll sq as it is full.
+            PollSQ();
+        }
+        return wr_id;
+    }
+
+    uint64_t
+    NovaRDMAUDBroker::PostSend(const NovaItemHandle &local, uint32_t size,
+                               int server_id, uint32_t imm_data) {
+        RDMA_ASSERT(size <= local.size);
+        // the message is copied into packets.
+        return PostSend(local.addr, size, server_id, imm_data);
+    }
+
+    uint64_t
+    NovaRDMAUDBroker::PostRead(char *localbuf, uint32_t size, int server_id,
+                               uint64_t local_offset, uint64_t remote_addr,
+                               bool is_offset) {
+        RDMA_ASSERT(false) << "UD supports SEND only";
+        return 0;
+    }
+
+    uint64_t
+    NovaRDMAUDBroker::PostWrite(const char *localbuf, uint32_t size,
+                                int server_id, uint64_t remote_offset,
+                                bool is_remote_offset, uint32_t imm_data) {
+        RDMA_ASSERT(false) << "UD supports SEND only";
+        return 0;
+    }
+
+    uint64_t
+    NovaRDMAUDBroker::PostRead(const NovaItemHandle &local,
+                               const NovaRemoteItem &remote, uint32_t size,
+                               int server_id) {
+        RDMA_ASSERT(false) << "UD supports SEND only";
+        return 0;
+    }
+
+    uint64_t
+    NovaRDMAUDBroker::PostWrite(const NovaItemHandle &local,
+                                const NovaRemoteItem &remote, uint32_t size,
+                                int server_id, uint32_t imm_data) {
+        RDMA_ASSERT(false) << "UD supports SEND only";
+        return 0;
+    }
+
+    void NovaRDMAUDBroker::FlushPendingSends() {}
+
+    void NovaRDMAUDBroker::FlushPendingSends(int remote_server_id) {}
+
+    void NovaRDMAUDBroker::PollSendCQ() {
+        int n = ibv_poll_cq(qp_->cq_, max_num_sends_, wcs_);
+        for (int i = 0; i < n; i++) {
+            // a lost packet is retransmitted after the timeout.
+            RDMA_LOG_IF(WARNING, wcs_[i].status != IBV_WC_SUCCESS)
+                << fmt::format("ud[{}]: SQ error wc status {}", thread_id_,
+                               ibv_wc_status_str(wcs_[i].status));
+        }
+        nposted_ -= n;
+    }
+
+    uint32_t NovaRDMAUDBroker::ProcessAck(int peer_id, uint32_t ack) {
+        UDPeer &peer = peers_[peer_id];
+        if (!SeqBefore(peer.acked_seq, ack) ||
+            SeqBefore(peer.next_seq, ack)) {
+            // stale or bogus.
+            return 0;
+        }
+        peer.acked_seq = ack;
+        peer.last_tx_us = NowMicros();
+        peer.rto_us = UD_RTO_MIN;
+        int server_id = end_points_[peer_id].server_id;
+        uint32_t n = 0;
+        while (!peer.msgs.empty() &&
+               !SeqBefore(ack, peer.msgs.front().end_seq)) {
+            uint64_t wr_id = peer.msgs.front().wr_id;
+            peer.msgs.pop_front();
+            char *buf = SendSlot(peer_id, wr_id);
+            callback_->ProcessRDMAWC(IBV_WC_SEND, wr_id, server_id, buf, 0);
+            // Send is complete.
+            buf[0] = '~';
+            peer.npending--;
+            n++;
+        }
+        return n;
+    }
+
+    uint32_t NovaRDMAUDBroker::PollRecvCQ() {
+        uint32_t ncompleted = 0;
+        int n = ibv_poll_cq(qp_->recv_queue(), max_num_sends_, wcs_);
+        for (int i = 0; i < n; i++) {
+            uint64_t wr_id = wcs_[i].wr_id;
+            if (wcs_[i].status != IBV_WC_SUCCESS) {
+                RDMA_LOG(WARNING) << fmt::format(
+                            "ud[{}]: RQ error wc status {}", thread_id_,
+                            ibv_wc_status_str(wcs_[i].status));
+                PostRecv(0, wr_id);
+                continue;
+            }
+            const NovaUDHeader *hdr =
+                    (const NovaUDHeader *) (RecvBuf(wr_id) + UD_GRH_SIZE);
+            auto it = server_peer_map_.find(hdr->src_server_id);
+            if (it == server_peer_map_.end()) {
+                PostRecv(0, wr_id);
+                continue;
+            }
+            int peer_id = it->second;
+            ncompleted += ProcessAck(peer_id, hdr->ack);
+            if (hdr->type != UD_PACKET_DATA) {
+                PostRecv(0, wr_id);
+                continue;
+            }
+            UDPeer &peer = peers_[peer_id];
+            if (!peer.ack_due) {
+                peer.ack_due = true;
+                ack_due_peers_.push_back(peer_id);
+            }
+            if (hdr->seq != peer.expected_seq || free_ready_.empty()) {
+                // a duplicate or a packet after a lost one, or PollRQ is
+                // behind. The ack tells the sender where to resume.
+                PostRecv(0, wr_id);
+                continue;
+            }
+            // Copied out so that the receive is posted again at once: acks
+            // keep arriving while a callback blocks in PostSend and PollRQ
+            // is not called. Acked once queued, so that a peer blocked in
+            // PostSend does not wait for our PollRQ either.
+            uint32_t slot = free_ready_.back();
+            free_ready_.pop_back();
+            memcpy(ReadyBuf(slot), hdr, sizeof(NovaUDHeader) +
+                                        std::min(hdr->payload_size,
+                                                 max_payload_));
+            PostRecv(0, wr_id);
+            peer.expected_seq++;
+            ready_recvs_.push_back(std::make_pair(peer_id, slot));
+        }
+        return ncompleted;
+    }
+
+    void NovaRDMAUDBroker::SendDueAcks() {
+        std::vector<int> peers;
+        peers.swap(ack_due_peers_);
+        for (int peer_id : peers) {
+            // skipped if the ack went out with data.
+            if (peers_[peer_id].ack_due) {
+                SendAck(peer_id);
+            }
+        }
+    }
+
+    bool NovaRDMAUDBroker::ProcessData(int peer_id, const NovaUDHeader *hdr) {
+        UDPeer &peer = peers_[peer_id];
+        int server_id = end_points_[peer_id].server_id;
+        // The sizes come off the wire. A packet that does not fit drops the
+        // message it belongs to; the rest of its packets are dropped by the
+        // size check of its last packet.
+        if (hdr->payload_size > max_payload_ ||
+            peer.reasm_size + hdr->payload_size > max_msg_size_) {
+            RDMA_LOG(WARNING) << fmt::format(
+                        "ud[{}]: dropped a packet of {} bytes from server {} at offset {}",
+                        thread_id_, hdr->payload_size, server_id,
+                        peer.reasm_size);
+            peer.reasm_size = 0;
+            return false;
+        }
+        memcpy(peer.reasm_buf + peer.reasm_size,
+               (const char *) hdr + sizeof(NovaUDHeader), hdr->payload_size);
+        peer.reasm_size += hdr->payload_size;
+        if (!hdr->last) {
+            return false;
+        }
+        if (peer.reasm_size != hdr->msg_size) {
+            RDMA_LOG(WARNING) << fmt::format(
+                        "ud[{}]: dropped a message of {} bytes from server {} that claims {}",
+                        thread_id_, peer.reasm_size, server_id,
+                        hdr->msg_size);
+            peer.reasm_size = 0;
+            return false;
+        }
+        uint64_t wr_id = peer.nrecv_msgs % max_num_sends_;
+        peer.nrecv_msgs++;
+        RDMA_LOG(DEBUG) << fmt::format(
+                    "ud[{}]: RQ: received from server {} wr:{} imm:{} size:{}",
+                    thread_id_, server_id, wr_id, hdr->imm_data,
+                    hdr->msg_size);
+        peer.reasm_size = 0;
+        NovaTraceIdScope trace_scope(0);
+        callback_->ProcessRDMAWC(IBV_WC_RECV, wr_id, server_id,
+                                 peer.reasm_buf, hdr->imm_data);
+        return true;
+    }
+
+    uint32_t NovaRDMAUDBroker::Retransmit() {
+        uint64_t now = NowMicros();
+        if (now < next_rto_check_us_) {
+            return 0;
+        }
+        next_rto_check_us_ = now + UD_RTO_MIN / 2;
+        uint32_t n = 0;
+        for (uint32_t peer_id = 0; peer_id < peers_.size(); peer_id++) {
+            UDPeer &peer = peers_[peer_id];
+            if (peer.next_seq == peer.acked_seq ||
+                now - peer.last_tx_us < peer.rto_us) {
+                continue;
+            }
+            RDMA_LOG(DEBUG) << fmt::format(
+                        "ud[{}]: retransmit [{},{}) to server {} rto:{}",
+                        thread_id_, peer.acked_seq, peer.next_seq,
+                        end_points_[peer_id].server_id, peer.rto_us);
+            PostPackets(peer_id, peer.acked_seq, peer.next_seq);
+            nretransmits_ += peer.next_seq - peer.acked_seq;
+            peer.last_tx_us = now;
+            peer.rto_us = std::min(peer.rto_us * 2, (uint64_t) UD_RTO_MAX);
+            n++;
+        }
+        return n;
+    }
+
+    uint32_t NovaRDMAUDBroker::PollSQ(int remote_server_id) {
+        return PollSQ();
+    }
+
+    uint32_t NovaRDMAUDBroker::PollSQ() {
+        PollSendCQ();
+        uint32_t n = PollRecvCQ();
+        SendDueAcks();
+        Retransmit();
+        return n;
+    }
+
+    void NovaRDMAUDBroker::PostRecv(int remote_server_id,
+                                    int recv_buf_index) {
+        qp_->post_receive(RecvBuf(recv_buf_index), UD_GRH_SIZE + mtu_,
+                          recv_buf_index);
+    }
+
+    void NovaRDMAUDBroker::FlushPendingRecvs() {}
+
+    uint32_t NovaRDMAUDBroker::PollRQ(int remote_server_id) {
+        return PollRQ();
+    }
+
+    uint32_t NovaRDMAUDBroker::PollRQ() {
+        PollRecvCQ();
+        // a callback may post and poll again.
+        std::vector<std::pair<int, uint32_t>> recvs;
+        recvs.swap(ready_recvs_);
+        uint32_t n = 0;
+        for (const auto &recv : recvs) {
+            const NovaUDHeader *hdr =
+                    (const NovaUDHeader *) ReadyBuf(recv.second);
+            if (ProcessData(recv.first, hdr)) {
+                n++;
+            }
+            free_ready_.push_back(recv.second);
+        }
+        SendDueAcks();
+        return n;
+    }
+
+    char *NovaRDMAUDBroker::GetSendBuf() {
+        return NULL;
+    }
+
+    char *NovaRDMAUDBroker::GetSendBuf(int server_id) {
+        int peer_id = to_peer_id(server_id);
+        return SendSlot(peer_id, peers_[peer_id].psend_index);
+    }
+}
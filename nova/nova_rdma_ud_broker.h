@@ -0,0 +1,239 @@
+//
+// Copyright (c) 2020 University of Southern California. All rights reserved.
+//
+
+#ifndef RLIB_NOVA_RDMA_UD_BROKER_H
+#define RLIB_NOVA_RDMA_UD_BROKER_H
+
+#include <fmt/core.h>
+#include <deque>
+#include <map>
+#include <vector>
+
+#include "rdma_ctrl.hpp"
+#include "nova_rdma_broker.h"
+#include "nova_rdma_rc_broker.h"
+#include "nova_msg_callback.h"
+#include "nova_common.h"
+
+// A UD receive starts with the 40-byte global routing header.
+#define UD_GRH_SIZE 40
+#define UD_MAX_MTU 4096
+// Retransmission timeout of unacknowledged packets, in microseconds. It
+// doubles after every retransmission without progress.
+#define UD_RTO_MIN 1000
+#define UD_RTO_MAX 100000
+
+namespace nova {
+
+    using namespace rdmaio;
+
+    enum NovaUDPacketType {
+        UD_PACKET_DATA = 0,
+        UD_PACKET_ACK = 1
+    };
+
+    // Precedes the payload of every datagram.
+    struct NovaUDHeader {
+        uint32_t src_server_id;
+        // Sequence number of this packet in the stream to the receiver.
+        uint32_t seq;
+        // Cumulative ack: the sender received all packets before ack.
+        uint32_t ack;
+        uint32_t msg_size;
+        uint32_t payload_size;
+        uint32_t imm_data;
+        uint8_t type;
+        // The last packet of a message.
+        uint8_t last;
+    };
+
+    // Thread local. Reliable messaging over one UD QP per thread, so that a
+    // thread reaches thousands of peers without a QP per peer. Thread i of a
+    // node talks to thread i of its peers, like NovaRDMARCBroker.
+    //
+    // Messages are split into MTU-sized packets with per-peer sequence
+    // numbers. The receiver acknowledges them cumulatively, piggybacked on
+    // data or in ack packets, and drops packets that arrive out of order; the
+    // sender retransmits everything unacknowledged after a timeout
+    // (go-back-N). A send completes once all its packets are acknowledged.
+    // Both PollSQ and PollRQ move the protocol forward.
+    //
+    // UD has no one-sided operations. PostRead and PostWrite abort.
+    class NovaRDMAUDBroker : public NovaRDMABroker {
+    public:
+        // buf must be registered and hold BufSize bytes. Every peer has
+        // max_num_sends messages or packets in flight; nrecvs receive buffers
+        // are shared by all peers.
+        NovaRDMAUDBroker(char *buf, int thread_id,
+                         const std::vector<QPEndPoint> &end_points,
+                         uint32_t max_num_sends,
+                         uint32_t max_msg_size,
+                         uint32_t nrecvs,
+                         uint32_t my_server_id,
+                         char *mr_buf,
+                         uint64_t mr_size,
+                         uint64_t rdma_port,
+                         NovaMsgCallback *callback);
+
+        static uint64_t BufSize(uint32_t npeers, uint32_t max_num_sends,
+                                uint32_t max_msg_size, uint32_t nrecvs);
+
+        void Init(RdmaCtrl *rdma_ctrl);
+
+        // Fetches the UD QPs of all peers, retrying until timeout_us elapses,
+        // 0 waits forever. Returns true if all peers are reachable.
+        bool Init(RdmaCtrl *rdma_ctrl, uint64_t timeout_us);
+
+        uint64_t PostRead(char *localbuf, uint32_t size, int remote_server_id,
+                          uint64_t local_offset,
+                          uint64_t remote_addr, bool is_remote_offset);
+
+        uint64_t
+        PostSend(const char *localbuf, uint32_t size, int remote_server_id,
+                 uint32_t imm_data);
+
+        uint64_t
+        PostWrite(const char *localbuf, uint32_t size, int remote_server_id,
+                  uint64_t remote_offset, bool is_remote_offset,
+                  uint32_t imm_data);
+
+        uint64_t PostRead(const NovaItemHandle &local,
+                          const NovaRemoteItem &remote, uint32_t size,
+                          int remote_server_id);
+
+        uint64_t PostSend(const NovaItemHandle &local, uint32_t size,
+                          int remote_server_id, uint32_t imm_data);
+
+        uint64_t PostWrite(const NovaItemHandle &local,
+                           const NovaRemoteItem &remote, uint32_t size,
+                           int remote_server_id, uint32_t imm_data);
+
+        // Packets are posted when a message is sent.
+        void FlushPendingSends();
+
+        void FlushPendingSends(int remote_server_id) override;
+
+        // Processes acks, completes acknowledged sends and retransmits
+        // timed out packets. All peers share the QP, so the peer argument of
+        // the poll functions is ignored.
+        uint32_t PollSQ(int remote_server_id);
+
+        uint32_t PollSQ();
+
+        void PostRecv(int remote_server_id, int recv_buf_index);
+
+        void FlushPendingRecvs();
+
+        // Delivers the messages received in order.
+        uint32_t PollRQ();
+
+        uint32_t PollRQ(int remote_server_id);
+
+        char *GetSendBuf();
+
+        char *GetSendBuf(int remote_server_id);
+
+        uint32_t thread_id() { return thread_id_; }
+
+        uint64_t nretransmits() { return nretransmits_; }
+
+    private:
+        struct PendingMsg {
+            uint64_t wr_id;
+            // seq after its last packet.
+            uint32_t end_seq;
+        };
+
+        struct UDPeer {
+            ibv_ah *ah = nullptr;
+            uint32_t qpn = 0;
+            // send side. Packets in [acked_seq, next_seq) are unacknowledged.
+            uint32_t next_seq = 0;
+            uint32_t acked_seq = 0;
+            uint64_t last_tx_us = 0;
+            uint64_t rto_us = UD_RTO_MIN;
+            std::deque<PendingMsg> msgs;
+            uint32_t psend_index = 0;
+            uint32_t npending = 0;
+            // receive side.
+            uint32_t expected_seq = 0;
+            bool ack_due = false;
+            uint32_t reasm_size = 0;
+            char *reasm_buf = nullptr;
+            uint64_t nrecv_msgs = 0;
+        };
+
+        int to_peer_id(int server_id);
+
+        char *RecvBuf(uint64_t recv_buf_index);
+
+        char *ReadyBuf(uint32_t slot);
+
+        char *SendSlot(int peer_id, uint64_t wr_id);
+
+        char *Packet(int peer_id, uint32_t seq);
+
+        // Posts the packets in [from_seq, to_seq) to peer_id with one
+        // doorbell.
+        void PostPackets(int peer_id, uint32_t from_seq, uint32_t to_seq);
+
+        void SendAck(int peer_id);
+
+        // Polls the receive CQ and posts every receive again. Acks are
+        // processed right away, in-order data packets are copied out,
+        // acknowledged and queued for PollRQ. Data packets that find no free
+        // ready slot are dropped and retransmitted. Returns the number of
+        // sends it completed.
+        uint32_t PollRecvCQ();
+
+        // Returns the number of sends it completed.
+        uint32_t ProcessAck(int peer_id, uint32_t ack);
+
+        void SendDueAcks();
+
+        // Reassembles an in-order packet. Returns true if it completed a
+        // message.
+        bool ProcessData(int peer_id, const NovaUDHeader *hdr);
+
+        void PollSendCQ();
+
+        uint32_t Retransmit();
+
+        const int thread_id_;
+        std::vector<QPEndPoint> end_points_;
+        const uint32_t max_num_sends_;
+        const uint32_t max_msg_size_;
+        const uint32_t nrecvs_;
+        const uint32_t my_server_id_;
+        const char *mr_buf_;
+        const uint64_t mr_size_;
+        const uint64_t rdma_port_;
+        NovaMsgCallback *callback_;
+        char *rdma_buf_;
+        RdmaCtrl *rdma_ctrl_ = nullptr;
+
+        UDQP *qp_ = nullptr;
+        uint32_t mtu_ = 0;
+        uint32_t max_payload_ = 0;
+        std::map<uint32_t, int> server_peer_map_;
+        std::vector<UDPeer> peers_;
+        // nrecvs packets copied out of the receive buffers, and the slots
+        // not in use.
+        char *ready_buf_;
+        std::vector<uint32_t> free_ready_;
+        // (peer, ready slot) of data packets not delivered yet.
+        std::vector<std::pair<int, uint32_t>> ready_recvs_;
+        std::vector<int> ack_due_peers_;
+        // Posted and not yet polled from the send CQ.
+        uint32_t nposted_ = 0;
+        uint64_t next_rto_check_us_ = 0;
+        uint64_t nretransmits_ = 0;
+
+        ibv_wc *wcs_;
+        ibv_sge *send_sges_;
+        ibv_send_wr *send_wrs_;
+    };
+}
+
+#endif //RLIB_NOVA_RDMA_UD_BROKER_H
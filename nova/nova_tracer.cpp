@@ -0,0 +1,147 @@
+//
+// Copyright (c) 2020 University of Southern California. All rights reserved.
+//
+
+#include <stdio.h>
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <vector>
+#include <fmt/format.h>
+
+#include "nova_tracer.h"
+#include "nova_common.h"
+
+namespace nova {
+
+    namespace {
+        struct SpanBuffer {
+            // Taken by the owning thread to record and by the exporter.
+            NovaSpinLock lock;
+            std::vector<NovaTraceSpan> spans;
+            // Total spans recorded; spans[n % TRACE_BUFFER_SPANS] is next.
+            uint64_t n = 0;
+        };
+
+        std::mutex buffers_mutex;
+        // Buffers outlive their threads so that their spans are exported.
+        std::vector<SpanBuffer *> buffers;
+        uint32_t trace_node_id = 0;
+        std::atomic<uint64_t> trace_seq{0};
+        thread_local SpanBuffer *this_buffer = nullptr;
+        thread_local uint64_t this_trace_id = 0;
+
+        SpanBuffer *ThisBuffer() {
+            if (this_buffer == nullptr) {
+                this_buffer = new SpanBuffer;
+                this_buffer->spans.resize(TRACE_BUFFER_SPANS);
+                std::lock_guard<std::mutex> lock(buffers_mutex);
+                buffers.push_back(this_buffer);
+            }
+            return this_buffer;
+        }
+
+        void WriteSpan(FILE *file, const NovaTraceSpan &span,
+                       int64_t wall_offset_ns, bool *first) {
+            double ts_us = (span.start_ns + wall_offset_ns) / 1000.0;
+            double dur_us = (span.end_ns - span.start_ns) / 1000.0;
+            std::string op = span.opcode < 0 ? "RECV" : ibv_wr_opcode_str(
+                    (ibv_wr_opcode) span.opcode);
+            fmt::print(file,
+                       "{}{{\"name\":\"{}\",\"cat\":\"rdma\",\"ph\":\"X\",\"pid\":{},\"tid\":{},\"ts\":{:.3f},\"dur\":{:.3f},"
+                       "\"args\":{{\"peer\":{},\"wr_id\":{},\"op\":\"{}\",\"trace_id\":\"{:#x}\"}}}}",
+                       *first ? "" : ",\n", span.name, trace_node_id,
+                       span.thread_id, ts_us, dur_us, span.peer, span.wr_id,
+                       op, span.trace_id);
+            *first = false;
+            if (span.trace_id == 0 || span.flow == TRACE_FLOW_NONE) {
+                return;
+            }
+            // Flow events bind to the enclosing span of the same thread. Ids
+            // are strings since JSON numbers lose precision above 2^53.
+            fmt::print(file,
+                       ",\n{{\"name\":\"trace\",\"cat\":\"rdma\",\"ph\":\"{}\",\"id\":\"{:#x}\",\"pid\":{},\"tid\":{},\"ts\":{:.3f}{}}}",
+                       span.flow == TRACE_FLOW_OUT ? "s" : "f",
+                       span.trace_id, trace_node_id, span.thread_id,
+                       span.flow == TRACE_FLOW_OUT ? ts_us : ts_us + dur_us,
+                       span.flow == TRACE_FLOW_OUT ? "" : ",\"bp\":\"e\"");
+        }
+    }
+
+    std::atomic<bool> NovaTracer::enabled_{false};
+
+    void NovaTracer::Enable(uint32_t node_id) {
+        trace_node_id = node_id;
+        enabled_.store(true, std::memory_order_relaxed);
+    }
+
+    void NovaTracer::Disable() {
+        enabled_.store(false, std::memory_order_relaxed);
+    }
+
+    void NovaTracer::SetTraceId(uint64_t trace_id) {
+        this_trace_id = trace_id;
+    }
+
+    uint64_t NovaTracer::trace_id() {
+        return this_trace_id;
+    }
+
+    uint64_t NovaTracer::NewTraceId() {
+        // Never 0.
+        return ((uint64_t) trace_node_id << 48) |
+               (trace_seq.fetch_add(1, std::memory_order_relaxed) + 1);
+    }
+
+    void NovaTracer::Record(const NovaTraceSpan &span) {
+        SpanBuffer *buffer = ThisBuffer();
+        buffer->lock.lock();
+        buffer->spans[buffer->n % TRACE_BUFFER_SPANS] = span;
+        buffer->n++;
+        buffer->lock.unlock();
+    }
+
+    bool NovaTracer::WriteChromeTrace(const std::string &path, bool clear) {
+        FILE *file = fopen(path.c_str(), "w");
+        if (file == nullptr) {
+            RDMA_LOG(WARNING) << fmt::format("tracer: cannot open {}", path);
+            return false;
+        }
+        // Spans carry the monotonic clock. Exports of different nodes are
+        // aligned on the wall clock.
+        int64_t wall_offset_ns =
+                std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::system_clock::now().time_since_epoch()).count() -
+                (int64_t) NowNanos();
+        std::vector<SpanBuffer *> snapshot;
+        {
+            std::lock_guard<std::mutex> lock(buffers_mutex);
+            snapshot = buffers;
+        }
+        fmt::print(file, "{{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+        bool first = true;
+        uint64_t nspans = 0;
+        std::vector<NovaTraceSpan> spans;
+        for (SpanBuffer *buffer : snapshot) {
+            buffer->lock.lock();
+            uint64_t n = std::min(buffer->n, (uint64_t) TRACE_BUFFER_SPANS);
+            spans.clear();
+            for (uint64_t i = buffer->n - n; i < buffer->n; i++) {
+                spans.push_back(buffer->spans[i % TRACE_BUFFER_SPANS]);
+            }
+            if (clear) {
+                buffer->n = 0;
+            }
+            buffer->lock.unlock();
+            for (const NovaTraceSpan &span : spans) {
+                WriteSpan(file, span, wall_offset_ns, &first);
+            }
+            nspans += spans.size();
+        }
+        fmt::print(file, "\n]}}\n");
+        fclose(file);
+        RDMA_LOG(INFO) << fmt::format("tracer: wrote {} spans to {}", nspans,
+                                      path);
+        return true;
+    }
+}
@@ -0,0 +1,105 @@
+//
+// Copyright (c) 2020 University of Southern California. All rights reserved.
+//
+
+#ifndef RLIB_NOVA_TRACER_H
+#define RLIB_NOVA_TRACER_H
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+
+// Spans kept per thread. Older spans are overwritten.
+#define TRACE_BUFFER_SPANS (1 << 16)
+
+namespace nova {
+
+    // How a span links to spans of other nodes with the same trace id.
+    enum NovaTraceFlow {
+        TRACE_FLOW_NONE = 0,
+        // The span sent a message of the trace.
+        TRACE_FLOW_OUT = 1,
+        // The span handled a message of the trace.
+        TRACE_FLOW_IN = 2
+    };
+
+    struct NovaTraceSpan {
+        // A string literal.
+        const char *name;
+        // Monotonic clock, see NowNanos.
+        uint64_t start_ns;
+        uint64_t end_ns;
+        uint64_t trace_id;
+        uint64_t wr_id;
+        int32_t peer;
+        uint32_t thread_id;
+        // ibv_wr_opcode of a request, -1 for a received message.
+        int16_t opcode;
+        uint8_t flow;
+    };
+
+    // Records spans of requests into per-thread buffers and exports them in
+    // Chrome trace-event JSON, viewable in chrome://tracing or Perfetto.
+    // Off by default; when off, a span costs one relaxed load.
+    //
+    // A trace id follows a request across nodes: the sender puts
+    // trace_id() into its message header and the receiver passes it to
+    // SetTraceId before handling the message, within the NovaTraceIdScope
+    // of the broker. The spans of both nodes then
+    // share the id and are linked with flow arrows once their exports are
+    // merged. Nodes should sync their clocks, e.g., with PTP.
+    class NovaTracer {
+    public:
+        // node_id is the process id of the spans in the export.
+        static void Enable(uint32_t node_id);
+
+        static void Disable();
+
+        static bool enabled() {
+            return enabled_.load(std::memory_order_relaxed);
+        }
+
+        // The trace id of the request the calling thread works on. Requests
+        // the thread posts are tagged with it. 0 means untraced.
+        static void SetTraceId(uint64_t trace_id);
+
+        static uint64_t trace_id();
+
+        // Returns an id unique across nodes.
+        static uint64_t NewTraceId();
+
+        static void Record(const NovaTraceSpan &span);
+
+        // Writes the spans of all threads to path. Returns false if path
+        // cannot be written.
+        static bool WriteChromeTrace(const std::string &path, bool clear);
+
+    private:
+        static std::atomic<bool> enabled_;
+    };
+
+    // Sets the trace id of the calling thread and restores the previous one
+    // when it goes out of scope. Brokers wrap their receive callbacks in one,
+    // so that the id a handler adopts from a message does not leak into the
+    // requests the thread works on next.
+    class NovaTraceIdScope {
+    public:
+        explicit NovaTraceIdScope(uint64_t trace_id)
+                : saved_(NovaTracer::trace_id()) {
+            NovaTracer::SetTraceId(trace_id);
+        }
+
+        ~NovaTraceIdScope() {
+            NovaTracer::SetTraceId(saved_);
+        }
+
+        NovaTraceIdScope(const NovaTraceIdScope &) = delete;
+
+        NovaTraceIdScope &operator=(const NovaTraceIdScope &) = delete;
+
+    private:
+        const uint64_t saved_;
+    };
+}
+
+#endif //RLIB_NOVA_TRACER_H
@@ -17,6 +17,9 @@ namespace rdmaio {
     constexpr struct timeval default_timeout = {0, 8000};
     constexpr struct timeval no_timeout = {0, 0};  // it means forever
     constexpr struct timeval no_wait = {-1, -1};
+    // How long a connector waits for the reply of a remote handler, which
+    // creates and connects its QPs before it replies.
+    constexpr uint32_t reply_timeout_us = 1000000;
 
     inline __attribute__ ((always_inline)) // inline to avoid multiple-definiations
     int64_t diff_time(const struct timeval &end, const struct timeval &start) {
@@ -46,6 +49,13 @@ namespace rdmaio {
             // port
             serv_addr.sin_port = htons(port);
 
+            // must be set before bind, so that a restarted node can listen
+            // while connections of its previous run are in TIME_WAIT
+            int opt = 1;
+            RDMA_VERIFY(ERROR, setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR,
+                                          &opt, sizeof(int)) == 0)
+                << "unable to configure socket status.";
+
             RDMA_ASSERT(bind(sockfd, (struct sockaddr *) &serv_addr,
                              sizeof(serv_addr)) == 0) << "ERROR on binding: " << strerror(errno);
             return sockfd;
@@ -99,21 +109,35 @@ namespace rdmaio {
             return sockfd;
         }
 
-        // timeout in microsend
-        static bool wait_recv(int socket, uint32_t timeout = 2000) {
+        static uint64_t now_us() {
+            struct timeval tv;
+            gettimeofday(&tv, NULL);
+            return tv.tv_sec * 1000000ULL + tv.tv_usec;
+        }
 
+        // Waits at most timeout microseconds for the socket to be readable.
+        // An interrupted select waits only for the time that remains.
+        static bool wait_recv(int socket, uint32_t timeout = 2000) {
+            uint64_t deadline = now_us() + timeout;
             while (true) {
 
                 fd_set rfds;
                 FD_ZERO(&rfds);
                 FD_SET(socket, &rfds);
 
-                struct timeval s_timeout = {10, timeout};
-                int ready = select(socket + 1, &rfds, NULL, NULL, NULL);
+                uint64_t now = now_us();
+                uint64_t remaining = now < deadline ? deadline - now : 0;
+                struct timeval s_timeout = {(time_t) (remaining / 1000000),
+                                            (suseconds_t) (remaining %
+                                                           1000000)};
+                int ready = select(socket + 1, &rfds, NULL, NULL, &s_timeout);
+                if (ready == -1 && errno == EINTR) {
+                    continue;
+                }
                 RDMA_ASSERT(ready != -1) << strerror(errno);
 
-                if (ready == 0) { // no file descriptor found
-                    continue;
+                if (ready == 0) { // timed out, let the caller retry
+                    return false;
                 }
 
                 if (ready < 0) { // error case
@@ -158,6 +182,31 @@ namespace rdmaio {
             return n;
         }
 
+        // receives exactly n bytes from a non-blocking socket within timeout
+        // microseconds.
+        // returns false on timeout, error or if the peer closed the socket.
+        static bool recv_from(int fd, char *usrbuf, size_t n,
+                              uint32_t timeout = reply_timeout_us) {
+            uint64_t deadline = now_us() + timeout;
+            size_t nleft = n;
+            while (nleft > 0) {
+                uint64_t now = now_us();
+                if (now >= deadline || !wait_recv(fd, deadline - now)) {
+                    return false;
+                }
+                auto nread = recv(fd, usrbuf + (n - nleft), nleft, 0);
+                if (nread < 0 && (errno == EINTR || errno == EAGAIN ||
+                                  errno == EWOULDBLOCK)) {
+                    continue;
+                }
+                if (nread <= 0) {
+                    return false;
+                }
+                nleft -= nread;
+            }
+            return true;
+        }
+
         typedef std::map<std::string, std::string> ipmap_t;
 
         static ipmap_t &local_ip_cache() {
@@ -1,5 +1,8 @@
 #pragma once
 
+#include <atomic>
+#include <mutex>
+
 #include "common.hpp"
 #include "qp_impl.hpp" // hide the implementation
 
@@ -45,7 +48,7 @@ namespace rdmaio {
                 rnic_(rnic) {
         }
 
-        ~QP() {
+        virtual ~QP() {
             if (qp_ != nullptr)
                 ibv_destroy_qp(qp_);
             if (cq_ != nullptr)
@@ -93,7 +96,7 @@ namespace rdmaio {
                     .addr     = rnic_->query_addr(),
                     .lid      = rnic_->lid,
                     .qpn      = (qp_ != nullptr) ? qp_->qp_num : 0,
-                    .psn      = DEFAULT_PSN, // TODO! this may be filled later
+                    .psn      = psn_,
                     .node_id  = 0, // a place holder
                     .port_id  = rnic_->port_id
             };
@@ -120,6 +123,8 @@ namespace rdmaio {
         // local MR used to post reqs
         MemoryAttr local_mr_;
         RNicHandler *rnic_;
+        // the PSN this QP sends with; a reset picks a new one
+        uint32_t psn_ = DEFAULT_PSN;
 
     protected:
         ConnStatus
@@ -157,6 +162,16 @@ namespace rdmaio {
             RCQPImpl::init<F>(qp_, cq_, recv_cq_, rnic_, qp_type);
         }
 
+        ~RRCQP() {
+            // the QP must go before its CQs; ~QP destroys cq_ afterwards
+            if (qp_ != nullptr) {
+                ibv_destroy_qp(qp_);
+                qp_ = nullptr;
+            }
+            if (recv_cq_ != nullptr && recv_cq_ != cq_)
+                ibv_destroy_cq(recv_cq_);
+        }
+
         ConnStatus connect(std::string ip, int port) {
             return connect(ip, port, idx_);
         }
@@ -177,32 +192,167 @@ namespace rdmaio {
             arg.payload.qp.from_node = idx.node_id;
             arg.payload.qp.from_worker = idx.worker_id;
             arg.payload.qp.from_index = idx.index;
-            arg.payload.qp.qp_type = IBV_QPT_RC;
+            arg.payload.qp.qp_type = qp_type_;
 
             auto ret = QPImpl::get_remote_helper(&arg, &reply, ip, port);
             if (ret == SUCC) {
-                // change QP status
-                if (!RCQPImpl::ready2rcv<F>(qp_, reply.payload.qp, rnic_,
-                                            qp_type_)) {
-                    RDMA_LOG(WARNING)
-                        << "change qp status to ready to receive error: "
-                        << strerror(errno);
-                    ret = ERR;
-                    goto CONN_END;
-                }
+                ret = connect_with_attr(reply.payload.qp);
+            }
+            return ret;
+        }
 
-                if (!RCQPImpl::ready2send<F>(qp_, qp_type_)) {
-                    RDMA_LOG(WARNING)
-                        << "change qp status to ready to send error: "
-                        << strerror(errno);
-                    ret = ERR;
-                    goto CONN_END;
-                }
+        /**
+         * Asks the peer to reset its side of the connection, e.g., after
+         * this QP hit an error. Call reset first: the request carries the
+         * new attributes of this QP. The peer's owner of the QP picks the
+         * request up through reset_requested_.
+         * return NO_QP if the peer has no QP to reset.
+         */
+        ConnStatus request_remote_reset(std::string ip, int port, QPIdx idx) {
+            ConnArg arg = {};
+            ConnReply reply = {};
+            arg.type = ConnArg::QP_RESET;
+            arg.payload.conn.qp.from_node = idx.node_id;
+            arg.payload.conn.qp.from_worker = idx.worker_id;
+            arg.payload.conn.qp.from_index = idx.index;
+            arg.payload.conn.qp.qp_type = qp_type_;
+            arg.payload.conn.attr = get_attr();
+            return QPImpl::get_remote_helper(&arg, &reply, ip, port);
+        }
+
+        /**
+         * Asks whether the peer finished the reset requested with
+         * request_remote_reset. return SUCC and the new attributes of the
+         * peer's QP in attr once it did, NOT_READY while it has not and
+         * NO_QP if the peer has no QP any more.
+         */
+        ConnStatus query_remote_reset(std::string ip, int port, QPIdx idx,
+                                      QPAttr *attr) {
+            ConnArg arg = {};
+            ConnReply reply = {};
+            arg.type = ConnArg::QP_RESET_DONE;
+            arg.payload.qp.from_node = idx.node_id;
+            arg.payload.qp.from_worker = idx.worker_id;
+            arg.payload.qp.from_index = idx.index;
+            arg.payload.qp.qp_type = qp_type_;
+            auto ret = QPImpl::get_remote_helper(&arg, &reply, ip, port);
+            if (ret == SUCC) {
+                *attr = reply.payload.qp;
+            }
+            return ret;
+        }
+
+        /**
+         * Connects to a peer that creates its QP on demand, see
+         * RdmaCtrl::register_qp_factory. Binds the peer's MR on success.
+         * return NOT_READY if the peer refused, e.g., it is connecting to
+         * us at the same time.
+         */
+        ConnStatus connect_on_demand(std::string ip, int port, QPIdx idx) {
+            ConnArg arg = {};
+            ConnReply reply = {};
+            arg.type = ConnArg::QP_CONNECT;
+            arg.payload.conn.qp.from_node = idx.node_id;
+            arg.payload.conn.qp.from_worker = idx.worker_id;
+            arg.payload.conn.qp.from_index = idx.index;
+            arg.payload.conn.qp.qp_type = qp_type_;
+            arg.payload.conn.attr = get_attr();
+            arg.payload.conn.mr = local_mr_;
+            auto ret = QPImpl::get_remote_helper(&arg, &reply, ip, port);
+            if (ret != SUCC) {
+                return ret;
+            }
+            ret = connect_with_attr(reply.payload.conn.qp);
+            if (ret == SUCC) {
+                bind_remote_mr(reply.payload.conn.mr);
             }
-            CONN_END:
             return ret;
         }
 
+        /**
+         * Tells the peer that this QP goes away. The peer's owner of the QP
+         * picks it up through disconnect_requested_.
+         */
+        ConnStatus request_remote_disconnect(std::string ip, int port,
+                                             QPIdx idx) {
+            ConnArg arg = {};
+            ConnReply reply = {};
+            arg.type = ConnArg::QP_DISCONNECT;
+            arg.payload.qp.from_node = idx.node_id;
+            arg.payload.qp.from_worker = idx.worker_id;
+            arg.payload.qp.from_index = idx.index;
+            arg.payload.qp.qp_type = qp_type_;
+            return QPImpl::get_remote_helper(&arg, &reply, ip, port);
+        }
+
+        /**
+         * Brings a QP in the error state back to INIT, so that
+         * connect_with_attr connects it again, and picks a new PSN. Packets
+         * of the old connection that are still in flight do not match it.
+         * A QP in INIT already keeps its PSN, which the peer may have been
+         * told.
+         */
+        ConnStatus reset() {
+            if (QPImpl::query_qp_status(qp_) == IBV_QPS_INIT) {
+                return SUCC;
+            }
+            struct ibv_qp_attr qp_attr = {};
+            qp_attr.qp_state = IBV_QPS_RESET;
+            if (ibv_modify_qp(qp_, &qp_attr, IBV_QP_STATE) != 0) {
+                RDMA_LOG(WARNING) << "change qp status to reset error: "
+                                  << strerror(errno);
+                return ERR;
+            }
+            RCQPImpl::ready2init<F>(qp_, rnic_, qp_type_);
+            psn_ = lrand48() & 0xffffff;
+            return SUCC;
+        }
+
+        // The attributes sent by the peer with its reset request.
+        QPAttr reset_attr() {
+            std::lock_guard<std::mutex> lock(reset_mutex_);
+            return reset_attr_;
+        }
+
+        // Called by the connection handler on a reset request of the peer.
+        void on_reset_request(const QPAttr &attr) {
+            std::lock_guard<std::mutex> lock(reset_mutex_);
+            reset_done_ = false;
+            reset_attr_ = attr;
+            reset_requested_ = true;
+        }
+
+        /**
+         * Moves the QP to RTS against a remote QP whose attributes were
+         * fetched already, e.g., with QPImpl::get_remote_batch.
+         * The attributes are kept in remote_attr_.
+         */
+        ConnStatus connect_with_attr(QPAttr attr) {
+            enum ibv_qp_state state;
+            if ((state = QPImpl::query_qp_status(qp_)) != IBV_QPS_INIT) {
+                if (state != IBV_QPS_RTS)
+                    RDMA_LOG(WARNING)
+                        << "qp not in a correct state to connect!";
+                return (state == IBV_QPS_RTS) ? SUCC : UNKNOWN;
+            }
+            // change QP status
+            if (!RCQPImpl::ready2rcv<F>(qp_, attr, rnic_, qp_type_)) {
+                RDMA_LOG(WARNING)
+                    << "change qp status to ready to receive error: "
+                    << strerror(errno);
+                return ERR;
+            }
+
+            if (!RCQPImpl::ready2send<F>(qp_, qp_type_, psn_)) {
+                RDMA_LOG(WARNING)
+                    << "change qp status to ready to send error: "
+                    << strerror(errno);
+                return ERR;
+            }
+            remote_attr_ = attr;
+            return SUCC;
+        }
+
         /**
          * Bind this QP's operation to a remote memory region according to the MemoryAttr.
          * Since usually one QP access *one memory region* almost all the time,
@@ -386,8 +536,21 @@ namespace rdmaio {
         uint64_t low_watermark_ = 0;
 
         MemoryAttr remote_mr_;
+        // attributes of the connected remote QP, valid once connected
+        QPAttr remote_attr_ = {};
+        // set by the connection handler when the peer asks for a reset
+        std::atomic<bool> reset_requested_{false};
+        // set by the owner once it reset the QP on the peer's request, so
+        // that query_remote_reset of the peer succeeds
+        std::atomic<bool> reset_done_{false};
+        // set by the connection handler when the peer disconnected
+        std::atomic<bool> disconnect_requested_{false};
         enum ibv_qp_type qp_type_;
         struct ibv_cq *recv_cq_ = NULL;
+
+    private:
+        std::mutex reset_mutex_;
+        QPAttr reset_attr_ = {};
     };
 
     inline constexpr UDConfig default_ud_config() {
@@ -465,7 +628,6 @@ namespace rdmaio {
                 ahs_[reply.payload.qp.node_id] = ah;
                 attrs_[reply.payload.qp.node_id] = reply.payload.qp;
             }
-            CONN_END:
             return ret;
         }
 
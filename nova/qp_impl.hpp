@@ -1,6 +1,7 @@
 #pragma once
 
 #include <limits>
+#include <vector>
 
 #include "pre_connector.hpp"
 
@@ -104,7 +105,7 @@ namespace rdmaio {
             }
 
             // receive reply
-            if (!PreConnector::wait_recv(socket, 10000)) {
+            if (!PreConnector::wait_recv(socket, reply_timeout_us)) {
                 ret = TIMEOUT;
                 goto CONN_END;
             }
@@ -116,9 +117,61 @@ namespace rdmaio {
                 goto CONN_END;
             }
             if (reply->ack != SUCC) {
+                ret = reply->ack == NO_QP ? NO_QP : NOT_READY;
+                goto CONN_END;
+            }
+            CONN_END:
+            shutdown(socket, SHUT_RDWR);
+            close(socket);
+            return ret;
+        }
+
+        /**
+         * Fetches the MR mr_id and the attributes of all qps from a peer in
+         * one TCP exchange. attrs[i] belongs to qps[i]; its qpn is 0 if the
+         * peer has not created that QP yet.
+         * return NOT_READY if the peer has not registered the MR.
+         */
+        static ConnStatus
+        get_remote_batch(std::string ip, int port, uint64_t mr_id,
+                         const std::vector<QPConnArg> &qps, MemoryAttr *mr,
+                         std::vector<QPAttr> *attrs) {
+            RDMA_ASSERT(qps.size() <= std::numeric_limits<uint16_t>::max());
+            ConnStatus ret = SUCC;
+            ConnArg arg = {};
+            ConnReply reply = {};
+            arg.type = ConnArg::BATCH;
+            arg.payload.batch.mr_id = mr_id;
+            arg.payload.batch.nqps = qps.size();
+
+            std::vector<char> req(sizeof(ConnArg) +
+                                  qps.size() * sizeof(QPConnArg));
+            memcpy(req.data(), &arg, sizeof(ConnArg));
+            memcpy(req.data() + sizeof(ConnArg), qps.data(),
+                   qps.size() * sizeof(QPConnArg));
+            attrs->resize(qps.size());
+
+            auto socket = PreConnector::get_send_socket(ip, port);
+            if (socket < 0) {
+                return ERR;
+            }
+            if (PreConnector::send_to(socket, req.data(), req.size()) !=
+                req.size()) {
+                ret = ERR;
+                goto CONN_END;
+            }
+            if (!PreConnector::recv_from(socket, (char *) (&reply),
+                                         sizeof(ConnReply)) ||
+                !PreConnector::recv_from(socket, (char *) attrs->data(),
+                                         qps.size() * sizeof(QPAttr))) {
+                ret = TIMEOUT;
+                goto CONN_END;
+            }
+            if (reply.ack != SUCC) {
                 ret = NOT_READY;
                 goto CONN_END;
             }
+            *mr = reply.payload.mr;
             CONN_END:
             shutdown(socket, SHUT_RDWR);
             close(socket);
@@ -277,7 +330,8 @@ namespace rdmaio {
             // DONOT CHANGE save as perftest.
             qp_attr.path_mtu = IBV_MTU_2048;
             qp_attr.dest_qp_num = attr.qpn;
-            qp_attr.rq_psn = config.rq_psn; // should this match the sender's psn ?
+            // the PSN the remote QP starts sending with
+            qp_attr.rq_psn = attr.psn;
 
             if (qp_type == IBV_QPT_RC) {
                 qp_attr.max_dest_rd_atomic = config.max_dest_rd_atomic;
@@ -305,19 +359,20 @@ namespace rdmaio {
                            | IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER;
             int flags = qp_type == IBV_QPT_RC ? rc_flags : uc_flags;
             auto rc = ibv_modify_qp(qp, &qp_attr, flags);
-            RDMA_ASSERT(rc == 0) << "ready to rcv failed " << rc;
+            RDMA_VERIFY(WARNING, rc == 0) << "ready to rcv failed " << rc;
             return rc == 0;
 
         }
 
         template<RCConfig (*F)(void)>
-        static bool ready2send(ibv_qp *qp, enum ibv_qp_type qp_type) {
+        static bool ready2send(ibv_qp *qp, enum ibv_qp_type qp_type,
+                               uint32_t sq_psn) {
 
             auto config = F();
             struct ibv_qp_attr qp_attr = {};
 
             qp_attr.qp_state = IBV_QPS_RTS;
-            qp_attr.sq_psn = config.sq_psn;
+            qp_attr.sq_psn = sq_psn;
 
             if (qp_type == IBV_QPT_RC) {
                 qp_attr.retry_cnt = 7;
@@ -333,7 +388,7 @@ namespace rdmaio {
             int uc_flags = IBV_QP_STATE | IBV_QP_SQ_PSN;
             int flags = qp_type == IBV_QPT_RC ? rc_flags : uc_flags;
             auto rc = ibv_modify_qp(qp, &qp_attr, flags);
-            RDMA_ASSERT(rc == 0) << "ready to rcv failed " << rc;
+            RDMA_VERIFY(WARNING, rc == 0) << "ready to send failed " << rc;
             return rc == 0;
         }
 
@@ -16,13 +16,33 @@ namespace rdmaio {
 
     typedef std::function<void(const QPConnArg &)> connection_callback_t;
 
+    /**
+     * Answers a QP_CONNECT request with the connected QP, or nullptr to
+     * refuse. Call it exactly once, from any thread.
+     */
+    typedef std::function<void(RCQP *)> qp_accept_t;
+
+    /**
+     * Creates and connects the local QP asked for by a QP_CONNECT request:
+     * the requester's QP arg, its QP attributes and its MR. It may hand the
+     * request to another thread and call accept later; the connection
+     * handler serves other requests in the meantime.
+     */
+    typedef std::function<void(const QPConnArg &, const QPAttr &,
+                               const MemoryAttr &,
+                               qp_accept_t accept)> qp_factory_t;
+
     class RdmaCtrl {
     public:
+        /**
+         * nhandlers threads serve the MR and QP requests of peers.
+         * Use more than one when many peers connect at the same time.
+         */
         RdmaCtrl(int node_id, int tcp_base_port,
                  connection_callback_t callback = [](const QPConnArg &) {
                      // the default callback does nothing
                  },
-                 std::string ip = "localhost");
+                 std::string ip = "localhost", int nhandlers = 1);
 
         ~RdmaCtrl();
 
@@ -62,6 +82,12 @@ namespace rdmaio {
          */
         void register_qp_callback(connection_callback_t callback);
 
+        /**
+         * The *factory* serves QP_CONNECT requests to QPs of worker_id, so
+         * the worker can create its QPs on demand.
+         */
+        void register_qp_factory(int worker_id, qp_factory_t factory);
+
         void close_device();
 
         void close_device(RNicHandler *);
@@ -103,6 +129,12 @@ namespace rdmaio {
 
         RCQP *get_rc_qp(QPIdx idx);
 
+        /**
+         * Destroy a QP created by create_rc_qp or create_uc_qp, with its CQs.
+         * The caller must not use it afterwards.
+         */
+        void destroy_rc_qp(QPIdx idx);
+
         UDQP *get_ud_qp(QPIdx idx);
 
         /**
@@ -1,32 +1,32 @@
 #include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <map>
+#include <memory>
 #include <mutex>
+#include <thread>
 #include "qp.hpp"
 #include "common.hpp"
 
+// Older glibc headers lack it. The kernel ignores unknown flags before 4.5,
+// in which case every handler thread is woken up on a new connection.
+#ifndef EPOLLEXCLUSIVE
+#define EPOLLEXCLUSIVE (1u << 28)
+#endif
+
 namespace rdmaio {
 
 /**
- * Simple critical section
- * It uses a single global block to guard RdmaCtrl.
- * This is acceptable, since RdmaCtrl is only the control plane.
+ * Connection handler parameters.
+ * A connection that has not sent its request, or has not closed after the
+ * reply, within HANDLER_CONN_TIMEOUT_MS is dropped.
  */
-    class SCS {
-    public:
-        SCS() {
-            get_lock().lock();
-        }
-
-        ~SCS() {
-            get_lock().unlock();
-        }
-
-    private:
-        static std::mutex &get_lock() {
-            static std::mutex lock;
-            return lock;
-        }
-    };
+#define HANDLER_MAX_EVENTS 64
+#define HANDLER_POLL_TIMEOUT_MS 100
+#define HANDLER_CONN_TIMEOUT_MS 10000
 
 /**
  * convert qp idx(node,worker,idx) -> key
@@ -57,21 +57,30 @@ namespace rdmaio {
     class RdmaCtrl::RdmaCtrlImpl {
     public:
         RdmaCtrlImpl(int node_id, int tcp_base_port,
-                     connection_callback_t callback, std::string local_ip) :
+                     connection_callback_t callback, std::string local_ip,
+                     int nhandlers) :
                 node_id_(node_id),
                 tcp_base_port_(tcp_base_port),
                 local_ip_(local_ip),
                 qp_callback_(callback) {
-            // start the background thread to handle QP connection request
-            pthread_attr_t attr;
-            pthread_attr_init(&attr);
-            pthread_create(&handler_tid_, &attr,
-                           &RdmaCtrlImpl::connection_handler_wrapper, this);
+            listenfd_ = PreConnector::get_listen_socket(local_ip_,
+                                                        tcp_base_port_);
+            fcntl(listenfd_, F_SETFL, O_NONBLOCK);
+            RDMA_VERIFY(ERROR, listen(listenfd_, SOMAXCONN) == 0)
+                << "TCP listen error: " << strerror(errno);
+            // start the background threads to handle QP connection requests
+            for (int i = 0; i < std::max(nhandlers, 1); i++) {
+                handlers_.emplace_back(&RdmaCtrlImpl::connection_handler,
+                                       this);
+            }
         }
 
         ~RdmaCtrlImpl() {
-            running_ = false; // wait for the handler to join
-            pthread_join(handler_tid_, NULL);
+            running_ = false; // wait for the handlers to join
+            for (auto &t : handlers_) {
+                t.join();
+            }
+            close(listenfd_);
             RDMA_LOG(INFO)
                 << "rdma controler close: does not handle any future connections.";
         }
@@ -154,7 +163,7 @@ namespace rdmaio {
         RCQP *get_rc_qp(QPIdx idx) {
             RCQP *res = nullptr;
             {
-                SCS s;
+                std::lock_guard<std::mutex> lock(qps_mutex_);
                 res = get_qp<RCQP, get_rc_key>(idx);
             };
             return res;
@@ -164,7 +173,7 @@ namespace rdmaio {
 
             UDQP *res = nullptr;
             {
-                SCS s;
+                std::lock_guard<std::mutex> lock(qps_mutex_);
                 res = get_qp<UDQP, get_ud_key>(idx);
             };
             return res;
@@ -188,7 +197,7 @@ namespace rdmaio {
 
             RCQP *res = nullptr;
             {
-                SCS s;
+                std::lock_guard<std::mutex> lock(qps_mutex_);
                 uint64_t qid = get_rc_key(idx);
                 if (qps_.find(qid) != qps_.end()) {
                     res = dynamic_cast<RCQP *>(qps_[qid]);
@@ -203,13 +212,27 @@ namespace rdmaio {
             return res;
         }
 
+        void destroy_rc_qp(QPIdx idx) {
+            RCQP *qp = nullptr;
+            {
+                std::lock_guard<std::mutex> lock(qps_mutex_);
+                uint64_t qid = get_rc_key(idx);
+                auto it = qps_.find(qid);
+                if (it == qps_.end())
+                    return;
+                qp = dynamic_cast<RCQP *>(it->second);
+                qps_.erase(it);
+            };
+            delete qp;
+        }
+
         UDQP *create_ud_qp(QPIdx idx, RNicHandler *dev, MemoryAttr *attr) {
 
             UDQP *res = nullptr;
             uint64_t qid = get_ud_key(idx);
 
             {
-                SCS s;
+                std::lock_guard<std::mutex> lock(qps_mutex_);
                 if (qps_.find(qid) != qps_.end()) {
                     res = dynamic_cast<UDQP *>(qps_[qid]);
                 } else {
@@ -233,7 +256,7 @@ namespace rdmaio {
                 return false;
             }
             {
-                SCS s;
+                std::lock_guard<std::mutex> lock(mrs_mutex_);
                 if (mrs_.find(mr_id) != mrs_.end()) {
                     RDMA_LOG(WARNING) << "mr " << mr_id
                                       << " has already been registered!";
@@ -246,7 +269,7 @@ namespace rdmaio {
         }
 
         int get_default_mr(MemoryAttr &attr) {
-            SCS s;
+            std::lock_guard<std::mutex> lock(mrs_mutex_);
             for (auto it = mrs_.begin(); it != mrs_.end(); ++it) {
                 int idx = it->first;
                 attr = it->second->rattr;
@@ -258,7 +281,7 @@ namespace rdmaio {
         MemoryAttr get_local_mr(uint64_t mr_id) {
             MemoryAttr attr = {};
             {
-                SCS s;
+                std::lock_guard<std::mutex> lock(mrs_mutex_);
                 if (mrs_.find(mr_id) != mrs_.end())
                     attr = mrs_[mr_id]->rattr;
             }
@@ -332,126 +355,462 @@ namespace rdmaio {
                 delete rnic;
         }
 
-        static void *connection_handler_wrapper(void *context) {
-            return ((RdmaCtrlImpl *) context)->connection_handler();
-        }
-
         /**
-         * Using TCP to connect in-coming QP & MR requests
+         * Using TCP to connect in-coming QP & MR requests.
+         * Every handler thread polls its own epoll set. The listening socket
+         * is in all of them with EPOLLEXCLUSIVE, so a new connection wakes up
+         * only one thread, which then owns the connection until it closes.
          */
-        void *connection_handler(void) {
-            pthread_detach(pthread_self());
-            auto listenfd = PreConnector::get_listen_socket(local_ip_,
-                                                            tcp_base_port_);
-            int opt = 1;
-            RDMA_VERIFY(ERROR, setsockopt(listenfd, SOL_SOCKET,
-                                          SO_REUSEADDR | SO_REUSEPORT, &opt,
-                                          sizeof(int)) == 0)
-                << "unable to configure socket status.";
-            RDMA_VERIFY(ERROR, listen(listenfd, 24) == 0)
-                << "TCP listen error: " << strerror(errno);
+        void connection_handler(void) {
+            auto epfd = epoll_create1(0);
+            RDMA_ASSERT(epfd >= 0) << "epoll create error: " << strerror(errno);
+            struct epoll_event ev = {};
+            ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+            ev.data.fd = listenfd_;
+            RDMA_ASSERT(epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd_, &ev) == 0)
+                << "epoll add listen socket error: " << strerror(errno);
+            auto replies = std::make_shared<AsyncReplies>();
+            replies->efd = eventfd(0, EFD_NONBLOCK);
+            RDMA_ASSERT(replies->efd >= 0)
+                << "eventfd create error: " << strerror(errno);
+            ev.events = EPOLLIN;
+            ev.data.fd = replies->efd;
+            RDMA_ASSERT(
+                    epoll_ctl(epfd, EPOLL_CTL_ADD, replies->efd, &ev) == 0)
+                << "epoll add eventfd error: " << strerror(errno);
+
+            std::map<int, PendingConn> conns;
+            struct epoll_event events[HANDLER_MAX_EVENTS];
             while (running_) {
-                asm volatile("":: : "memory");
+                int n = epoll_wait(epfd, events, HANDLER_MAX_EVENTS,
+                                   HANDLER_POLL_TIMEOUT_MS);
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                RDMA_ASSERT(n >= 0) << "epoll wait error: " << strerror(errno);
+                for (int i = 0; i < n; i++) {
+                    if (events[i].data.fd == listenfd_) {
+                        accept_conns(epfd, conns);
+                    } else if (events[i].data.fd == replies->efd) {
+                        serve_async_replies(epfd, replies, conns);
+                    } else {
+                        handle_conn(epfd, events[i].data.fd, conns, replies);
+                    }
+                }
+                // drop connections of clients that stopped talking to us
+                auto now = std::chrono::steady_clock::now();
+                for (auto it = conns.begin(); it != conns.end();) {
+                    if (now < it->second.deadline) {
+                        ++it;
+                        continue;
+                    }
+                    close(it->first);
+                    it = conns.erase(it);
+                }
+            }
+            // end of the server
+            for (auto &conn : conns) {
+                close(conn.first);
+            }
+            {
+                // late answers of factories are dropped
+                std::lock_guard<std::mutex> lock(replies->mutex);
+                replies->closed = true;
+                close(replies->efd);
+            }
+            close(epfd);
+        }
+
+    private:
+        // A connection accepted by a handler thread. It reads one request,
+        // sends one reply and waits for the client to close.
+        struct PendingConn {
+            // tells a reused fd apart from the connection it replaces
+            uint64_t id;
+            // a ConnArg, followed by the QPConnArgs of a BATCH
+            std::vector<char> req;
+            uint32_t nread;
+            // the reply, sent as fast as the socket takes it
+            std::vector<char> reply;
+            uint32_t nwritten;
+            bool replied;
+            std::chrono::steady_clock::time_point deadline;
+        };
+
+        // A reply to a QP_CONNECT request that its factory answered later.
+        struct AsyncReply {
+            int fd;
+            uint64_t conn_id;
+            std::vector<char> reply;
+        };
+
+        // Replies handed to a handler thread by other threads. Writing to
+        // efd wakes the handler up. Shared with the accept callbacks, which
+        // may outlive the handler.
+        struct AsyncReplies {
+            std::mutex mutex;
+            int efd = -1;
+            bool closed = false;
+            std::vector<AsyncReply> pending;
+        };
+
+        void accept_conns(int epfd, std::map<int, PendingConn> &conns) {
+            while (true) {
                 struct sockaddr_in cli_addr = {0};
                 socklen_t clilen = sizeof(cli_addr);
-                auto csfd = accept(listenfd, (struct sockaddr *) &cli_addr,
+                auto csfd = accept(listenfd_, (struct sockaddr *) &cli_addr,
                                    &clilen);
                 if (csfd < 0) {
-                    RDMA_LOG(ERROR) << "accept a wrong connection error: "
+                    // another handler may have taken it
+                    if (errno != EAGAIN && errno != EWOULDBLOCK &&
+                        errno != EINTR) {
+                        RDMA_LOG(ERROR) << "accept a wrong connection error: "
+                                        << strerror(errno);
+                    }
+                    return;
+                }
+                fcntl(csfd, F_SETFL, O_NONBLOCK);
+                struct epoll_event ev = {};
+                ev.events = EPOLLIN | EPOLLRDHUP;
+                ev.data.fd = csfd;
+                if (epoll_ctl(epfd, EPOLL_CTL_ADD, csfd, &ev) != 0) {
+                    RDMA_LOG(ERROR) << "epoll add connection error: "
                                     << strerror(errno);
+                    close(csfd);
                     continue;
                 }
-                if (!PreConnector::wait_recv(csfd, 10000)) {
-                    close(csfd);
+                PendingConn &conn = conns[csfd];
+                conn = {};
+                conn.id = next_conn_id_++;
+                conn.req.resize(sizeof(ConnArg));
+                conn.deadline = std::chrono::steady_clock::now() +
+                                std::chrono::milliseconds(
+                                        HANDLER_CONN_TIMEOUT_MS);
+            }
+        }
+
+        void handle_conn(int epfd, int csfd,
+                         std::map<int, PendingConn> &conns,
+                         const std::shared_ptr<AsyncReplies> &replies) {
+            auto it = conns.find(csfd);
+            if (it == conns.end()) {
+                return;
+            }
+            PendingConn &conn = it->second;
+            while (true) {
+                if (conn.nwritten < conn.reply.size()) {
+                    // the rest of a reply that did not fit into the socket
+                    // buffer; EPOLLOUT calls us again
+                    if (!send_reply(epfd, csfd, conn)) {
+                        break;
+                    }
+                    if (!conn.replied) {
+                        return;
+                    }
                     continue;
                 }
-                ConnArg arg = {};
-                auto n = recv(csfd, (char *) (&arg), sizeof(ConnArg),
-                              MSG_WAITALL);
-                if (n != sizeof(ConnArg)) {
-                    // an invalid message
-                    close(csfd);
+                // once the request is read, only the client's EOF is left
+                char drain[64];
+                char *buf = drain;
+                size_t len = sizeof(drain);
+                if (conn.nread < conn.req.size()) {
+                    buf = conn.req.data() + conn.nread;
+                    len = conn.req.size() - conn.nread;
+                }
+                auto n = recv(csfd, buf, len, 0);
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    return;
+                }
+                if (n <= 0) {
+                    // the client closed the connection, or an error
+                    break;
+                }
+                if (conn.nread == conn.req.size()) {
+                    continue;
+                }
+                conn.nread += n;
+                if (conn.nread < conn.req.size()) {
+                    continue;
+                }
+                const ConnArg *arg = (const ConnArg *) conn.req.data();
+                if (arg->type == ConnArg::BATCH &&
+                    arg->payload.batch.nqps > 0 &&
+                    conn.req.size() == sizeof(ConnArg)) {
+                    // the QPConnArgs follow
+                    conn.req.resize(sizeof(ConnArg) +
+                                    arg->payload.batch.nqps *
+                                    sizeof(QPConnArg));
+                    continue;
+                }
+                if (arg->type == ConnArg::QP_CONNECT) {
+                    // answered by serve_async_replies
+                    start_connect(csfd, conn, replies);
+                    continue;
+                }
+                // an empty BATCH gets a reply with no QPs
+                conn.reply = handle_request(conn.req);
+                conn.nwritten = 0;
+            }
+            close(csfd);
+            conns.erase(it);
+        }
+
+        /**
+         * Writes what the socket takes of the reply of conn without blocking
+         * the handler. A reply that does not fit, e.g., of a large BATCH, waits
+         * for EPOLLOUT. Returns false on error.
+         */
+        bool send_reply(int epfd, int csfd, PendingConn &conn) {
+            while (conn.nwritten < conn.reply.size()) {
+                auto n = send(csfd, conn.reply.data() + conn.nwritten,
+                              conn.reply.size() - conn.nwritten, MSG_NOSIGNAL);
+                if (n < 0 && errno == EINTR) {
                     continue;
                 }
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    struct epoll_event ev = {};
+                    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+                    ev.data.fd = csfd;
+                    return epoll_ctl(epfd, EPOLL_CTL_MOD, csfd, &ev) == 0;
+                }
+                if (n <= 0) {
+                    return false;
+                }
+                conn.nwritten += n;
+            }
+            struct epoll_event ev = {};
+            ev.events = EPOLLIN | EPOLLRDHUP;
+            ev.data.fd = csfd;
+            if (epoll_ctl(epfd, EPOLL_CTL_MOD, csfd, &ev) != 0) {
+                return false;
+            }
+            // let the client close first; its EOF closes the connection
+            shutdown(csfd, SHUT_WR);
+            conn.replied = true;
+            return true;
+        }
+
+        /**
+         * Hands a QP_CONNECT request to the factory of its worker. The
+         * factory's answer is queued for this handler, which sends it from
+         * serve_async_replies, so the handler does not wait for the worker.
+         */
+        void start_connect(int csfd, const PendingConn &conn,
+                           const std::shared_ptr<AsyncReplies> &replies) {
+            const ConnArg &arg = *(const ConnArg *) conn.req.data();
+            qp_callback_(arg.payload.conn.qp);
+            qp_factory_t factory;
+            {
+                std::lock_guard<std::mutex> lock(factories_mutex_);
+                auto it = qp_factories_.find(arg.payload.conn.qp.from_worker);
+                if (it != qp_factories_.end()) {
+                    factory = it->second;
+                }
+            }
+            int node_id = node_id_;
+            uint64_t conn_id = conn.id;
+            qp_accept_t accept = [replies, csfd, conn_id, node_id](RCQP *qp) {
                 ConnReply reply = {};
-                reply.ack = ERR;
-                { // in a global critical section
-                    SCS s;
-                    switch (arg.type) {
-                        case ConnArg::TERMINATE:
-                            terminate_mutex_.lock();
-                            RDMA_LOG(INFO) << "Received terminate from "
-                                           << arg.payload.node_id;
-                            terminated_node_ids_.insert(arg.payload.node_id);
-                            terminate_mutex_.unlock();
+                reply.ack = NOT_READY;
+                if (qp != nullptr) {
+                    reply.payload.conn.qp = qp->get_attr();
+                    reply.payload.conn.qp.node_id = node_id;
+                    reply.payload.conn.mr = qp->local_mr_;
+                    reply.ack = SUCC;
+                }
+                std::vector<char> buf(sizeof(ConnReply));
+                memcpy(buf.data(), &reply, sizeof(ConnReply));
+                std::lock_guard<std::mutex> lock(replies->mutex);
+                if (replies->closed) {
+                    return;
+                }
+                replies->pending.push_back({csfd, conn_id, std::move(buf)});
+                uint64_t one = 1;
+                RDMA_VERIFY(WARNING,
+                            write(replies->efd, &one, sizeof(one)) ==
+                            sizeof(one))
+                    << "eventfd write error: " << strerror(errno);
+            };
+            if (!factory) {
+                accept(nullptr);
+                return;
+            }
+            // outside of the locks, the factory creates the QP
+            factory(arg.payload.conn.qp, arg.payload.conn.attr,
+                    arg.payload.conn.mr, accept);
+        }
+
+        /**
+         * Sends the replies queued by the factories. A reply to a client
+         * that gave up and closed its connection is dropped.
+         */
+        void serve_async_replies(int epfd,
+                                 const std::shared_ptr<AsyncReplies> &replies,
+                                 std::map<int, PendingConn> &conns) {
+            std::vector<AsyncReply> pending;
+            {
+                std::lock_guard<std::mutex> lock(replies->mutex);
+                uint64_t count;
+                while (read(replies->efd, &count, sizeof(count)) > 0) {
+                    // reset the counter
+                }
+                pending.swap(replies->pending);
+            }
+            for (auto &r : pending) {
+                auto it = conns.find(r.fd);
+                if (it == conns.end() || it->second.id != r.conn_id ||
+                    !it->second.reply.empty()) {
+                    continue;
+                }
+                it->second.reply.swap(r.reply);
+                it->second.nwritten = 0;
+                handle_conn(epfd, r.fd, conns, replies);
+            }
+        }
+
+        /**
+         * Note! this is not a thread-safe function
+         */
+        QP *find_qp(const QPConnArg &arg) {
+            QP *qp = NULL;
+            switch (arg.qp_type) {
+                case IBV_QPT_UD: {
+                    UDQP *ud_qp = get_qp<UDQP, get_ud_key>(
+                            create_ud_idx(arg.from_worker, arg.from_index));
+                    if (ud_qp != nullptr && ud_qp->ready()) {
+                        qp = ud_qp;
+                        RDMA_LOG(INFO) << "Received request "
+                                       << arg.from_worker << ":"
+                                       << arg.from_index << ":"
+                                       << qp->get_attr().qpn;
+                    }
+                }
+                    break;
+                case IBV_QPT_RC:
+                case IBV_QPT_UC: {
+                    // UC QPs are RCQPs keyed with UC_ID_BASE
+                    RCQP *rc_qp = get_qp<RCQP, get_rc_key>(
+                            create_rc_idx(arg.from_node, arg.from_worker,
+                                          arg.from_index));
+                    qp = rc_qp;
+                }
+                    break;
+                default:
+                    RDMA_LOG(ERROR) << "unknown QP connection type: "
+                                    << arg.qp_type;
+            }
+            return qp;
+        }
+
+        std::vector<char> handle_request(const std::vector<char> &req) {
+            const ConnArg &arg = *(const ConnArg *) req.data();
+            std::vector<char> buf(sizeof(ConnReply));
+            ConnReply reply = {};
+            reply.ack = ERR;
+            switch (arg.type) {
+                case ConnArg::TERMINATE: {
+                    std::lock_guard<std::mutex> lock(terminate_mutex_);
+                    RDMA_LOG(INFO) << "Received terminate from "
+                                   << arg.payload.node_id;
+                    terminated_node_ids_.insert(arg.payload.node_id);
+                    reply.ack = SUCC;
+                    break;
+                }
+                case ConnArg::MR: {
+                    std::lock_guard<std::mutex> lock(mrs_mutex_);
+                    if (mrs_.find(arg.payload.mr.mr_id) != mrs_.end()) {
+                        memcpy((char *) (&(reply.payload.mr)),
+                               (char *) (&(mrs_[arg.payload.mr.mr_id]->rattr)),
+                               sizeof(MemoryAttr));
+                        reply.ack = SUCC;
+                    };
+                    break;
+                }
+                case ConnArg::QP: {
+                    qp_callback_(arg.payload.qp); // call the user callback
+                    std::lock_guard<std::mutex> lock(qps_mutex_);
+                    QP *qp = find_qp(arg.payload.qp);
+                    if (qp != nullptr) {
+                        reply.payload.qp = qp->get_attr();
+                        reply.ack = SUCC;
+                    }
+                    reply.payload.qp.node_id = node_id_;
+                    break;
+                }
+                case ConnArg::QP_RESET: {
+                    std::lock_guard<std::mutex> lock(qps_mutex_);
+                    RCQP *qp = dynamic_cast<RCQP *>(
+                            find_qp(arg.payload.conn.qp));
+                    reply.ack = NO_QP;
+                    if (qp != nullptr) {
+                        qp->on_reset_request(arg.payload.conn.attr);
+                        reply.ack = SUCC;
+                    }
+                    break;
+                }
+                case ConnArg::QP_RESET_DONE: {
+                    std::lock_guard<std::mutex> lock(qps_mutex_);
+                    RCQP *qp = dynamic_cast<RCQP *>(find_qp(arg.payload.qp));
+                    reply.ack = NO_QP;
+                    if (qp != nullptr) {
+                        reply.ack = NOT_READY;
+                        if (qp->reset_done_) {
+                            reply.payload.qp = qp->get_attr();
+                            reply.ack = SUCC;
+                        }
+                    }
+                    break;
+                }
+                case ConnArg::QP_DISCONNECT: {
+                    std::lock_guard<std::mutex> lock(qps_mutex_);
+                    RCQP *qp = dynamic_cast<RCQP *>(find_qp(arg.payload.qp));
+                    if (qp != nullptr) {
+                        qp->disconnect_requested_ = true;
+                        reply.ack = SUCC;
+                    }
+                    break;
+                }
+                case ConnArg::BATCH: {
+                    {
+                        std::lock_guard<std::mutex> lock(mrs_mutex_);
+                        if (mrs_.find(arg.payload.batch.mr_id) != mrs_.end()) {
+                            reply.payload.mr =
+                                    mrs_[arg.payload.batch.mr_id]->rattr;
                             reply.ack = SUCC;
-                            break;
-                        case ConnArg::MR:
-                            if (mrs_.find(arg.payload.mr.mr_id) != mrs_.end()) {
-                                memcpy((char *) (&(reply.payload.mr)),
-                                       (char *) (&(mrs_[arg.payload.mr.mr_id]->rattr)),
-                                       sizeof(MemoryAttr));
-                                reply.ack = SUCC;
-                            };
-                            break;
-                        case ConnArg::QP: {
-                            qp_callback_(
-                                    arg.payload.qp); // call the user callback
-                            QP *qp = NULL;
-                            switch (arg.payload.qp.qp_type) {
-                                case IBV_QPT_UD: {
-                                    UDQP *ud_qp = get_qp<UDQP, get_ud_key>(
-                                            create_ud_idx(
-                                                    arg.payload.qp.from_worker,
-                                                    arg.payload.qp.from_index));
-                                    if (ud_qp != nullptr && ud_qp->ready()) {
-                                        qp = ud_qp;
-                                        RDMA_LOG(INFO) << "Received request "
-                                                       << arg.payload.qp
-                                                               .from_worker
-                                                       << ":" << arg.payload.qp
-                                                               .from_index
-                                                       << ":"
-                                                       << qp->get_attr().qpn;
-                                    }
-                                }
-                                    break;
-                                case IBV_QPT_RC: {
-                                    RCQP *rc_qp = get_qp<RCQP, get_rc_key>(
-                                            create_rc_idx(
-                                                    arg.payload.qp.from_node,
-                                                    arg.payload.qp.from_worker,
-                                                    arg.payload.qp.from_index));
-                                    qp = rc_qp;
-                                }
-                                    break;
-                                default:
-                                    RDMA_LOG(ERROR)
-                                        << "unknown QP connection type: "
-                                        << arg.payload.qp.qp_type;
-                            }
-                            if (qp != nullptr) {
-                                reply.payload.qp = qp->get_attr();
-                                reply.ack = SUCC;
-                            }
-                            reply.payload.qp.node_id = node_id_;
-                            break;
                         }
-                        default:
-                            RDMA_LOG(WARNING)
-                                << "received unknown connect type " << arg.type;
                     }
-                } // end simple critical section protection
-                PreConnector::send_to(csfd, (char *) (&reply),
-                                      sizeof(ConnReply));
-                PreConnector::wait_close(
-                        csfd); // wait for the client to close the connection
+                    uint16_t nqps = arg.payload.batch.nqps;
+                    const QPConnArg *qp_args = (const QPConnArg *) (
+                            req.data() + sizeof(ConnArg));
+                    for (int i = 0; i < nqps; i++) {
+                        qp_callback_(qp_args[i]);
+                    }
+                    buf.resize(sizeof(ConnReply) + nqps * sizeof(QPAttr));
+                    QPAttr *attrs = (QPAttr *) (buf.data() +
+                                                sizeof(ConnReply));
+                    std::lock_guard<std::mutex> lock(qps_mutex_);
+                    for (int i = 0; i < nqps; i++) {
+                        QPAttr attr = {};
+                        QP *qp = find_qp(qp_args[i]);
+                        if (qp != nullptr) {
+                            attr = qp->get_attr();
+                        }
+                        attr.node_id = node_id_;
+                        memcpy(&attrs[i], &attr, sizeof(QPAttr));
+                    }
+                    break;
+                }
+                default:
+                    RDMA_LOG(WARNING)
+                        << "received unknown connect type " << arg.type;
             }
-            // end of the server
-            close(listenfd);
+            memcpy(buf.data(), &reply, sizeof(ConnReply));
+            return buf;
         }
 
-    private:
         friend class RdmaCtrl;
 
         static RNicHandler *&rnic_instance() {
@@ -462,9 +821,11 @@ namespace rdmaio {
         std::vector<RNicInfo> cached_infos_;
 
         // registered MRs at this control manager
+        std::mutex mrs_mutex_;
         std::map<uint64_t, Memory *> mrs_;
 
         // created QPs on this control manager
+        std::mutex qps_mutex_;
         std::map<uint64_t, QP *> qps_;
 
         // local node information
@@ -475,12 +836,18 @@ namespace rdmaio {
         std::mutex terminate_mutex_;
         std::set<uint64_t> terminated_node_ids_;
 
-        pthread_t handler_tid_;
-        bool running_ = true;
+        int listenfd_;
+        std::vector<std::thread> handlers_;
+        std::atomic<bool> running_{true};
 
         // connection callback function
         connection_callback_t qp_callback_;
 
+        // worker id -> creates its QPs on demand
+        std::mutex factories_mutex_;
+        std::map<int, qp_factory_t> qp_factories_;
+        std::atomic<uint64_t> next_conn_id_{0};
+
 //        bool
 //        link_symmetric_rcqps(const std::vector<std::string> &cluster, int l_mrid, uint64_t mr_id, int wid, int idx) {
 //
@@ -536,13 +903,20 @@ namespace rdmaio {
             qp_callback_ = callback;
         }
 
+        void register_qp_factory(int worker_id, qp_factory_t factory) {
+            std::lock_guard<std::mutex> lock(factories_mutex_);
+            qp_factories_[worker_id] = factory;
+        }
+
     }; //
 
 // link to the main class
     inline __attribute__ ((always_inline))
     RdmaCtrl::RdmaCtrl(int node_id, int tcp_base_port,
-                       connection_callback_t callback, std::string ip)
-            : impl_(new RdmaCtrlImpl(node_id, tcp_base_port, callback, ip)) {
+                       connection_callback_t callback, std::string ip,
+                       int nhandlers)
+            : impl_(new RdmaCtrlImpl(node_id, tcp_base_port, callback, ip,
+                                     nhandlers)) {
     }
 
     inline __attribute__ ((always_inline))
@@ -629,6 +1003,11 @@ namespace rdmaio {
         return impl_->get_rc_qp(idx);
     }
 
+    inline __attribute__ ((always_inline))
+    void RdmaCtrl::destroy_rc_qp(QPIdx idx) {
+        impl_->destroy_rc_qp(idx);
+    }
+
     inline __attribute__ ((always_inline))
     UDQP *RdmaCtrl::get_ud_qp(QPIdx idx) {
         return impl_->get_ud_qp(idx);
@@ -660,6 +1039,11 @@ namespace rdmaio {
         impl_->register_qp_callback(callback);
     }
 
+    inline __attribute__ ((always_inline))
+    void RdmaCtrl::register_qp_factory(int worker_id, qp_factory_t factory) {
+        impl_->register_qp_factory(worker_id, factory);
+    }
+
     inline __attribute__ ((always_inline))
     std::set<uint64_t> RdmaCtrl::terminated_node_ids() {
         std::lock_guard<std::mutex> lock(impl_->terminate_mutex_);